@@ -0,0 +1,105 @@
+/*
+	A bump allocator for everything belonging to a single message. Nothing is freed on its own. Instead the whole
+	arena is emptied at once, keeping its chunks for the next message.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <limits.h>
+
+#include "arena.h"
+
+void SMTPArenaInit(SMTPArena *Arena)
+{
+	Arena->First = Arena->Current = NULL;
+	Arena->Used = 0;
+
+	return;
+}
+
+/* Returns NULL when out of memory. The memory is aligned to SMTP_ARENA_ALIGN and lasts until the arena's reset. */
+void *SMTPArenaAlloc(SMTPArena *Arena, unsigned int Size)
+{
+	SMTPArenaChunk *Chunk;
+	unsigned int NewSize;
+	void *Data;
+
+	if (Size > UINT_MAX - SMTP_ARENA_ALIGN)
+		return NULL;
+	Size = (Size + SMTP_ARENA_ALIGN - 1) & ~(SMTP_ARENA_ALIGN - 1);
+
+	/* Move on through any chunks kept from before until one has room. */
+	while (Arena->Current && Arena->Used + Size > Arena->Current->Size && Arena->Current->Next) {
+		Arena->Current = Arena->Current->Next;
+		Arena->Used = 0;
+	}
+
+	if (!Arena->Current || Arena->Used + Size > Arena->Current->Size) {
+
+		/* Twice the last chunk, or just what's asked for if that's larger. */
+		NewSize = Arena->Current ? Arena->Current->Size * 2 : SMTP_ARENA_CHUNK_SIZE;
+		if (NewSize < Size)
+			NewSize = Size;
+
+		Chunk = malloc(sizeof(SMTPArenaChunk) + NewSize);
+		if (!Chunk)
+			return NULL;
+		Chunk->Next = NULL;
+		Chunk->Size = NewSize;
+
+		if (Arena->Current)
+			Arena->Current->Next = Chunk;
+		else
+			Arena->First = Chunk;
+		Arena->Current = Chunk;
+		Arena->Used = 0;
+	}
+
+	Data = (char *)(Arena->Current + 1) + Arena->Used;
+	Arena->Used += Size;
+
+	return Data;
+}
+
+/* Everything allocated is let go of at once. The chunks are kept. */
+void SMTPArenaReset(SMTPArena *Arena)
+{
+	Arena->Current = Arena->First;
+	Arena->Used = 0;
+
+	return;
+}
+
+void SMTPArenaFree(SMTPArena *Arena)
+{
+	SMTPArenaChunk *Chunk, *Next;
+
+	for (Chunk = Arena->First; Chunk; Chunk = Next) {
+		Next = Chunk->Next;
+		free(Chunk);
+	}
+
+	SMTPArenaInit(Arena);
+
+	return;
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/* The first chunk's size. Each one after is twice the last. */
+#ifndef SMTP_ARENA_CHUNK_SIZE
+	#define SMTP_ARENA_CHUNK_SIZE	4096
+#endif
+
+#define SMTP_ARENA_ALIGN		8
+
+typedef struct SMTPArenaChunk {
+	struct SMTPArenaChunk *Next;
+	unsigned int Size;		/* Not counting this header, which the memory follows. */
+} SMTPArenaChunk;
+
+/* All zeros is an empty arena. Holds no pointers into itself, so it may be copied to move it elsewhere. */
+typedef struct SMTPArena {
+	SMTPArenaChunk *First, *Current;
+	unsigned int Used;		/* Of the current chunk. */
+} SMTPArena;
+
+void SMTPArenaInit(SMTPArena *Arena);
+void *SMTPArenaAlloc(SMTPArena *Arena, unsigned int Size);
+void SMTPArenaReset(SMTPArena *Arena);
+void SMTPArenaFree(SMTPArena *Arena);
+
+#endif
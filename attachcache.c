@@ -0,0 +1,579 @@
+/*
+	A process-wide cache of attachments already encoded into Base64 lines, so the same file sent to many
+	recipients is only read and encoded once.
+
+	Entries are keyed either by an ID and version given by the caller, such as a path and its modification time,
+	or by a hash of the content. The least recently used are dropped once over budget.
+	Large encodings can be spilled to files, which are then mapped back in.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "attachcache.h"
+#include "base64.h"
+
+#define PRIME1	11400714785074694791ULL
+#define PRIME2	14029467366897019727ULL
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SMTPAttachCacheEntry *Buckets[SMTP_ATTACH_CACHE_BUCKETS];
+static SMTPAttachCacheEntry *Newest, *Oldest;
+static SMTPAttachCacheStats Stats;
+
+static char *SpillDirectory = NULL;
+
+static unsigned long long Rotate(unsigned long long Value, unsigned int Bits)
+{
+	return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+static unsigned long long Round(unsigned long long Lane, unsigned long long Word)
+{
+	return Rotate(Lane + Word * PRIME2, 31) * PRIME1;
+}
+
+static unsigned long long Mix(unsigned long long Value)
+{
+	Value ^= Value >> 33;
+	Value *= PRIME2;
+	Value ^= Value >> 29;
+	Value *= PRIME1;
+	Value ^= Value >> 32;
+
+	return Value;
+}
+
+/* A 128 bit hash of the content. Four lanes are kept so it runs at memory speed. */
+static void Digest(const unsigned char *Data, unsigned int Size, unsigned long long Result[2])
+{
+	unsigned long long Lanes[4], Word;
+	unsigned char Tail[32];
+	unsigned int Offset, Loop;
+
+	Lanes[0] = PRIME1 + PRIME2;
+	Lanes[1] = PRIME2;
+	Lanes[2] = 0;
+	Lanes[3] = 0 - PRIME1;
+
+	for (Offset = 0; Offset + sizeof(Tail) <= Size; Offset += sizeof(Tail)) {
+		for (Loop = 0; Loop < 4; Loop++) {
+			memcpy(&Word, &Data[Offset + Loop * 8], 8);
+			Lanes[Loop] = Round(Lanes[Loop], Word);
+		}
+	}
+
+	/* The size is mixed in below, so padding the rest with zeros is fine. */
+	if (Offset < Size) {
+		memset(Tail, 0, sizeof(Tail));
+		memcpy(Tail, &Data[Offset], Size - Offset);
+		for (Loop = 0; Loop < 4; Loop++) {
+			memcpy(&Word, &Tail[Loop * 8], 8);
+			Lanes[Loop] = Round(Lanes[Loop], Word);
+		}
+	}
+
+	Result[0] = Mix(Rotate(Lanes[0], 1) + Rotate(Lanes[1], 7) + Rotate(Lanes[2], 12) + Rotate(Lanes[3], 18) + Size);
+	Result[1] = Mix(Round(Round(Round(Round(Size, Lanes[3]), Lanes[2]), Lanes[1]), Lanes[0]));
+
+	return;
+}
+
+static unsigned int HashID(const char *ID, long long Version)
+{
+	unsigned int Value = 2166136261u;
+
+	for (; *ID; ID++) {
+		Value ^= (unsigned char)*ID;
+		Value *= 16777619u;
+	}
+
+	return (unsigned int)Mix(Value ^ (unsigned long long)Version) % SMTP_ATTACH_CACHE_BUCKETS;
+}
+
+static void FreeEntry(SMTPAttachCacheEntry *Entry)
+{
+	if (Entry->Spilled)
+		munmap(Entry->Data, Entry->Size);
+	else
+		free(Entry->Data);
+	free(Entry);
+
+	return;
+}
+
+/* Takes the entry out of the cache, dropping the cache's reference. */
+static void Evict(SMTPAttachCacheEntry *Entry, unsigned int Bucket)
+{
+	SMTPAttachCacheEntry **Link;
+
+	for (Link = &Buckets[Bucket]; *Link != Entry; Link = &(*Link)->Next);
+	*Link = Entry->Next;
+
+	if (Entry->Newer)
+		Entry->Newer->Older = Entry->Older;
+	else
+		Newest = Entry->Older;
+	if (Entry->Older)
+		Entry->Older->Newer = Entry->Newer;
+	else
+		Oldest = Entry->Newer;
+
+	if (Entry->Spilled)
+		Stats.SpillBytes -= Entry->Size;
+	else
+		Stats.Bytes -= Entry->Size;
+	Stats.Entries--;
+
+	if (--Entry->References == 0)
+		FreeEntry(Entry);
+
+	return;
+}
+
+static unsigned int BucketOf(const SMTPAttachCacheEntry *Entry)
+{
+	return Entry->ID ? HashID(Entry->ID, Entry->Version) : Entry->Digest[0] % SMTP_ATTACH_CACHE_BUCKETS;
+}
+
+/* Drops the least recently used entries of whichever kind is over budget. */
+static void Trim(void)
+{
+	SMTPAttachCacheEntry *Entry, *Newer;
+	int Memory, Spill;
+
+	for (Entry = Oldest; Entry; Entry = Newer) {
+
+		Memory = Stats.Bytes > SMTP_ATTACH_CACHE_SIZE;
+		Spill = Stats.SpillBytes > SMTP_ATTACH_CACHE_SPILL_LIMIT;
+		if (!Memory && !Spill)
+			break;
+
+		Newer = Entry->Newer;
+		if ((Entry->Spilled && Spill) || (!Entry->Spilled && Memory)) {
+			Evict(Entry, BucketOf(Entry));
+			Stats.Evictions++;
+		}
+
+	}
+
+	return;
+}
+
+/* Looks for a matching entry, returning it referenced and marked as the most recently used. Called with the lock held. */
+static SMTPAttachCacheEntry *Find(const char *ID, long long Version, const unsigned long long Digest[2], unsigned int RawSize)
+{
+	SMTPAttachCacheEntry *Entry;
+	unsigned int Bucket;
+
+	Bucket = ID ? HashID(ID, Version) : Digest[0] % SMTP_ATTACH_CACHE_BUCKETS;
+
+	for (Entry = Buckets[Bucket]; Entry; Entry = Entry->Next) {
+
+		if (ID) {
+			if (Entry->ID && Entry->Version == Version && strcmp(Entry->ID, ID) == 0)
+				break;
+		}
+		else if (!Entry->ID && Entry->RawSize == RawSize && Entry->Digest[0] == Digest[0] && Entry->Digest[1] == Digest[1])
+			break;
+
+	}
+
+	if (!Entry)
+		return NULL;
+
+	if (Entry != Newest) {
+		Entry->Newer->Older = Entry->Older;
+		if (Entry->Older)
+			Entry->Older->Newer = Entry->Newer;
+		else
+			Oldest = Entry->Newer;
+
+		Entry->Older = Newest;
+		Entry->Newer = NULL;
+		Newest->Newer = Entry;
+		Newest = Entry;
+	}
+
+	Entry->References++;
+
+	return Entry;
+}
+
+/* Reads everything from a callback attachment. */
+static int ReadAll(const SMTPAttach *Source, unsigned char **Data, unsigned int *Size)
+{
+	unsigned char *Buffer, *NewBuffer;
+	unsigned int Length, BufferSize;
+	int Return;
+
+	BufferSize = 65536;
+	Buffer = malloc(BufferSize);
+	if (!Buffer)
+		return SMTP_ERR_BUFFER;
+
+	Length = 0;
+	for (;;) {
+
+		if (Length == BufferSize) {
+
+			if (BufferSize > UINT_MAX / 2) {
+				free(Buffer);
+				return SMTP_ERR_BUFFER;
+			}
+
+			NewBuffer = realloc(Buffer, BufferSize * 2);
+			if (!NewBuffer) {
+				free(Buffer);
+				return SMTP_ERR_BUFFER;
+			}
+			Buffer = NewBuffer;
+			BufferSize *= 2;
+
+		}
+
+		Return = Source->Read(Source->ReadData, &Buffer[Length], BufferSize - Length);
+		if (Return < 0) {
+			free(Buffer);
+			return SMTP_ERR_DATA;
+		}
+		if (Return == 0)
+			break;
+		Length += Return;
+
+	}
+
+	*Data = Buffer;
+	*Size = Length;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Writes the encoding out to an unlinked file and maps it back in. Returns NULL if it can't be. */
+static char *Spill(const char *Data, unsigned int Size)
+{
+	char Path[4096];
+	void *View;
+	unsigned int Offset;
+	ssize_t Return;
+	int File;
+
+	pthread_mutex_lock(&Lock);
+	if (!SpillDirectory || (size_t)snprintf(Path, sizeof(Path), "%s/ssmtp-XXXXXX", SpillDirectory) >= sizeof(Path)) {
+		pthread_mutex_unlock(&Lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&Lock);
+
+	File = mkstemp(Path);
+	if (File == -1)
+		return NULL;
+	unlink(Path);
+
+	for (Offset = 0; Offset < Size; Offset += Return) {
+		Return = write(File, &Data[Offset], Size - Offset);
+		if (Return <= 0) {
+			close(File);
+			return NULL;
+		}
+	}
+
+	View = mmap(NULL, Size, PROT_READ, MAP_SHARED, File, 0);
+	close(File);
+
+	return View == MAP_FAILED ? NULL : View;
+}
+
+/* Encodes the content into a new entry. The key is filled in by the caller. */
+static SMTPAttachCacheEntry *Encode(const unsigned char *Data, unsigned int Size, const char *ID)
+{
+	SMTPAttachCacheEntry *Entry;
+	unsigned long long Encoded;
+	unsigned int IDLength;
+	B64Stream Stream;
+	char *Spilled;
+
+	/* Every line is full apart from maybe the last, and each has a CRLF. */
+	Encoded = ((unsigned long long)Size + 2) / 3 * 4;
+	Encoded += (Encoded + SMTP_LINE_LENGTH - 1) / SMTP_LINE_LENGTH * 2;
+	if (Encoded > UINT_MAX)
+		return NULL;
+
+	IDLength = ID ? strlen(ID) + 1 : 0;
+	Entry = calloc(1, sizeof(SMTPAttachCacheEntry) + IDLength);
+	if (!Entry)
+		return NULL;
+
+	Entry->Data = malloc(Encoded ? Encoded : 1);
+	if (!Entry->Data) {
+		free(Entry);
+		return NULL;
+	}
+
+	if (ID) {
+		Entry->ID = (char *)(Entry + 1);
+		memcpy(Entry->ID, ID, IDLength);
+	}
+	Entry->RawSize = Size;
+	Entry->Size = Encoded;
+
+	InitEncode64Lines(&Stream, SMTP_LINE_LENGTH);
+	Stream.NextIn = (unsigned char *)Data;
+	Stream.AvailIn = Size;
+	Stream.NextOut = Entry->Data;
+	Stream.AvailOut = Encoded;
+	Encode64(&Stream, 1);
+
+	if (Encoded >= SMTP_ATTACH_CACHE_SPILL_SIZE && Encoded > 0) {
+		Spilled = Spill(Entry->Data, Encoded);
+		if (Spilled) {
+			free(Entry->Data);
+			Entry->Data = Spilled;
+			Entry->Spilled = 1;
+		}
+	}
+
+	return Entry;
+}
+
+/* Adds a new entry unless another thread beat us to it, in which case theirs is used. */
+static SMTPAttachCacheEntry *Insert(SMTPAttachCacheEntry *Entry)
+{
+	SMTPAttachCacheEntry *Found;
+	unsigned int Bucket;
+
+	pthread_mutex_lock(&Lock);
+
+	Found = Find(Entry->ID, Entry->Version, Entry->Digest, Entry->RawSize);
+	if (Found) {
+		pthread_mutex_unlock(&Lock);
+		FreeEntry(Entry);
+		return Found;
+	}
+
+	/* Anything larger than the whole budget is used once and thrown away. */
+	Entry->References = 1;
+	if (Entry->Size > (Entry->Spilled ? SMTP_ATTACH_CACHE_SPILL_LIMIT : SMTP_ATTACH_CACHE_SIZE)) {
+		pthread_mutex_unlock(&Lock);
+		return Entry;
+	}
+
+	Bucket = BucketOf(Entry);
+	Entry->Next = Buckets[Bucket];
+	Buckets[Bucket] = Entry;
+
+	Entry->Older = Newest;
+	Entry->Newer = NULL;
+	if (Newest)
+		Newest->Newer = Entry;
+	else
+		Oldest = Entry;
+	Newest = Entry;
+
+	Entry->References++;
+	if (Entry->Spilled)
+		Stats.SpillBytes += Entry->Size;
+	else
+		Stats.Bytes += Entry->Size;
+	Stats.Entries++;
+
+	Trim();
+
+	pthread_mutex_unlock(&Lock);
+
+	return Entry;
+}
+
+static void Fill(SMTPAttach *Attach, char *Filename, char *MIMEType, const SMTPAttachCacheEntry *Entry)
+{
+	SMTPAttachMemory(Attach, Filename, MIMEType, Entry->Data, Entry->Size);
+	Attach->Encoded = 1;
+
+	return;
+}
+
+/*
+	Fills in Attach with the encoded form of Source, encoding and storing it first if it's not already cached.
+	When ID is NULL, the content is hashed instead, which means reading it each time.
+	Returns SMTP_ERR_SUCCESS and a referenced entry, which must be released once Attach has been sent.
+*/
+int SMTPAttachCacheLookup(const SMTPAttach *Source, const char *ID, long long Version, SMTPAttach *Attach, SMTPAttachCacheEntry **Entry)
+{
+	SMTPAttachCacheEntry *Found;
+	unsigned long long Hash[2];
+	unsigned char *Data, *Read;
+	unsigned int Size;
+	int Return;
+
+	Read = NULL;
+	Size = 0;
+	Hash[0] = Hash[1] = 0;
+	if (Source->Read) {
+		if (!ID) {
+			Return = ReadAll(Source, &Read, &Size);
+			if (Return != SMTP_ERR_SUCCESS)
+				return Return;
+		}
+		Data = Read;
+	}
+	else {
+		Data = (unsigned char *)Source->Data;
+		Size = Source->Size;
+	}
+
+	if (!ID)
+		Digest(Data, Size, Hash);
+
+	pthread_mutex_lock(&Lock);
+	Found = Find(ID, Version, Hash, Size);
+	if (Found)
+		Stats.Hits++;
+	else
+		Stats.Misses++;
+	pthread_mutex_unlock(&Lock);
+
+	if (!Found) {
+
+		if (Source->Read && !Read) {
+			Return = ReadAll(Source, &Read, &Size);
+			if (Return != SMTP_ERR_SUCCESS)
+				return Return;
+			Data = Read;
+		}
+
+		Found = Encode(Data, Size, ID);
+		if (!Found) {
+			free(Read);
+			return SMTP_ERR_BUFFER;
+		}
+
+		Found->Version = Version;
+		if (!ID)
+			memcpy(Found->Digest, Hash, sizeof(Hash));
+		Found = Insert(Found);
+
+	}
+
+	free(Read);
+
+	Fill(Attach, Source->Filename, Source->MIMEType, Found);
+	*Entry = Found;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* As above for a file on disk, keyed by its path and modification time. The file is only mapped when it needs encoding. */
+int SMTPAttachCacheFile(const char *Path, char *Filename, char *MIMEType, SMTPAttach *Attach, SMTPAttachCacheEntry **Entry)
+{
+	struct stat Info;
+	long long Version;
+	SMTPAttach Source;
+	int Return;
+
+	if (stat(Path, &Info) != 0)
+		return SMTP_ERR_DATA;
+	Version = (long long)Info.st_mtim.tv_sec * 1000000000 + Info.st_mtim.tv_nsec;
+
+	pthread_mutex_lock(&Lock);
+	*Entry = Find(Path, Version, NULL, 0);
+	if (*Entry)
+		Stats.Hits++;
+	pthread_mutex_unlock(&Lock);
+
+	if (*Entry) {
+		Fill(Attach, Filename, MIMEType, *Entry);
+		return SMTP_ERR_SUCCESS;
+	}
+
+	Return = SMTPAttachFile(&Source, Path, Filename, MIMEType);
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return;
+
+	/* Counts the miss. */
+	Return = SMTPAttachCacheLookup(&Source, Path, Version, Attach, Entry);
+	SMTPAttachFree(&Source);
+
+	return Return;
+}
+
+void SMTPAttachCacheRelease(SMTPAttachCacheEntry *Entry)
+{
+	pthread_mutex_lock(&Lock);
+	if (--Entry->References == 0)
+		FreeEntry(Entry);
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
+
+/* Encodings of at least SMTP_ATTACH_CACHE_SPILL_SIZE bytes are kept in files in the directory from now on. NULL stops it. */
+int SMTPAttachCacheSpill(const char *Directory)
+{
+	char *Copy;
+
+	Copy = NULL;
+	if (Directory) {
+		Copy = malloc(strlen(Directory) + 1);
+		if (!Copy)
+			return SMTP_ERR_BUFFER;
+		strcpy(Copy, Directory);
+	}
+
+	pthread_mutex_lock(&Lock);
+	free(SpillDirectory);
+	SpillDirectory = Copy;
+	pthread_mutex_unlock(&Lock);
+
+	return SMTP_ERR_SUCCESS;
+}
+
+void SMTPAttachCacheGetStats(SMTPAttachCacheStats *Result)
+{
+	pthread_mutex_lock(&Lock);
+	*Result = Stats;
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
+
+/* Drops every entry. Those still being sent are freed once released. */
+void SMTPAttachCacheFlush(void)
+{
+	pthread_mutex_lock(&Lock);
+	while (Oldest)
+		Evict(Oldest, BucketOf(Oldest));
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
@@ -0,0 +1,56 @@
+#ifndef ATTACHCACHE_H
+#define ATTACHCACHE_H
+
+#include "ssmtp.h"
+
+#define SMTP_ATTACH_CACHE_BUCKETS		256
+
+/* The most encoded bytes kept in memory. The least recently used are dropped first. */
+#ifndef SMTP_ATTACH_CACHE_SIZE
+	#define SMTP_ATTACH_CACHE_SIZE		(64 * 1024 * 1024)
+#endif
+
+/* Once a spill directory is set, encodings at least this large go there instead, up to the second limit in total. */
+#ifndef SMTP_ATTACH_CACHE_SPILL_SIZE
+	#define SMTP_ATTACH_CACHE_SPILL_SIZE	(1024 * 1024)
+#endif
+#ifndef SMTP_ATTACH_CACHE_SPILL_LIMIT
+	#define SMTP_ATTACH_CACHE_SPILL_LIMIT	(1024ULL * 1024 * 1024)
+#endif
+
+/* Entries are never modified once in the cache. */
+typedef struct SMTPAttachCacheEntry {
+	/* The key. ID is NULL when keyed by content, otherwise it's stored after the entry. */
+	char *ID;
+	long long Version;
+	unsigned long long Digest[2];
+	unsigned int RawSize;
+
+	/* Base64 in lines of SMTP_LINE_LENGTH, each ending with a CRLF. */
+	char *Data;
+	unsigned int Size;
+	int Spilled;	/* Mapped from a file in the spill directory. */
+
+	/* Everything below is protected by the cache's lock. */
+	unsigned int References;
+	struct SMTPAttachCacheEntry *Next;
+	struct SMTPAttachCacheEntry *Older, *Newer;
+} SMTPAttachCacheEntry;
+
+typedef struct SMTPAttachCacheStats {
+	unsigned long Hits;
+	unsigned long Misses;
+	unsigned long Evictions;
+	unsigned long Entries;
+	unsigned long long Bytes;		/* Held in memory. */
+	unsigned long long SpillBytes;
+} SMTPAttachCacheStats;
+
+int SMTPAttachCacheLookup(const SMTPAttach *Source, const char *ID, long long Version, SMTPAttach *Attach, SMTPAttachCacheEntry **Entry);
+int SMTPAttachCacheFile(const char *Path, char *Filename, char *MIMEType, SMTPAttach *Attach, SMTPAttachCacheEntry **Entry);
+void SMTPAttachCacheRelease(SMTPAttachCacheEntry *Entry);
+int SMTPAttachCacheSpill(const char *Directory);
+void SMTPAttachCacheGetStats(SMTPAttachCacheStats *Stats);
+void SMTPAttachCacheFlush(void);
+
+#endif
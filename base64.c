@@ -26,9 +26,170 @@
 #include <string.h>	/* For memcpy() */
 
 #include "base64.h"
+#include "cpu.h"
 
 static const char B64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+#ifdef CPU_X86
+	#include <immintrin.h>
+#endif
+
+/* Encodes whole groups with nothing to pad. */
+static void EncodeGroups(const unsigned char *In, char *Out, unsigned int Groups)
+{
+	unsigned long Word;
+
+	/* Loading the group first stops the stores from forcing the input to be read again. */
+	for (; Groups != 0; Groups--) {
+		Word = (unsigned long)In[0] << 16 | (unsigned long)In[1] << 8 | In[2];
+		Out[0] = B64[Word >> 18];
+		Out[1] = B64[(Word >> 12) & 0x3F];
+		Out[2] = B64[(Word >> 6) & 0x3F];
+		Out[3] = B64[Word & 0x3F];
+		In += BASE64_IN_SIZE;
+		Out += BASE64_OUT_SIZE;
+	}
+
+	return;
+}
+
+#ifdef CPU_X86
+
+/*
+	The 128 and 256 bit kernels spread each 3 bytes over a 32 bit lane, move every 6 bits into their own byte with
+	a pair of multiplies and then turn those into characters by adding an offset looked up by range.
+*/
+__attribute__((target("ssse3"))) static __m128i Split128(__m128i In)
+{
+	__m128i Low, High;
+
+	In = _mm_shuffle_epi8(In, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	High = _mm_mulhi_epu16(_mm_and_si128(In, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+	Low = _mm_mullo_epi16(_mm_and_si128(In, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+
+	return _mm_or_si128(High, Low);
+}
+
+/*
+	Maps 0-25 to 13, 26-51 to 0, 52-61 to 1-10, 62 to 11 and 63 to 12, which selects what to add to get the
+	character.
+*/
+__attribute__((target("ssse3"))) static __m128i Translate128(__m128i Indices)
+{
+	__m128i Range;
+
+	Range = _mm_subs_epu8(Indices, _mm_set1_epi8(51));
+	Range = _mm_or_si128(Range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), Indices), _mm_set1_epi8(13)));
+	Range = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), Range);
+
+	return _mm_add_epi8(Range, Indices);
+}
+
+/* Each load reads 16 bytes but uses 12, so the last few groups are left for the scalar kernel. */
+__attribute__((target("ssse3"))) static void EncodeGroupsSSSE3(const unsigned char *In, char *Out, unsigned int Groups)
+{
+	__m128i Data;
+
+	for (; Groups >= 6; Groups -= 4) {
+		Data = Translate128(Split128(_mm_loadu_si128((const __m128i *)In)));
+		_mm_storeu_si128((__m128i *)Out, Data);
+		In += 12;
+		Out += 16;
+	}
+
+	EncodeGroups(In, Out, Groups);
+
+	return;
+}
+
+__attribute__((target("avx2"))) static void EncodeGroupsAVX2(const unsigned char *In, char *Out, unsigned int Groups)
+{
+	const __m256i Shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i Offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m256i Data, High, Low, Range;
+
+	/* Each half of the register takes 12 bytes from its own 16 byte load. */
+	for (; Groups >= 10; Groups -= 8) {
+		Data = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)In)),
+			_mm_loadu_si128((const __m128i *)(In + 12)), 1);
+
+		Data = _mm256_shuffle_epi8(Data, Shuffle);
+		High = _mm256_mulhi_epu16(_mm256_and_si256(Data, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+		Low = _mm256_mullo_epi16(_mm256_and_si256(Data, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+		Data = _mm256_or_si256(High, Low);
+
+		Range = _mm256_subs_epu8(Data, _mm256_set1_epi8(51));
+		Range = _mm256_or_si256(Range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), Data), _mm256_set1_epi8(13)));
+		Data = _mm256_add_epi8(_mm256_shuffle_epi8(Offsets, Range), Data);
+
+		_mm256_storeu_si256((__m256i *)Out, Data);
+		In += 24;
+		Out += 32;
+	}
+
+	EncodeGroupsSSSE3(In, Out, Groups);
+
+	return;
+}
+
+/*
+	With VBMI the bytes can be moved anywhere, each 6 bits pulled out with a single shift and the alphabet used
+	directly as the table. The masked loads and stores never touch anything past the groups being encoded.
+*/
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) static void EncodeGroupsVBMI(const unsigned char *In, char *Out, unsigned int Groups)
+{
+	const __m512i Shuffle = _mm512_setr_epi32(0x01020001, 0x04050304, 0x07080607, 0x0A0B090A, 0x0D0E0C0D, 0x10110F10,
+		0x13141213, 0x16171516, 0x191A1819, 0x1C1D1B1C, 0x1F201E1F, 0x22232122, 0x25262425, 0x28292728, 0x2B2C2A2B,
+		0x2E2F2D2E);
+	const __m512i Shifts = _mm512_set1_epi64(0x3036242A1016040ALL);
+	const __m512i Table = _mm512_loadu_si512((const void *)B64);
+	__m512i Data;
+	unsigned int Count;
+
+	/* The last few groups are done the same way with shorter masks. */
+	while (Groups != 0) {
+		Count = Groups < 16 ? Groups : 16;
+
+		Data = _mm512_maskz_loadu_epi8((1ULL << (Count * 3)) - 1, In);
+		Data = _mm512_permutexvar_epi8(Shuffle, Data);
+		Data = _mm512_multishift_epi64_epi8(Shifts, Data);
+		Data = _mm512_permutexvar_epi8(Data, Table);
+		_mm512_mask_storeu_epi8(Out, Count == 16 ? ~0ULL : (1ULL << (Count * 4)) - 1, Data);
+
+		Groups -= Count;
+		In += Count * 3;
+		Out += Count * 4;
+	}
+
+	return;
+}
+
+#endif
+
+typedef void (*EncodeKernel)(const unsigned char *In, char *Out, unsigned int Groups);
+
+/* The byte shuffles need SSSE3 at least. */
+static EncodeKernel SelectKernel(void)
+{
+#ifdef CPU_X86
+	unsigned int Features = CPUFeatures();
+
+	if (Features & CPU_AVX512VBMI)
+		return EncodeGroupsVBMI;
+	if (Features & CPU_AVX2)
+		return EncodeGroupsAVX2;
+	if (Features & CPU_SSSE3)
+		return EncodeGroupsSSSE3;
+#endif
+
+	return EncodeGroups;
+}
+
 static void EncodeBlock(unsigned char In[BASE64_IN_SIZE], unsigned char Out[BASE64_OUT_SIZE], unsigned int Length)
 {
 	unsigned int Index;
@@ -44,11 +205,69 @@ static void EncodeBlock(unsigned char In[BASE64_IN_SIZE], unsigned char Out[BASE
 	return;
 }
 
+/* Queues a line break to be written out like any other block. */
+static void BreakLine(B64Stream *Stream)
+{
+	Stream->Block[BASE64_OUT_SIZE - 2] = '\r';
+	Stream->Block[BASE64_OUT_SIZE - 1] = '\n';
+	Stream->BlockSize = 2;
+	Stream->BlockOut = 1;
+	Stream->Column = 0;
+
+	return;
+}
+
+/* Encodes as many complete lines as fit. The stream must be at the start of a line with nothing in the block. */
+static void EncodeLines(B64Stream *Stream, EncodeKernel Kernel)
+{
+	const unsigned char *In;
+	char *Out;
+	unsigned int Groups, Lines, Count;
+
+	Groups = Stream->LineLength / BASE64_OUT_SIZE;
+	Lines = Stream->AvailIn / (Groups * BASE64_IN_SIZE);
+	if (Lines > Stream->AvailOut / (Stream->LineLength + 2))
+		Lines = Stream->AvailOut / (Stream->LineLength + 2);
+
+	In = Stream->NextIn;
+	Out = Stream->NextOut;
+
+	for (Count = Lines; Count != 0; Count--) {
+		Kernel(In, Out, Groups);
+		Out[Stream->LineLength] = '\r';
+		Out[Stream->LineLength + 1] = '\n';
+		In += Groups * BASE64_IN_SIZE;
+		Out += Stream->LineLength + 2;
+	}
+
+	Stream->NextIn += Lines * Groups * BASE64_IN_SIZE;
+	Stream->TotalIn += Lines * Groups * BASE64_IN_SIZE;
+	Stream->AvailIn -= Lines * Groups * BASE64_IN_SIZE;
+	Stream->NextOut += Lines * (Stream->LineLength + 2);
+	Stream->TotalOut += Lines * (Stream->LineLength + 2);
+	Stream->AvailOut -= Lines * (Stream->LineLength + 2);
+
+	return;
+}
+
 void InitEncode64(B64Stream *Stream)
 {
 	Stream->AvailIn = Stream->AvailOut = \
 		Stream->TotalIn = Stream->TotalOut = \
-		Stream->BlockSize = Stream->BlockOut = 0;
+		Stream->BlockSize = Stream->BlockOut = \
+		Stream->LineLength = Stream->Column = 0;
+
+	return;
+}
+
+/*
+	As InitEncode64() but the output is split into lines of LineLength characters, each ending with a CRLF,
+	including the last once finished. The length is rounded down to a whole number of blocks.
+*/
+void InitEncode64Lines(B64Stream *Stream, unsigned int LineLength)
+{
+	InitEncode64(Stream);
+	Stream->LineLength = LineLength - LineLength % BASE64_OUT_SIZE;
 
 	return;
 }
@@ -56,9 +275,13 @@ void InitEncode64(B64Stream *Stream)
 void Encode64(B64Stream *Stream, int Finished)
 {
 	unsigned char OutBlock[BASE64_OUT_SIZE];
+	unsigned int Groups;
+	EncodeKernel Kernel;
+
+	Kernel = SelectKernel();
 
 	/* Loop until we have no more input or unable to output. */
-	while (Stream->AvailIn != 0 || Stream->BlockSize != 0) {
+	for (;;) {
 
 		/* If anything is in our block for output, dump it. */
 		if (Stream->BlockOut && Stream->BlockSize != 0) {
@@ -76,15 +299,69 @@ void Encode64(B64Stream *Stream, int Finished)
 
 		}
 
-		/* Now that our buffer is empty, fill the input. */
 		Stream->BlockOut = 0;
+		if (Stream->BlockSize == 0) {
+
+			/* End the line as soon as it's full. */
+			if (Stream->LineLength != 0 && Stream->Column >= Stream->LineLength) {
+				BreakLine(Stream);
+				continue;
+			}
+
+			if (Stream->LineLength != 0 && Stream->Column == 0)
+				EncodeLines(Stream, Kernel);
+
+			/* Encode as many whole groups as fit straight into the output, stopping at the end of the line. */
+			Groups = Stream->AvailIn / BASE64_IN_SIZE;
+			if (Groups > Stream->AvailOut / BASE64_OUT_SIZE)
+				Groups = Stream->AvailOut / BASE64_OUT_SIZE;
+			if (Stream->LineLength != 0 && Groups > (Stream->LineLength - Stream->Column) / BASE64_OUT_SIZE)
+				Groups = (Stream->LineLength - Stream->Column) / BASE64_OUT_SIZE;
+
+			if (Groups != 0) {
+				Kernel(Stream->NextIn, Stream->NextOut, Groups);
+
+				Stream->NextIn += Groups * BASE64_IN_SIZE;
+				Stream->TotalIn += Groups * BASE64_IN_SIZE;
+				Stream->AvailIn -= Groups * BASE64_IN_SIZE;
+				Stream->NextOut += Groups * BASE64_OUT_SIZE;
+				Stream->TotalOut += Groups * BASE64_OUT_SIZE;
+				Stream->AvailOut -= Groups * BASE64_OUT_SIZE;
+
+				if (Stream->LineLength != 0) {
+					Stream->Column += Groups * BASE64_OUT_SIZE;
+
+					/* Skip the block when there's room for the line break. */
+					if (Stream->Column >= Stream->LineLength && Stream->AvailOut >= 2) {
+						Stream->NextOut[0] = '\r';
+						Stream->NextOut[1] = '\n';
+						Stream->NextOut += 2;
+						Stream->TotalOut += 2;
+						Stream->AvailOut -= 2;
+						Stream->Column = 0;
+					}
+				}
+
+				continue;
+			}
+
+		}
+
+		/* Whatever is left goes through the block a byte at a time. */
 		for (; Stream->BlockSize < BASE64_IN_SIZE; Stream->BlockSize++) {
 
 			/* Out of input. This may be expected if there is no data left. */
 			if (Stream->AvailIn == 0) {
-				if (!Finished || Stream->BlockSize == 0)
-					return;
-				break;
+				if (Finished && Stream->BlockSize != 0)
+					break;
+
+				/* A partial last line still needs ending. */
+				if (Finished && Stream->Column != 0) {
+					BreakLine(Stream);
+					break;
+				}
+
+				return;
 			}
 
 			Stream->Block[Stream->BlockSize] = *Stream->NextIn;
@@ -93,6 +370,9 @@ void Encode64(B64Stream *Stream, int Finished)
 			Stream->AvailIn--;
 		}
 
+		if (Stream->BlockOut)
+			continue;
+
 		/* Encode the input we have. */
 		EncodeBlock(Stream->Block, OutBlock, Stream->BlockSize);
 
@@ -100,7 +380,7 @@ void Encode64(B64Stream *Stream, int Finished)
 		memcpy(Stream->Block, OutBlock, Stream->BlockSize);
 
 		Stream->BlockOut = 1;
+		if (Stream->LineLength != 0)
+			Stream->Column += BASE64_OUT_SIZE;
 	}
-
-	return;
 }
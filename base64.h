@@ -13,6 +13,10 @@ typedef struct B64Stream {
 	unsigned int TotalOut;
 	char *NextOut;
 
+	/* Set by InitEncode64Lines(). */
+	unsigned int LineLength;
+	unsigned int Column;
+
 	/* Internal cache. */
 	unsigned int BlockSize;
 	int BlockOut;	/* Direction of block. (Input or Output) */
@@ -20,6 +24,7 @@ typedef struct B64Stream {
 } B64Stream;
 
 void InitEncode64(B64Stream *Stream);
+void InitEncode64Lines(B64Stream *Stream, unsigned int LineLength);
 void Encode64(B64Stream *Stream, int Finished);
 
 #endif
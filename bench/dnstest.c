@@ -0,0 +1,173 @@
+/*
+	Runs the resolver against the stub server (stubdns.c) and checks what it gets back. Covers a truncated reply
+	being asked for again over TCP, the negative TTL from an NXDOMAIN's SOA, CNAMEs being skipped and many queries
+	in flight at once with DNSStart() and DNSWait().
+
+	From the repository's root, compile with;
+	gcc -O2 -Wall -I. bench/dnstest.c bench/stubdns.c dns.c -lpthread -o dnstest
+
+	Run as 'dnstest [port]'. Prints a line per check and exits with 1 if any failed.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns.h"
+#include "stubdns.h"
+
+#define DEFAULT_PORT	5353
+
+static unsigned int Failures;
+
+static void Check(int Passed, const char *What)
+{
+	printf("%s\t%s\n", Passed ? "ok" : "FAILED", What);
+	if (!Passed)
+		Failures++;
+
+	return;
+}
+
+static int IsAddress(const DNSRecord *Record, int Family, const char *Expected)
+{
+	unsigned char Address[16];
+
+	return inet_pton(Family, Expected, Address) == 1 && memcmp(Record->Data.Address, Address, Family == AF_INET6 ? 16 : 4) == 0;
+}
+
+static void Truncation(const DNSResolver *Resolver, StubDNS *Server)
+{
+	DNSQuery Query;
+	unsigned long TCP = Server->TCPQueries;
+	unsigned int Loop;
+	int Sorted = 1;
+
+	Check(DNSLookup(&Query, Resolver, "mx.test", DNS_RR_MX) == DNS_DONE, "mx.test resolves");
+	Check(Query.RecordCount == STUB_MX_COUNT, "all of the truncated MX records arrive");
+	Check(Server->TCPQueries == TCP + 1, "the truncated reply is asked for again over TCP");
+
+	for (Loop = 1; Loop < Query.RecordCount; Loop++) {
+		if (Query.Records[Loop - 1].Data.MX.Preference > Query.Records[Loop].Data.MX.Preference)
+			Sorted = 0;
+	}
+	Check(Sorted, "MX records are sorted by preference");
+	Check(Query.RecordCount > 0 && strcmp(Query.Records[0].Data.MX.Exchange, "mx1.mx.test") == 0, "exchange names are decoded");
+
+	DNSFree(&Query);
+
+	return;
+}
+
+static void Negative(const DNSResolver *Resolver)
+{
+	DNSQuery Query;
+
+	Check(DNSLookup(&Query, Resolver, "nx.test", DNS_RR_MX) == DNS_DONE, "nx.test gets an answer");
+	Check(Query.RCode == DNS_RCODE_NXDOMAIN, "nx.test is NXDOMAIN");
+	Check(Query.RecordCount == 0, "nx.test has no records");
+	Check(Query.NegativeTTL == (STUB_SOA_MINIMUM < STUB_SOA_TTL ? STUB_SOA_MINIMUM : STUB_SOA_TTL), "the negative TTL is the lower of the SOA's TTL and minimum");
+	DNSFree(&Query);
+
+	Check(DNSLookup(&Query, Resolver, "real.test", DNS_RR_MX) == DNS_DONE, "real.test's MX gets an answer");
+	Check(Query.RCode == DNS_RCODE_NOERROR && Query.RecordCount == 0, "real.test has no MX records");
+	Check(Query.NegativeTTL != 0, "real.test's missing MX has a negative TTL");
+	DNSFree(&Query);
+
+	return;
+}
+
+static void Alias(const DNSResolver *Resolver)
+{
+	DNSQuery Query;
+
+	Check(DNSLookup(&Query, Resolver, "alias.test", DNS_RR_A) == DNS_DONE, "alias.test resolves");
+	Check(Query.RecordCount == 1, "the CNAME is skipped");
+	Check(Query.RecordCount == 1 && IsAddress(&Query.Records[0], AF_INET, "192.0.2.7"), "the address is the CNAME target's");
+	DNSFree(&Query);
+
+	Check(DNSLookup(&Query, Resolver, "real.test", DNS_RR_AAAA) == DNS_DONE, "real.test's AAAA resolves");
+	Check(Query.RecordCount == 1 && IsAddress(&Query.Records[0], AF_INET6, "2001:db8::7"), "the IPv6 address is right");
+	DNSFree(&Query);
+
+	return;
+}
+
+/* Every MX host's address at once, as the cache does. */
+static void Concurrent(const DNSResolver *Resolver)
+{
+	DNSQuery Queries[STUB_MX_COUNT], *Pending[STUB_MX_COUNT];
+	char Name[DNS_NAME_SIZE], Expected[16];
+	unsigned int Loop, Started = 0, Right = 0;
+
+	for (Loop = 0; Loop < STUB_MX_COUNT; Loop++) {
+		snprintf(Name, sizeof(Name), "mx%u.mx.test", Loop + 1);
+		if (DNSStart(&Queries[Loop], Resolver, Name, DNS_RR_A) == 0)
+			Pending[Started++] = &Queries[Loop];
+	}
+	Check(Started == STUB_MX_COUNT, "every query starts");
+	Check(DNSWait(Pending, Started) == 0, "DNSWait() finishes");
+
+	for (Loop = 0; Loop < STUB_MX_COUNT; Loop++) {
+		snprintf(Expected, sizeof(Expected), "192.0.2.%u", Loop + 1);
+		if (DNSProcess(&Queries[Loop]) == DNS_DONE && Queries[Loop].RecordCount == 1 &&
+			IsAddress(&Queries[Loop].Records[0], AF_INET, Expected))
+			Right++;
+		DNSFree(&Queries[Loop]);
+	}
+	Check(Right == STUB_MX_COUNT, "each query gets its own answer");
+
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	DNSResolver Resolver;
+	StubDNS Server;
+	unsigned short Port;
+
+	Port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+
+	if (StubDNSStart(&Server, Port) != 0) {
+		fprintf(stderr, "Unable to listen on port %u.\n", Port);
+		return 1;
+	}
+
+	if (DNSInit(&Resolver, "127.0.0.1", Port) != 0) {
+		fprintf(stderr, "Unable to set up the resolver.\n");
+		StubDNSStop(&Server);
+		return 1;
+	}
+	Resolver.Timeout = 1000;
+
+	Truncation(&Resolver, &Server);
+	Negative(&Resolver);
+	Alias(&Resolver);
+	Concurrent(&Resolver);
+
+	StubDNSStop(&Server);
+
+	return Failures ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/*
+	Thread scaling of header generation. Each thread makes the Date, a boundary and a Message-ID per message, then
+	formats whole messages with SMTPFormat(). With nothing shared, the rate per thread should hold steady as threads
+	are added, up to the number of cores.
+
+	From the repository's root, compile with;
+	gcc -O2 -Wall -I. bench/headers.c ssmtp.c reply.c arena.c headers.c dns.c dnscache.c cbuffer.c base64.c body.c qp.c cpu.c -lpthread -o bench-headers
+
+	Run as 'bench-headers [max threads] [seconds per run]'. Prints a line of tab separated values per run.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssmtp.h"
+#include "headers.h"
+
+typedef struct Worker {
+	pthread_t Thread;
+	int Whole;		/* Format whole messages rather than only the headers. */
+	double Seconds;
+	unsigned long Count;
+	unsigned long Sink;
+} Worker;
+
+static double Now(void)
+{
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+
+	return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+static void *Run(void *Data)
+{
+	Worker *Work = Data;
+	const char *Addresses[] = { "Someone <someone@example.com>" };
+	const int Types[] = { SMTP_ADDRESS_TO };
+	char Random[SMTP_BOUNDARY_RAND_LENGTH + SMTP_MESSAGE_ID_RAND_LENGTH];
+	SMTPAttach Attach;
+	char *Message;
+	unsigned int Length, Loop;
+	double End;
+
+	SMTPAttachMemory(&Attach, "note.txt", "text/plain", "A short note.\r\n", 15);
+
+	End = Now() + Work->Seconds;
+	Work->Count = 0;
+
+	/* The clock is only checked every so often, so it doesn't dominate. */
+	while (Now() < End) {
+		for (Loop = 0; Loop < 256; Loop++) {
+
+			if (Work->Whole) {
+				if (SMTPFormat("Sender <sender@example.org>", Types, Addresses, 1, "Subject", "Body.\r\n", &Attach, &Message, &Length) != SMTP_ERR_SUCCESS)
+					return NULL;
+				Work->Sink += Length;
+				free(Message);
+			}
+			else {
+				Work->Sink += strlen(CurrentDate());
+				RandomString(Random, sizeof(Random));
+				Work->Sink += Random[0];
+			}
+
+		}
+		Work->Count += Loop;
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	Worker *Workers;
+	unsigned int MaxThreads, Threads, Loop;
+	unsigned long Total;
+	double Seconds, Single[2];
+	int Whole;
+
+	MaxThreads = argc > 1 ? atoi(argv[1]) : 8;
+	Seconds = argc > 2 ? atof(argv[2]) : 1.0;
+	if (!MaxThreads)
+		MaxThreads = 1;
+
+	Workers = calloc(MaxThreads, sizeof(Worker));
+	if (!Workers)
+		return 1;
+
+	printf("work\tthreads\tops_per_sec\tops_per_sec_per_thread\tscaling\n");
+
+	for (Whole = 0; Whole < 2; Whole++) {
+		for (Threads = 1; Threads <= MaxThreads; Threads *= 2) {
+
+			for (Loop = 0; Loop < Threads; Loop++) {
+				Workers[Loop].Whole = Whole;
+				Workers[Loop].Seconds = Seconds;
+				if (pthread_create(&Workers[Loop].Thread, NULL, Run, &Workers[Loop]) != 0)
+					return 1;
+			}
+
+			Total = 0;
+			for (Loop = 0; Loop < Threads; Loop++) {
+				pthread_join(Workers[Loop].Thread, NULL);
+				Total += Workers[Loop].Count;
+			}
+
+			/* Per thread against a single thread. Near 1.0 means nothing's being fought over. */
+			if (Threads == 1)
+				Single[Whole] = Total / Seconds;
+
+			printf("%s\t%u\t%.0f\t%.0f\t%.2f\n", Whole ? "format" : "headers", Threads, Total / Seconds,
+				Total / Seconds / Threads, Total / Seconds / Threads / Single[Whole]);
+		}
+	}
+
+	free(Workers);
+
+	return 0;
+}
@@ -0,0 +1,546 @@
+/*
+	Micro-benchmarks of the encoding and buffering hot paths, each timed on its own without a server. ssmtp.c is
+	included whole so its internal functions, MIMEData() and ReadReply(), can be called directly.
+
+	encode		Encode64() into 76 character lines, over input sizes and the size of the buffer written to.
+	mime		MIMEData() with a single attachment, into a send buffer that's thrown away when flushed.
+	cbuffer		CSend() and CSendStrings() with small fragments, against CSend() with bulk data.
+	reply		ReadReply() on single line and multi-line replies, fed through a socketpair.
+	address		SMTPAddressCommand(), finding the address in what's given and writing the command.
+
+	From the repository's root, compile with;
+	gcc -O2 -Wall -I. bench/kernels.c bench/timing.c reply.c arena.c headers.c dns.c dnscache.c cbuffer.c base64.c body.c qp.c cpu.c -lpthread -o bench-kernels
+
+	Run as 'bench-kernels [-t seconds per case] [-b baseline] [kernel ...]'. Prints a line of tab separated values
+	per case. The baseline is the output of an earlier run, such as before a change. Each case is run five times
+	and the fastest is kept, as anything slower is only noise from elsewhere.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "ssmtp.c"
+#include "timing.h"
+
+#define TRIALS			5
+#define MAX_BASELINES	256
+
+/* Replies written to the socketpair before reading them back. Kept under what its buffer holds. */
+#define REPLY_BATCH_SIZE	(48 * 1024)
+
+typedef struct Baseline {
+	char Kernel[32], Case[64];
+	double NsPerOp;
+} Baseline;
+
+static Baseline Baselines[MAX_BASELINES];
+static unsigned int BaselineCount;
+
+static double TrialTime = 0.2;
+
+/* What's timed. Returns the seconds taken by Count operations. */
+typedef double (*Kernel)(void *Data, unsigned long Count);
+
+static int LoadBaseline(const char *Path)
+{
+	FILE *File;
+	char Line[256];
+	Baseline *Entry;
+
+	File = fopen(Path, "r");
+	if (!File)
+		return -1;
+
+	while (BaselineCount < MAX_BASELINES && fgets(Line, sizeof(Line), File)) {
+		Entry = &Baselines[BaselineCount];
+		if (sscanf(Line, "%31[^\t]\t%63[^\t]\t%*s\t%lf", Entry->Kernel, Entry->Case, &Entry->NsPerOp) == 3)
+			BaselineCount++;
+	}
+
+	fclose(File);
+
+	return 0;
+}
+
+static const Baseline *FindBaseline(const char *Kernel, const char *Case)
+{
+	unsigned int Loop;
+
+	for (Loop = 0; Loop < BaselineCount; Loop++) {
+		if (strcmp(Baselines[Loop].Kernel, Kernel) == 0 && strcmp(Baselines[Loop].Case, Case) == 0)
+			return &Baselines[Loop];
+	}
+
+	return NULL;
+}
+
+/* Works out how many operations fill a trial, then keeps the fastest of several. */
+static void Measure(const char *Name, const char *Case, unsigned long Bytes, Kernel Run, void *Data)
+{
+	const Baseline *Base;
+	unsigned long Count;
+	unsigned int Loop;
+	double Taken, Best, Rate;
+
+	Count = 1;
+	while ((Taken = Run(Data, Count)) < TrialTime / 10 && Count < 1UL << 30)
+		Count *= 2;
+	if (Taken > 0)
+		Count = Count * (TrialTime / Taken) + 1;
+
+	Best = Run(Data, Count);
+	for (Loop = 1; Loop < TRIALS; Loop++) {
+		Taken = Run(Data, Count);
+		if (Taken < Best)
+			Best = Taken;
+	}
+
+	Best = Best / Count * 1e9;
+	Rate = TimingCycleRate();
+
+	printf("%s\t%s\t%lu\t%.1f\t%.3f", Name, Case, Bytes, Best, Rate ? Bytes / (Best * Rate / 1e9) : 0);
+
+	Base = FindBaseline(Name, Case);
+	if (Base)
+		printf("\t%.1f\t%.3f\n", Base->NsPerOp, Base->NsPerOp / Best);
+	else
+		printf("\t-\t-\n");
+
+	fflush(stdout);
+
+	return;
+}
+
+static unsigned char *RandomData(unsigned int Size)
+{
+	unsigned char *Data;
+	unsigned int Loop;
+
+	Data = malloc(Size ? Size : 1);
+	if (!Data) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	for (Loop = 0; Loop < Size; Loop++)
+		Data[Loop] = rand();
+
+	return Data;
+}
+
+/* Text in lines of 72 characters, each ending with a CRLF. */
+static unsigned char *TextData(unsigned int Size)
+{
+	unsigned char *Data;
+	unsigned int Loop;
+
+	Data = RandomData(Size);
+	for (Loop = 0; Loop < Size; Loop++)
+		Data[Loop] = Loop % 74 == 72 ? '\r' : Loop % 74 == 73 ? '\n' : 'a' + Data[Loop] % 26;
+
+	return Data;
+}
+
+/* Stands in for the socket. */
+static int Discard(void *Data, char *Buffer, unsigned int Size)
+{
+	(void)Data;
+	(void)Buffer;
+	(void)Size;
+
+	return 0;
+}
+
+/* Encode64. */
+
+typedef struct EncodeCase {
+	unsigned char *In;
+	unsigned int InSize;
+	char *Out;
+	unsigned int OutSize;
+} EncodeCase;
+
+static double Encode(void *Data, unsigned long Count)
+{
+	EncodeCase *Case = Data;
+	B64Stream Stream;
+	double Start;
+
+	Start = TimingNow();
+
+	for (; Count != 0; Count--) {
+
+		InitEncode64Lines(&Stream, SMTP_LINE_LENGTH);
+		Stream.NextIn = Case->In;
+		Stream.AvailIn = Case->InSize;
+
+		/* As SendBase64(), with the buffer emptied each time it fills. */
+		do {
+			Stream.NextOut = Case->Out;
+			Stream.AvailOut = Case->OutSize;
+			Encode64(&Stream, 1);
+		} while (Stream.AvailOut == 0);
+
+	}
+
+	return TimingNow() - Start;
+}
+
+static void BenchEncode(void)
+{
+	static const unsigned int InSizes[] = { 57, 4096, 65536, 1024 * 1024 };
+	static const unsigned int OutSizes[] = { SMTP_LINE_LENGTH + 2, 4096, SMTP_SEND_BUFFER_SIZE };
+	EncodeCase Case;
+	char Name[64];
+	unsigned int In, Out;
+
+	for (In = 0; In < sizeof(InSizes) / sizeof(InSizes[0]); In++) {
+		for (Out = 0; Out < sizeof(OutSizes) / sizeof(OutSizes[0]); Out++) {
+
+			Case.InSize = InSizes[In];
+			Case.OutSize = OutSizes[Out];
+			Case.In = RandomData(Case.InSize);
+			Case.Out = (char *)RandomData(Case.OutSize);
+
+			snprintf(Name, sizeof(Name), "in=%u,out=%u", Case.InSize, Case.OutSize);
+			Measure("encode", Name, Case.InSize, Encode, &Case);
+
+			free(Case.In);
+			free(Case.Out);
+		}
+	}
+
+	return;
+}
+
+/* MIMEData. */
+
+typedef struct MIMECase {
+	SMTPAttach Attach;
+	char *Buffer;
+} MIMECase;
+
+static double MIME(void *Data, unsigned long Count)
+{
+	MIMECase *Case = Data;
+	CSendBuffer CBuffer;
+	MessageBody Body;
+	double Start;
+
+	Body.Data = "A short body.\r\n";
+	Body.Read = NULL;
+	Body.ReadData = NULL;
+
+	Start = TimingNow();
+
+	for (; Count != 0; Count--) {
+		CInit(&CBuffer, Case->Buffer, SMTP_SEND_BUFFER_SIZE, Discard, NULL);
+		if (MIMEData(&CBuffer, &Body, &Case->Attach, 1, 0) != 0 || CFlush(&CBuffer) != 0) {
+			fprintf(stderr, "MIMEData() failed.\n");
+			exit(1);
+		}
+	}
+
+	return TimingNow() - Start;
+}
+
+static void BenchMIME(void)
+{
+	static const unsigned int Sizes[] = { 4096, 65536, 1024 * 1024 };
+	MIMECase Case;
+	unsigned char *Attachment;
+	char Name[64];
+	unsigned int Size, Text;
+
+	Case.Buffer = malloc(SMTP_SEND_BUFFER_SIZE);
+	if (!Case.Buffer)
+		return;
+
+	/* Binary data is Base64 encoded. Text is sent as it is. */
+	for (Text = 0; Text < 2; Text++) {
+		for (Size = 0; Size < sizeof(Sizes) / sizeof(Sizes[0]); Size++) {
+
+			Attachment = Text ? TextData(Sizes[Size]) : RandomData(Sizes[Size]);
+			SMTPAttachMemory(&Case.Attach, "data", NULL, Attachment, Sizes[Size]);
+
+			snprintf(Name, sizeof(Name), "%s,size=%u", Text ? "text" : "binary", Sizes[Size]);
+			Measure("mime", Name, Sizes[Size], MIME, &Case);
+
+			free(Attachment);
+		}
+	}
+
+	free(Case.Buffer);
+
+	return;
+}
+
+/* CSend and CSendStrings. */
+
+typedef struct CBufferCase {
+	int Strings;			/* CSendStrings() with four at a time rather than CSend(). */
+	unsigned int Size;		/* Of each fragment. */
+	unsigned int Total;		/* Sent per operation. */
+	const char *Data;
+	char *Buffer;
+} CBufferCase;
+
+static double Buffer(void *Data, unsigned long Count)
+{
+	CBufferCase *Case = Data;
+	CSendBuffer CBuffer;
+	const char *String;
+	unsigned int Sent;
+	double Start;
+
+	/* Each of the four strings is a quarter of the fragment. */
+	String = &Case->Data[Case->Total - Case->Size / 4];
+
+	Start = TimingNow();
+
+	for (; Count != 0; Count--) {
+
+		CInit(&CBuffer, Case->Buffer, SMTP_SEND_BUFFER_SIZE, Discard, NULL);
+
+		for (Sent = 0; Sent < Case->Total; Sent += Case->Size) {
+			if (Case->Strings)
+				CSendStrings(&CBuffer, String, String, String, String, NULL);
+			else
+				CSend(&CBuffer, &Case->Data[Sent], Case->Size);
+		}
+
+		CFlush(&CBuffer);
+	}
+
+	return TimingNow() - Start;
+}
+
+static void BenchBuffer(void)
+{
+	static const unsigned int Sizes[] = { 8, 32, 256, 4096, 65536 };
+	CBufferCase Case;
+	char *Data, Name[64];
+	unsigned int Size;
+
+	/* The strings for CSendStrings() are terminated at the end. */
+	Case.Total = 65536;
+	Data = (char *)TextData(Case.Total + 1);
+	Data[Case.Total] = '\0';
+	Case.Data = Data;
+
+	Case.Buffer = malloc(SMTP_SEND_BUFFER_SIZE);
+	if (!Case.Buffer)
+		return;
+
+	for (Size = 0; Size < sizeof(Sizes) / sizeof(Sizes[0]); Size++) {
+		Case.Strings = 0;
+		Case.Size = Sizes[Size];
+		snprintf(Name, sizeof(Name), "csend,fragment=%u", Case.Size);
+		Measure("cbuffer", Name, Case.Total, Buffer, &Case);
+	}
+
+	for (Size = 0; Size < 3; Size++) {
+		Case.Strings = 1;
+		Case.Size = Sizes[Size];
+		snprintf(Name, sizeof(Name), "csendstrings,fragment=%u", Case.Size);
+		Measure("cbuffer", Name, Case.Total, Buffer, &Case);
+	}
+
+	free(Case.Buffer);
+	free(Data);
+
+	return;
+}
+
+/* ReadReply. */
+
+typedef struct ReplyCase {
+	SMTPConn Conn;
+	int Writer;
+	char *Batch;
+	unsigned int Size, PerBatch;
+} ReplyCase;
+
+static double Reply(void *Data, unsigned long Count)
+{
+	ReplyCase *Case = Data;
+	SMTPReply Reply;
+	unsigned long Batch, Done;
+	double Taken = 0, Start;
+
+	/* Only the reading is timed. Whatever's left of the last batch is read too, so nothing's left over. */
+	for (Done = 0; Done < Count; Done += Case->PerBatch) {
+
+		if (send(Case->Writer, Case->Batch, Case->Size * Case->PerBatch, 0) != (ssize_t)(Case->Size * Case->PerBatch)) {
+			fprintf(stderr, "Unable to write to the socketpair.\n");
+			exit(1);
+		}
+
+		Start = TimingNow();
+		for (Batch = 0; Batch < Case->PerBatch; Batch++) {
+			if (ReadReply(&Case->Conn, &Reply) != 0) {
+				fprintf(stderr, "ReadReply() failed.\n");
+				exit(1);
+			}
+		}
+		Taken += TimingNow() - Start;
+	}
+
+	return Taken / Done * Count;
+}
+
+static void BenchReply(void)
+{
+	static const unsigned int Lines[] = { 1, 10, 100 };
+	ReplyCase Case;
+	char Text[8192], Name[64];
+	unsigned int Size, Loop, Line;
+	int Pair[2], Buffer = 4 * REPLY_BATCH_SIZE;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, Pair) != 0)
+		return;
+	setsockopt(Pair[1], SOL_SOCKET, SO_SNDBUF, &Buffer, sizeof(Buffer));
+	setsockopt(Pair[0], SOL_SOCKET, SO_RCVBUF, &Buffer, sizeof(Buffer));
+
+	memset(&Case.Conn, 0, sizeof(Case.Conn));
+	Case.Conn.Socket = Pair[0];
+	Case.Conn.State = SMTP_CONNECTED;
+	Case.Writer = Pair[1];
+
+	for (Loop = 0; Loop < sizeof(Lines) / sizeof(Lines[0]); Loop++) {
+
+		/* Like an EHLO reply, or a rejection that goes on at length. */
+		Size = 0;
+		for (Line = 1; Line < Lines[Loop]; Line++)
+			Size += snprintf(&Text[Size], sizeof(Text) - Size, "250-2.0.0 Line %u of the reply, going on for a while\r\n", Line);
+		Size += snprintf(&Text[Size], sizeof(Text) - Size, "250 2.0.0 OK\r\n");
+
+		Case.Size = Size;
+		Case.PerBatch = REPLY_BATCH_SIZE / Size;
+		Case.Batch = malloc(Size * Case.PerBatch);
+		if (!Case.Batch)
+			break;
+		for (Line = 0; Line < Case.PerBatch; Line++)
+			memcpy(&Case.Batch[Line * Size], Text, Size);
+
+		snprintf(Name, sizeof(Name), "lines=%u", Lines[Loop]);
+		Measure("reply", Name, Size, Reply, &Case);
+
+		free(Case.Batch);
+	}
+
+	free(Case.Conn.RecvBuffer);
+	closesocket(Pair[0]);
+	closesocket(Pair[1]);
+
+	return;
+}
+
+/* SMTPAddress's extraction. */
+
+static double Address(void *Data, unsigned long Count)
+{
+	const char *Address = Data;
+	char Buffer[SMTP_BUFFER_SIZE];
+	int Length;
+	double Start;
+
+	Start = TimingNow();
+
+	for (; Count != 0; Count--) {
+		if (SMTPAddressCommand(Buffer, sizeof(Buffer), SMTP_ADDRESS_TO, Address, &Length) != SMTP_ERR_SUCCESS) {
+			fprintf(stderr, "SMTPAddressCommand() failed.\n");
+			exit(1);
+		}
+	}
+
+	return TimingNow() - Start;
+}
+
+static void BenchAddress(void)
+{
+	static const char *Cases[][2] = {
+		{ "bare", "someone@example.com" },
+		{ "named", "Someone Else <someone@example.com>" },
+		{ "quoted", "\"Else, Someone <or another>\" <someone@example.com>" },
+		{ "long", "A Display Name Going On For Quite A While, As Some Do In Lists <someone.with.a.long.address@mail.example.com>" }
+	};
+	unsigned int Loop;
+
+	for (Loop = 0; Loop < sizeof(Cases) / sizeof(Cases[0]); Loop++)
+		Measure("address", Cases[Loop][0], strlen(Cases[Loop][1]), Address, (void *)Cases[Loop][1]);
+
+	return;
+}
+
+static const struct {
+	const char *Name;
+	void (*Run)(void);
+} Kernels[] = {
+	{ "encode", BenchEncode },
+	{ "mime", BenchMIME },
+	{ "cbuffer", BenchBuffer },
+	{ "reply", BenchReply },
+	{ "address", BenchAddress }
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int Loop;
+	int Arg, Chosen = 0;
+
+	for (Arg = 1; Arg < argc; Arg++) {
+		if (strcmp(argv[Arg], "-t") == 0 && Arg + 1 < argc)
+			TrialTime = atof(argv[++Arg]);
+		else if (strcmp(argv[Arg], "-b") == 0 && Arg + 1 < argc) {
+			if (LoadBaseline(argv[++Arg]) != 0) {
+				fprintf(stderr, "Unable to read %s.\n", argv[Arg]);
+				return 1;
+			}
+		}
+		else
+			Chosen = 1;
+	}
+
+	if (TrialTime <= 0)
+		TrialTime = 0.2;
+
+	printf("kernel\tcase\tbytes_per_op\tns_per_op\tbytes_per_cycle\tbaseline_ns_per_op\tspeedup\n");
+
+	for (Loop = 0; Loop < sizeof(Kernels) / sizeof(Kernels[0]); Loop++) {
+
+		/* Everything unless some are named. */
+		if (Chosen) {
+			for (Arg = 1; Arg < argc; Arg++) {
+				if (strcmp(argv[Arg], "-t") == 0 || strcmp(argv[Arg], "-b") == 0)
+					Arg++;
+				else if (strcmp(argv[Arg], Kernels[Loop].Name) == 0)
+					break;
+			}
+			if (Arg >= argc)
+				continue;
+		}
+
+		Kernels[Loop].Run();
+	}
+
+	return 0;
+}
@@ -0,0 +1,506 @@
+/*
+	A local SMTP server that accepts everything and throws it away, for benchmarking against. It understands
+	HELO/EHLO, PIPELINING, CHUNKING, SIZE and 8BITMIME. Replies to pipelined commands are sent together, once
+	everything that's arrived has been handled, after waiting the configured latency.
+
+	Built with SMTP_TLS, it can also offer STARTTLS, using a self-signed certificate made when it starts. OpenSSL
+	writes to the socket without MSG_NOSIGNAL, so SIGPIPE should be ignored by the program then.
+
+	Each connection gets its own thread, so it's best run in a process of its own when measuring the client's CPU.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef SMTP_TLS
+	#include <openssl/ssl.h>
+	#include <openssl/x509.h>
+#endif
+
+#include "sink.h"
+
+#define SINK_BUFFER_SIZE	(256 * 1024)
+
+enum SinkModes {
+	MODE_COMMANDS,
+	MODE_DATA,		/* Looking for the end of data marker. */
+	MODE_BDAT		/* Skipping a chunk. */
+};
+
+typedef struct Client {
+	Sink *Sink;
+	int Socket;
+	int Mode;
+	unsigned long long Left;	/* Of the current chunk. */
+	unsigned int Matched;		/* Of the end of data marker, across reads. */
+	int Last;					/* The chunk is the last. */
+	#ifdef SMTP_TLS
+	SSL *TLS;					/* Once STARTTLS has been accepted. */
+	#endif
+	unsigned int OutSize;
+	char Out[8192];
+} Client;
+
+static int Flush(Client *Conn)
+{
+	struct timespec Wait;
+	unsigned int Offset;
+	ssize_t Return;
+
+	if (!Conn->OutSize)
+		return 0;
+
+	if (Conn->Sink->Config.Latency) {
+		Wait.tv_sec = Conn->Sink->Config.Latency / 1000000;
+		Wait.tv_nsec = (Conn->Sink->Config.Latency % 1000000) * 1000;
+		nanosleep(&Wait, NULL);
+	}
+
+	for (Offset = 0; Offset < Conn->OutSize; Offset += Return) {
+		#ifdef SMTP_TLS
+		if (Conn->TLS)
+			Return = SSL_write(Conn->TLS, Conn->Out + Offset, Conn->OutSize - Offset);
+		else
+		#endif
+		Return = send(Conn->Socket, Conn->Out + Offset, Conn->OutSize - Offset, MSG_NOSIGNAL);
+		if (Return <= 0)
+			return -1;
+	}
+	Conn->OutSize = 0;
+
+	return 0;
+}
+
+static int Reply(Client *Conn, const char *Text)
+{
+	unsigned int Length = strlen(Text);
+
+	if (Conn->OutSize + Length > sizeof(Conn->Out) && Flush(Conn) != 0)
+		return -1;
+
+	memcpy(Conn->Out + Conn->OutSize, Text, Length);
+	Conn->OutSize += Length;
+
+	return 0;
+}
+
+#ifdef SMTP_TLS
+/* A throwaway certificate, as the client doesn't check it by default. Version is as in SinkConfig. */
+static SSL_CTX *CreateContext(unsigned int Version)
+{
+	EVP_PKEY_CTX *KeyContext;
+	EVP_PKEY *Key = NULL;
+	X509 *Certificate = NULL;
+	SSL_CTX *Context = NULL;
+
+	KeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (!KeyContext)
+		return NULL;
+
+	if (EVP_PKEY_keygen_init(KeyContext) != 1 ||
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(KeyContext, NID_X9_62_prime256v1) != 1 ||
+		EVP_PKEY_keygen(KeyContext, &Key) != 1)
+		goto Done;
+
+	Certificate = X509_new();
+	if (!Certificate ||
+		X509_set_version(Certificate, 2) != 1 ||
+		ASN1_INTEGER_set(X509_get_serialNumber(Certificate), 1) != 1 ||
+		!X509_gmtime_adj(X509_getm_notBefore(Certificate), -60) ||
+		!X509_gmtime_adj(X509_getm_notAfter(Certificate), 24 * 60 * 60) ||
+		X509_set_pubkey(Certificate, Key) != 1 ||
+		X509_NAME_add_entry_by_txt(X509_get_subject_name(Certificate), "CN", MBSTRING_ASC, (const unsigned char *)"sink", -1, -1, 0) != 1 ||
+		X509_set_issuer_name(Certificate, X509_get_subject_name(Certificate)) != 1 ||
+		!X509_sign(Certificate, Key, EVP_sha256()))
+		goto Done;
+
+	Context = SSL_CTX_new(TLS_server_method());
+	if (!Context)
+		goto Done;
+
+	SSL_CTX_set_min_proto_version(Context, Version == 13 ? TLS1_3_VERSION : TLS1_2_VERSION);
+	SSL_CTX_set_max_proto_version(Context, Version == 12 ? TLS1_2_VERSION : 0);
+
+	/* Sessions aren't resumed without one. */
+	SSL_CTX_set_session_id_context(Context, (const unsigned char *)"sink", 4);
+
+	if (SSL_CTX_use_certificate(Context, Certificate) != 1 || SSL_CTX_use_PrivateKey(Context, Key) != 1) {
+		SSL_CTX_free(Context);
+		Context = NULL;
+	}
+
+	Done:
+	X509_free(Certificate);
+	EVP_PKEY_free(Key);
+	EVP_PKEY_CTX_free(KeyContext);
+	return Context;
+}
+
+static int StartTLS(Client *Conn)
+{
+	Sink *Server = Conn->Sink;
+
+	Conn->TLS = SSL_new(Server->TLSContext);
+	if (!Conn->TLS)
+		return -1;
+
+	if (SSL_set_fd(Conn->TLS, Conn->Socket) != 1 || SSL_accept(Conn->TLS) != 1)
+		return -1;
+
+	__atomic_add_fetch(&Server->Handshakes, 1, __ATOMIC_RELAXED);
+	if (SSL_session_reused(Conn->TLS))
+		__atomic_add_fetch(&Server->Resumed, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&Server->LastVersion, SSL_version(Conn->TLS) == TLS1_3_VERSION ? 13 : 12, __ATOMIC_RELAXED);
+
+	return 0;
+}
+#endif
+
+/* STARTTLS is only offered before it's been done. */
+static int Offered(const Client *Conn)
+{
+	#ifdef SMTP_TLS
+	return Conn->Sink->TLSContext && !Conn->TLS;
+	#else
+	(void)Conn;
+	return 0;
+	#endif
+}
+
+/* Returns 1 once the client has quit and 2 once TLS has started. */
+static int Command(Client *Conn, char *Line, unsigned int Length)
+{
+	char Ehlo[256];
+	char *End;
+
+	Line[Length] = '\0';
+
+	if (strncasecmp(Line, "EHLO", 4) == 0) {
+		snprintf(Ehlo, sizeof(Ehlo), "250-sink\r\n%s%s%s250-8BITMIME\r\n250 SIZE 0\r\n",
+			Conn->Sink->Config.Pipelining ? "250-PIPELINING\r\n" : "",
+			Conn->Sink->Config.Chunking ? "250-CHUNKING\r\n" : "",
+			Offered(Conn) ? "250-STARTTLS\r\n" : "");
+		return Reply(Conn, Ehlo);
+	}
+
+	#ifdef SMTP_TLS
+	if (strncasecmp(Line, "STARTTLS", 8) == 0 && Offered(Conn)) {
+		if (Conn->Sink->Config.RefuseTLS)
+			return Reply(Conn, "454 4.7.0 TLS not available\r\n");
+		if (Reply(Conn, "220 2.0.0 Ready to start TLS\r\n") != 0 ||
+			(Conn->Sink->Config.InjectTLS && Reply(Conn, "250 2.0.0 Injected\r\n") != 0) ||
+			Flush(Conn) != 0 || StartTLS(Conn) != 0)
+			return -1;
+		return 2;
+	}
+	#endif
+
+	if (strncasecmp(Line, "HELO", 4) == 0 || strncasecmp(Line, "MAIL", 4) == 0 || strncasecmp(Line, "RCPT", 4) == 0 ||
+		strncasecmp(Line, "RSET", 4) == 0 || strncasecmp(Line, "NOOP", 4) == 0)
+		return Reply(Conn, "250 2.0.0 OK\r\n");
+
+	if (strncasecmp(Line, "DATA", 4) == 0) {
+		Conn->Mode = MODE_DATA;
+		Conn->Matched = 2;	/* The line ending before DATA counts towards the marker. */
+		return Reply(Conn, "354 Go ahead\r\n");
+	}
+
+	if (strncasecmp(Line, "BDAT ", 5) == 0) {
+		Conn->Left = strtoull(Line + 5, &End, 10);
+		while (*End == ' ')
+			End++;
+		Conn->Last = strncasecmp(End, "LAST", 4) == 0;
+		Conn->Mode = MODE_BDAT;
+		return 0;
+	}
+
+	if (strncasecmp(Line, "QUIT", 4) == 0) {
+		Reply(Conn, "221 2.0.0 Bye\r\n");
+		return 1;
+	}
+
+	return Reply(Conn, "500 5.5.1 Unrecognised command\r\n");
+}
+
+/* Finds the end of data marker, which may be split across reads. Returns how much was used or -1 if more's needed. */
+static long FindEnd(Client *Conn, const char *Data, unsigned long Size)
+{
+	static const char Marker[] = "\r\n.\r\n";
+	unsigned long Loop;
+
+	for (Loop = 0; Loop < Size; Loop++) {
+
+		/* Skip ahead to the next CR when nothing's matched. */
+		if (!Conn->Matched) {
+			const char *CR = memchr(Data + Loop, '\r', Size - Loop);
+			if (!CR)
+				return -1;
+			Loop = CR - Data;
+		}
+
+		if (Data[Loop] == Marker[Conn->Matched])
+			Conn->Matched++;
+		else
+			Conn->Matched = Data[Loop] == '\r' ? 1 : 0;
+
+		if (Conn->Matched == sizeof(Marker) - 1)
+			return Loop + 1;
+	}
+
+	return -1;
+}
+
+static void *Serve(void *Data)
+{
+	Client *Conn = Data;
+	char *Buffer;
+	char *Line, *Next;
+	unsigned long Start, End, Used;
+	long Found;
+	ssize_t Return;
+	int Quit = 0;
+
+	Buffer = malloc(SINK_BUFFER_SIZE);
+	if (!Buffer)
+		goto Done;
+
+	Conn->Mode = MODE_COMMANDS;
+	if (Reply(Conn, "220 sink ESMTP\r\n") != 0 || Flush(Conn) != 0)
+		goto Done;
+
+	Start = End = 0;
+	while (!Quit) {
+
+		#ifdef SMTP_TLS
+		if (Conn->TLS)
+			Return = SSL_read(Conn->TLS, Buffer + End, SINK_BUFFER_SIZE - End);
+		else
+		#endif
+		Return = recv(Conn->Socket, Buffer + End, SINK_BUFFER_SIZE - End, 0);
+		if (Return <= 0)
+			break;
+		End += Return;
+		__atomic_add_fetch(&Conn->Sink->Bytes, Return, __ATOMIC_RELAXED);
+
+		while (Start < End && !Quit) {
+
+			if (Conn->Mode == MODE_DATA) {
+				Found = FindEnd(Conn, Buffer + Start, End - Start);
+				if (Found < 0) {
+					Start = End;
+					break;
+				}
+				Start += Found;
+				Conn->Mode = MODE_COMMANDS;
+				__atomic_add_fetch(&Conn->Sink->Messages, 1, __ATOMIC_RELAXED);
+				if (Reply(Conn, "250 2.0.0 Queued\r\n") != 0)
+					goto Done;
+				continue;
+			}
+
+			if (Conn->Mode == MODE_BDAT) {
+				Used = End - Start < Conn->Left ? End - Start : Conn->Left;
+				Start += Used;
+				Conn->Left -= Used;
+				if (Conn->Left)
+					break;
+				Conn->Mode = MODE_COMMANDS;
+				if (Conn->Last)
+					__atomic_add_fetch(&Conn->Sink->Messages, 1, __ATOMIC_RELAXED);
+				if (Reply(Conn, "250 2.0.0 Chunk accepted\r\n") != 0)
+					goto Done;
+				continue;
+			}
+
+			Line = Buffer + Start;
+			Next = memchr(Line, '\n', End - Start);
+			if (!Next)
+				break;
+			Start = Next + 1 - Buffer;
+			if (Next > Line && Next[-1] == '\r')
+				Next--;
+
+			Quit = Command(Conn, Line, Next - Line);
+			if (Quit < 0)
+				goto Done;
+
+			/* Anything that came in the clear after STARTTLS is thrown away, as RFC 3207 asks. */
+			if (Quit == 2) {
+				Start = End;
+				Quit = 0;
+			}
+		}
+
+		/* Everything that's arrived has been handled, so the replies go out together. */
+		if (Start >= End || Conn->Mode != MODE_COMMANDS) {
+			if (Flush(Conn) != 0)
+				break;
+		}
+
+		/* Keep any partial line at the front. */
+		if (Start >= End)
+			Start = End = 0;
+		else if (Start > 0 && (End == SINK_BUFFER_SIZE || Conn->Mode == MODE_COMMANDS)) {
+			memmove(Buffer, Buffer + Start, End - Start);
+			End -= Start;
+			Start = 0;
+		}
+
+		/* A line that doesn't fit. */
+		if (End == SINK_BUFFER_SIZE)
+			break;
+	}
+
+	Flush(Conn);
+
+	Done:
+	#ifdef SMTP_TLS
+	if (Conn->TLS) {
+		SSL_shutdown(Conn->TLS);
+		SSL_free(Conn->TLS);
+	}
+	#endif
+	close(Conn->Socket);
+	free(Buffer);
+	free(Conn);
+	return NULL;
+}
+
+static void *Listen(void *Data)
+{
+	Sink *Server = Data;
+	pthread_attr_t Attributes;
+	pthread_t Thread;
+	Client *Conn;
+	int Socket, Enable;
+
+	pthread_attr_init(&Attributes);
+	pthread_attr_setdetachstate(&Attributes, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+
+		Socket = accept(Server->Socket, NULL, NULL);
+		if (Socket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		Enable = 1;
+		setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &Enable, sizeof(Enable));
+
+		Conn = calloc(1, sizeof(Client));
+		if (!Conn) {
+			close(Socket);
+			continue;
+		}
+		Conn->Sink = Server;
+		Conn->Socket = Socket;
+
+		if (pthread_create(&Thread, &Attributes, Serve, Conn) != 0) {
+			close(Socket);
+			free(Conn);
+		}
+	}
+
+	pthread_attr_destroy(&Attributes);
+
+	return NULL;
+}
+
+/* Starts listening straight away, serving clients from a thread of its own. */
+int SinkStart(Sink *Server, const SinkConfig *Config)
+{
+	struct sockaddr_in Address;
+	int Enable = 1;
+
+	Server->Config = *Config;
+	Server->Messages = 0;
+	Server->Bytes = 0;
+	Server->Handshakes = Server->Resumed = 0;
+	Server->LastVersion = 0;
+
+	Server->TLSContext = NULL;
+	if (Config->StartTLS) {
+		#ifdef SMTP_TLS
+		Server->TLSContext = CreateContext(Config->TLSVersion);
+		if (!Server->TLSContext)
+			return -1;
+		#else
+		return -1;
+		#endif
+	}
+
+	Server->Socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (Server->Socket < 0)
+		goto Err;
+	setsockopt(Server->Socket, SOL_SOCKET, SO_REUSEADDR, &Enable, sizeof(Enable));
+
+	memset(&Address, 0, sizeof(Address));
+	Address.sin_family = AF_INET;
+	Address.sin_port = htons(Config->Port);
+	Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(Server->Socket, (struct sockaddr *)&Address, sizeof(Address)) != 0 ||
+		listen(Server->Socket, 1024) != 0 ||
+		pthread_create(&Server->Thread, NULL, Listen, Server) != 0) {
+		close(Server->Socket);
+		goto Err;
+	}
+
+	return 0;
+
+	Err:
+	#ifdef SMTP_TLS
+	SSL_CTX_free(Server->TLSContext);
+	#endif
+	return -1;
+}
+
+/* Stops accepting. Connections already open are served until their clients leave. */
+void SinkStop(Sink *Server)
+{
+	shutdown(Server->Socket, SHUT_RDWR);
+	pthread_join(Server->Thread, NULL);
+	close(Server->Socket);
+
+	/* Connections still open hold their own reference. */
+	#ifdef SMTP_TLS
+	SSL_CTX_free(Server->TLSContext);
+	#endif
+
+	return;
+}
@@ -0,0 +1,35 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <pthread.h>
+
+typedef struct SinkConfig {
+	unsigned short Port;	/* On 127.0.0.1. */
+	unsigned int Latency;	/* In microseconds, waited before each batch of replies is sent. */
+	int Pipelining;
+	int Chunking;
+
+	/* Only with SMTP_TLS. */
+	int StartTLS;
+	unsigned int TLSVersion;	/* The only version allowed, 12 or 13. 0 for either. */
+	int RefuseTLS;				/* STARTTLS is offered but answered with 454. */
+	int InjectTLS;				/* A reply is sent in the clear straight after STARTTLS's, as an attacker might. */
+} SinkConfig;
+
+typedef struct Sink {
+	SinkConfig Config;
+	int Socket;
+	pthread_t Thread;
+	volatile unsigned long Messages;
+	volatile unsigned long long Bytes;
+
+	void *TLSContext;
+	volatile unsigned long Handshakes;
+	volatile unsigned long Resumed;		/* Also counted as handshakes. */
+	volatile unsigned int LastVersion;	/* Of the last handshake, 12 or 13. */
+} Sink;
+
+int SinkStart(Sink *Sink, const SinkConfig *Config);
+void SinkStop(Sink *Sink);
+
+#endif
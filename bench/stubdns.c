@@ -0,0 +1,351 @@
+/*
+	A DNS server on 127.0.0.1 with a small fixed zone, for testing the resolver against.
+
+	mx.test			STUB_MX_COUNT MX records, so the UDP reply is truncated and has to be asked for again over TCP.
+	alias.test		A CNAME to real.test, followed by real.test's A record of 192.0.2.7.
+	real.test		A 192.0.2.7 and AAAA 2001:db8::7.
+	mx<n>.mx.test	A 192.0.2.<n>.
+	nx.test			NXDOMAIN, with the zone's SOA.
+
+	Anything else is answered with no records along with the SOA.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "stubdns.h"
+
+#define PACKET_SIZE		4096
+#define UDP_SIZE		512
+
+#define TYPE_A			1
+#define TYPE_CNAME		5
+#define TYPE_SOA		6
+#define TYPE_MX			15
+#define TYPE_AAAA		28
+
+/* A reply being built up. */
+typedef struct Reply {
+	unsigned char Data[PACKET_SIZE];
+	unsigned int Size;
+	unsigned int Answers, Authorities;
+} Reply;
+
+/* Writes the name as labels. Returns its length. */
+static unsigned int EncodeName(unsigned char *Out, const char *Name)
+{
+	unsigned int Size = 0, Length;
+	const char *Dot;
+
+	while (*Name) {
+		Dot = strchr(Name, '.');
+		Length = Dot ? (unsigned int)(Dot - Name) : strlen(Name);
+		Out[Size++] = Length;
+		memcpy(&Out[Size], Name, Length);
+		Size += Length;
+		Name += Length + (Dot ? 1 : 0);
+	}
+	Out[Size++] = 0;
+
+	return Size;
+}
+
+static void AddRecord(Reply *Out, const char *Owner, unsigned int Type, unsigned int TTL, const unsigned char *Data, unsigned int Length)
+{
+	unsigned char *Record;
+
+	/* The question's name is always at the same place, so it's pointed to. */
+	if (Owner)
+		Out->Size += EncodeName(&Out->Data[Out->Size], Owner);
+	else {
+		Out->Data[Out->Size++] = 0xC0;
+		Out->Data[Out->Size++] = 12;
+	}
+
+	Record = &Out->Data[Out->Size];
+	Record[0] = Type >> 8;
+	Record[1] = Type & 0xFF;
+	Record[2] = 0;
+	Record[3] = 1;
+	Record[4] = TTL >> 24;
+	Record[5] = (TTL >> 16) & 0xFF;
+	Record[6] = (TTL >> 8) & 0xFF;
+	Record[7] = TTL & 0xFF;
+	Record[8] = Length >> 8;
+	Record[9] = Length & 0xFF;
+	memcpy(&Record[10], Data, Length);
+	Out->Size += 10 + Length;
+
+	return;
+}
+
+static void AddSOA(Reply *Out)
+{
+	unsigned char Data[128];
+	unsigned int Size, Loop;
+	static const unsigned int Times[5] = { 1, 3600, 600, 86400, STUB_SOA_MINIMUM };
+
+	Size = EncodeName(Data, "ns.test");
+	Size += EncodeName(&Data[Size], "hostmaster.test");
+	for (Loop = 0; Loop < 5; Loop++) {
+		Data[Size++] = Times[Loop] >> 24;
+		Data[Size++] = (Times[Loop] >> 16) & 0xFF;
+		Data[Size++] = (Times[Loop] >> 8) & 0xFF;
+		Data[Size++] = Times[Loop] & 0xFF;
+	}
+
+	AddRecord(Out, "test", TYPE_SOA, STUB_SOA_TTL, Data, Size);
+	Out->Authorities++;
+
+	return;
+}
+
+/* Builds the reply to a query. Returns -1 if it's not one. */
+static int Answer(const unsigned char *Query, unsigned int Size, Reply *Out)
+{
+	char Name[256];
+	unsigned char Data[256];
+	unsigned int Offset, Used, Length, Type, Loop, RCode = 0;
+
+	if (Size < 12 || Query[5] != 1)
+		return -1;
+
+	/* Read the question's name back into text. */
+	Offset = 12;
+	Used = 0;
+	while (Offset < Size && Query[Offset]) {
+		Length = Query[Offset++];
+		if (Length > 63 || Offset + Length > Size || Used + Length + 1 >= sizeof(Name))
+			return -1;
+		if (Used)
+			Name[Used++] = '.';
+		memcpy(&Name[Used], &Query[Offset], Length);
+		Used += Length;
+		Offset += Length;
+	}
+	Name[Used] = '\0';
+	if (Offset + 5 > Size)
+		return -1;
+	Type = Query[Offset + 1] << 8 | Query[Offset + 2];
+	Offset += 5;
+
+	/* The header and question, as asked. */
+	memcpy(Out->Data, Query, Offset);
+	Out->Size = Offset;
+	Out->Answers = Out->Authorities = 0;
+
+	if (strcasecmp(Name, "mx.test") == 0 && Type == TYPE_MX) {
+		for (Loop = STUB_MX_COUNT; Loop > 0; Loop--) {
+			Data[0] = 0;
+			Data[1] = Loop;
+			Length = snprintf((char *)&Data[100], 100, "mx%u.mx.test", Loop);
+			Length = EncodeName(&Data[2], (char *)&Data[100]);
+			AddRecord(Out, NULL, TYPE_MX, 300, Data, 2 + Length);
+			Out->Answers++;
+		}
+	}
+	else if (strcasecmp(Name, "alias.test") == 0) {
+		Length = EncodeName(Data, "real.test");
+		AddRecord(Out, NULL, TYPE_CNAME, 300, Data, Length);
+		Out->Answers++;
+		if (Type == TYPE_A) {
+			inet_pton(AF_INET, "192.0.2.7", Data);
+			AddRecord(Out, "real.test", TYPE_A, 60, Data, 4);
+			Out->Answers++;
+		}
+	}
+	else if (strcasecmp(Name, "real.test") == 0 && Type == TYPE_A) {
+		inet_pton(AF_INET, "192.0.2.7", Data);
+		AddRecord(Out, NULL, TYPE_A, 60, Data, 4);
+		Out->Answers++;
+	}
+	else if (strcasecmp(Name, "real.test") == 0 && Type == TYPE_AAAA) {
+		inet_pton(AF_INET6, "2001:db8::7", Data);
+		AddRecord(Out, NULL, TYPE_AAAA, 60, Data, 16);
+		Out->Answers++;
+	}
+	else if (sscanf(Name, "mx%u.mx.test", &Loop) == 1 && Type == TYPE_A) {
+		Data[0] = 192;
+		Data[1] = 0;
+		Data[2] = 2;
+		Data[3] = Loop;
+		AddRecord(Out, NULL, TYPE_A, 60, Data, 4);
+		Out->Answers++;
+	}
+	else if (strcasecmp(Name, "nx.test") == 0)
+		RCode = 3;
+
+	if (!Out->Answers)
+		AddSOA(Out);
+
+	/* A response, recursion available, and the counts. */
+	Out->Data[2] = 0x80 | (Query[2] & 0x01);
+	Out->Data[3] = 0x80 | RCode;
+	Out->Data[6] = Out->Answers >> 8;
+	Out->Data[7] = Out->Answers & 0xFF;
+	Out->Data[8] = Out->Authorities >> 8;
+	Out->Data[9] = Out->Authorities & 0xFF;
+	Out->Data[10] = Out->Data[11] = 0;
+
+	return 0;
+}
+
+static void *ServeUDP(void *Data)
+{
+	StubDNS *Server = Data;
+	unsigned char Query[PACKET_SIZE];
+	struct sockaddr_storage From;
+	socklen_t FromLength;
+	Reply Out;
+	ssize_t Size;
+
+	for (;;) {
+
+		FromLength = sizeof(From);
+		Size = recvfrom(Server->UDP, Query, sizeof(Query), 0, (struct sockaddr *)&From, &FromLength);
+		if (Size <= 0)
+			break;	/* Shut down. */
+		if (Answer(Query, Size, &Out) != 0)
+			continue;
+		Server->UDPQueries++;
+
+		/* Too large, so only the question goes back, marked as truncated. */
+		if (Out.Size > UDP_SIZE) {
+			Out.Data[2] |= 0x02;
+			memset(&Out.Data[6], 0, 6);
+			Out.Size = Size;
+		}
+
+		sendto(Server->UDP, Out.Data, Out.Size, 0, (struct sockaddr *)&From, FromLength);
+	}
+
+	return NULL;
+}
+
+/* One query per connection, which is all the resolver sends. */
+static void *ServeTCP(void *Data)
+{
+	StubDNS *Server = Data;
+	unsigned char Query[PACKET_SIZE], Length[2];
+	unsigned int Size, Got;
+	Reply Out;
+	ssize_t Return;
+	int Client;
+
+	for (;;) {
+
+		Client = accept(Server->TCP, NULL, NULL);
+		if (Client < 0)
+			break;
+
+		Size = 0;
+		for (Got = 0; Got < 2 + Size; Got += Return) {
+			if (Got < 2)
+				Return = recv(Client, &Length[Got], 2 - Got, 0);
+			else
+				Return = recv(Client, &Query[Got - 2], 2 + Size - Got, 0);
+			if (Return <= 0)
+				break;
+			if (Got + Return == 2) {
+				Size = Length[0] << 8 | Length[1];
+				if (Size > sizeof(Query))
+					break;
+			}
+		}
+
+		if (Got == 2 + Size && Size && Answer(Query, Size, &Out) == 0) {
+			Server->TCPQueries++;
+			Length[0] = Out.Size >> 8;
+			Length[1] = Out.Size & 0xFF;
+			send(Client, Length, 2, MSG_NOSIGNAL);
+			send(Client, Out.Data, Out.Size, MSG_NOSIGNAL);
+		}
+
+		close(Client);
+	}
+
+	return NULL;
+}
+
+/* Listens on the port for both UDP and TCP. */
+int StubDNSStart(StubDNS *Server, unsigned short Port)
+{
+	struct sockaddr_in Address;
+	int Enable = 1;
+
+	Server->Port = Port;
+	Server->UDPQueries = Server->TCPQueries = 0;
+
+	memset(&Address, 0, sizeof(Address));
+	Address.sin_family = AF_INET;
+	Address.sin_port = htons(Port);
+	Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	Server->UDP = socket(AF_INET, SOCK_DGRAM, 0);
+	Server->TCP = socket(AF_INET, SOCK_STREAM, 0);
+	if (Server->UDP < 0 || Server->TCP < 0)
+		goto Err;
+	setsockopt(Server->TCP, SOL_SOCKET, SO_REUSEADDR, &Enable, sizeof(Enable));
+
+	if (bind(Server->UDP, (struct sockaddr *)&Address, sizeof(Address)) != 0 ||
+		bind(Server->TCP, (struct sockaddr *)&Address, sizeof(Address)) != 0 ||
+		listen(Server->TCP, 64) != 0)
+		goto Err;
+
+	if (pthread_create(&Server->UDPThread, NULL, ServeUDP, Server) != 0)
+		goto Err;
+	if (pthread_create(&Server->TCPThread, NULL, ServeTCP, Server) != 0) {
+		shutdown(Server->UDP, SHUT_RDWR);
+		pthread_join(Server->UDPThread, NULL);
+		goto Err;
+	}
+
+	return 0;
+
+	Err:
+	if (Server->UDP >= 0)
+		close(Server->UDP);
+	if (Server->TCP >= 0)
+		close(Server->TCP);
+	return -1;
+}
+
+void StubDNSStop(StubDNS *Server)
+{
+	shutdown(Server->UDP, SHUT_RDWR);
+	shutdown(Server->TCP, SHUT_RDWR);
+	pthread_join(Server->UDPThread, NULL);
+	pthread_join(Server->TCPThread, NULL);
+	close(Server->UDP);
+	close(Server->TCP);
+
+	return;
+}
@@ -0,0 +1,21 @@
+#ifndef STUBDNS_H
+#define STUBDNS_H
+
+#include <pthread.h>
+
+/* The zone it answers for. */
+#define STUB_MX_COUNT		40			/* mx.test has this many MX records, more than fits in a UDP reply. */
+#define STUB_SOA_TTL		120			/* Of the SOA record sent with nx.test and anything without an answer. */
+#define STUB_SOA_MINIMUM	30
+
+typedef struct StubDNS {
+	unsigned short Port;
+	int UDP, TCP;
+	pthread_t UDPThread, TCPThread;
+	volatile unsigned long UDPQueries, TCPQueries;
+} StubDNS;
+
+int StubDNSStart(StubDNS *Server, unsigned short Port);
+void StubDNSStop(StubDNS *Server);
+
+#endif
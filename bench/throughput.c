@@ -0,0 +1,309 @@
+/*
+	End-to-end throughput against the local sink (sink.c), run in a child process so only the client's CPU time is
+	counted. Messages go through SMTPConnect(), SMTPAddresses() and SMTPData() over a matrix of body sizes, attachment
+	sizes, recipient counts and concurrent connections. Each connection sends its messages one after another.
+
+	From the repository's root, compile with;
+	gcc -O2 -Wall -I. -DSMTP_DEFAULT_PORT='"2525"' bench/throughput.c bench/sink.c bench/timing.c ssmtp.c reply.c arena.c headers.c dns.c dnscache.c cbuffer.c base64.c body.c qp.c cpu.c -lpthread -o bench-throughput
+
+	Run as 'bench-throughput [messages per run] [sink latency in microseconds] [-q]'. -q only runs the smallest and
+	largest of each size. Prints a line of tab separated values per run. Cycles are the client's CPU time at the
+	rate of the timestamp counter, so they're only an estimate where the clock speed varies.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+	#include <sys/prctl.h>
+#endif
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssmtp.h"
+#include "sink.h"
+#include "timing.h"
+
+#define MAX_RECIPIENTS	100
+
+static const unsigned int BodySizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+static const unsigned int AttachSizes[] = { 0, 64 * 1024, 1024 * 1024 };
+static const unsigned int RecipientCounts[] = { 1, 10, MAX_RECIPIENTS };
+static const unsigned int Concurrency[] = { 1, 4, 16 };
+
+typedef struct Run {
+	const char *Body;
+	const unsigned char *Attachment;
+	unsigned int AttachSize, Recipients;
+	unsigned int Messages;
+} Run;
+
+typedef struct Worker {
+	pthread_t Thread;
+	const Run *Run;
+	double *Latencies;		/* One per message sent. */
+	unsigned int Sent, Failed;
+	unsigned long long Bytes;
+} Worker;
+
+static const char *Addresses[MAX_RECIPIENTS];
+static int Types[MAX_RECIPIENTS];
+
+static void *Send(void *Data)
+{
+	Worker *Work = Data;
+	const Run *Run = Work->Run;
+	SMTPConn Conn;
+	SMTPAttach Attach;
+	int Results[MAX_RECIPIENTS];
+	unsigned int Loop;
+	double Start;
+
+	memset(&Conn, 0, sizeof(Conn));
+	if (SMTPConnect(&Conn, "127.0.0.1", "bench.example") != SMTP_ERR_SUCCESS) {
+		Work->Failed = Run->Messages;
+		return NULL;
+	}
+
+	if (Run->AttachSize)
+		SMTPAttachMemory(&Attach, "data.bin", "application/octet-stream", Run->Attachment, Run->AttachSize);
+
+	for (Loop = 0; Loop < Run->Messages; Loop++) {
+
+		Start = TimingNow();
+
+		if (SMTPAddresses(&Conn, "Bench <bench@example.org>", Types, Addresses, Run->Recipients, Results) != SMTP_ERR_SUCCESS ||
+			SMTPData(&Conn, "Benchmark", Run->Body, Run->AttachSize ? &Attach : NULL) != SMTP_ERR_SUCCESS) {
+			Work->Failed++;
+			if (Conn.State == SMTP_DISCONNECTED)
+				break;
+			if (Conn.State != SMTP_CONNECTED)
+				SMTPReset(&Conn);
+			continue;
+		}
+
+		Work->Latencies[Work->Sent++] = TimingNow() - Start;
+	}
+
+	Work->Bytes = Conn.TotalSent;
+	if (Conn.State != SMTP_DISCONNECTED)
+		SMTPDisconnect(&Conn);
+
+	return NULL;
+}
+
+static int CompareDouble(const void *First, const void *Second)
+{
+	double A = *(const double *)First, B = *(const double *)Second;
+
+	return (A > B) - (A < B);
+}
+
+static double Percentile(const double *Sorted, unsigned int Count, double Fraction)
+{
+	unsigned int Index;
+
+	if (!Count)
+		return 0;
+
+	Index = (unsigned int)(Fraction * Count);
+	if (Index >= Count)
+		Index = Count - 1;
+
+	return Sorted[Index];
+}
+
+static int Measure(const Run *Run, unsigned int Threads, double Rate)
+{
+	Worker Workers[16];
+	double *Latencies, Wall, CPU;
+	unsigned long long Bytes;
+	unsigned int Loop, Sent, Failed;
+
+	Latencies = malloc(Threads * Run->Messages * sizeof(double));
+	if (!Latencies)
+		return -1;
+
+	Wall = TimingNow();
+	CPU = TimingCPU();
+
+	for (Loop = 0; Loop < Threads; Loop++) {
+		memset(&Workers[Loop], 0, sizeof(Worker));
+		Workers[Loop].Run = Run;
+		Workers[Loop].Latencies = &Latencies[Loop * Run->Messages];
+		if (pthread_create(&Workers[Loop].Thread, NULL, Send, &Workers[Loop]) != 0)
+			return -1;
+	}
+
+	Sent = Failed = 0;
+	Bytes = 0;
+	for (Loop = 0; Loop < Threads; Loop++) {
+		pthread_join(Workers[Loop].Thread, NULL);
+
+		/* Gather the latencies together for sorting. */
+		memmove(&Latencies[Sent], Workers[Loop].Latencies, Workers[Loop].Sent * sizeof(double));
+		Sent += Workers[Loop].Sent;
+		Failed += Workers[Loop].Failed;
+		Bytes += Workers[Loop].Bytes;
+	}
+
+	CPU = TimingCPU() - CPU;
+	Wall = TimingNow() - Wall;
+
+	qsort(Latencies, Sent, sizeof(double), CompareDouble);
+
+	printf("%u\t%u\t%u\t%u\t%u\t%u\t%.1f\t%.2f\t%.2f\t%.1f\t%.1f\t%.1f\n",
+		(unsigned int)strlen(Run->Body), Run->AttachSize, Run->Recipients, Threads, Sent, Failed,
+		Sent / Wall, Bytes / Wall / (1024 * 1024), Bytes ? CPU * Rate / Bytes : 0,
+		Percentile(Latencies, Sent, 0.5) * 1e6, Percentile(Latencies, Sent, 0.99) * 1e6, Percentile(Latencies, Sent, 0.999) * 1e6);
+	fflush(stdout);
+
+	free(Latencies);
+
+	return 0;
+}
+
+/* Text lines of the given size in total. */
+static char *MakeBody(unsigned int Size)
+{
+	char *Body;
+	unsigned int Loop;
+
+	Body = malloc(Size + 1);
+	if (!Body)
+		return NULL;
+
+	for (Loop = 0; Loop < Size; Loop++)
+		Body[Loop] = Loop % 72 == 70 ? '\r' : Loop % 72 == 71 ? '\n' : 'a' + Loop % 26;
+	Body[Size] = '\0';
+
+	return Body;
+}
+
+int main(int argc, char *argv[])
+{
+	SinkConfig Config;
+	Sink Server;
+	Run Run;
+	char Names[MAX_RECIPIENTS][32];
+	unsigned char *Attachment = NULL;
+	char *Bodies[3] = { NULL, NULL, NULL };
+	unsigned int Body, Attach, Recipient, Threads, Loop, Step;
+	double Rate;
+	pid_t Parent, Child;
+	int Quick, Ready[2], Return;
+	char Status;
+
+	Quick = argc > 3 && strcmp(argv[3], "-q") == 0;
+	Step = Quick ? 2 : 1;
+
+	Run.Messages = argc > 1 ? atoi(argv[1]) : 200;
+	if (!Run.Messages)
+		Run.Messages = 1;
+
+	memset(&Config, 0, sizeof(Config));
+	Config.Port = atoi(SMTP_DEFAULT_PORT);
+	Config.Latency = argc > 2 ? atoi(argv[2]) : 0;
+	Config.Pipelining = Config.Chunking = 1;
+
+	/* The sink has a process to itself, so its CPU time isn't counted as ours. It says whether it's listening over a pipe. */
+	if (pipe(Ready) != 0)
+		return 1;
+
+	Parent = getpid();
+	Child = fork();
+	if (Child < 0)
+		return 1;
+	if (Child == 0) {
+		close(Ready[0]);
+#ifdef __linux__
+		/* Don't outlive the parent if it's killed before it can stop us. */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != Parent)
+			_exit(1);
+#endif
+		Status = SinkStart(&Server, &Config) == 0;
+		if (!Status)
+			fprintf(stderr, "Unable to listen on port %u.\n", Config.Port);
+		if (write(Ready[1], &Status, 1) != 1 || !Status)
+			_exit(1);
+		close(Ready[1]);
+		pause();
+		_exit(0);
+	}
+
+	close(Ready[1]);
+	Return = 1;
+	if (read(Ready[0], &Status, 1) != 1 || !Status)
+		goto Stop;
+
+	for (Loop = 0; Loop < MAX_RECIPIENTS; Loop++) {
+		snprintf(Names[Loop], sizeof(Names[Loop]), "user%u@example.com", Loop);
+		Addresses[Loop] = Names[Loop];
+		Types[Loop] = SMTP_ADDRESS_TO;
+	}
+
+	Attachment = malloc(AttachSizes[2]);
+	if (!Attachment)
+		goto Stop;
+	for (Loop = 0; Loop < AttachSizes[2]; Loop++)
+		Attachment[Loop] = rand();
+	for (Loop = 0; Loop < 3; Loop++) {
+		Bodies[Loop] = MakeBody(BodySizes[Loop]);
+		if (!Bodies[Loop])
+			goto Stop;
+	}
+
+	Rate = TimingCycleRate();
+	Run.Attachment = Attachment;
+
+	printf("body_bytes\tattach_bytes\trecipients\tconnections\tsent\tfailed\tmessages_per_sec\tmb_per_sec\tcycles_per_byte\tp50_us\tp99_us\tp999_us\n");
+
+	for (Body = 0; Body < 3; Body += Step)
+		for (Attach = 0; Attach < 3; Attach += Step)
+			for (Recipient = 0; Recipient < 3; Recipient += Step)
+				for (Threads = 0; Threads < 3; Threads += Step) {
+					Run.Body = Bodies[Body];
+					Run.AttachSize = AttachSizes[Attach];
+					Run.Recipients = RecipientCounts[Recipient];
+					if (Measure(&Run, Concurrency[Threads], Rate) != 0)
+						goto Stop;
+				}
+
+	Return = 0;
+
+	Stop:
+	kill(Child, SIGTERM);
+	waitpid(Child, NULL, 0);
+	close(Ready[0]);
+
+	for (Loop = 0; Loop < 3; Loop++)
+		free(Bodies[Loop]);
+	free(Attachment);
+
+	return Return;
+}
@@ -0,0 +1,76 @@
+/*
+	Clocks shared by the benchmarks. Cycles are estimated from the timestamp counter, whose rate is measured once
+	against the monotonic clock, so they're only approximate where the clock speed varies.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+#endif
+
+#include "timing.h"
+
+static double Seconds(clockid_t Clock)
+{
+	struct timespec Time;
+
+	clock_gettime(Clock, &Time);
+
+	return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+/* Wall clock time in seconds, from an arbitrary start. */
+double TimingNow(void)
+{
+	return Seconds(CLOCK_MONOTONIC);
+}
+
+/* The CPU time used by the whole process so far, in seconds. */
+double TimingCPU(void)
+{
+	return Seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* Ticks of the timestamp counter per second. Takes a fifth of a second the first time. 0 where there isn't one. */
+double TimingCycleRate(void)
+{
+	#if defined(__x86_64__) || defined(__i386__)
+	static double Rate = 0;
+	struct timespec Wait = { 0, 200 * 1000000 };
+	unsigned long long Start;
+	double Began;
+
+	if (Rate)
+		return Rate;
+
+	Began = TimingNow();
+	Start = __rdtsc();
+	nanosleep(&Wait, NULL);
+	Rate = (__rdtsc() - Start) / (TimingNow() - Began);
+
+	return Rate;
+	#else
+	return 0;
+	#endif
+}
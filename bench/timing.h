@@ -0,0 +1,8 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+double TimingNow(void);
+double TimingCPU(void);
+double TimingCycleRate(void);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+	Runs STARTTLS against the sink (sink.c) and checks what happens. Covers TLS 1.2 and 1.3, sessions being resumed
+	on reconnecting, a server turning STARTTLS down with 454 and a reply injected in the clear after STARTTLS's,
+	which must fail the connection rather than be read as if it came over TLS.
+
+	From the repository's root, compile with;
+	gcc -O2 -Wall -I. -DSMTP_TLS -DSMTP_DEFAULT_PORT='"2525"' bench/tlstest.c bench/sink.c ssmtp.c reply.c arena.c headers.c dns.c dnscache.c cbuffer.c base64.c body.c qp.c cpu.c tls.c -lssl -lcrypto -lpthread -o tlstest
+
+	Run as 'tlstest'. Prints a line per check and exits with 1 if any failed.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssmtp.h"
+#include "tls.h"
+#include "sink.h"
+
+/* Big enough to take many records, and several writes. */
+#define BODY_SIZE		(256 * 1024)
+
+static unsigned int Failures;
+static char *Body;
+
+static void Check(int Passed, const char *What)
+{
+	printf("%s\t%s\n", Passed ? "ok" : "FAILED", What);
+	if (!Passed)
+		Failures++;
+
+	return;
+}
+
+/* A sink of its own for each case, so sessions can't be carried over from one to the next. */
+static int Start(Sink *Server, unsigned int Version, int Refuse, int Inject)
+{
+	SinkConfig Config;
+
+	memset(&Config, 0, sizeof(Config));
+	Config.Port = atoi(SMTP_DEFAULT_PORT);
+	Config.Pipelining = Config.Chunking = 1;
+	Config.StartTLS = 1;
+	Config.TLSVersion = Version;
+	Config.RefuseTLS = Refuse;
+	Config.InjectTLS = Inject;
+
+	TLSFlushCache();
+
+	if (SinkStart(Server, &Config) != 0) {
+		fprintf(stderr, "Unable to start the sink on port %u.\n", Config.Port);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sends a message on an open connection and checks the sink got it. */
+static void Deliver(SMTPConn *Conn, Sink *Server, const char *What)
+{
+	unsigned long Messages = Server->Messages;
+	int Sent;
+
+	Sent = SMTPAddress(Conn, SMTP_ADDRESS_FROM, "tlstest@example.org") == SMTP_ERR_SUCCESS &&
+		SMTPAddress(Conn, SMTP_ADDRESS_TO, "sink@example.org") == SMTP_ERR_SUCCESS &&
+		SMTPData(Conn, "TLS", Body, NULL) == SMTP_ERR_SUCCESS;
+	Check(Sent && Server->Messages == Messages + 1, What);
+
+	return;
+}
+
+/* A full handshake, then two reconnects that should both resume. With TLS 1.3, that needs the ticket handed out on the second. */
+static void Version(unsigned int Version)
+{
+	Sink Server;
+	SMTPConn Conn;
+	TLSStats Before, After;
+	char What[128];
+	unsigned int Loop;
+
+	if (Start(&Server, Version, 0, 0) != 0) {
+		Failures++;
+		return;
+	}
+
+	memset(&Conn, 0, sizeof(Conn));
+	snprintf(What, sizeof(What), "TLS 1.%u is negotiated", Version - 10);
+	Check(SMTPConnect(&Conn, "127.0.0.1", "tlstest") == SMTP_ERR_SUCCESS && Conn.TLS && Server.LastVersion == Version, What);
+	Check((Conn.Extensions & SMTP_EXT_CHUNKING) && !(Conn.Extensions & SMTP_EXT_STARTTLS), "the EHLO is repeated over TLS");
+	snprintf(What, sizeof(What), "a message is sent over TLS 1.%u", Version - 10);
+	Deliver(&Conn, &Server, What);
+	SMTPDisconnect(&Conn);
+
+	for (Loop = 0; Loop < 2; Loop++) {
+		TLSGetStats(&Before);
+		memset(&Conn, 0, sizeof(Conn));
+		snprintf(What, sizeof(What), "TLS 1.%u reconnect %u resumes the session", Version - 10, Loop + 1);
+		Check(SMTPConnect(&Conn, "127.0.0.1", "tlstest") == SMTP_ERR_SUCCESS && Conn.TLS, "the reconnect is upgraded");
+		TLSGetStats(&After);
+		Check(After.Handshakes == Before.Handshakes + 1 && After.Resumed == Before.Resumed + 1 && Server.Resumed == Loop + 1, What);
+		Deliver(&Conn, &Server, "a message is sent over the resumed session");
+		SMTPDisconnect(&Conn);
+	}
+
+	SinkStop(&Server);
+
+	return;
+}
+
+static void Refused(void)
+{
+	Sink Server;
+	SMTPConn Conn;
+
+	if (Start(&Server, 0, 1, 0) != 0) {
+		Failures++;
+		return;
+	}
+
+	memset(&Conn, 0, sizeof(Conn));
+	Check(SMTPConnect(&Conn, "127.0.0.1", "tlstest") == SMTP_ERR_SUCCESS, "a 454 to STARTTLS doesn't fail the connection");
+	Check(!Conn.TLS && Server.Handshakes == 0, "the connection carries on in the clear");
+	Deliver(&Conn, &Server, "a message is sent in the clear");
+	SMTPDisconnect(&Conn);
+
+	SinkStop(&Server);
+
+	return;
+}
+
+static void Injected(void)
+{
+	Sink Server;
+	SMTPConn Conn;
+	TLSStats Before, After;
+
+	if (Start(&Server, 0, 0, 1) != 0) {
+		Failures++;
+		return;
+	}
+
+	TLSGetStats(&Before);
+	memset(&Conn, 0, sizeof(Conn));
+	Check(SMTPConnect(&Conn, "127.0.0.1", "tlstest") != SMTP_ERR_SUCCESS && Conn.State == SMTP_DISCONNECTED,
+		"a reply pipelined after STARTTLS's fails the connection");
+	TLSGetStats(&After);
+	Check(After.Handshakes == Before.Handshakes && Server.Messages == 0, "no handshake is done and nothing is sent");
+
+	SinkStop(&Server);
+
+	return;
+}
+
+int main(void)
+{
+	unsigned int Loop;
+
+	/* Both OpenSSL and the sink write to sockets that may have been closed. */
+	signal(SIGPIPE, SIG_IGN);
+
+	Body = malloc(BODY_SIZE + 1);
+	if (!Body)
+		return 1;
+	for (Loop = 0; Loop < BODY_SIZE; Loop++)
+		Body[Loop] = Loop % 72 == 70 ? '\r' : Loop % 72 == 71 ? '\n' : 'a' + Loop % 26;
+	Body[BODY_SIZE] = '\0';
+
+	Version(12);
+	Version(13);
+	Refused();
+	Injected();
+
+	free(Body);
+
+	return Failures ? 1 : 0;
+}
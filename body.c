@@ -0,0 +1,235 @@
+/*
+	Prepares a message body as it is sent. Line endings become CRLF, lines are kept within BODY_LINE_LIMIT octets
+	and, for DATA, lines starting with a period have another added (RFC 5321, section 4.5.2).
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "body.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+	#include <immintrin.h>
+#endif
+
+static const char LineBreak[] = "\r\n";
+static const char Period[] = ".";
+
+/* Returns the offset of the first CR or LF, or Size if there isn't one. */
+static unsigned int FindLineEnd(const char *Data, unsigned int Size)
+{
+	unsigned int Offset;
+
+	/* Nearly everything is above CR, so that's checked first. */
+	for (Offset = 0; Offset < Size; Offset++) {
+		if ((unsigned char)Data[Offset] <= '\r' && (Data[Offset] == '\r' || Data[Offset] == '\n'))
+			break;
+	}
+
+	return Offset;
+}
+
+#ifdef CPU_X86
+
+__attribute__((target("sse2"))) static unsigned int FindLineEndSSE2(const char *Data, unsigned int Size)
+{
+	const __m128i CR = _mm_set1_epi8('\r'), LF = _mm_set1_epi8('\n');
+	unsigned int Offset;
+	__m128i In;
+	int Mask;
+
+	for (Offset = 0; Offset + 16 <= Size; Offset += 16) {
+		In = _mm_loadu_si128((const __m128i *)&Data[Offset]);
+		Mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(In, CR), _mm_cmpeq_epi8(In, LF)));
+		if (Mask)
+			return Offset + __builtin_ctz(Mask);
+	}
+
+	return Offset + FindLineEnd(&Data[Offset], Size - Offset);
+}
+
+__attribute__((target("avx2"))) static unsigned int FindLineEndAVX2(const char *Data, unsigned int Size)
+{
+	const __m256i CR = _mm256_set1_epi8('\r'), LF = _mm256_set1_epi8('\n');
+	unsigned int Offset;
+	__m256i In;
+	__m128i In128;
+	unsigned int Mask;
+
+	for (Offset = 0; Offset + 32 <= Size; Offset += 32) {
+		In = _mm256_loadu_si256((const __m256i *)&Data[Offset]);
+		Mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(In, CR), _mm256_cmpeq_epi8(In, LF)));
+		if (Mask)
+			return Offset + __builtin_ctz(Mask);
+	}
+
+	/*
+		The rest is less than a vector. It's finished here rather than in the SSE2 kernel, as going from AVX to legacy
+		SSE code stalls on each switch.
+	*/
+	if (Offset + 16 <= Size) {
+		In128 = _mm_loadu_si128((const __m128i *)&Data[Offset]);
+		Mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(In128, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(In128, _mm_set1_epi8('\n'))));
+		if (Mask)
+			return Offset + __builtin_ctz(Mask);
+		Offset += 16;
+	}
+
+	return Offset + FindLineEnd(&Data[Offset], Size - Offset);
+}
+
+#endif
+
+typedef unsigned int (*FindKernel)(const char *Data, unsigned int Size);
+
+/* Looks for the CR or LF that ends the current line. */
+static FindKernel SelectKernel(void)
+{
+#ifdef CPU_X86
+	unsigned int Features = CPUFeatures();
+
+	if (Features & CPU_AVX2)
+		return FindLineEndAVX2;
+	if (Features & CPU_SSE2)
+		return FindLineEndSSE2;
+#endif
+
+	return FindLineEnd;
+}
+
+void InitBody(BodyStream *Stream, int Stuffing)
+{
+	Stream->Column = 0;
+	Stream->CR = 0;
+	Stream->Stuffing = Stuffing;
+	Stream->Copy = 0;
+
+	return;
+}
+
+/* Sends a run of the body that needs no changes. */
+static int SendRun(CSendBuffer *Buffer, BodyStream *Stream, const char *Data, unsigned int Size)
+{
+	if (Stream->Copy)
+		return CSend(Buffer, Data, Size);
+
+	return CSendRef(Buffer, Data, Size);
+}
+
+/*
+	Sends the next chunk of the body. Unless Copy is set, unchanged runs are passed to CSendRef(), so the chunk must
+	stay as it is until the buffer is next flushed. Finished is only needed to end a trailing CR; an unfinished last line is left as it is.
+*/
+int SendBody(CSendBuffer *Buffer, BodyStream *Stream, const char *Data, unsigned int Size, int Finished)
+{
+	unsigned int Start, Offset, Scan, Found;
+	FindKernel Kernel;
+	int Return;
+
+	Kernel = SelectKernel();
+	Start = Offset = 0;
+
+	/* The last chunk ended with a CR, which has already been sent. */
+	if (Stream->CR) {
+
+		if (Size > 0 && Data[0] == '\n')
+			Offset = 1;
+		else if (Size > 0 || Finished) {
+			Return = CSend(Buffer, &LineBreak[1], 1);
+			if (Return != 0)
+				return Return;
+		}
+		else
+			return 0;
+
+		Stream->CR = 0;
+	}
+
+	while (Offset < Size) {
+
+		/* Stuff the period by sending one more before it. */
+		if (Stream->Column == 0 && Data[Offset] == '.' && Stream->Stuffing) {
+			if ((Offset > Start && (Return = SendRun(Buffer, Stream, &Data[Start], Offset - Start)) != 0) ||
+				(Return = CSend(Buffer, Period, 1)) != 0)
+				return Return;
+			Start = Offset;
+			Stream->Column = 1;
+		}
+
+		/* Find the end of the line, but look no further than the line may go. */
+		Scan = BODY_LINE_LIMIT - Stream->Column;
+		if (Scan > Size - Offset)
+			Scan = Size - Offset;
+
+		Found = Kernel(&Data[Offset], Scan);
+		Offset += Found;
+		Stream->Column += Found;
+
+		if (Offset == Size)
+			break;
+
+		switch (Data[Offset]) {
+
+			case '\r':
+				Offset++;
+				Stream->Column = 0;
+
+				if (Offset < Size && Data[Offset] == '\n')
+					Offset++;
+				else if (Offset < Size || Finished) {
+					/* A lone CR. */
+					if ((Return = SendRun(Buffer, Stream, &Data[Start], Offset - Start)) != 0 ||
+						(Return = CSend(Buffer, &LineBreak[1], 1)) != 0)
+						return Return;
+					Start = Offset;
+				}
+				else
+					Stream->CR = 1;
+				break;
+
+			case '\n':
+				/* A lone LF. The LF starts the next run. */
+				if ((Offset > Start && (Return = SendRun(Buffer, Stream, &Data[Start], Offset - Start)) != 0) ||
+					(Return = CSend(Buffer, LineBreak, 1)) != 0)
+					return Return;
+				Start = Offset;
+				Offset++;
+				Stream->Column = 0;
+				break;
+
+			default:
+				/* The line is too long, so break it here. */
+				if ((Offset > Start && (Return = SendRun(Buffer, Stream, &Data[Start], Offset - Start)) != 0) ||
+					(Return = CSend(Buffer, LineBreak, 2)) != 0)
+					return Return;
+				Start = Offset;
+				Stream->Column = 0;
+
+		}
+
+	}
+
+	if (Offset > Start)
+		return SendRun(Buffer, Stream, &Data[Start], Offset - Start);
+
+	return 0;
+}
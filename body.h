@@ -0,0 +1,19 @@
+#ifndef BODY_H
+#define BODY_H
+
+#include "cbuffer.h"
+
+/* The most octets allowed on a line, not counting its CRLF. Longer lines are broken up. */
+#define BODY_LINE_LIMIT		998
+
+typedef struct BodyStream {
+	unsigned int Column;	/* Octets already sent on the current line. */
+	int CR;					/* The last chunk ended with a CR that may yet be followed by a LF. */
+	int Stuffing;			/* Periods are only stuffed for DATA. BDAT sends the body as it is. */
+	int Copy;				/* Set after InitBody() if each chunk is reused once SendBody() returns. */
+} BodyStream;
+
+void InitBody(BodyStream *Stream, int Stuffing);
+int SendBody(CSendBuffer *Buffer, BodyStream *Stream, const char *Data, unsigned int Size, int Finished);
+
+#endif
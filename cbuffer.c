@@ -28,10 +28,38 @@
 
 #include "cbuffer.h"
 
+/* Adds whatever has been copied into the buffer since the last piece. */
+static void QueueBuffered(CSendBuffer *Buffer)
+{
+	if (Buffer->Cursor > Buffer->Start) {
+		Buffer->Vecs[Buffer->VecCount].Data = &Buffer->Data[Buffer->Start];
+		Buffer->Vecs[Buffer->VecCount].Size = Buffer->Cursor - Buffer->Start;
+		Buffer->VecCount++;
+		Buffer->Start = Buffer->Cursor;
+	}
+
+	return;
+}
+
 int CFlush(CSendBuffer *Buffer)
 {
 	int Return;
 
+	if (Buffer->VecCallback) {
+
+		QueueBuffered(Buffer);
+		if (Buffer->VecCount > 0) {
+
+			Return = Buffer->VecCallback(Buffer->CallbackData, Buffer->Vecs, Buffer->VecCount);
+			if (Return != 0)
+				return Return;
+			Buffer->VecCount = Buffer->Start = Buffer->Cursor = 0;
+
+		}
+
+		return 0;
+	}
+
 	if (Buffer->Cursor > 0) {
 
 		Return = Buffer->Callback(Buffer->CallbackData, Buffer->Data, Buffer->Cursor);
@@ -63,10 +91,9 @@ int CSend(CSendBuffer *Buffer, const char *Data, unsigned int Size)
 		Buffer->Cursor += BufferAvailable;
 		if (Buffer->Cursor >= Buffer->Size) {
 
-			Return = Buffer->Callback(Buffer->CallbackData, Buffer->Data, Buffer->Cursor);
+			Return = CFlush(Buffer);
 			if (Return != 0)
 				return Return;
-			Buffer->Cursor = 0;
 		}
 
 	}
@@ -74,6 +101,32 @@ int CSend(CSendBuffer *Buffer, const char *Data, unsigned int Size)
 	return 0;
 }
 
+/*
+	Sends data that stays untouched until the next flush without copying it, when a vector callback is used.
+	Otherwise it's no different to CSend().
+*/
+int CSendRef(CSendBuffer *Buffer, const char *Data, unsigned int Size)
+{
+	int Return;
+
+	if (!Buffer->VecCallback || Size < CBUFFER_REF_SIZE)
+		return CSend(Buffer, Data, Size);
+
+	/* Leave room for what's buffered, this and whatever's buffered after it. */
+	if (Buffer->VecCount + 3 > CBUFFER_VECS) {
+		Return = CFlush(Buffer);
+		if (Return != 0)
+			return Return;
+	}
+
+	QueueBuffered(Buffer);
+	Buffer->Vecs[Buffer->VecCount].Data = Data;
+	Buffer->Vecs[Buffer->VecCount].Size = Size;
+	Buffer->VecCount++;
+
+	return 0;
+}
+
 int CSendStrings(CSendBuffer *Buffer, ...)
 {
 	va_list Args;
@@ -109,5 +162,17 @@ void CInit(CSendBuffer *Buffer, char *Data, unsigned int Size, int (*Callback)(v
 	Buffer->Callback = Callback;
 	Buffer->CallbackData = CallbackData;
 
+	Buffer->VecCallback = NULL;
+	Buffer->Start = Buffer->VecCount = 0;
+
+	return;
+}
+
+/* Everything is handed to the callback as a list of pieces, so referenced data doesn't need to be copied. */
+void CInitVec(CSendBuffer *Buffer, char *Data, unsigned int Size, int (*Callback)(void *, const CVec *, unsigned int), void *CallbackData)
+{
+	CInit(Buffer, Data, Size, NULL, CallbackData);
+	Buffer->VecCallback = Callback;
+
 	return;
 }
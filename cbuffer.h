@@ -1,16 +1,38 @@
 #ifndef CBUFFER_H
 #define CBUFFER_H
 
+/* The most pieces gathered into a single write. */
+#ifndef CBUFFER_VECS
+	#define CBUFFER_VECS		64
+#endif
+
+/* Anything smaller given to CSendRef() is copied, as it's cheaper than sending it as its own piece. */
+#ifndef CBUFFER_REF_SIZE
+	#define CBUFFER_REF_SIZE	1024
+#endif
+
+typedef struct CVec {
+	const char *Data;
+	unsigned int Size;
+} CVec;
+
 typedef struct CSendBuffer {
 	char *Data;
 	unsigned int Size, Cursor;
 	void *CallbackData;
 	int (*Callback)(void *, char *, unsigned int);
+
+	/* Only used after CInitVec(). The buffer from Start onwards hasn't been queued yet. */
+	int (*VecCallback)(void *, const CVec *, unsigned int);
+	unsigned int Start, VecCount;
+	CVec Vecs[CBUFFER_VECS];
 } CSendBuffer;
 
 int CFlush(CSendBuffer *Buffer);
 int CSend(CSendBuffer *Buffer, const char *Data, unsigned int Size);
+int CSendRef(CSendBuffer *Buffer, const char *Data, unsigned int Size);
 int CSendStrings(CSendBuffer *Buffer, ...);
 void CInit(CSendBuffer *Buffer, char *Data, unsigned int Size, int (*Callback)(void *, char *, unsigned int), void *CallbackData);
+void CInitVec(CSendBuffer *Buffer, char *Data, unsigned int Size, int (*Callback)(void *, const CVec *, unsigned int), void *CallbackData);
 
 #endif
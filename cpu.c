@@ -0,0 +1,62 @@
+/*
+	Works out once which vector instructions the processor has, for the kernels in base64.c, qp.c and body.c.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "cpu.h"
+
+#define CPU_CHECKED	0x80000000
+
+/*
+	Returns the CPU_ flags. The check is only done the first time. If several threads race to do it, they all
+	come up with the same answer, so whichever stores it last doesn't matter.
+*/
+unsigned int CPUFeatures(void)
+{
+#ifdef CPU_X86
+	static unsigned int Cached;		/* Has CPU_CHECKED set once filled in. */
+	unsigned int Features;
+
+	Features = __atomic_load_n(&Cached, __ATOMIC_RELAXED);
+	if (Features)
+		return Features & ~CPU_CHECKED;
+
+	__builtin_cpu_init();
+
+	Features = CPU_CHECKED;
+	if (__builtin_cpu_supports("sse2"))
+		Features |= CPU_SSE2;
+	if (__builtin_cpu_supports("ssse3"))
+		Features |= CPU_SSSE3;
+	if (__builtin_cpu_supports("avx2"))
+		Features |= CPU_AVX2;
+	if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw"))
+		Features |= CPU_AVX512VBMI;
+
+	__atomic_store_n(&Cached, Features, __ATOMIC_RELAXED);
+
+	return Features & ~CPU_CHECKED;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,17 @@
+#ifndef CPU_H
+#define CPU_H
+
+/* GCC and Clang x86 builds have vector kernels chosen at runtime. Anything else only has the scalar ones. */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	#define CPU_X86
+#endif
+
+/* Filled in by CPUFeatures(). */
+#define CPU_SSE2		0x01
+#define CPU_SSSE3		0x02
+#define CPU_AVX2		0x04
+#define CPU_AVX512VBMI	0x08	/* Along with AVX512BW. */
+
+unsigned int CPUFeatures(void);
+
+#endif
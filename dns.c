@@ -0,0 +1,747 @@
+/*
+	A small non-blocking DNS stub resolver. Only handles the records needed to locate a mail server.
+
+	Queries are sent over UDP and retried over TCP if the reply was truncated.
+	Each query has its own socket so any number of them can be in flight at once.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <stdio.h>	/* For reading resolv.conf. */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "dns.h"
+
+#define DNS_HEADER_SIZE		12
+#define DNS_MAX_JUMPS		64
+#define DNS_CLASS_IN		1
+
+/* Flags within the third byte of the header. */
+#define DNS_FLAG_QR			0x80
+#define DNS_FLAG_TC			0x02
+#define DNS_FLAG_RD			0x01
+
+enum DNSStates {
+	DNS_STATE_UDP,
+	DNS_STATE_TCP_SEND,
+	DNS_STATE_TCP_RECV,
+	DNS_STATE_DONE,
+	DNS_STATE_FAILED
+};
+
+/* Returned by ParseReply(). */
+enum DNSParseResults {
+	DNS_PARSE_INVALID = -1,	/* Malformed or the server failed. Try the next one. */
+	DNS_PARSE_DONE,
+	DNS_PARSE_IGNORE,		/* Not a reply to our query. */
+	DNS_PARSE_TRUNCATED
+};
+
+static DNSResolver DefaultResolver;
+static const DNSResolver *DefaultResolverSet = NULL;
+static pthread_once_t DefaultResolverOnce = PTHREAD_ONCE_INIT;
+
+static long long Now(void)
+{
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+
+	return (long long)Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
+}
+
+/* IDs are taken from getrandom() a batch at a time, so a query rarely costs a system call for one. Per thread. */
+#define DNS_ID_BATCH		32
+
+static __thread unsigned short IDs[DNS_ID_BATCH];
+static __thread unsigned int IDsLeft = 0;
+static __thread unsigned int IDSeed = 0;
+
+static unsigned short RandomID(void)
+{
+	if (IDsLeft == 0 && getrandom(IDs, sizeof(IDs), GRND_NONBLOCK) == sizeof(IDs))
+		IDsLeft = DNS_ID_BATCH;
+	if (IDsLeft > 0)
+		return IDs[--IDsLeft];
+
+	/* Not ideal but better than a fixed ID. */
+	if (!IDSeed)
+		IDSeed = (unsigned int)Now() ^ (unsigned int)getpid() ^ (unsigned int)(size_t)&IDSeed;
+	return (unsigned short)(rand_r(&IDSeed) & 0xFFFF);
+}
+
+static int AddServer(DNSResolver *Resolver, const char *Server, unsigned short Port)
+{
+	struct sockaddr_in *IPv4;
+	struct sockaddr_in6 *IPv6;
+	unsigned int Index;
+
+	if (Resolver->ServerCount >= DNS_MAX_SERVERS)
+		return -1;
+
+	Index = Resolver->ServerCount;
+	memset(&Resolver->Servers[Index], 0, sizeof(Resolver->Servers[Index]));
+
+	IPv4 = (struct sockaddr_in *)&Resolver->Servers[Index];
+	IPv6 = (struct sockaddr_in6 *)&Resolver->Servers[Index];
+
+	if (inet_pton(AF_INET, Server, &IPv4->sin_addr) == 1) {
+		IPv4->sin_family = AF_INET;
+		IPv4->sin_port = htons(Port);
+		Resolver->ServerLengths[Index] = sizeof(*IPv4);
+	}
+	else if (inet_pton(AF_INET6, Server, &IPv6->sin6_addr) == 1) {
+		IPv6->sin6_family = AF_INET6;
+		IPv6->sin6_port = htons(Port);
+		Resolver->ServerLengths[Index] = sizeof(*IPv6);
+	}
+	else
+		return -1;
+
+	Resolver->ServerCount++;
+
+	return 0;
+}
+
+/* If Server is NULL, the nameservers are read from resolv.conf. A Port of 0 uses the default. */
+int DNSInit(DNSResolver *Resolver, const char *Server, unsigned short Port)
+{
+	FILE *File;
+	char Line[256];
+	char *Token, *Save;
+	int Value;
+
+	Resolver->ServerCount = 0;
+	Resolver->Timeout = DNS_TIMEOUT;
+	Resolver->Attempts = DNS_ATTEMPTS;
+
+	if (!Port)
+		Port = DNS_DEFAULT_PORT;
+
+	if (Server)
+		return AddServer(Resolver, Server, Port);
+
+	File = fopen(DNS_RESOLV_CONF, "r");
+	if (File) {
+
+		while (fgets(Line, sizeof(Line), File)) {
+
+			Token = strtok_r(Line, " \t\r\n", &Save);
+			if (!Token)
+				continue;
+
+			if (strcmp(Token, "nameserver") == 0) {
+				Token = strtok_r(NULL, " \t\r\n", &Save);
+				if (Token)
+					AddServer(Resolver, Token, Port);	/* Unsupported entries are skipped. */
+			}
+			else if (strcmp(Token, "options") == 0) {
+				while ((Token = strtok_r(NULL, " \t\r\n", &Save)) != NULL) {
+					if (strncmp(Token, "timeout:", 8) == 0 && (Value = atoi(Token + 8)) > 0)
+						Resolver->Timeout = Value * 1000;
+					else if (strncmp(Token, "attempts:", 9) == 0 && (Value = atoi(Token + 9)) > 0)
+						Resolver->Attempts = Value;
+				}
+			}
+
+		}
+
+		fclose(File);
+	}
+
+	/* Same as the system resolver when nothing is configured. */
+	if (Resolver->ServerCount == 0)
+		return AddServer(Resolver, "127.0.0.1", Port);
+
+	return 0;
+}
+
+static void InitDefaultResolver(void)
+{
+	if (DNSInit(&DefaultResolver, NULL, 0) == 0)
+		DefaultResolverSet = &DefaultResolver;
+
+	return;
+}
+
+/* The process-wide resolver used by SMTPConnect(). Returns NULL if one couldn't be set up. */
+const DNSResolver *DNSDefaultResolver(void)
+{
+	pthread_once(&DefaultResolverOnce, InitDefaultResolver);
+
+	return DefaultResolverSet;
+}
+
+/* Must be called before any connections are made. The resolver must remain valid. */
+void DNSSetDefaultResolver(const DNSResolver *Resolver)
+{
+	pthread_once(&DefaultResolverOnce, InitDefaultResolver);
+	DefaultResolverSet = Resolver;
+
+	return;
+}
+
+/* Converts a name to its wire format. Returns the size used or -1 if invalid. */
+static int EncodeName(unsigned char *Out, unsigned int Size, const char *Name)
+{
+	const char *Label;
+	unsigned int Length, Used = 0;
+
+	while (*Name) {
+
+		Label = Name;
+		while (*Name && *Name != '.')
+			Name++;
+
+		Length = Name - Label;
+		if (Length == 0 || Length > 63 || Used + Length + 2 > Size)
+			return -1;
+
+		Out[Used++] = Length;
+		memcpy(&Out[Used], Label, Length);
+		Used += Length;
+
+		if (*Name == '.')
+			Name++;
+	}
+
+	if (Used + 1 > Size)
+		return -1;
+	Out[Used++] = 0;
+
+	return Used;
+}
+
+/*
+	Reads a possibly compressed name starting at Offset.
+	Returns the offset just past the name in its original position or -1 if malformed.
+*/
+static int DecodeName(const unsigned char *Packet, unsigned int Size, unsigned int Offset, char *Out, unsigned int OutSize)
+{
+	unsigned int Length, Used = 0, Jumps = 0;
+	int End = -1;
+
+	for (;;) {
+
+		if (Offset >= Size)
+			return -1;
+		Length = Packet[Offset];
+
+		if ((Length & 0xC0) == 0xC0) {
+			if (Offset + 1 >= Size || ++Jumps > DNS_MAX_JUMPS)
+				return -1;
+			if (End == -1)
+				End = Offset + 2;
+			Offset = ((Length & 0x3F) << 8) | Packet[Offset + 1];
+			continue;
+		}
+		else if (Length & 0xC0)
+			return -1;
+
+		Offset++;
+
+		if (Length == 0)
+			break;
+
+		if (Offset + Length > Size || Used + Length + 1 >= OutSize)
+			return -1;
+
+		if (Used)
+			Out[Used++] = '.';
+		memcpy(&Out[Used], &Packet[Offset], Length);
+		Used += Length;
+		Offset += Length;
+	}
+
+	Out[Used] = '\0';
+
+	return End == -1 ? (int)Offset : End;
+}
+
+static int CompareMXRecord(const void *First, const void *Second)
+{
+	return ((const DNSRecord *)First)->Data.MX.Preference - ((const DNSRecord *)Second)->Data.MX.Preference;
+}
+
+static int ParseReply(DNSQuery *Query, const unsigned char *Packet, unsigned int Size, int Truncatable)
+{
+	char Name[DNS_NAME_SIZE];
+	unsigned int QuestionCount, AnswerCount, AuthorityCount, Loop;
+	unsigned int Type, Class, TTL, DataLength;
+	int Offset;
+	DNSRecord *Record;
+
+	if (Size < DNS_HEADER_SIZE)
+		return DNS_PARSE_IGNORE;
+
+	/* Ensure it's the reply to our question. */
+	if (((Packet[0] << 8) | Packet[1]) != Query->ID || !(Packet[2] & DNS_FLAG_QR))
+		return DNS_PARSE_IGNORE;
+
+	QuestionCount = (Packet[4] << 8) | Packet[5];
+	AnswerCount = (Packet[6] << 8) | Packet[7];
+	AuthorityCount = (Packet[8] << 8) | Packet[9];
+	if (QuestionCount != 1)
+		return DNS_PARSE_IGNORE;
+
+	Offset = DecodeName(Packet, Size, DNS_HEADER_SIZE, Name, sizeof(Name));
+	if (Offset == -1 || Offset + 4 > Size)
+		return DNS_PARSE_IGNORE;
+	if (strcasecmp(Name, Query->Name) != 0 || ((Packet[Offset] << 8) | Packet[Offset + 1]) != Query->Type)
+		return DNS_PARSE_IGNORE;
+	Offset += 4;
+
+	if (Packet[2] & DNS_FLAG_TC && Truncatable)
+		return DNS_PARSE_TRUNCATED;
+
+	Query->RCode = Packet[3] & 0x0F;
+	if (Query->RCode != DNS_RCODE_NOERROR && Query->RCode != DNS_RCODE_NXDOMAIN)
+		return DNS_PARSE_INVALID;
+
+	if (AnswerCount > 0) {
+		Query->Records = malloc(AnswerCount * sizeof(DNSRecord));
+		if (!Query->Records)
+			return DNS_PARSE_INVALID;
+	}
+
+	for (Loop = 0; Loop < AnswerCount; Loop++) {
+
+		Offset = DecodeName(Packet, Size, Offset, Name, sizeof(Name));
+		if (Offset == -1 || Offset + 10 > Size)
+			goto Malformed;
+
+		Type = (Packet[Offset] << 8) | Packet[Offset + 1];
+		Class = (Packet[Offset + 2] << 8) | Packet[Offset + 3];
+		TTL = ((unsigned int)Packet[Offset + 4] << 24) | (Packet[Offset + 5] << 16) | (Packet[Offset + 6] << 8) | Packet[Offset + 7];
+		DataLength = (Packet[Offset + 8] << 8) | Packet[Offset + 9];
+		Offset += 10;
+
+		if (Offset + DataLength > Size)
+			goto Malformed;
+
+		/* Anything else, such as CNAMEs along the way, is skipped. */
+		if (Type == Query->Type && Class == DNS_CLASS_IN) {
+
+			Record = &Query->Records[Query->RecordCount];
+			Record->Type = Type;
+			Record->TTL = TTL & 0x80000000 ? 0 : TTL;
+
+			switch (Type) {
+				case DNS_RR_MX:
+					if (DataLength < 3)
+						goto Malformed;
+					Record->Data.MX.Preference = (Packet[Offset] << 8) | Packet[Offset + 1];
+					if (DecodeName(Packet, Size, Offset + 2, Record->Data.MX.Exchange, sizeof(Record->Data.MX.Exchange)) == -1)
+						goto Malformed;
+					break;
+				case DNS_RR_A:
+					if (DataLength != 4)
+						goto Malformed;
+					memcpy(Record->Data.Address, &Packet[Offset], 4);
+					break;
+				case DNS_RR_AAAA:
+					if (DataLength != 16)
+						goto Malformed;
+					memcpy(Record->Data.Address, &Packet[Offset], 16);
+					break;
+			}
+
+			Query->RecordCount++;
+		}
+
+		Offset += DataLength;
+	}
+
+	/* How long a missing answer can be cached for is given by the SOA record, if there is one. */
+	for (Loop = 0; Loop < AuthorityCount && Query->RecordCount == 0; Loop++) {
+
+		Offset = DecodeName(Packet, Size, Offset, Name, sizeof(Name));
+		if (Offset == -1 || Offset + 10 > Size)
+			break;
+
+		Type = (Packet[Offset] << 8) | Packet[Offset + 1];
+		TTL = ((unsigned int)Packet[Offset + 4] << 24) | (Packet[Offset + 5] << 16) | (Packet[Offset + 6] << 8) | Packet[Offset + 7];
+		DataLength = (Packet[Offset + 8] << 8) | Packet[Offset + 9];
+		Offset += 10;
+
+		if (Offset + DataLength > Size)
+			break;
+
+		if (Type == DNS_RR_SOA && DataLength >= 22) {
+			/* The minimum field is the last four bytes. */
+			Query->NegativeTTL = ((unsigned int)Packet[Offset + DataLength - 4] << 24) | (Packet[Offset + DataLength - 3] << 16) |
+				(Packet[Offset + DataLength - 2] << 8) | Packet[Offset + DataLength - 1];
+			if (TTL < Query->NegativeTTL)
+				Query->NegativeTTL = TTL;
+			if (Query->NegativeTTL & 0x80000000)
+				Query->NegativeTTL = 0;
+			break;
+		}
+
+		Offset += DataLength;
+	}
+
+	if (Query->Type == DNS_RR_MX && Query->RecordCount > 1)
+		qsort(Query->Records, Query->RecordCount, sizeof(DNSRecord), CompareMXRecord);
+
+	return DNS_PARSE_DONE;
+
+	Malformed:
+	free(Query->Records);
+	Query->Records = NULL;
+	Query->RecordCount = 0;
+	return DNS_PARSE_INVALID;
+}
+
+static void CloseQuerySocket(DNSQuery *Query)
+{
+	if (Query->Socket != -1) {
+		close(Query->Socket);
+		Query->Socket = -1;
+	}
+
+	return;
+}
+
+static int OpenQuerySocket(DNSQuery *Query, int Type)
+{
+	const struct sockaddr_storage *Server = &Query->Resolver->Servers[Query->Server];
+
+	CloseQuerySocket(Query);
+
+	Query->Socket = socket(Server->ss_family, Type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (Query->Socket == -1)
+		return -1;
+
+	/* Connecting a UDP socket has the kernel discard replies from anyone else. */
+	if (connect(Query->Socket, (const struct sockaddr *)Server, Query->Resolver->ServerLengths[Query->Server]) != 0 &&
+		errno != EINPROGRESS) {
+		CloseQuerySocket(Query);
+		return -1;
+	}
+
+	Query->Deadline = Now() + Query->Resolver->Timeout;
+
+	return 0;
+}
+
+static int SendUDP(DNSQuery *Query)
+{
+	Query->State = DNS_STATE_UDP;
+
+	if (OpenQuerySocket(Query, SOCK_DGRAM) != 0 ||
+		send(Query->Socket, &Query->Packet[2], Query->PacketSize, 0) != Query->PacketSize)
+		return -1;
+
+	return 0;
+}
+
+/* Moves onto the next server, or the next round of attempts. */
+static int NextServer(DNSQuery *Query)
+{
+	free(Query->Buffer);
+	Query->Buffer = NULL;
+
+	for (;;) {
+
+		Query->Attempt++;
+		if (Query->Attempt >= Query->Resolver->Attempts * Query->Resolver->ServerCount) {
+			CloseQuerySocket(Query);
+			Query->State = DNS_STATE_FAILED;
+			return DNS_FAILED;
+		}
+
+		Query->Server = Query->Attempt % Query->Resolver->ServerCount;
+		if (SendUDP(Query) == 0)
+			return DNS_PENDING;
+
+	}
+}
+
+static int StartTCP(DNSQuery *Query)
+{
+	Query->State = DNS_STATE_TCP_SEND;
+	Query->PacketCursor = 0;
+	Query->BufferCursor = 0;
+
+	Query->Buffer = malloc(2 + 65535);
+	if (!Query->Buffer || OpenQuerySocket(Query, SOCK_STREAM) != 0)
+		return NextServer(Query);
+
+	return DNS_PENDING;
+}
+
+static int Finish(DNSQuery *Query, int Result)
+{
+	switch (Result) {
+		case DNS_PARSE_DONE:
+			CloseQuerySocket(Query);
+			free(Query->Buffer);
+			Query->Buffer = NULL;
+			Query->State = DNS_STATE_DONE;
+			return DNS_DONE;
+		case DNS_PARSE_TRUNCATED:
+			return StartTCP(Query);
+		case DNS_PARSE_INVALID:
+			return NextServer(Query);
+	}
+
+	return DNS_PENDING;
+}
+
+int DNSStart(DNSQuery *Query, const DNSResolver *Resolver, const char *Name, unsigned short Type)
+{
+	size_t Length;
+	int Return;
+
+	Query->Resolver = Resolver;
+	Query->Socket = -1;
+	Query->State = DNS_STATE_FAILED;
+	Query->Buffer = NULL;
+	Query->Records = NULL;
+	Query->RecordCount = 0;
+	Query->RCode = DNS_RCODE_SERVFAIL;
+	Query->NegativeTTL = 0;
+	Query->Server = Query->Attempt = 0;
+
+	Length = strlen(Name);
+	if (!Resolver || Resolver->ServerCount == 0 || Length == 0 || Length >= sizeof(Query->Name))
+		return -1;
+
+	memcpy(Query->Name, Name, Length + 1);
+	if (Query->Name[Length - 1] == '.')
+		Query->Name[Length - 1] = '\0';
+
+	Query->ID = RandomID();
+	Query->Type = Type;
+
+	/* Header asking for recursion with a single question. */
+	memset(&Query->Packet[2], 0, DNS_HEADER_SIZE);
+	Query->Packet[2] = Query->ID >> 8;
+	Query->Packet[3] = Query->ID & 0xFF;
+	Query->Packet[4] = DNS_FLAG_RD;
+	Query->Packet[7] = 1;
+
+	Return = EncodeName(&Query->Packet[2 + DNS_HEADER_SIZE], DNS_PACKET_SIZE - DNS_HEADER_SIZE - 4, Query->Name);
+	if (Return == -1)
+		return -1;
+	Query->PacketSize = DNS_HEADER_SIZE + Return;
+
+	Query->Packet[2 + Query->PacketSize++] = Type >> 8;
+	Query->Packet[2 + Query->PacketSize++] = Type & 0xFF;
+	Query->Packet[2 + Query->PacketSize++] = 0;
+	Query->Packet[2 + Query->PacketSize++] = DNS_CLASS_IN;
+
+	/* TCP length prefix. */
+	Query->Packet[0] = Query->PacketSize >> 8;
+	Query->Packet[1] = Query->PacketSize & 0xFF;
+
+	if (SendUDP(Query) != 0 && NextServer(Query) == DNS_FAILED)
+		return -1;
+
+	return 0;
+}
+
+/*
+	Advances the query. Call when its socket is ready or its timeout has passed, although spurious calls are harmless.
+	Returns DNS_PENDING until it has either completed or failed.
+*/
+int DNSProcess(DNSQuery *Query)
+{
+	unsigned char Packet[DNS_PACKET_SIZE * 8];
+	unsigned int Size;
+	int Return;
+
+	for (;;) {
+
+		switch (Query->State) {
+
+			case DNS_STATE_DONE:
+				return DNS_DONE;
+
+			case DNS_STATE_FAILED:
+				return DNS_FAILED;
+
+			case DNS_STATE_UDP:
+				Return = recv(Query->Socket, Packet, sizeof(Packet), 0);
+				if (Return == -1) {
+					if (errno == EINTR)
+						continue;
+					if ((errno == EAGAIN || errno == EWOULDBLOCK) && Now() < Query->Deadline)
+						return DNS_PENDING;
+					return NextServer(Query);	/* Timed out or refused. */
+				}
+
+				Return = Finish(Query, ParseReply(Query, Packet, Return, 1));
+				if (Return != DNS_PENDING || Query->State != DNS_STATE_UDP)
+					return Return;
+				break;
+
+			case DNS_STATE_TCP_SEND:
+				Return = send(Query->Socket, &Query->Packet[Query->PacketCursor], Query->PacketSize + 2 - Query->PacketCursor, MSG_NOSIGNAL);
+				if (Return == -1) {
+					if (errno == EINTR)
+						continue;
+					if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) && Now() < Query->Deadline)
+						return DNS_PENDING;
+					return NextServer(Query);
+				}
+
+				Query->PacketCursor += Return;
+				if (Query->PacketCursor >= Query->PacketSize + 2)
+					Query->State = DNS_STATE_TCP_RECV;
+				break;
+
+			case DNS_STATE_TCP_RECV:
+				/* Read the length prefix first, then exactly that amount. */
+				Size = Query->BufferCursor < 2 ? 2 : 2 + ((Query->Buffer[0] << 8) | Query->Buffer[1]);
+
+				Return = recv(Query->Socket, &Query->Buffer[Query->BufferCursor], Size - Query->BufferCursor, 0);
+				if (Return <= 0) {
+					if (Return == -1 && errno == EINTR)
+						continue;
+					if (Return == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && Now() < Query->Deadline)
+						return DNS_PENDING;
+					return NextServer(Query);
+				}
+
+				Query->BufferCursor += Return;
+				if (Query->BufferCursor >= 2 && Query->BufferCursor == 2 + ((Query->Buffer[0] << 8) | Query->Buffer[1])) {
+					Return = ParseReply(Query, &Query->Buffer[2], Query->BufferCursor - 2, 0);
+					return Finish(Query, Return == DNS_PARSE_IGNORE ? DNS_PARSE_INVALID : Return);
+				}
+				break;
+
+		}
+
+	}
+}
+
+/* The poll() events the query is waiting on. */
+int DNSEvents(const DNSQuery *Query)
+{
+	switch (Query->State) {
+		case DNS_STATE_UDP:
+		case DNS_STATE_TCP_RECV:
+			return POLLIN;
+		case DNS_STATE_TCP_SEND:
+			return POLLOUT;
+	}
+
+	return 0;
+}
+
+/* Milliseconds until DNSProcess() should be called regardless of any events. */
+int DNSTimeout(const DNSQuery *Query)
+{
+	long long Remaining;
+
+	if (Query->State >= DNS_STATE_DONE)
+		return 0;
+
+	Remaining = Query->Deadline - Now();
+	if (Remaining < 0)
+		return 0;
+
+	return (int)Remaining;
+}
+
+/* Drives several queries at once until every one of them has completed or failed. */
+int DNSWait(DNSQuery **Queries, unsigned int Count)
+{
+	struct pollfd *Polls;
+	unsigned int Loop, Pending;
+	int Timeout, Return;
+
+	Polls = malloc(Count * sizeof(struct pollfd));
+	if (!Polls)
+		return -1;
+
+	for (;;) {
+
+		Pending = 0;
+		Timeout = -1;
+
+		for (Loop = 0; Loop < Count; Loop++) {
+
+			if (DNSProcess(Queries[Loop]) != DNS_PENDING)
+				continue;
+
+			Polls[Pending].fd = Queries[Loop]->Socket;
+			Polls[Pending].events = DNSEvents(Queries[Loop]);
+			Pending++;
+
+			Return = DNSTimeout(Queries[Loop]);
+			if (Timeout == -1 || Return < Timeout)
+				Timeout = Return;
+		}
+
+		if (Pending == 0)
+			break;
+
+		if (poll(Polls, Pending, Timeout) == -1 && errno != EINTR) {
+			free(Polls);
+			return -1;
+		}
+	}
+
+	free(Polls);
+
+	return 0;
+}
+
+/* Blocking lookup. Returns DNS_DONE or DNS_FAILED. The query must still be freed either way. */
+int DNSLookup(DNSQuery *Query, const DNSResolver *Resolver, const char *Name, unsigned short Type)
+{
+	if (DNSStart(Query, Resolver, Name, Type) != 0 ||
+		DNSWait(&Query, 1) != 0)
+		return DNS_FAILED;
+
+	return DNSProcess(Query);
+}
+
+void DNSFree(DNSQuery *Query)
+{
+	CloseQuerySocket(Query);
+
+	free(Query->Buffer);
+	Query->Buffer = NULL;
+
+	free(Query->Records);
+	Query->Records = NULL;
+	Query->RecordCount = 0;
+
+	return;
+}
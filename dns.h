@@ -0,0 +1,100 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define DNS_DEFAULT_PORT	53
+#define DNS_RESOLV_CONF		"/etc/resolv.conf"
+
+#define DNS_MAX_SERVERS		3
+#define DNS_NAME_SIZE		256
+#define DNS_PACKET_SIZE		512		/* Largest UDP reply without EDNS. */
+
+/* Per attempt, in milliseconds. resolv.conf may override these. */
+#ifndef DNS_TIMEOUT
+	#define DNS_TIMEOUT		5000
+#endif
+#ifndef DNS_ATTEMPTS
+	#define DNS_ATTEMPTS	2
+#endif
+
+typedef struct DNSResolver {
+	struct sockaddr_storage Servers[DNS_MAX_SERVERS];
+	socklen_t ServerLengths[DNS_MAX_SERVERS];
+	unsigned int ServerCount;
+
+	unsigned int Timeout;
+	unsigned int Attempts;
+} DNSResolver;
+
+typedef struct DNSRecord {
+	unsigned short Type;
+	unsigned int TTL;
+
+	union {
+		struct {
+			unsigned short Preference;
+			char Exchange[DNS_NAME_SIZE];
+		} MX;
+		unsigned char Address[16];
+	} Data;
+} DNSRecord;
+
+typedef struct DNSQuery {
+	const DNSResolver *Resolver;
+	int Socket;
+	unsigned int State;
+
+	char Name[DNS_NAME_SIZE];
+	unsigned short ID, Type;
+	unsigned int Server, Attempt;
+	long long Deadline;
+
+	/* The request, with room for the TCP length prefix in front. */
+	unsigned char Packet[DNS_PACKET_SIZE + 2];
+	unsigned int PacketSize, PacketCursor;
+
+	/* Only used when the reply was truncated and we're reading it over TCP. */
+	unsigned char *Buffer;
+	unsigned int BufferCursor;
+
+	/* Results. Only valid once DNSProcess() returns DNS_DONE. */
+	int RCode;
+	unsigned int NegativeTTL;	/* From the SOA when there's no answer. */
+	unsigned int RecordCount;
+	DNSRecord *Records;
+} DNSQuery;
+
+int DNSInit(DNSResolver *Resolver, const char *Server, unsigned short Port);
+const DNSResolver *DNSDefaultResolver(void);
+void DNSSetDefaultResolver(const DNSResolver *Resolver);
+
+int DNSStart(DNSQuery *Query, const DNSResolver *Resolver, const char *Name, unsigned short Type);
+int DNSProcess(DNSQuery *Query);
+int DNSEvents(const DNSQuery *Query);
+int DNSTimeout(const DNSQuery *Query);
+int DNSWait(DNSQuery **Queries, unsigned int Count);
+int DNSLookup(DNSQuery *Query, const DNSResolver *Resolver, const char *Name, unsigned short Type);
+void DNSFree(DNSQuery *Query);
+
+enum DNSRecordTypes {
+	DNS_RR_A = 1,
+	DNS_RR_SOA = 6,
+	DNS_RR_MX = 15,
+	DNS_RR_AAAA = 28
+};
+
+enum DNSRCodes {
+	DNS_RCODE_NOERROR = 0,
+	DNS_RCODE_SERVFAIL = 2,
+	DNS_RCODE_NXDOMAIN = 3
+};
+
+enum DNSResults {
+	DNS_FAILED = -1,	/* Every server either timed out or refused. */
+	DNS_DONE,
+	DNS_PENDING
+};
+
+#endif
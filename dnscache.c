@@ -0,0 +1,697 @@
+/*
+	A process-wide cache of the mail servers for each domain, along with their addresses.
+
+	Entries live for as long as their records' TTLs and missing domains are cached as well.
+	Entries that are being used are refreshed by a background thread before they expire so lookups don't have to wait.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "dnscache.h"
+
+typedef struct DNSCacheRefresh {
+	char Domain[DNS_NAME_SIZE];
+	struct DNSCacheRefresh *Next;
+} DNSCacheRefresh;
+
+/* A lookup in progress. Others after the same domain wait for it rather than asking the DNS themselves. */
+typedef struct DNSCacheFlight {
+	char Domain[DNS_NAME_SIZE];
+	DNSCacheEntry *Result;		/* NULL if it failed. */
+	int Finished;
+	unsigned int Waiters;
+	unsigned int References;	/* The one doing the lookup and each waiter. Freed by whoever's last. */
+	struct DNSCacheFlight *Next;
+} DNSCacheFlight;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t RefreshSignal = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t FlightSignal = PTHREAD_COND_INITIALIZER;
+
+static DNSCacheEntry *Buckets[DNS_CACHE_BUCKETS];
+static DNSCacheStats Stats;
+
+static DNSCacheRefresh *RefreshQueue = NULL;
+static DNSCacheFlight *Flights = NULL;
+static int RefreshThreadStarted = 0;
+
+static long long Now(void)
+{
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+
+	return (long long)Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
+}
+
+/* Domains are case-insensitive. */
+static unsigned int Hash(const char *Domain)
+{
+	unsigned int Value = 2166136261u;
+
+	for (; *Domain; Domain++) {
+		Value ^= (unsigned char)tolower((unsigned char)*Domain);
+		Value *= 16777619u;
+	}
+
+	return Value % DNS_CACHE_BUCKETS;
+}
+
+static unsigned int ClampTTL(unsigned int TTL)
+{
+	if (TTL < DNS_CACHE_MIN_TTL)
+		return DNS_CACHE_MIN_TTL;
+	if (TTL > DNS_CACHE_MAX_TTL)
+		return DNS_CACHE_MAX_TTL;
+
+	return TTL;
+}
+
+static void FreeEntry(DNSCacheEntry *Entry)
+{
+	unsigned int Loop;
+
+	for (Loop = 0; Loop < Entry->HostCount; Loop++)
+		free(Entry->Hosts[Loop].Addresses);
+	free(Entry->Hosts);
+	free(Entry);
+
+	return;
+}
+
+enum ResolveSteps {
+	RESOLVE_MX,
+	RESOLVE_ADDRESSES,
+	RESOLVE_DONE,
+	RESOLVE_FAILED
+};
+
+/* Given the MX records, starts looking up every host's addresses at once. Returns -1 on failure. */
+static int StartAddresses(DNSCacheResolve *Resolve)
+{
+	const DNSResolver *Resolver;
+	DNSCacheEntry *Entry = Resolve->Entry;
+	DNSQuery *MX = &Resolve->MX;
+	DNSCacheHost *Host;
+	unsigned int Loop, TTL;
+
+	if (MX->RCode == DNS_RCODE_NXDOMAIN) {
+		Entry->NXDomain = 1;
+		Resolve->TTL = MX->NegativeTTL ? MX->NegativeTTL : DNS_CACHE_NEGATIVE_TTL;
+		return 0;
+	}
+
+	Resolver = DNSDefaultResolver();
+	if (!Resolver)
+		return -1;
+
+	/* The MX hosts in order, then the domain itself. */
+	Entry->Hosts = calloc(MX->RecordCount + 1, sizeof(DNSCacheHost));
+	if (!Entry->Hosts)
+		return -1;
+
+	TTL = DNS_CACHE_MAX_TTL;
+	for (Loop = 0; Loop < MX->RecordCount; Loop++) {
+		Host = &Entry->Hosts[Loop];
+		strcpy(Host->Name, MX->Records[Loop].Data.MX.Exchange);
+		Host->Preference = MX->Records[Loop].Data.MX.Preference;
+		if (MX->Records[Loop].TTL < TTL)
+			TTL = MX->Records[Loop].TTL;
+	}
+	strcpy(Entry->Hosts[Loop].Name, Entry->Domain);
+	Entry->Hosts[Loop].Preference = Loop ? 65536 : 0;
+	Entry->HostCount = Loop + 1;
+
+	/* A domain without MX records may cache that for as long as its SOA says. */
+	if (MX->RecordCount == 0 && MX->NegativeTTL)
+		TTL = MX->NegativeTTL;
+	Resolve->TTL = TTL;
+
+	Resolve->Queries = malloc(Entry->HostCount * 2 * sizeof(DNSQuery));
+	if (!Resolve->Queries)
+		return -1;
+
+	/* One that can't be started is left failed. */
+	for (Loop = 0; Loop < Entry->HostCount * 2; Loop++)
+		DNSStart(&Resolve->Queries[Loop], Resolver, Entry->Hosts[Loop / 2].Name, Loop & 1 ? DNS_RR_A : DNS_RR_AAAA);
+	Resolve->QueryCount = Loop;
+
+	return 0;
+}
+
+/* Once every address query is finished, copies their answers into the entry. */
+static void FinishAddresses(DNSCacheResolve *Resolve)
+{
+	DNSCacheEntry *Entry = Resolve->Entry;
+	DNSQuery *Queries = Resolve->Queries;
+	DNSCacheHost *Host;
+	unsigned int Loop, Record, Query, TTL = Resolve->TTL;
+
+	/* A timeout or SERVFAIL says nothing about the host, so it's soon tried again rather than cached as having no addresses. */
+	for (Loop = 0; Loop < Resolve->QueryCount; Loop++) {
+		if (DNSProcess(&Queries[Loop]) != DNS_DONE && TTL > DNS_CACHE_RETRY_TTL)
+			TTL = DNS_CACHE_RETRY_TTL;
+	}
+
+	for (Loop = 0; Loop < Resolve->QueryCount / 2; Loop++) {
+
+		Host = &Entry->Hosts[Loop];
+		Host->AddressCount = Queries[Loop * 2].RecordCount + Queries[Loop * 2 + 1].RecordCount;
+		if (Host->AddressCount == 0)
+			continue;
+
+		Host->Addresses = malloc(Host->AddressCount * sizeof(DNSCacheAddress));
+		if (!Host->Addresses) {
+			Host->AddressCount = 0;
+			continue;
+		}
+
+		Host->AddressCount = 0;
+		for (Query = Loop * 2; Query < Loop * 2 + 2; Query++) {
+			for (Record = 0; Record < Queries[Query].RecordCount; Record++) {
+				Host->Addresses[Host->AddressCount].Family = Queries[Query].Type == DNS_RR_AAAA ? AF_INET6 : AF_INET;
+				memcpy(Host->Addresses[Host->AddressCount].Address, Queries[Query].Records[Record].Data.Address, 16);
+				Host->AddressCount++;
+
+				if (Queries[Query].Records[Record].TTL < TTL)
+					TTL = Queries[Query].Records[Record].TTL;
+			}
+		}
+	}
+
+	for (Loop = 0; Loop < Resolve->QueryCount; Loop++)
+		DNSFree(&Queries[Loop]);
+	free(Queries);
+	Resolve->Queries = NULL;
+	Resolve->QueryCount = 0;
+
+	Entry->Lifetime = (long long)ClampTTL(TTL) * 1000;
+	Entry->Expires = Now() + Entry->Lifetime;
+	Entry->References = 1;
+
+	return;
+}
+
+/* Handles whatever's arrived. Every pending query is processed each time, as any of their sockets may be ready. */
+static int Advance(DNSCacheResolve *Resolve)
+{
+	unsigned int Loop, Pending;
+	int Return;
+
+	if (Resolve->Step == RESOLVE_MX) {
+
+		Return = DNSProcess(&Resolve->MX);
+		if (Return == DNS_PENDING)
+			return DNS_PENDING;
+		if (Return == DNS_DONE && StartAddresses(Resolve) != 0)
+			Return = DNS_FAILED;
+		DNSFree(&Resolve->MX);
+
+		Resolve->Step = Return == DNS_DONE ? RESOLVE_ADDRESSES : RESOLVE_FAILED;
+	}
+
+	if (Resolve->Step == RESOLVE_ADDRESSES) {
+
+		Pending = 0;
+		for (Loop = 0; Loop < Resolve->QueryCount; Loop++) {
+			if (DNSProcess(&Resolve->Queries[Loop]) == DNS_PENDING)
+				Pending++;
+		}
+		if (Pending)
+			return DNS_PENDING;
+
+		FinishAddresses(Resolve);
+		Resolve->Step = RESOLVE_DONE;
+	}
+
+	return Resolve->Step == RESOLVE_DONE ? DNS_DONE : DNS_FAILED;
+}
+
+/* Builds a new entry by asking the DNS, waiting for the answers. Returns NULL if the lookup itself failed. */
+static DNSCacheEntry *Resolve(const char *Domain)
+{
+	DNSCacheResolve State;
+	DNSCacheEntry *Entry = NULL;
+	DNSQuery *Query, **Pending;
+	unsigned int Index, Count;
+	int Return = DNS_FAILED;
+
+	if (DNSCacheStart(&State, Domain) == 0) {
+
+		while ((Return = Advance(&State)) == DNS_PENDING) {
+
+			Pending = malloc((State.QueryCount + 1) * sizeof(DNSQuery *));
+			if (!Pending)
+				break;
+
+			Index = Count = 0;
+			while ((Query = DNSCacheNextQuery(&State, &Index)))
+				Pending[Count++] = Query;
+			if (DNSWait(Pending, Count) != 0)
+				Return = DNS_FAILED;
+			free(Pending);
+
+			if (Return == DNS_FAILED)
+				break;
+		}
+
+	}
+
+	if (Return == DNS_DONE) {
+		Entry = State.Entry;
+		State.Entry = NULL;
+	}
+	DNSCacheFree(&State);
+
+	return Entry;
+}
+
+/* Assumes the lock is held. The entry is only freed once nothing is using it. */
+static void Unlink(DNSCacheEntry **Link)
+{
+	DNSCacheEntry *Entry = *Link;
+
+	*Link = Entry->Next;
+	Entry->Next = NULL;
+	Stats.Entries--;
+
+	if (--Entry->References == 0)
+		FreeEntry(Entry);
+
+	return;
+}
+
+/* Assumes the lock is held. Takes over the caller's reference. */
+static void Insert(DNSCacheEntry *Entry)
+{
+	DNSCacheEntry **Link;
+	unsigned int Loop;
+	long long Time = Now();
+
+	/* Replace any existing entry for the domain. */
+	Link = &Buckets[Hash(Entry->Domain)];
+	while (*Link) {
+		if (strcasecmp((*Link)->Domain, Entry->Domain) == 0 || (*Link)->Expires <= Time)
+			Unlink(Link);
+		else
+			Link = &(*Link)->Next;
+	}
+
+	/* If full, clear out anything that's expired. If still full, it's just not cached. */
+	if (Stats.Entries >= DNS_CACHE_ENTRIES) {
+		for (Loop = 0; Loop < DNS_CACHE_BUCKETS; Loop++) {
+			Link = &Buckets[Loop];
+			while (*Link) {
+				if ((*Link)->Expires <= Time)
+					Unlink(Link);
+				else
+					Link = &(*Link)->Next;
+			}
+		}
+
+		if (Stats.Entries >= DNS_CACHE_ENTRIES) {
+			if (--Entry->References == 0)
+				FreeEntry(Entry);
+			return;
+		}
+	}
+
+	Link = &Buckets[Hash(Entry->Domain)];
+	Entry->Next = *Link;
+	*Link = Entry;
+	Stats.Entries++;
+
+	return;
+}
+
+/* Assumes the lock is held. */
+static DNSCacheEntry *Find(const char *Domain, long long Time)
+{
+	DNSCacheEntry *Entry;
+
+	for (Entry = Buckets[Hash(Domain)]; Entry; Entry = Entry->Next) {
+		if (Entry->Expires > Time && strcasecmp(Entry->Domain, Domain) == 0)
+			return Entry;
+	}
+
+	return NULL;
+}
+
+static void *RefreshThread(void *Unused)
+{
+	DNSCacheRefresh *Refresh;
+	DNSCacheEntry *Entry;
+
+	pthread_mutex_lock(&Lock);
+
+	for (;;) {
+
+		while (!RefreshQueue)
+			pthread_cond_wait(&RefreshSignal, &Lock);
+
+		Refresh = RefreshQueue;
+		RefreshQueue = Refresh->Next;
+
+		pthread_mutex_unlock(&Lock);
+		Entry = Resolve(Refresh->Domain);
+		pthread_mutex_lock(&Lock);
+
+		Stats.Refreshes++;
+
+		/* On failure, the old entry stays until it expires. Another hit may queue it again in the meantime. */
+		if (Entry)
+			Insert(Entry);
+		else {
+			Entry = Find(Refresh->Domain, Now());
+			if (Entry)
+				Entry->Refreshing = 0;
+		}
+
+		free(Refresh);
+	}
+
+	return NULL;
+}
+
+/* Assumes the lock is held. */
+static void QueueRefresh(DNSCacheEntry *Entry)
+{
+	DNSCacheRefresh *Refresh;
+	pthread_t Thread;
+	pthread_attr_t Attributes;
+
+	if (!RefreshThreadStarted) {
+		pthread_attr_init(&Attributes);
+		pthread_attr_setdetachstate(&Attributes, PTHREAD_CREATE_DETACHED);
+		RefreshThreadStarted = pthread_create(&Thread, &Attributes, RefreshThread, NULL) == 0;
+		pthread_attr_destroy(&Attributes);
+
+		if (!RefreshThreadStarted)
+			return;
+	}
+
+	Refresh = malloc(sizeof(DNSCacheRefresh));
+	if (!Refresh)
+		return;
+
+	strcpy(Refresh->Domain, Entry->Domain);
+	Refresh->Next = RefreshQueue;
+	RefreshQueue = Refresh;
+	Entry->Refreshing = 1;
+
+	pthread_cond_signal(&RefreshSignal);
+
+	return;
+}
+
+/* Assumes the lock is held. Takes a reference for the caller and refreshes the entry ahead of time if it's in use. */
+static void Hit(DNSCacheEntry *Entry, long long Time)
+{
+	Entry->References++;
+	Entry->Hits++;
+	Stats.Hits++;
+	if (Entry->NXDomain)
+		Stats.NegativeHits++;
+
+	if (!Entry->Refreshing && Entry->Hits >= DNS_CACHE_HOT_HITS &&
+		(Entry->Expires - Time) * 100 <= Entry->Lifetime * DNS_CACHE_REFRESH_AHEAD)
+		QueueRefresh(Entry);
+
+	return;
+}
+
+/*
+	Finds the mail servers for a domain, only asking the DNS if they're not already known.
+	Returns 0 and a referenced entry, which must be released with DNSCacheRelease(), or -1 if the lookup failed.
+*/
+int DNSCacheLookup(const char *Domain, DNSCacheEntry **Entry)
+{
+	DNSCacheEntry *Found;
+	DNSCacheFlight *Flight, **Link;
+	long long Time;
+
+	pthread_mutex_lock(&Lock);
+
+	Time = Now();
+	Found = Find(Domain, Time);
+	if (Found) {
+		Hit(Found, Time);
+		pthread_mutex_unlock(&Lock);
+
+		*Entry = Found;
+		return 0;
+	}
+
+	Stats.Misses++;
+
+	/* Someone's already asking, so wait for their answer. */
+	for (Flight = Flights; Flight; Flight = Flight->Next) {
+		if (strcasecmp(Flight->Domain, Domain) == 0)
+			break;
+	}
+	if (Flight) {
+
+		Flight->Waiters++;
+		Flight->References++;
+		while (!Flight->Finished)
+			pthread_cond_wait(&FlightSignal, &Lock);
+
+		Found = Flight->Result;
+		if (--Flight->References == 0)
+			free(Flight);
+		pthread_mutex_unlock(&Lock);
+
+		if (!Found)
+			return -1;
+		*Entry = Found;
+		return 0;
+	}
+
+	Flight = malloc(sizeof(DNSCacheFlight));
+	if (Flight) {
+		strncpy(Flight->Domain, Domain, sizeof(Flight->Domain) - 1);
+		Flight->Domain[sizeof(Flight->Domain) - 1] = '\0';
+		Flight->Result = NULL;
+		Flight->Finished = 0;
+		Flight->Waiters = 0;
+		Flight->References = 1;
+		Flight->Next = Flights;
+		Flights = Flight;
+	}
+
+	pthread_mutex_unlock(&Lock);
+
+	Found = Resolve(Domain);
+
+	pthread_mutex_lock(&Lock);
+
+	if (Found) {
+		Found->References++;	/* One for the cache, one for the caller. */
+		Insert(Found);
+	}
+
+	/* Hand the answer to everyone who waited for it, with a reference each. */
+	if (Flight) {
+
+		for (Link = &Flights; *Link != Flight; Link = &(*Link)->Next);
+		*Link = Flight->Next;
+
+		if (Found)
+			Found->References += Flight->Waiters;
+		Flight->Result = Found;
+		Flight->Finished = 1;
+		pthread_cond_broadcast(&FlightSignal);
+
+		if (--Flight->References == 0)
+			free(Flight);
+	}
+
+	pthread_mutex_unlock(&Lock);
+
+	if (!Found)
+		return -1;
+
+	*Entry = Found;
+	return 0;
+}
+
+/* Like DNSCacheLookup(), but never asks the DNS. Returns -1 if the domain isn't cached, which counts as a miss. */
+int DNSCachePeek(const char *Domain, DNSCacheEntry **Entry)
+{
+	DNSCacheEntry *Found;
+	long long Time;
+
+	pthread_mutex_lock(&Lock);
+
+	Time = Now();
+	Found = Find(Domain, Time);
+	if (Found)
+		Hit(Found, Time);
+	else
+		Stats.Misses++;
+
+	pthread_mutex_unlock(&Lock);
+
+	if (!Found)
+		return -1;
+
+	*Entry = Found;
+	return 0;
+}
+
+/*
+	Starts looking up a domain without waiting on the DNS. Drive it with DNSCacheProcess(), polling the queries from DNSCacheNextQuery().
+	Returns -1 on failure. Either way, DNSCacheFree() must be called afterwards.
+*/
+int DNSCacheStart(DNSCacheResolve *Resolve, const char *Domain)
+{
+	const DNSResolver *Resolver;
+
+	Resolve->Step = RESOLVE_FAILED;
+	Resolve->Queries = NULL;
+	Resolve->QueryCount = 0;
+	Resolve->TTL = 0;
+
+	Resolver = DNSDefaultResolver();
+	Resolve->Entry = calloc(1, sizeof(DNSCacheEntry));
+	if (!Resolver || !Resolve->Entry)
+		return -1;
+	strncpy(Resolve->Entry->Domain, Domain, sizeof(Resolve->Entry->Domain) - 1);
+
+	if (DNSStart(&Resolve->MX, Resolver, Domain, DNS_RR_MX) != 0) {
+		DNSFree(&Resolve->MX);
+		return -1;
+	}
+	Resolve->Step = RESOLVE_MX;
+
+	return 0;
+}
+
+/*
+	Handles any answers that have arrived. Returns DNS_PENDING until the lookup has finished, then DNS_DONE or DNS_FAILED.
+	On DNS_DONE, the entry is added to the cache and a reference is handed back, which must be released with DNSCacheRelease().
+*/
+int DNSCacheProcess(DNSCacheResolve *Resolve, DNSCacheEntry **Entry)
+{
+	int Return;
+
+	Return = Advance(Resolve);
+	if (Return != DNS_DONE)
+		return Return;
+	if (!Resolve->Entry)
+		return DNS_FAILED;
+
+	*Entry = Resolve->Entry;
+	Resolve->Entry = NULL;
+
+	pthread_mutex_lock(&Lock);
+	(*Entry)->References++;		/* One for the cache, one for the caller. */
+	Insert(*Entry);
+	pthread_mutex_unlock(&Lock);
+
+	return DNS_DONE;
+}
+
+/* Steps through the queries still waiting on an answer, starting with *Index at 0. Returns NULL after the last. */
+DNSQuery *DNSCacheNextQuery(DNSCacheResolve *Resolve, unsigned int *Index)
+{
+	DNSQuery *Query;
+
+	if (Resolve->Step == RESOLVE_MX)
+		return (*Index)++ == 0 ? &Resolve->MX : NULL;
+
+	if (Resolve->Step != RESOLVE_ADDRESSES)
+		return NULL;
+
+	while (*Index < Resolve->QueryCount) {
+		Query = &Resolve->Queries[(*Index)++];
+		if (DNSEvents(Query))
+			return Query;
+	}
+
+	return NULL;
+}
+
+void DNSCacheFree(DNSCacheResolve *Resolve)
+{
+	unsigned int Loop;
+
+	if (Resolve->Step == RESOLVE_MX)
+		DNSFree(&Resolve->MX);
+
+	for (Loop = 0; Loop < Resolve->QueryCount; Loop++)
+		DNSFree(&Resolve->Queries[Loop]);
+	free(Resolve->Queries);
+	Resolve->Queries = NULL;
+	Resolve->QueryCount = 0;
+
+	if (Resolve->Entry) {
+		FreeEntry(Resolve->Entry);
+		Resolve->Entry = NULL;
+	}
+
+	Resolve->Step = RESOLVE_FAILED;
+
+	return;
+}
+
+void DNSCacheRelease(DNSCacheEntry *Entry)
+{
+	pthread_mutex_lock(&Lock);
+	if (--Entry->References == 0)
+		FreeEntry(Entry);
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
+
+void DNSCacheGetStats(DNSCacheStats *Result)
+{
+	pthread_mutex_lock(&Lock);
+	*Result = Stats;
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
+
+void DNSCacheFlush(void)
+{
+	unsigned int Loop;
+
+	pthread_mutex_lock(&Lock);
+	for (Loop = 0; Loop < DNS_CACHE_BUCKETS; Loop++) {
+		while (Buckets[Loop])
+			Unlink(&Buckets[Loop]);
+	}
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
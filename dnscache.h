@@ -0,0 +1,94 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "dns.h"
+
+#define DNS_CACHE_BUCKETS		256
+
+#ifndef DNS_CACHE_ENTRIES
+	#define DNS_CACHE_ENTRIES		4096
+#endif
+
+/* In seconds. Record TTLs are clamped between these. */
+#ifndef DNS_CACHE_MIN_TTL
+	#define DNS_CACHE_MIN_TTL		5
+#endif
+#ifndef DNS_CACHE_MAX_TTL
+	#define DNS_CACHE_MAX_TTL		86400
+#endif
+#ifndef DNS_CACHE_NEGATIVE_TTL
+	#define DNS_CACHE_NEGATIVE_TTL	900		/* Used when there was no SOA record. */
+#endif
+
+/* The most an entry's kept when any of its hosts' addresses couldn't be looked up, such as from a timeout. */
+#ifndef DNS_CACHE_RETRY_TTL
+	#define DNS_CACHE_RETRY_TTL		30
+#endif
+
+/* Entries hit this often are refreshed in the background once this percentage of their TTL remains. */
+#ifndef DNS_CACHE_HOT_HITS
+	#define DNS_CACHE_HOT_HITS		2
+#endif
+#ifndef DNS_CACHE_REFRESH_AHEAD
+	#define DNS_CACHE_REFRESH_AHEAD	10
+#endif
+
+typedef struct DNSCacheAddress {
+	int Family;		/* AF_INET or AF_INET6. */
+	unsigned char Address[16];
+} DNSCacheAddress;
+
+typedef struct DNSCacheHost {
+	char Name[DNS_NAME_SIZE];
+	unsigned int Preference;
+	unsigned int AddressCount;
+	DNSCacheAddress *Addresses;	/* IPv6 addresses are first. */
+} DNSCacheHost;
+
+/* Entries are never modified once in the cache. A refresh replaces them. */
+typedef struct DNSCacheEntry {
+	char Domain[DNS_NAME_SIZE];
+	int NXDomain;
+
+	/* Sorted by preference. When there are MX records, the domain itself is the last host. */
+	unsigned int HostCount;
+	DNSCacheHost *Hosts;
+
+	long long Expires, Lifetime;
+
+	/* Everything below is protected by the cache's lock. */
+	unsigned int References;
+	unsigned int Hits;
+	int Refreshing;
+	struct DNSCacheEntry *Next;
+} DNSCacheEntry;
+
+typedef struct DNSCacheStats {
+	unsigned long Hits;
+	unsigned long Misses;
+	unsigned long NegativeHits;	/* Also counted as hits. */
+	unsigned long Refreshes;
+	unsigned long Entries;
+} DNSCacheStats;
+
+/* A lookup driven a step at a time, such as from an event loop. */
+typedef struct DNSCacheResolve {
+	int Step;
+	DNSQuery MX;
+	DNSQuery *Queries;			/* AAAA then A for each host. */
+	unsigned int QueryCount;
+	DNSCacheEntry *Entry;		/* Being built. */
+	unsigned int TTL;
+} DNSCacheResolve;
+
+int DNSCacheLookup(const char *Domain, DNSCacheEntry **Entry);
+int DNSCachePeek(const char *Domain, DNSCacheEntry **Entry);
+int DNSCacheStart(DNSCacheResolve *Resolve, const char *Domain);
+int DNSCacheProcess(DNSCacheResolve *Resolve, DNSCacheEntry **Entry);
+DNSQuery *DNSCacheNextQuery(DNSCacheResolve *Resolve, unsigned int *Index);
+void DNSCacheFree(DNSCacheResolve *Resolve);
+void DNSCacheRelease(DNSCacheEntry *Entry);
+void DNSCacheGetStats(DNSCacheStats *Stats);
+void DNSCacheFlush(void);
+
+#endif
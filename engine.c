@@ -0,0 +1,927 @@
+/*
+	Delivers many e-mails at once from a single thread using epoll.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "engine.h"
+
+/* Each job moves through these in order, although a failed greeting goes back to connecting to the next address. */
+enum EngineSteps {
+	STEP_WAITING,		/* On another job's lookup of the same domain. */
+	STEP_RESOLVING,
+	STEP_CONNECTING,
+	STEP_BANNER,
+	STEP_EHLO,
+	STEP_HELO,
+	STEP_ENVELOPE,
+	STEP_BODY,
+	STEP_QUIT
+};
+
+static const char EndOfBody[] = ".\r\n";
+
+static long long Now(void)
+{
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+
+	return (long long)Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
+}
+
+/* Takes the job off whichever list it's on, if any. */
+static void Unlink(SMTPEngine *Engine, SMTPJob *Job)
+{
+	SMTPJob **First = Job->Step == STEP_RESOLVING ? &Engine->Resolving : &Engine->First;
+
+	if (Job->Previous)
+		Job->Previous->Next = Job->Next;
+	else if (*First == Job)
+		*First = Job->Next;
+	if (Job->Next)
+		Job->Next->Previous = Job->Previous;
+	else if (Engine->Last == Job)
+		Engine->Last = Job->Previous;
+
+	Job->Previous = Job->Next = NULL;
+
+	return;
+}
+
+/* Pushes the job's deadline back, keeping the list in order. */
+static void Touch(SMTPEngine *Engine, SMTPJob *Job)
+{
+	Job->Deadline = Now() + SMTP_BLOCKING_TIME;
+
+	if (Engine->Last == Job)
+		return;
+
+	Unlink(Engine, Job);
+
+	/* Every deadline is the same length, so the newest is always last. */
+	Job->Previous = Engine->Last;
+	Job->Next = NULL;
+	if (Engine->Last)
+		Engine->Last->Next = Job;
+	else
+		Engine->First = Job;
+	Engine->Last = Job;
+
+	return;
+}
+
+/* Updates what the job is waiting on. */
+static int Watch(SMTPEngine *Engine, SMTPJob *Job)
+{
+	struct epoll_event Event;
+	int Events;
+
+	/* Replies are always read, even while writing, so neither side can block the other. */
+	if (Job->Step == STEP_CONNECTING)
+		Events = EPOLLOUT;
+	else if (Job->OutStart < Job->OutEnd || (Job->Step == STEP_BODY && Job->Body < Job->MessageLength))
+		Events = EPOLLIN | EPOLLOUT;
+	else
+		Events = EPOLLIN;
+
+	if (Events == Job->Events)
+		return 0;
+
+	Event.events = Events;
+	Event.data.ptr = Job;
+	if (epoll_ctl(Engine->Epoll, Job->Events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, Job->Conn.Socket, &Event) != 0)
+		return -1;
+
+	Job->Events = Events;
+
+	return 0;
+}
+
+/*
+	Updates what the job's DNS queries are waiting on. They share the job's place in epoll, so any of them being ready processes the lot.
+	The job is woken for whichever query times out first.
+*/
+static int WatchQueries(SMTPEngine *Engine, SMTPJob *Job)
+{
+	struct epoll_event Event;
+	DNSQuery *Query;
+	unsigned int Index = 0;
+	int Timeout = SMTP_BLOCKING_TIME;
+
+	while ((Query = DNSCacheNextQuery(&Job->Resolve, &Index))) {
+
+		Event.events = DNSEvents(Query) == POLLOUT ? EPOLLOUT : EPOLLIN;
+		Event.data.ptr = Job;
+
+		/* A query moving to TCP or another server has a new socket. */
+		if (epoll_ctl(Engine->Epoll, EPOLL_CTL_MOD, Query->Socket, &Event) != 0 &&
+			(errno != ENOENT || epoll_ctl(Engine->Epoll, EPOLL_CTL_ADD, Query->Socket, &Event) != 0))
+			return -1;
+
+		if (DNSTimeout(Query) < Timeout)
+			Timeout = DNSTimeout(Query);
+	}
+
+	Job->Deadline = Now() + Timeout;
+
+	return 0;
+}
+
+static void CloseSocket(SMTPJob *Job)
+{
+	if (Job->Conn.Socket == -1)
+		return;
+
+	/* Closing it removes it from epoll as well. */
+	close(Job->Conn.Socket);
+	Job->Conn.Socket = -1;
+	Job->Conn.State = SMTP_DISCONNECTED;
+	Job->Events = 0;
+
+	Job->Conn.RecvStart = Job->Conn.RecvEnd = 0;
+	Job->OutStart = Job->OutEnd = 0;
+
+	return;
+}
+
+static void Finish(SMTPEngine *Engine, SMTPJob *Job, int Result)
+{
+	SMTPJob *Waiting;
+
+	Unlink(Engine, Job);
+
+	/* Anything waiting on its lookup goes with it. */
+	while (Job->Waiting) {
+		Waiting = Job->Waiting;
+		Job->Waiting = Waiting->Waiting;
+		Waiting->Waiting = NULL;
+		Finish(Engine, Waiting, Result);
+	}
+
+	if (Job->Step == STEP_RESOLVING)
+		DNSCacheFree(&Job->Resolve);
+	CloseSocket(Job);
+
+	if (Job->Conn.RecvBuffer) {
+		free(Job->Conn.RecvBuffer);
+		Job->Conn.RecvBuffer = NULL;
+	}
+	if (Job->Out) {
+		free(Job->Out);
+		Job->Out = NULL;
+	}
+	if (Job->Entry) {
+		DNSCacheRelease(Job->Entry);
+		Job->Entry = NULL;
+	}
+
+	Engine->Active--;
+
+	/* Last as it may submit the job again. */
+	if (Job->Done)
+		Job->Done(Job, Result);
+
+	return;
+}
+
+/* Adds to what's waiting to be sent. */
+static int Queue(SMTPJob *Job, const char *Data, unsigned int Length)
+{
+	char *NewOut;
+	unsigned int NewSize;
+
+	if (Job->OutStart == Job->OutEnd)
+		Job->OutStart = Job->OutEnd = 0;
+
+	if (Job->OutEnd + Length > Job->OutSize) {
+
+		NewSize = Job->OutSize ? Job->OutSize : SMTP_BUFFER_SIZE;
+		while (NewSize < Job->OutEnd + Length)
+			NewSize *= 2;
+
+		NewOut = realloc(Job->Out, NewSize);
+		if (!NewOut)
+			return -1;
+		Job->Out = NewOut;
+		Job->OutSize = NewSize;
+
+	}
+
+	memcpy(&Job->Out[Job->OutEnd], Data, Length);
+	Job->OutEnd += Length;
+
+	return 0;
+}
+
+/* Starts a non-blocking connection to the next address. Returns -1 once they've all been tried. */
+static int ConnectNext(SMTPEngine *Engine, SMTPJob *Job)
+{
+	struct sockaddr_storage Address;
+	struct sockaddr_in *IPv4;
+	struct sockaddr_in6 *IPv6;
+	DNSCacheAddress *Next;
+	socklen_t Length;
+	int Enable = 1;
+
+	CloseSocket(Job);
+
+	for (;;) {
+
+		memset(&Address, 0, sizeof(Address));
+
+		if (!Job->Entry) {
+			if (Job->Host > 0)
+				return -1;
+			Address = Job->Literal;
+			Job->Host++;
+		}
+		else {
+
+			while (Job->Host < Job->Entry->HostCount && Job->Address >= Job->Entry->Hosts[Job->Host].AddressCount) {
+				Job->Host++;
+				Job->Address = 0;
+			}
+			if (Job->Host >= Job->Entry->HostCount)
+				return -1;
+
+			Next = &Job->Entry->Hosts[Job->Host].Addresses[Job->Address++];
+			if (Next->Family == AF_INET6) {
+				IPv6 = (struct sockaddr_in6 *)&Address;
+				IPv6->sin6_family = AF_INET6;
+				memcpy(&IPv6->sin6_addr, Next->Address, sizeof(IPv6->sin6_addr));
+			}
+			else {
+				IPv4 = (struct sockaddr_in *)&Address;
+				IPv4->sin_family = AF_INET;
+				memcpy(&IPv4->sin_addr, Next->Address, sizeof(IPv4->sin_addr));
+			}
+
+		}
+
+		if (Address.ss_family == AF_INET6) {
+			((struct sockaddr_in6 *)&Address)->sin6_port = htons(atoi(SMTP_DEFAULT_PORT));
+			Length = sizeof(struct sockaddr_in6);
+		}
+		else {
+			((struct sockaddr_in *)&Address)->sin_port = htons(atoi(SMTP_DEFAULT_PORT));
+			Length = sizeof(struct sockaddr_in);
+		}
+
+		Job->Conn.Socket = socket(Address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (Job->Conn.Socket == -1)
+			continue;
+
+		/* Pipelined commands are written whole, so Nagle would only hold back the end of each until it's ACKed. */
+		setsockopt(Job->Conn.Socket, IPPROTO_TCP, TCP_NODELAY, &Enable, sizeof(Enable));
+
+		if (connect(Job->Conn.Socket, (struct sockaddr *)&Address, Length) == 0)
+			Job->Step = STEP_BANNER;
+		else if (errno == EINPROGRESS)
+			Job->Step = STEP_CONNECTING;
+		else {
+			CloseSocket(Job);
+			continue;
+		}
+
+		Job->Conn.Extensions = 0;
+		Job->Conn.SizeLimit = 0;
+		SMTPInitReply(&Job->Reply);
+
+		if (Watch(Engine, Job) != 0) {
+			CloseSocket(Job);
+			continue;
+		}
+
+		Touch(Engine, Job);
+
+		return 0;
+	}
+}
+
+/* Whether there's anywhere to deliver to. */
+static int Deliverable(const DNSCacheEntry *Entry)
+{
+	unsigned int Loop;
+
+	if (Entry->NXDomain)
+		return 0;
+
+	for (Loop = 0; Loop < Entry->HostCount; Loop++) {
+		if (Entry->Hosts[Loop].AddressCount)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Handles any answers to the job's lookup, connecting once it's finished. Returns -1 if the job was finished or has moved on. */
+static int Resolving(SMTPEngine *Engine, SMTPJob *Job)
+{
+	SMTPJob *Waiting, *Next;
+	int Return;
+
+	Return = DNSCacheProcess(&Job->Resolve, &Job->Entry);
+	if (Return == DNS_PENDING) {
+		if (WatchQueries(Engine, Job) == 0)
+			return 0;
+		Return = DNS_FAILED;
+	}
+
+	/* Freeing the queries closes their sockets, which takes them out of epoll. */
+	Unlink(Engine, Job);
+	DNSCacheFree(&Job->Resolve);
+	Job->Step = STEP_CONNECTING;
+
+	Waiting = Job->Waiting;
+	Job->Waiting = NULL;
+
+	if (Return != DNS_DONE || !Deliverable(Job->Entry) || ConnectNext(Engine, Job) != 0)
+		Finish(Engine, Job, SMTP_ERR_FAILURE);
+
+	/* The answer's in the cache now for the rest. */
+	for (; Waiting; Waiting = Next) {
+		Next = Waiting->Waiting;
+		Waiting->Waiting = NULL;
+		Waiting->Step = STEP_CONNECTING;
+
+		if (Return != DNS_DONE || DNSCachePeek(Waiting->Domain, &Waiting->Entry) != 0 ||
+			!Deliverable(Waiting->Entry) || ConnectNext(Engine, Waiting) != 0)
+			Finish(Engine, Waiting, SMTP_ERR_FAILURE);
+	}
+
+	return -1;
+}
+
+/* Moves on to the next address, finishing the job if there's none left. Always returns -1 for the callers' convenience. */
+static int Retry(SMTPEngine *Engine, SMTPJob *Job)
+{
+	if (ConnectNext(Engine, Job) != 0)
+		Finish(Engine, Job, SMTP_ERR_FAILURE);
+
+	return -1;
+}
+
+static int Quit(SMTPJob *Job)
+{
+	Job->Step = STEP_QUIT;
+
+	return Queue(Job, "QUIT\r\n", 6);
+}
+
+/* The command after this one. Recipients with invalid addresses are skipped. 0 is MAIL, then RCPT for each recipient and finally DATA. */
+static unsigned int Following(const SMTPJob *Job, unsigned int Command)
+{
+	for (Command++; Command <= Job->Count; Command++) {
+		if (Job->Results[Command - 1] != SMTP_ERR_DATA)
+			break;
+	}
+
+	return Command;
+}
+
+static int QueueCommand(SMTPJob *Job, unsigned int Command)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	int Length;
+
+	if (Command > Job->Count)
+		return Queue(Job, "DATA\r\n", 6);
+
+	if (SMTPAddressCommand(Buffer, sizeof(Buffer),
+		Command ? Job->Types[Command - 1] : SMTP_ADDRESS_FROM,
+		Command ? Job->Addresses[Command - 1] : Job->From, &Length) != SMTP_ERR_SUCCESS)
+		return -1;
+
+	return Queue(Job, Buffer, Length);
+}
+
+/* With pipelining, every command is sent at once. Otherwise, they're sent one at a time as the replies come back. */
+static int StartEnvelope(SMTPJob *Job)
+{
+	unsigned int Command;
+
+	Job->Conn.State = SMTP_CONNECTED;
+	Job->Step = STEP_ENVELOPE;
+	Job->Replied = Job->Accepted = 0;
+
+	if (!(Job->Conn.Extensions & SMTP_EXT_PIPELINING))
+		return QueueCommand(Job, 0);
+
+	for (Command = 0; Command <= Job->Count + 1; Command = Following(Job, Command)) {
+		if (QueueCommand(Job, Command) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int EnvelopeReply(SMTPJob *Job, const SMTPReply *Reply)
+{
+	unsigned int Command;
+
+	Command = Job->Replied;
+	Job->Replied = Following(Job, Command);
+
+	if (Command == 0) {
+
+		if (Reply->Code != 250) {
+			Job->Result = SMTP_ERR_FAILURE;
+			if (!(Job->Conn.Extensions & SMTP_EXT_PIPELINING))
+				return Quit(Job);
+		}
+		else
+			Job->Conn.State = SMTP_AWAITING_RECIPIENT;
+
+	}
+	else if (Command <= Job->Count) {
+
+		if (Job->Result == SMTP_ERR_SUCCESS && (Reply->Code == 250 || Reply->Code == 251)) {
+			Job->Results[Command - 1] = SMTP_ERR_SUCCESS;
+			Job->Accepted++;
+			Job->Conn.State = SMTP_READY;
+		}
+		else
+			Job->Results[Command - 1] = SMTP_ERR_FAILURE;
+
+	}
+	else {
+
+		if (Reply->Code != 354) {
+			Job->Result = SMTP_ERR_FAILURE;
+			return Quit(Job);
+		}
+
+		Job->Conn.State = SMTP_DATA;
+		Job->Step = STEP_BODY;
+		Job->Body = 0;
+
+		/* Nobody to send it to, so end it straight away. */
+		if (!Job->Accepted || Job->Result != SMTP_ERR_SUCCESS) {
+			Job->Result = SMTP_ERR_FAILURE;
+			Job->Body = Job->MessageLength;
+			return Queue(Job, EndOfBody, sizeof(EndOfBody) - 1);
+		}
+
+		return 0;
+	}
+
+	if (Job->Conn.Extensions & SMTP_EXT_PIPELINING)
+		return 0;
+
+	/* Send the next command now that this one's been answered. */
+	if (Job->Replied > Job->Count && !Job->Accepted) {
+		Job->Result = SMTP_ERR_FAILURE;
+		return Quit(Job);
+	}
+
+	return QueueCommand(Job, Job->Replied);
+}
+
+/* Handles a complete reply. Returns -1 if the job was finished or has moved on to another address. */
+static int HandleReply(SMTPEngine *Engine, SMTPJob *Job, const SMTPReply *Reply)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	int Length, Return;
+
+	switch (Job->Step) {
+
+		case STEP_BANNER:
+		case STEP_EHLO:
+			if (Job->Step == STEP_BANNER && Reply->Code != 220)
+				return Retry(Engine, Job);
+
+			if (Job->Step == STEP_EHLO) {
+				if (Reply->Code == 250) {
+					Job->Conn.Extensions = SMTPParseExtensions(Reply, &Job->Conn.SizeLimit);
+					Return = StartEnvelope(Job);
+					break;
+				}
+				Job->Step = STEP_HELO;
+				Length = snprintf(Buffer, sizeof(Buffer), "HELO %s\r\n", Job->HeloLine);
+			}
+			else {
+				Job->Step = STEP_EHLO;
+				Length = snprintf(Buffer, sizeof(Buffer), "EHLO %s\r\n", Job->HeloLine);
+			}
+
+			if (Length <= 0 || Length >= (int)sizeof(Buffer)) {
+				Finish(Engine, Job, SMTP_ERR_BUFFER);
+				return -1;
+			}
+			Return = Queue(Job, Buffer, Length);
+			break;
+
+		case STEP_HELO:
+			if (Reply->Code != 250)
+				return Retry(Engine, Job);
+			Return = StartEnvelope(Job);
+			break;
+
+		case STEP_ENVELOPE:
+			Return = EnvelopeReply(Job, Reply);
+			break;
+
+		case STEP_BODY:
+			if (Reply->Code == 250 && Job->Result == SMTP_ERR_SUCCESS)
+				Job->Conn.Messages++;
+			else
+				Job->Result = SMTP_ERR_FAILURE;
+			Job->Conn.State = SMTP_CONNECTED;
+			Return = Quit(Job);
+			break;
+
+		case STEP_QUIT:
+			Finish(Engine, Job, Job->Result);
+			return -1;
+
+		default:
+			Return = -1;
+
+	}
+
+	if (Return != 0) {
+		Finish(Engine, Job, SMTP_ERR_BUFFER);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Drops the connection. Until greeted, the next address is tried instead. */
+static int Failed(SMTPEngine *Engine, SMTPJob *Job)
+{
+	if (Job->Step <= STEP_HELO)
+		return Retry(Engine, Job);
+
+	Finish(Engine, Job, Job->Step == STEP_QUIT ? Job->Result : SMTP_ERR_PROTOCOL);
+
+	return -1;
+}
+
+static int Readable(SMTPEngine *Engine, SMTPJob *Job)
+{
+	SMTPConn *Conn = &Job->Conn;
+	char *NewBuffer;
+	unsigned int NewSize;
+	int Return;
+
+	/* Make room, first by moving what's left to the front. */
+	if (Conn->RecvEnd >= Conn->RecvSize) {
+
+		if (Conn->RecvStart > 0) {
+			memmove(Conn->RecvBuffer, &Conn->RecvBuffer[Conn->RecvStart], Conn->RecvEnd - Conn->RecvStart);
+			SMTPRebaseReplies(&Job->Reply, 1, &Conn->RecvBuffer[Conn->RecvStart], Conn->RecvBuffer);
+			Conn->RecvEnd -= Conn->RecvStart;
+			Conn->RecvStart = 0;
+		}
+		else {
+
+			NewSize = Conn->RecvSize ? Conn->RecvSize * 2 : SMTP_BUFFER_SIZE;
+			if (NewSize > SMTP_RECV_LIMIT)
+				return Failed(Engine, Job);
+
+			NewBuffer = realloc(Conn->RecvBuffer, NewSize);
+			if (!NewBuffer)
+				return Failed(Engine, Job);
+			if (Conn->RecvBuffer)
+				SMTPRebaseReplies(&Job->Reply, 1, Conn->RecvBuffer, NewBuffer);
+			Conn->RecvBuffer = NewBuffer;
+			Conn->RecvSize = NewSize;
+
+		}
+
+	}
+
+	Return = recv(Conn->Socket, &Conn->RecvBuffer[Conn->RecvEnd], Conn->RecvSize - Conn->RecvEnd, 0);
+	if (Return == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (Return <= 0)
+		return Failed(Engine, Job);
+
+	Conn->TotalRecv += Return;
+	Conn->RecvEnd += Return;
+	Touch(Engine, Job);
+
+	/* Handle every reply that's complete. */
+	for (;;) {
+
+		Return = SMTPParseReply(&Conn->RecvBuffer[Conn->RecvStart], Conn->RecvEnd - Conn->RecvStart, &Job->Reply);
+		if (Return == 0)
+			break;
+		if (Return == -1)
+			return Failed(Engine, Job);
+
+		Conn->RecvStart += Job->Reply.Size;
+		if (HandleReply(Engine, Job, &Job->Reply) != 0)
+			return -1;
+
+		SMTPInitReply(&Job->Reply);
+	}
+
+	if (Conn->RecvStart >= Conn->RecvEnd)
+		Conn->RecvStart = Conn->RecvEnd = 0;
+
+	return 0;
+}
+
+static int Writable(SMTPEngine *Engine, SMTPJob *Job)
+{
+	int Error, Return;
+	socklen_t Length;
+
+	if (Job->Step == STEP_CONNECTING) {
+
+		Length = sizeof(Error);
+		if (getsockopt(Job->Conn.Socket, SOL_SOCKET, SO_ERROR, &Error, &Length) != 0 || Error != 0)
+			return Retry(Engine, Job);
+
+		Job->Step = STEP_BANNER;
+		Touch(Engine, Job);
+		return 0;
+	}
+
+	while (Job->OutStart < Job->OutEnd) {
+
+		Return = send(Job->Conn.Socket, &Job->Out[Job->OutStart], Job->OutEnd - Job->OutStart, MSG_NOSIGNAL);
+		if (Return == -1)
+			goto Err;
+
+		Job->Conn.TotalSent += Return;
+		Job->OutStart += Return;
+		Touch(Engine, Job);
+	}
+
+	/* The message goes straight from the caller's memory. */
+	if (Job->Step == STEP_BODY && Job->Body < Job->MessageLength) {
+
+		while (Job->Body < Job->MessageLength) {
+
+			Return = send(Job->Conn.Socket, &Job->Message[Job->Body], Job->MessageLength - Job->Body, MSG_NOSIGNAL);
+			if (Return == -1)
+				goto Err;
+
+			Job->Conn.TotalSent += Return;
+			Job->Body += Return;
+			Touch(Engine, Job);
+		}
+
+		if (Queue(Job, EndOfBody, sizeof(EndOfBody) - 1) != 0) {
+			Finish(Engine, Job, SMTP_ERR_BUFFER);
+			return -1;
+		}
+
+		return Writable(Engine, Job);
+	}
+
+	return 0;
+
+	Err:
+	if (errno == EAGAIN || errno == EINTR)
+		return 0;
+	return Failed(Engine, Job);
+}
+
+int SMTPEngineInit(SMTPEngine *Engine)
+{
+	Engine->Epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (Engine->Epoll == -1)
+		return -1;
+
+	Engine->Active = 0;
+	Engine->First = Engine->Last = NULL;
+	Engine->Resolving = NULL;
+
+	return 0;
+}
+
+/*
+	Starts delivering the job. The mail servers are found through the DNS cache. If they aren't cached, they're looked up from the engine.
+	On success, Done is called once the job has finished. Otherwise, it isn't called at all.
+*/
+int SMTPEngineSubmit(SMTPEngine *Engine, SMTPJob *Job)
+{
+	struct sockaddr_in *Loopback;
+	SMTPJob *Leader;
+	unsigned int Loop, Found;
+	char Buffer[SMTP_BUFFER_SIZE];
+	int Length;
+
+	if (SMTPAddressCommand(Buffer, sizeof(Buffer), SMTP_ADDRESS_FROM, Job->From, &Length) != SMTP_ERR_SUCCESS)
+		return SMTP_ERR_DATA;
+
+	/* Invalid recipients are never sent. */
+	Found = 0;
+	for (Loop = 0; Loop < Job->Count; Loop++) {
+		Job->Results[Loop] = SMTPAddressCommand(Buffer, sizeof(Buffer), Job->Types[Loop], Job->Addresses[Loop], &Length);
+		if (Job->Results[Loop] == SMTP_ERR_SUCCESS)
+			Found++;
+	}
+	if (!Found)
+		return SMTP_ERR_DATA;
+
+	Job->Step = STEP_CONNECTING;
+	Job->Entry = NULL;
+	memset(&Job->Literal, 0, sizeof(Job->Literal));
+
+	/* Address literals don't need a lookup and neither does 'localhost', which the DNS doesn't know. */
+	if (inet_pton(AF_INET, Job->Domain, &((struct sockaddr_in *)&Job->Literal)->sin_addr) == 1)
+		Job->Literal.ss_family = AF_INET;
+	else if (inet_pton(AF_INET6, Job->Domain, &((struct sockaddr_in6 *)&Job->Literal)->sin6_addr) == 1)
+		Job->Literal.ss_family = AF_INET6;
+	else if (strcasecmp(Job->Domain, "localhost") == 0) {
+		Loopback = (struct sockaddr_in *)&Job->Literal;
+		Loopback->sin_family = AF_INET;
+		Loopback->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+	else if (DNSCachePeek(Job->Domain, &Job->Entry) != 0)
+		Job->Step = STEP_RESOLVING;
+	else if (!Deliverable(Job->Entry)) {
+		DNSCacheRelease(Job->Entry);
+		return SMTP_ERR_FAILURE;
+	}
+
+	Job->Conn.Socket = -1;
+	Job->Conn.State = SMTP_DISCONNECTED;
+	Job->Conn.RecvStart = Job->Conn.RecvEnd = Job->Conn.RecvSize = 0;
+	Job->Conn.RecvBuffer = NULL;
+	SMTPArenaInit(&Job->Conn.Arena);
+	Job->Conn.Addresses = Job->Conn.LastAddress = NULL;
+	Job->Conn.TotalSent = Job->Conn.TotalRecv = 0;
+	Job->Conn.Messages = 0;
+	Job->Conn.ZeroCopySent = Job->Conn.ZeroCopyDone = 0;
+
+	Job->Events = 0;
+	Job->Result = SMTP_ERR_SUCCESS;
+	Job->Host = Job->Address = 0;
+	Job->Out = NULL;
+	Job->OutStart = Job->OutEnd = Job->OutSize = 0;
+	Job->Body = 0;
+	Job->Previous = Job->Next = NULL;
+	Job->Waiting = NULL;
+
+	if (Job->Step == STEP_RESOLVING) {
+
+		/* Only one lookup per domain. The rest wait for it. */
+		for (Leader = Engine->Resolving; Leader; Leader = Leader->Next) {
+			if (strcasecmp(Leader->Domain, Job->Domain) == 0)
+				break;
+		}
+
+		if (Leader) {
+			Job->Step = STEP_WAITING;
+			Job->Waiting = Leader->Waiting;
+			Leader->Waiting = Job;
+		}
+		else {
+
+			if (DNSCacheStart(&Job->Resolve, Job->Domain) != 0 || WatchQueries(Engine, Job) != 0) {
+				DNSCacheFree(&Job->Resolve);
+				return SMTP_ERR_FAILURE;
+			}
+
+			Job->Next = Engine->Resolving;
+			if (Engine->Resolving)
+				Engine->Resolving->Previous = Job;
+			Engine->Resolving = Job;
+
+		}
+
+	}
+	else if (ConnectNext(Engine, Job) != 0) {
+		if (Job->Entry)
+			DNSCacheRelease(Job->Entry);
+		return SMTP_ERR_FAILURE;
+	}
+
+	Engine->Active++;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/*
+	Waits up to Timeout milliseconds for something to happen and then handles it. A Timeout of -1 waits until something does.
+	Returns the number of jobs still going or -1 on error.
+*/
+int SMTPEngineRun(SMTPEngine *Engine, int Timeout)
+{
+	struct epoll_event Events[SMTP_ENGINE_EVENTS];
+	SMTPJob *Job, *Next;
+	long long Until, Current;
+	int Count, Loop, Later;
+
+	/* The soonest deadline. Lookups wake for their queries' timeouts, which aren't in order. */
+	Until = Engine->First ? Engine->First->Deadline : -1;
+	for (Job = Engine->Resolving; Job; Job = Job->Next) {
+		if (Until == -1 || Job->Deadline < Until)
+			Until = Job->Deadline;
+	}
+	if (Until != -1) {
+		Until -= Now();
+		if (Until < 0)
+			Until = 0;
+		if (Timeout < 0 || Until < Timeout)
+			Timeout = Until;
+	}
+
+	Count = epoll_wait(Engine->Epoll, Events, SMTP_ENGINE_EVENTS, Timeout);
+	if (Count == -1) {
+		if (errno != EINTR)
+			return -1;
+		Count = 0;
+	}
+
+	for (Loop = 0; Loop < Count; Loop++) {
+
+		Job = Events[Loop].data.ptr;
+		if (!Job)
+			continue;
+
+		/* Once it's moved on, it mustn't see the rest of its queries' events. */
+		if (Job->Step == STEP_RESOLVING) {
+			if (Resolving(Engine, Job) != 0) {
+				for (Later = Loop + 1; Later < Count; Later++) {
+					if (Events[Later].data.ptr == Job)
+						Events[Later].data.ptr = NULL;
+				}
+			}
+			continue;
+		}
+
+		if (Job->Step == STEP_CONNECTING || (Events[Loop].events & EPOLLOUT)) {
+			if (Writable(Engine, Job) != 0)
+				continue;
+		}
+		if (Events[Loop].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			if (Readable(Engine, Job) != 0)
+				continue;
+		}
+
+		if (Watch(Engine, Job) != 0)
+			Failed(Engine, Job);
+
+	}
+
+	/* Anything that's taken too long. Each is either finished or given a new deadline. */
+	Current = Now();
+	while (Engine->First && Engine->First->Deadline <= Current)
+		Failed(Engine, Engine->First);
+
+	/* Lookups whose queries have timed out move on to their next attempt. */
+	for (Job = Engine->Resolving; Job; Job = Next) {
+		Next = Job->Next;
+		if (Job->Deadline <= Current)
+			Resolving(Engine, Job);
+	}
+
+	return Engine->Active;
+}
+
+/* Abandons any jobs still going. Their Done callbacks are called with SMTP_ERR_FAILURE. */
+void SMTPEngineFree(SMTPEngine *Engine)
+{
+	while (Engine->First)
+		Finish(Engine, Engine->First, SMTP_ERR_FAILURE);
+	while (Engine->Resolving)
+		Finish(Engine, Engine->Resolving, SMTP_ERR_FAILURE);
+
+	close(Engine->Epoll);
+
+	return;
+}
@@ -0,0 +1,63 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ssmtp.h"
+#include "reply.h"
+#include "dnscache.h"
+
+/* The most events handled by each wait. */
+#ifndef SMTP_ENGINE_EVENTS
+	#define SMTP_ENGINE_EVENTS	256
+#endif
+
+/* A single e-mail being delivered. */
+typedef struct SMTPJob {
+	/* Filled in before submitting. Everything pointed to must last until Done is called. */
+	const char *Domain, *HeloLine;
+	const char *From;
+	const int *Types;
+	const char **Addresses;
+	unsigned int Count;
+	int *Results;				/* Receives the outcome of each recipient. */
+	const char *Message;		/* Such as from SMTPFormat(). */
+	unsigned int MessageLength;
+	void (*Done)(struct SMTPJob *Job, int Result);
+	void *Data;
+
+	/* Everything below is used by the engine. */
+	SMTPConn Conn;
+	int Step, Events, Result;
+
+	DNSCacheResolve Resolve;
+	DNSCacheEntry *Entry;
+	struct sockaddr_storage Literal;
+	unsigned int Host, Address;	/* The next one to try. */
+
+	char *Out;
+	unsigned int OutStart, OutEnd, OutSize;
+	unsigned int Body;			/* How much of the message has been sent, once DATA is accepted. */
+
+	SMTPReply Reply;
+	unsigned int Replied, Accepted;
+
+	long long Deadline;
+	struct SMTPJob *Previous, *Next;
+	struct SMTPJob *Waiting;	/* Others for the same domain, waiting on this one's lookup. */
+} SMTPJob;
+
+typedef struct SMTPEngine {
+	int Epoll;
+	unsigned int Active;
+	SMTPJob *First, *Last;		/* In order of their deadlines. */
+	SMTPJob *Resolving;			/* Still looking up their mail servers. */
+} SMTPEngine;
+
+int SMTPEngineInit(SMTPEngine *Engine);
+int SMTPEngineSubmit(SMTPEngine *Engine, SMTPJob *Job);
+int SMTPEngineRun(SMTPEngine *Engine, int Timeout);
+void SMTPEngineFree(SMTPEngine *Engine);
+
+#endif
@@ -2,7 +2,12 @@
 	SSMTP example program.
 
 	On MinGW, use the following to compile;
-	gcc -Wall example.c ssmtp.c cbuffer.c base64.c -lws2_32 -lDnsapi -o example
+	gcc -Wall example.c ssmtp.c reply.c pool.c arena.c headers.c cbuffer.c base64.c body.c qp.c cpu.c -lws2_32 -lDnsapi -o example
+
+	Elsewhere, the resolver, its cache and the attachment cache are also required;
+	gcc -Wall example.c ssmtp.c reply.c pool.c arena.c headers.c engine.c scheduler.c dns.c dnscache.c attachcache.c cbuffer.c base64.c body.c qp.c cpu.c -lpthread -o example
+
+	For STARTTLS, also add -DSMTP_TLS tls.c -lssl -lcrypto.
 
 	Simple SMTP Mailer.
 	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
@@ -27,7 +32,9 @@
 */
 
 #include <stdio.h>
-#include <Winsock2.h>
+#ifdef _WIN32
+	#include <Winsock2.h>
+#endif
 
 #include "ssmtp.h"
 
@@ -51,14 +58,18 @@ static FILE *AttachmentFile = NULL;
 static int ReadAttach(FILE **File, void *Buffer, unsigned int BufferSize);
 static void CloseAttach(FILE **File);
 
+static void Cleanup(void);
+
 int main(int argc, char *argv[])
 {
+#ifdef _WIN32
 	WSADATA WinsockData;
 
 	if (WSAStartup(MAKEWORD(2,2), &WinsockData) != 0) {
 		fprintf(stderr, "Couldn't initialize Winsock.\n");
 		return 1;
 	}
+#endif
 
 	/*
 	   Adjust the state to the inital disconnected state.
@@ -88,6 +99,7 @@ int main(int argc, char *argv[])
 	/*
 	   These two following function pointers do and the actual reading & closing.
 	   Reading may be called several times. If an internal error occurs, Close is then called.
+	   For files on disk, SMTPAttachFile() can do all of this instead.
 	*/
 	Attachment.Read = (int (*)(void *, void *, unsigned int))ReadAttach;
 	Attachment.Close = (void (*)(void *))CloseAttach;
@@ -98,7 +110,7 @@ int main(int argc, char *argv[])
 	/* Connecting. */
 	if (SMTPConnect(&SMTPConnection, SMTP_SERVER, HELO_HOSTNAME) != SMTP_ERR_SUCCESS) {
 		fprintf(stderr, "Unable to connect to a working mail server for '%s'.\n", SMTP_SERVER);
-		WSACleanup();
+		Cleanup();
 		return 1;
 	}
 
@@ -106,7 +118,7 @@ int main(int argc, char *argv[])
 	if (SMTPAddress(&SMTPConnection, SMTP_ADDRESS_FROM, ADDRESS_SENDER) != SMTP_ERR_SUCCESS) {
 		fprintf(stderr, "Unable to send from '%s'.\n", ADDRESS_SENDER);
 		SMTPDisconnect(&SMTPConnection);
-		WSACleanup();
+		Cleanup();
 		return 1;
 	}
 
@@ -114,7 +126,7 @@ int main(int argc, char *argv[])
 	if (SMTPAddress(&SMTPConnection, SMTP_ADDRESS_TO, ADDRESS_RECEIVER) != SMTP_ERR_SUCCESS) {
 		fprintf(stderr, "Unable to send to '%s'.\n", ADDRESS_RECEIVER);
 		SMTPDisconnect(&SMTPConnection);
-		WSACleanup();
+		Cleanup();
 		return 1;
 	}
 
@@ -122,12 +134,12 @@ int main(int argc, char *argv[])
 	if (SMTPData(&SMTPConnection, SUBJECT_LINE, MESSAGE_BODY, &Attachment) != SMTP_ERR_SUCCESS) {
 		fprintf(stderr, "Unable to relay the e-mail.\n");
 		SMTPDisconnect(&SMTPConnection);
-		WSACleanup();
+		Cleanup();
 		return 1;
 	}
 
 	SMTPDisconnect(&SMTPConnection);
-	WSACleanup();
+	Cleanup();
 
 	return 0;
 }
@@ -173,3 +185,14 @@ static void CloseAttach(FILE **File)
 	*File = NULL;
 	return;
 }
+
+/*
+   Only Winsock needs anything undone before exiting.
+*/
+static void Cleanup(void)
+{
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return;
+}
@@ -0,0 +1,219 @@
+/*
+	Generated header values. The Date is only formatted again once a second has passed and the random parts of
+	boundaries and Message-IDs come from a fast generator. Both are kept per thread, so nothing is shared.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#ifdef _WIN32
+	#include <windows.h>
+	#define THREAD_LOCAL	__declspec(thread)
+
+	/* Enables 64-bit time functions. */
+	#if __MSVCRT_VERSION__ <= 0x0601
+		#undef __MSVCRT_VERSION__
+		#define __MSVCRT_VERSION__	0x0601
+	#endif
+#else
+	#include <sys/types.h>
+	#include <unistd.h>
+	#define THREAD_LOCAL	__thread
+#endif
+
+#include <time.h>
+
+/* As in ssmtp.c, MinGW's own snprintf is avoided. */
+#include <stdio.h>
+#ifdef _WIN32
+	#define __snprintf	_snprintf
+#else
+	#define __snprintf	snprintf
+#endif
+
+#include "headers.h"
+
+static const char *Days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *Months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static THREAD_LOCAL long long DateSecond = -1;
+static THREAD_LOCAL char DateString[SMTP_DATE_SIZE];
+
+static THREAD_LOCAL unsigned long long RandomState;
+static THREAD_LOCAL int RandomSeeded;
+#ifndef _WIN32
+static THREAD_LOCAL pid_t RandomProcess;
+#endif
+static volatile long RandomThreads;
+
+/* Works out the local time's offset from UTC in minutes by comparing the two. */
+static int UTCOffset(const struct tm *GMT, const struct tm *Local)
+{
+	int Offset;
+
+	Offset = (Local->tm_hour - GMT->tm_hour) * 60 + Local->tm_min - GMT->tm_min;
+
+	/* Either side of midnight, or of the new year. */
+	if (Local->tm_year != GMT->tm_year)
+		Offset += Local->tm_year > GMT->tm_year ? 1440 : -1440;
+	else if (Local->tm_yday != GMT->tm_yday)
+		Offset += Local->tm_yday > GMT->tm_yday ? 1440 : -1440;
+
+	return Offset;
+}
+
+/*
+	Returns the current local time as per RFC 5322, such as "Sun, 01 Jan 2023 00:00:00 +1300". Returns NULL on
+	failure. Only valid until the next call on the same thread.
+*/
+const char *CurrentDate(void)
+{
+	#ifndef _WIN32
+	time_t RawTime;
+	#else
+	__time64_t RawTime;
+	struct tm *TimeInfo;
+	#endif
+	struct tm GMT, Local;
+	int Offset, Return;
+
+	RawTime =
+	#ifndef _WIN32
+		time(NULL);
+	#else
+		_time64(NULL);
+	#endif
+	if (RawTime == -1)
+		return NULL;
+
+	if (RawTime == DateSecond)
+		return DateString;
+
+	#ifndef _WIN32
+	if (!gmtime_r(&RawTime, &GMT) || !localtime_r(&RawTime, &Local))
+		return NULL;
+	#else
+	/* The CRT keeps these results per thread, so they're safe as long as they're copied straight away. */
+	TimeInfo = (struct tm *)_gmtime64(&RawTime);
+	if (!TimeInfo)
+		return NULL;
+	GMT = *TimeInfo;
+
+	TimeInfo = (struct tm *)_localtime64(&RawTime);
+	if (!TimeInfo)
+		return NULL;
+	Local = *TimeInfo;
+	#endif
+
+	Offset = UTCOffset(&GMT, &Local);
+
+	/* Years past 9999 don't fit. */
+	if (Local.tm_year + 1900 > 9999)
+		return NULL;
+
+	Return = __snprintf(DateString, sizeof(DateString),
+		"%s, %.2d %s %d %.2d:%.2d:%.2d %c%.2d%.2d",
+		Days[Local.tm_wday], Local.tm_mday, Months[Local.tm_mon], Local.tm_year + 1900,
+		Local.tm_hour, Local.tm_min, Local.tm_sec,
+		Offset < 0 ? '-' : '+', (Offset < 0 ? -Offset : Offset) / 60, (Offset < 0 ? -Offset : Offset) % 60);
+	if (Return >= (int)sizeof(DateString) || Return <= 0)
+		return NULL;
+
+	DateSecond = RawTime;
+
+	return DateString;
+}
+
+/* SplitMix64. Fast and every seed gives a different stream, which is all that's needed for unique strings. */
+static unsigned long long NextRandom(void)
+{
+	unsigned long long Value;
+
+	RandomState += 0x9E3779B97F4A7C15ULL;
+
+	Value = RandomState;
+	Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBULL;
+
+	return Value ^ (Value >> 31);
+}
+
+/* Each thread is seeded differently from the time, the process, a count of threads and where its state lives. */
+static void SeedRandom(void)
+{
+	unsigned long long Seed, Thread;
+	#ifdef _WIN32
+	FILETIME Time;
+	LARGE_INTEGER Counter;
+
+	GetSystemTimeAsFileTime(&Time);
+	QueryPerformanceCounter(&Counter);
+	Seed = ((unsigned long long)Time.dwHighDateTime << 32 | Time.dwLowDateTime) ^ Counter.QuadPart;
+	Seed ^= (unsigned long long)GetCurrentProcessId() << 32;
+	Thread = InterlockedIncrement(&RandomThreads);
+	#else
+	struct timespec Time;
+
+	clock_gettime(CLOCK_REALTIME, &Time);
+	Seed = (unsigned long long)Time.tv_sec * 1000000000 + Time.tv_nsec;
+	RandomProcess = getpid();
+	Seed ^= (unsigned long long)RandomProcess << 32;
+	Thread = __atomic_add_fetch(&RandomThreads, 1, __ATOMIC_RELAXED);
+	#endif
+
+	RandomState = Seed;
+	RandomState ^= NextRandom() ^ Thread * 0xD1B54A32D192ED03ULL;
+	RandomState ^= (unsigned long long)(size_t)&RandomState;
+	RandomSeeded = 1;
+
+	return;
+}
+
+/* Fills the buffer with random letters and digits. Not terminated. Not for anything that has to be secret. */
+void RandomString(char *Buffer, unsigned int Length)
+{
+	static const char Chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	unsigned long long Value;
+	unsigned int Loop, Left;
+
+	/* A forked child would otherwise carry on with its parent's stream. */
+	#ifndef _WIN32
+	if (RandomSeeded && RandomProcess != getpid())
+		RandomSeeded = 0;
+	#endif
+	if (!RandomSeeded)
+		SeedRandom();
+
+	/* Ten characters come out of each number. */
+	Left = 0;
+	Value = 0;
+	for (Loop = 0; Loop < Length; Loop++) {
+		if (!Left) {
+			Value = NextRandom();
+			Left = 10;
+		}
+		Buffer[Loop] = Chars[Value % (sizeof(Chars) - 1)];
+		Value /= sizeof(Chars) - 1;
+		Left--;
+	}
+
+	return;
+}
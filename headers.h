@@ -0,0 +1,10 @@
+#ifndef HEADERS_H
+#define HEADERS_H
+
+/* Such as "Sun, 01 Jan 2023 00:00:00 +1300" with its NULL byte. */
+#define SMTP_DATE_SIZE		32
+
+const char *CurrentDate(void);
+void RandomString(char *Buffer, unsigned int Length);
+
+#endif
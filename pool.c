@@ -0,0 +1,354 @@
+/*
+	Keeps greeted connections open between messages so they can be reused.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#ifdef _WIN32
+	#define WIN32_MEAN_AND_LEAN
+	#define _WIN32_WINNT	0x0600	/* For slim reader/writer locks. */
+	#include <winsock2.h>
+	#include <windows.h>
+
+	#define strcasecmp	_stricmp
+
+	static SRWLOCK Lock = SRWLOCK_INIT;
+	#define LOCK()		AcquireSRWLockExclusive(&Lock)
+	#define UNLOCK()	ReleaseSRWLockExclusive(&Lock)
+#else
+	#include <poll.h>
+	#include <strings.h>
+	#include <pthread.h>
+
+	static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+	#define LOCK()		pthread_mutex_lock(&Lock)
+	#define UNLOCK()	pthread_mutex_unlock(&Lock)
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pool.h"
+
+typedef struct PoolEntry {
+	SMTPConn Conn;
+	time_t Used, Probed;
+	char *Domain, *HeloLine;	/* Stored after the entry. */
+	struct PoolEntry *Next;
+} PoolEntry;
+
+/* Most recently released first. Everything here is protected by the lock. */
+static PoolEntry *Idle;
+static SMTPPoolStats Stats;
+
+/* Nothing should arrive unprompted, so anything waiting is either a 421 or the server closing the connection. */
+static int Closed(const SMTPConn *Conn)
+{
+	#ifdef _WIN32
+	fd_set Set;
+	struct timeval Wait;
+	#else
+	struct pollfd Poll;
+	#endif
+
+	if (Conn->RecvStart != Conn->RecvEnd)
+		return 1;
+
+	#ifdef _WIN32
+	FD_ZERO(&Set);
+	FD_SET(Conn->Socket, &Set);
+	Wait.tv_sec = Wait.tv_usec = 0;
+
+	return select(Conn->Socket + 1, &Set, NULL, NULL, &Wait) != 0;
+	#else
+	/* select() can't take descriptors past FD_SETSIZE, which thousands of connections soon reach. */
+	Poll.fd = Conn->Socket;
+	Poll.events = POLLIN;
+	Poll.revents = 0;
+
+	return poll(&Poll, 1, 0) != 0;
+	#endif
+}
+
+/* Removes the most recently used session for the destination. */
+static PoolEntry *Take(const char *Domain, const char *HeloLine)
+{
+	PoolEntry *Entry, **Link;
+
+	LOCK();
+
+	for (Link = &Idle; *Link; Link = &(*Link)->Next) {
+
+		Entry = *Link;
+		if (strcasecmp(Entry->Domain, Domain) == 0 && strcmp(Entry->HeloLine, HeloLine) == 0) {
+			*Link = Entry->Next;
+			Stats.Idle--;
+			UNLOCK();
+			return Entry;
+		}
+
+	}
+
+	UNLOCK();
+
+	return NULL;
+}
+
+static void Insert(PoolEntry *Entry)
+{
+	LOCK();
+	Entry->Next = Idle;
+	Idle = Entry;
+	Stats.Idle++;
+	UNLOCK();
+
+	return;
+}
+
+static void CountDead(void)
+{
+	LOCK();
+	Stats.Dead++;
+	UNLOCK();
+
+	return;
+}
+
+/* Ensures a session is still usable, closing it if not. Returns 0 if it can be used. */
+static int Check(PoolEntry *Entry, time_t Now)
+{
+	if (Closed(&Entry->Conn)) {
+		SMTPAbort(&Entry->Conn);
+		CountDead();
+		return -1;
+	}
+
+	if (Now - Entry->Used >= SMTP_POOL_IDLE_TIME) {
+		SMTPDisconnect(&Entry->Conn);
+		return -1;
+	}
+
+	if (Now - Entry->Probed >= SMTP_POOL_PROBE_TIME) {
+
+		if (SMTPNoop(&Entry->Conn) != SMTP_ERR_SUCCESS) {
+			if (Entry->Conn.State != SMTP_DISCONNECTED)
+				SMTPAbort(&Entry->Conn);
+			CountDead();
+			return -1;
+		}
+
+		Entry->Probed = Now;
+	}
+
+	return 0;
+}
+
+/* Hands out an idle session for the destination, otherwise connects as SMTPConnect() would. */
+int SMTPPoolAcquire(SMTPConn *Conn, const char *Domain, const char *HeloLine)
+{
+	PoolEntry *Entry;
+	int Return;
+
+	if (Conn->State != SMTP_DISCONNECTED)
+		return SMTP_ERR_INVALID_STATE;
+
+	while ((Entry = Take(Domain, HeloLine))) {
+
+		if (Check(Entry, time(NULL)) != 0) {
+			free(Entry);
+			continue;
+		}
+
+		*Conn = Entry->Conn;
+		free(Entry);
+
+		LOCK();
+		Stats.Reused++;
+		UNLOCK();
+
+		return SMTP_ERR_SUCCESS;
+	}
+
+	Return = SMTPConnect(Conn, Domain, HeloLine);
+	if (Return == SMTP_ERR_SUCCESS) {
+		LOCK();
+		Stats.Connected++;
+		UNLOCK();
+	}
+
+	return Return;
+}
+
+/*
+	Resets the session and keeps it for the next SMTPPoolAcquire(). Conn is left disconnected either way.
+	Sessions that have sent too many messages or don't fit into the pool are closed instead.
+*/
+int SMTPPoolRelease(SMTPConn *Conn, const char *Domain, const char *HeloLine)
+{
+	PoolEntry *Entry, *Search;
+	unsigned int DomainLength, HeloLength, Count;
+	int Return;
+
+	if (Conn->State == SMTP_DISCONNECTED)
+		return SMTP_ERR_INVALID_STATE;
+
+	if (Conn->State != SMTP_CONNECTED) {
+
+		Return = SMTPReset(Conn);
+		if (Return != SMTP_ERR_SUCCESS) {
+			if (Conn->State != SMTP_DISCONNECTED)
+				SMTPDisconnect(Conn);
+			return Return;
+		}
+
+	}
+
+	if (Conn->Messages >= SMTP_POOL_MESSAGES)
+		return SMTPDisconnect(Conn);
+
+	DomainLength = strlen(Domain) + 1;
+	HeloLength = strlen(HeloLine) + 1;
+
+	Entry = malloc(sizeof(PoolEntry) + DomainLength + HeloLength);
+	if (!Entry) {
+		SMTPDisconnect(Conn);
+		return SMTP_ERR_BUFFER;
+	}
+
+	Entry->Domain = (char *)(Entry + 1);
+	Entry->HeloLine = Entry->Domain + DomainLength;
+	memcpy(Entry->Domain, Domain, DomainLength);
+	memcpy(Entry->HeloLine, HeloLine, HeloLength);
+	Entry->Used = Entry->Probed = time(NULL);
+
+	Entry->Conn = *Conn;
+	Conn->State = SMTP_DISCONNECTED;
+	Conn->RecvBuffer = NULL;
+	SMTPArenaInit(&Conn->Arena);
+
+	LOCK();
+
+	Count = 0;
+	for (Search = Idle; Search; Search = Search->Next) {
+		if (strcasecmp(Search->Domain, Domain) == 0 && strcmp(Search->HeloLine, HeloLine) == 0)
+			Count++;
+	}
+
+	if (Count < SMTP_POOL_HOST_SIZE && Stats.Idle < SMTP_POOL_SIZE) {
+		Entry->Next = Idle;
+		Idle = Entry;
+		Stats.Idle++;
+		Entry = NULL;
+	}
+
+	UNLOCK();
+
+	/* No room, so it's closed. */
+	if (Entry) {
+		SMTPDisconnect(&Entry->Conn);
+		free(Entry);
+	}
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/*
+	Closes sessions that have been idle too long and sends a NOOP to those that have been quiet for a while.
+	Call this every so often to keep the pool fresh. The checking is done without holding the lock.
+*/
+void SMTPPoolReap(void)
+{
+	PoolEntry *Entry, **Link, *Due;
+	time_t Now;
+
+	Now = time(NULL);
+	Due = NULL;
+
+	LOCK();
+
+	Link = &Idle;
+	while (*Link) {
+
+		Entry = *Link;
+		if (Now - Entry->Used >= SMTP_POOL_IDLE_TIME || Now - Entry->Probed >= SMTP_POOL_PROBE_TIME) {
+			*Link = Entry->Next;
+			Entry->Next = Due;
+			Due = Entry;
+			Stats.Idle--;
+		}
+		else
+			Link = &Entry->Next;
+
+	}
+
+	UNLOCK();
+
+	while (Due) {
+
+		Entry = Due;
+		Due = Entry->Next;
+
+		if (Check(Entry, Now) != 0)
+			free(Entry);
+		else
+			Insert(Entry);
+
+	}
+
+	return;
+}
+
+void SMTPPoolGetStats(SMTPPoolStats *Result)
+{
+	LOCK();
+	*Result = Stats;
+	UNLOCK();
+
+	return;
+}
+
+/* Closes every idle session. */
+void SMTPPoolFlush(void)
+{
+	PoolEntry *Entry, *Next;
+
+	LOCK();
+	Entry = Idle;
+	Idle = NULL;
+	Stats.Idle = 0;
+	UNLOCK();
+
+	for (; Entry; Entry = Next) {
+
+		Next = Entry->Next;
+
+		if (Closed(&Entry->Conn))
+			SMTPAbort(&Entry->Conn);
+		else
+			SMTPDisconnect(&Entry->Conn);
+		free(Entry);
+
+	}
+
+	return;
+}
@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "ssmtp.h"
+
+/* In seconds. Sessions unused for this long are closed. */
+#ifndef SMTP_POOL_IDLE_TIME
+	#define SMTP_POOL_IDLE_TIME		60
+#endif
+
+/* Sessions that have been quiet for this long are sent a NOOP before they're used again. */
+#ifndef SMTP_POOL_PROBE_TIME
+	#define SMTP_POOL_PROBE_TIME	15
+#endif
+
+/* Connections are closed after sending this many messages. */
+#ifndef SMTP_POOL_MESSAGES
+	#define SMTP_POOL_MESSAGES		100
+#endif
+
+/* The most idle sessions kept for one destination and in total. */
+#ifndef SMTP_POOL_HOST_SIZE
+	#define SMTP_POOL_HOST_SIZE		8
+#endif
+#ifndef SMTP_POOL_SIZE
+	#define SMTP_POOL_SIZE			256
+#endif
+
+typedef struct SMTPPoolStats {
+	unsigned long Reused;
+	unsigned long Connected;
+	unsigned long Dead;		/* Pooled sessions that were found closed or failed their NOOP. */
+	unsigned long Idle;
+} SMTPPoolStats;
+
+int SMTPPoolAcquire(SMTPConn *Conn, const char *Domain, const char *HeloLine);
+int SMTPPoolRelease(SMTPConn *Conn, const char *Domain, const char *HeloLine);
+void SMTPPoolReap(void);
+void SMTPPoolGetStats(SMTPPoolStats *Stats);
+void SMTPPoolFlush(void);
+
+#endif
@@ -0,0 +1,452 @@
+/*
+	A streaming quoted-printable encoder (RFC 2045, section 6.7) along with a scan used to decide between it, Base64 and
+	sending data as it is.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <string.h>	/* For memcpy() and memset() */
+
+#include "qp.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+	#include <immintrin.h>
+#endif
+
+static const char Hex[] = "0123456789ABCDEF";
+
+/* Plain octets are sent as they are. Spaces and tabs are too, unless they end a line. */
+static int IsPlain(unsigned char Char)
+{
+	return (Char >= ' ' && Char <= '~' && Char != '=') || Char == '\t';
+}
+
+/* Returns how many octets from the start are plain. */
+static unsigned int PlainRun(const unsigned char *Data, unsigned int Size)
+{
+	unsigned int Offset;
+
+	for (Offset = 0; Offset < Size; Offset++) {
+		if (!IsPlain(Data[Offset]))
+			break;
+	}
+
+	return Offset;
+}
+
+/* Counts a line ending, keeping track of the longest line. */
+static void ScanBreak(const unsigned char *Data, unsigned int Size, unsigned int Offset, QPScan *Scan, unsigned int *LineStart)
+{
+	/* The LF of a CRLF. The line was counted at the CR. */
+	if (Data[Offset] == '\n' && Offset > 0 && Data[Offset - 1] == '\r') {
+		*LineStart = Offset + 1;
+		return;
+	}
+
+	if (Offset - *LineStart > Scan->LongestLine)
+		Scan->LongestLine = Offset - *LineStart;
+	*LineStart = Offset + 1;
+
+	if (Data[Offset] == '\n' || Offset + 1 == Size || Data[Offset + 1] != '\n') {
+		Scan->LoneBreaks++;
+		Scan->Escapes++;
+	}
+
+	return;
+}
+
+/* Looks at a single octet that isn't plain. */
+static void ScanOctet(const unsigned char *Data, unsigned int Size, unsigned int Offset, QPScan *Scan, unsigned int *LineStart)
+{
+	unsigned char Char = Data[Offset];
+
+	if (Char == '\r' || Char == '\n') {
+		ScanBreak(Data, Size, Offset, Scan, LineStart);
+		return;
+	}
+
+	Scan->Escapes++;
+	if (Char >= 0x80)
+		Scan->HighBytes++;
+	else if (Char != '=')
+		Scan->Controls++;
+
+	return;
+}
+
+static void ScanQPScalar(const unsigned char *Data, unsigned int Size, unsigned int Offset, QPScan *Scan, unsigned int *LineStart)
+{
+	for (; Offset < Size; Offset++) {
+		if (!IsPlain(Data[Offset]))
+			ScanOctet(Data, Size, Offset, Scan, LineStart);
+	}
+
+	return;
+}
+
+#ifdef CPU_X86
+
+/*
+	Adding 96 moves ' ' to '~' onto -128 to -34, so one signed compare finds them. '=' is then taken out and TAB
+	put in.
+*/
+__attribute__((target("sse2"))) static unsigned int PlainMaskSSE2(__m128i In)
+{
+	__m128i Plain;
+
+	Plain = _mm_cmpgt_epi8(_mm_set1_epi8(-33), _mm_add_epi8(In, _mm_set1_epi8(96)));
+	Plain = _mm_andnot_si128(_mm_cmpeq_epi8(In, _mm_set1_epi8('=')), Plain);
+	Plain = _mm_or_si128(Plain, _mm_cmpeq_epi8(In, _mm_set1_epi8('\t')));
+
+	return (unsigned int)_mm_movemask_epi8(Plain);
+}
+
+__attribute__((target("avx2"))) static unsigned int PlainMaskAVX2(__m256i In)
+{
+	__m256i Plain;
+
+	Plain = _mm256_cmpgt_epi8(_mm256_set1_epi8(-33), _mm256_add_epi8(In, _mm256_set1_epi8(96)));
+	Plain = _mm256_andnot_si256(_mm256_cmpeq_epi8(In, _mm256_set1_epi8('=')), Plain);
+	Plain = _mm256_or_si256(Plain, _mm256_cmpeq_epi8(In, _mm256_set1_epi8('\t')));
+
+	return (unsigned int)_mm256_movemask_epi8(Plain);
+}
+
+__attribute__((target("sse2"))) static unsigned int PlainRunSSE2(const unsigned char *Data, unsigned int Size)
+{
+	unsigned int Offset, Mask;
+
+	for (Offset = 0; Offset + 16 <= Size; Offset += 16) {
+		Mask = ~PlainMaskSSE2(_mm_loadu_si128((const __m128i *)&Data[Offset])) & 0xFFFF;
+		if (Mask)
+			return Offset + __builtin_ctz(Mask);
+	}
+
+	return Offset + PlainRun(&Data[Offset], Size - Offset);
+}
+
+__attribute__((target("avx2"))) static unsigned int PlainRunAVX2(const unsigned char *Data, unsigned int Size)
+{
+	unsigned int Offset, Mask;
+
+	for (Offset = 0; Offset + 32 <= Size; Offset += 32) {
+		Mask = ~PlainMaskAVX2(_mm256_loadu_si256((const __m256i *)&Data[Offset]));
+		if (Mask)
+			return Offset + __builtin_ctz(Mask);
+	}
+
+	/*
+		The rest is less than a vector. It's finished here rather than in the SSE2 kernel, as going from AVX to legacy
+		SSE code stalls on each switch. The SSE2 mask is inlined, so it's encoded as AVX.
+	*/
+	if (Offset + 16 <= Size) {
+		Mask = ~PlainMaskSSE2(_mm_loadu_si128((const __m128i *)&Data[Offset])) & 0xFFFF;
+		if (Mask)
+			return Offset + __builtin_ctz(Mask);
+		Offset += 16;
+	}
+
+	return Offset + PlainRun(&Data[Offset], Size - Offset);
+}
+
+/* Whole vectors are counted with masks. Only line endings are looked at one by one. */
+__attribute__((target("sse2"))) static void ScanQPSSE2(const unsigned char *Data, unsigned int Size, QPScan *Scan, unsigned int *LineStart)
+{
+	unsigned int Offset, Other, High, Breaks;
+	__m128i In;
+
+	for (Offset = 0; Offset + 16 <= Size; Offset += 16) {
+
+		In = _mm_loadu_si128((const __m128i *)&Data[Offset]);
+		Other = ~PlainMaskSSE2(In) & 0xFFFF;
+		if (!Other)
+			continue;
+
+		High = (unsigned int)_mm_movemask_epi8(In);
+		Breaks = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(In, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(In, _mm_set1_epi8('\n'))));
+		Other &= ~Breaks;
+
+		Scan->Escapes += __builtin_popcount(Other);
+		Scan->HighBytes += __builtin_popcount(High);
+		Scan->Controls += __builtin_popcount(Other & ~High & ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(In, _mm_set1_epi8('='))));
+
+		for (; Breaks; Breaks &= Breaks - 1)
+			ScanBreak(Data, Size, Offset + __builtin_ctz(Breaks), Scan, LineStart);
+	}
+
+	ScanQPScalar(Data, Size, Offset, Scan, LineStart);
+
+	return;
+}
+
+__attribute__((target("avx2"))) static void ScanQPAVX2(const unsigned char *Data, unsigned int Size, QPScan *Scan, unsigned int *LineStart)
+{
+	unsigned int Offset, Other, High, Breaks;
+	__m256i In;
+
+	for (Offset = 0; Offset + 32 <= Size; Offset += 32) {
+
+		In = _mm256_loadu_si256((const __m256i *)&Data[Offset]);
+		Other = ~PlainMaskAVX2(In);
+		if (!Other)
+			continue;
+
+		High = (unsigned int)_mm256_movemask_epi8(In);
+		Breaks = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(In, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(In, _mm256_set1_epi8('\n'))));
+		Other &= ~Breaks;
+
+		Scan->Escapes += __builtin_popcount(Other);
+		Scan->HighBytes += __builtin_popcount(High);
+		Scan->Controls += __builtin_popcount(Other & ~High & ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(In, _mm256_set1_epi8('='))));
+
+		for (; Breaks; Breaks &= Breaks - 1)
+			ScanBreak(Data, Size, Offset + __builtin_ctz(Breaks), Scan, LineStart);
+	}
+
+	ScanQPScalar(Data, Size, Offset, Scan, LineStart);
+
+	return;
+}
+
+#endif
+
+typedef unsigned int (*RunKernel)(const unsigned char *Data, unsigned int Size);
+
+/* Finds runs of bytes that go out as they are. */
+static RunKernel SelectKernel(void)
+{
+#ifdef CPU_X86
+	unsigned int Features = CPUFeatures();
+
+	if (Features & CPU_AVX2)
+		return PlainRunAVX2;
+	if (Features & CPU_SSE2)
+		return PlainRunSSE2;
+#endif
+
+	return PlainRun;
+}
+
+void ScanQP(const unsigned char *Data, unsigned int Size, QPScan *Scan)
+{
+	unsigned int LineStart = 0;
+#ifdef CPU_X86
+	unsigned int Features = CPUFeatures();
+#endif
+
+	memset(Scan, 0, sizeof(QPScan));
+
+#ifdef CPU_X86
+	if (Features & CPU_AVX2)
+		ScanQPAVX2(Data, Size, Scan, &LineStart);
+	else if (Features & CPU_SSE2)
+		ScanQPSSE2(Data, Size, Scan, &LineStart);
+	else
+#endif
+		ScanQPScalar(Data, Size, 0, Scan, &LineStart);
+
+	if (Size - LineStart > Scan->LongestLine)
+		Scan->LongestLine = Size - LineStart;
+
+	return;
+}
+
+void InitEncodeQP(QPStream *Stream, int Text)
+{
+	Stream->AvailIn = Stream->AvailOut = \
+		Stream->TotalIn = Stream->TotalOut = \
+		Stream->Column = Stream->SkipLF = Stream->LineEnded = \
+		Stream->BlockStart = Stream->BlockSize = 0;
+	Stream->Text = Text;
+
+	return;
+}
+
+static void Emit(QPStream *Stream, const char *Data, unsigned int Size)
+{
+	memcpy(&Stream->Block[Stream->BlockSize], Data, Size);
+	Stream->BlockSize += Size;
+
+	return;
+}
+
+static void Consume(QPStream *Stream, unsigned int Size)
+{
+	Stream->NextIn += Size;
+	Stream->TotalIn += Size;
+	Stream->AvailIn -= Size;
+
+	return;
+}
+
+/* Ends the line for real. */
+static void HardBreak(QPStream *Stream)
+{
+	Emit(Stream, "\r\n", 2);
+	Stream->Column = 0;
+	Stream->LineEnded = 1;
+
+	return;
+}
+
+/*
+	Encodes as much as fits. A period starting a line is always encoded, so the output never needs stuffing.
+	Before it's finished, a last CR, space or tab is left in the input until what follows it is known.
+	Once finished, the output ends with a CRLF for the boundary that follows to take as its own.
+*/
+void EncodeQP(QPStream *Stream, int Finished)
+{
+	unsigned int Run, Width;
+	unsigned char Char;
+	char Escape[3];
+	RunKernel Kernel;
+	int Plain;
+
+	Kernel = SelectKernel();
+
+	for (;;) {
+
+		/* If anything is in our block for output, dump as much of it as fits. */
+		if (Stream->BlockSize != 0) {
+
+			Width = Stream->BlockSize;
+			if (Width > Stream->AvailOut)
+				Width = Stream->AvailOut;
+
+			memcpy(Stream->NextOut, &Stream->Block[Stream->BlockStart], Width);
+			Stream->BlockStart += Width;
+			Stream->BlockSize -= Width;
+			Stream->NextOut += Width;
+			Stream->TotalOut += Width;
+			Stream->AvailOut -= Width;
+
+			if (Stream->BlockSize != 0)
+				return;
+		}
+		Stream->BlockStart = 0;
+
+		if (Stream->AvailIn == 0) {
+
+			if (Finished && (Stream->Column != 0 || Stream->LineEnded)) {
+				Emit(Stream, "\r\n", 2);
+				Stream->Column = Stream->LineEnded = 0;
+				continue;
+			}
+
+			return;
+		}
+
+		Char = *Stream->NextIn;
+
+		if (Stream->SkipLF) {
+			Stream->SkipLF = 0;
+			if (Char == '\n') {
+				Consume(Stream, 1);
+				continue;
+			}
+		}
+
+		/* Copy runs of plain octets straight over. A last space or tab is left, as it may end the line. */
+		if (Stream->Column != 0 || Char != '.') {
+
+			Run = Stream->AvailIn;
+			if (Run > Stream->AvailOut)
+				Run = Stream->AvailOut;
+			if (Run > QP_LINE_LENGTH - 1 - Stream->Column)
+				Run = QP_LINE_LENGTH - 1 - Stream->Column;
+
+			Run = Kernel(Stream->NextIn, Run);
+			if (Run != 0 && (Stream->NextIn[Run - 1] == ' ' || Stream->NextIn[Run - 1] == '\t'))
+				Run--;
+
+			if (Run != 0) {
+				memcpy(Stream->NextOut, Stream->NextIn, Run);
+				Consume(Stream, Run);
+				Stream->NextOut += Run;
+				Stream->TotalOut += Run;
+				Stream->AvailOut -= Run;
+				Stream->Column += Run;
+				Stream->LineEnded = 0;
+				continue;
+			}
+
+		}
+
+		/* Line endings. Outside of text, lone ones are encoded like anything else. */
+		if (Stream->Text && (Char == '\r' || Char == '\n')) {
+			Consume(Stream, 1);
+			Stream->SkipLF = Char == '\r';
+			HardBreak(Stream);
+			continue;
+		}
+
+		if (Char == '\r') {
+
+			if (Stream->AvailIn < 2 && !Finished)
+				return;
+
+			if (Stream->AvailIn >= 2 && Stream->NextIn[1] == '\n') {
+				Consume(Stream, 2);
+				HardBreak(Stream);
+				continue;
+			}
+
+		}
+
+		Plain = IsPlain(Char) && (Char != '.' || Stream->Column != 0);
+
+		/* Spaces and tabs can't end a line, so look at what follows. */
+		if (Plain && (Char == ' ' || Char == '\t')) {
+
+			if (Stream->AvailIn < 2) {
+				if (!Finished)
+					return;
+				Plain = 0;
+			}
+			else if (Stream->NextIn[1] == '\r' || Stream->NextIn[1] == '\n')
+				Plain = 0;
+
+		}
+
+		/* Soft line break, leaving room for its '='. */
+		Width = Plain ? 1 : 3;
+		if (Stream->Column + Width > QP_LINE_LENGTH - 1) {
+			Emit(Stream, "=\r\n", 3);
+			Stream->Column = 0;
+			continue;
+		}
+
+		if (Plain)
+			Emit(Stream, (const char *)&Char, 1);
+		else {
+			Escape[0] = '=';
+			Escape[1] = Hex[Char >> 4];
+			Escape[2] = Hex[Char & 0x0F];
+			Emit(Stream, Escape, 3);
+		}
+
+		Consume(Stream, 1);
+		Stream->Column += Width;
+		Stream->LineEnded = 0;
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef QP_H
+#define QP_H
+
+/* The longest encoded line, not counting its CRLF. A soft line break's '=' is included. */
+#define QP_LINE_LENGTH		76
+#define QP_BLOCK_SIZE		8
+
+typedef struct QPStream {
+	unsigned int AvailIn;
+	unsigned int TotalIn;
+	unsigned char *NextIn;
+
+	unsigned int AvailOut;
+	unsigned int TotalOut;
+	char *NextOut;
+
+	/* Set by InitEncodeQP(). Text treats any line ending as a line break, otherwise only CRLF is one. */
+	int Text;
+
+	/* Internal. */
+	unsigned int Column;
+	int SkipLF;		/* A CR was just taken as a line break, so a LF straight after it belongs to it. */
+	int LineEnded;	/* The last output was a line break of the data's own. */
+	unsigned int BlockStart, BlockSize;
+	char Block[QP_BLOCK_SIZE];
+} QPStream;
+
+/* Filled in by ScanQP(). */
+typedef struct QPScan {
+	unsigned int Escapes;		/* Octets that would have to be encoded, lone line endings included. */
+	unsigned int HighBytes;		/* Octets of 128 and over. */
+	unsigned int Controls;		/* Control characters other than TAB, CR and LF. */
+	unsigned int LoneBreaks;	/* CRs and LFs that aren't part of a CRLF. */
+	unsigned int LongestLine;	/* Not counting its line ending. */
+} QPScan;
+
+void InitEncodeQP(QPStream *Stream, int Text);
+void EncodeQP(QPStream *Stream, int Finished);
+void ScanQP(const unsigned char *Data, unsigned int Size, QPScan *Scan);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+	An incremental parser for SMTP replies. Nothing is copied, the reply only points into the buffer it was given.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <string.h>	/* For memchr() */
+#include <stdlib.h>
+#ifdef _WIN32
+	#define strncasecmp	_strnicmp
+#else
+	#include <strings.h>
+#endif
+
+#include "ssmtp.h"
+#include "reply.h"
+
+#define IS_DIGIT(Char)	((Char) >= '0' && (Char) <= '9')
+
+/* Returns the length of an enhanced status code, such as '2.1.5', at the start of the text. Otherwise 0. */
+static unsigned int EnhancedLength(const char *Text, unsigned int Length, int Code)
+{
+	unsigned int Offset, Part, Digits;
+
+	if (Length < 5 || Text[0] != '0' + Code / 100 || Text[1] != '.')
+		return 0;
+
+	Offset = 2;
+	for (Part = 0; Part < 2; Part++) {
+
+		for (Digits = 0; Offset < Length && IS_DIGIT(Text[Offset]) && Digits < 3; Offset++, Digits++);
+		if (Digits == 0)
+			return 0;
+
+		if (Part == 0) {
+			if (Offset >= Length || Text[Offset] != '.')
+				return 0;
+			Offset++;
+		}
+
+	}
+
+	if (Offset < Length && Text[Offset] != ' ')
+		return 0;
+
+	return Offset;
+}
+
+void SMTPInitReply(SMTPReply *Reply)
+{
+	Reply->Code = 0;
+	Reply->Enhanced.Data = NULL;
+	Reply->Enhanced.Length = 0;
+	Reply->LineCount = 0;
+	Reply->Data = NULL;
+	Reply->Size = 0;
+
+	return;
+}
+
+/*
+	Carries on from where the last call left off, so only new data is scanned.
+	Data must start at the same reply each time, although it may have been moved. (See SMTPRebaseReplies())
+	Returns 1 once the reply is complete, 0 if more data is required or -1 if it's not a valid reply.
+*/
+int SMTPParseReply(const char *Data, unsigned int Size, SMTPReply *Reply)
+{
+	const char *Line, *End, *Text;
+	unsigned int Length, TextLength, Enhanced;
+	int Code;
+
+	while (Reply->Size < Size) {
+
+		/* memchr() is vectorized by any decent C library, so let it find the end of the line. */
+		Line = &Data[Reply->Size];
+		End = memchr(Line, '\n', Size - Reply->Size);
+		if (!End)
+			return 0;
+
+		Length = End - Line;
+		if (Length > 0 && Line[Length - 1] == '\r')
+			Length--;
+
+		/* Ensure the first three bytes of a line are digits as per the spec. */
+		if (Length < 3 || !IS_DIGIT(Line[0]) || !IS_DIGIT(Line[1]) || !IS_DIGIT(Line[2]))
+			return -1;
+		if (Length > 3 && Line[3] != ' ' && Line[3] != '-')
+			return -1;
+
+		Code = (Line[0] - '0') * 100 + (Line[1] - '0') * 10 + (Line[2] - '0');
+		if (Reply->Size == 0) {
+			Reply->Code = Code;
+			Reply->Data = Data;
+		}
+		else if (Code != Reply->Code)
+			return -1;
+
+		Text = Length > 3 ? &Line[4] : &Line[3];
+		TextLength = Length > 3 ? Length - 4 : 0;
+
+		/* Each line repeats the enhanced code. Only the first is kept. */
+		Enhanced = EnhancedLength(Text, TextLength, Code);
+		if (Enhanced) {
+			if (!Reply->Enhanced.Data) {
+				Reply->Enhanced.Data = Text;
+				Reply->Enhanced.Length = Enhanced;
+			}
+
+			if (Enhanced < TextLength)
+				Enhanced++;
+			Text += Enhanced;
+			TextLength -= Enhanced;
+		}
+
+		if (Reply->LineCount < SMTP_REPLY_LINES) {
+			Reply->Lines[Reply->LineCount].Data = Text;
+			Reply->Lines[Reply->LineCount].Length = TextLength;
+			Reply->LineCount++;
+		}
+
+		Reply->Size = End - Data + 1;
+
+		/* Anything other than a hyphen is the last line. */
+		if (Length == 3 || Line[3] == ' ')
+			return 1;
+	}
+
+	return 0;
+}
+
+/* For when the buffer the replies point into has been moved. Both pointers must still be valid. */
+void SMTPRebaseReplies(SMTPReply *Replies, unsigned int Count, const char *From, const char *To)
+{
+	unsigned int Loop, Line;
+
+	for (Loop = 0; Loop < Count; Loop++) {
+
+		if (Replies[Loop].Data)
+			Replies[Loop].Data = To + (Replies[Loop].Data - From);
+		if (Replies[Loop].Enhanced.Data)
+			Replies[Loop].Enhanced.Data = To + (Replies[Loop].Enhanced.Data - From);
+
+		for (Line = 0; Line < Replies[Loop].LineCount; Line++)
+			Replies[Loop].Lines[Line].Data = To + (Replies[Loop].Lines[Line].Data - From);
+
+	}
+
+	return;
+}
+
+/* Picks out the extensions we know of from the lines of an EHLO reply, returning them as SMTP_EXT_* flags. The first line is the greeting. */
+unsigned int SMTPParseExtensions(const SMTPReply *Reply, unsigned long *SizeLimit)
+{
+	static const struct {
+		const char *Keyword;
+		unsigned int Flag;
+	} Known[] = {
+		{ "PIPELINING", SMTP_EXT_PIPELINING },
+		{ "SIZE", SMTP_EXT_SIZE },
+		{ "8BITMIME", SMTP_EXT_8BITMIME },
+		{ "SMTPUTF8", SMTP_EXT_SMTPUTF8 },
+		{ "CHUNKING", SMTP_EXT_CHUNKING },
+		{ "STARTTLS", SMTP_EXT_STARTTLS },
+		{ "ENHANCEDSTATUSCODES", SMTP_EXT_ENHANCEDSTATUSCODES }
+	};
+	const char *Line, *End, *Next;
+	unsigned int Loop, Length, Extensions;
+	char Number[21];
+
+	Extensions = 0;
+	*SizeLimit = 0;
+
+	/* Walk the raw reply rather than its kept lines as there may be more of them. */
+	Line = memchr(Reply->Data, '\n', Reply->Size);
+	while (Line) {
+
+		Line++;
+		End = Next = memchr(Line, '\n', Reply->Data + Reply->Size - Line);
+		if (!End || End - Line < 4)
+			break;
+		if (End[-1] == '\r')
+			End--;
+		Line += 4;	/* Code and separator. */
+
+		for (Length = 0; Line + Length < End && Line[Length] != ' '; Length++);
+
+		for (Loop = 0; Loop < sizeof(Known) / sizeof(Known[0]); Loop++) {
+			if (Length == strlen(Known[Loop].Keyword) && strncasecmp(Line, Known[Loop].Keyword, Length) == 0) {
+				Extensions |= Known[Loop].Flag;
+
+				/* The reply isn't terminated, so copy out the limit. */
+				if (Known[Loop].Flag == SMTP_EXT_SIZE && End - Line - Length > 1 && End - Line - Length < sizeof(Number)) {
+					memcpy(Number, &Line[Length + 1], End - Line - Length - 1);
+					Number[End - Line - Length - 1] = '\0';
+					*SizeLimit = strtoul(Number, NULL, 10);
+				}
+				break;
+			}
+		}
+
+		Line = Next;
+	}
+
+	return Extensions;
+}
@@ -0,0 +1,35 @@
+#ifndef REPLY_H
+#define REPLY_H
+
+/* Lines beyond this are still parsed but aren't kept. */
+#ifndef SMTP_REPLY_LINES
+	#define SMTP_REPLY_LINES	32
+#endif
+
+/* Points into the receive buffer. Not terminated. */
+typedef struct SMTPSlice {
+	const char *Data;
+	unsigned int Length;
+} SMTPSlice;
+
+typedef struct SMTPReply {
+	int Code;
+
+	/* Such as '2.1.5'. Empty if the server doesn't send them. */
+	SMTPSlice Enhanced;
+
+	/* The text of each line, without the code, separator or line ending. */
+	unsigned int LineCount;
+	SMTPSlice Lines[SMTP_REPLY_LINES];
+
+	/* The whole reply, for when there's more lines than are kept. Size is how much has been scanned so far. */
+	const char *Data;
+	unsigned int Size;
+} SMTPReply;
+
+void SMTPInitReply(SMTPReply *Reply);
+int SMTPParseReply(const char *Data, unsigned int Size, SMTPReply *Reply);
+void SMTPRebaseReplies(SMTPReply *Replies, unsigned int Count, const char *From, const char *To);
+unsigned int SMTPParseExtensions(const SMTPReply *Reply, unsigned long *SizeLimit);
+
+#endif
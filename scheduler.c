@@ -0,0 +1,458 @@
+/*
+	Delivers queued e-mails on a fixed set of worker threads, grouped by their domain.
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "scheduler.h"
+#include "pool.h"
+
+/* The e-mails waiting for a single domain. */
+typedef struct SchedulerDomain {
+	char *Name;		/* Stored after the domain. */
+	unsigned int Hash;
+
+	/* Protected by the scheduler's lock. */
+	SMTPMail *First, *Last;
+	unsigned int Pending, Active;
+	int Queued;		/* In a worker's queue. */
+	struct SchedulerDomain *Next;
+
+	/* Protected by the lock of the worker it's queued on. */
+	struct SchedulerDomain *Older, *Newer;
+} SchedulerDomain;
+
+/*
+	Each worker has its own queue of domains that are ready to go. It takes the newest from its own queue
+	while idle workers steal the oldest, so they rarely contend for the same end.
+*/
+typedef struct SchedulerWorker {
+	SMTPScheduler *Scheduler;
+	unsigned int Index;
+	pthread_t Thread;
+
+	pthread_mutex_t Lock;
+	SchedulerDomain *Oldest, *Newest;
+} SchedulerWorker;
+
+/* Domains are case-insensitive. */
+static unsigned int Hash(const char *Domain)
+{
+	unsigned int Value = 2166136261u;
+
+	for (; *Domain; Domain++) {
+		Value ^= (unsigned char)tolower((unsigned char)*Domain);
+		Value *= 16777619u;
+	}
+
+	return Value;
+}
+
+static void Push(SchedulerWorker *Worker, SchedulerDomain *Domain)
+{
+	pthread_mutex_lock(&Worker->Lock);
+
+	Domain->Older = Worker->Newest;
+	Domain->Newer = NULL;
+	if (Worker->Newest)
+		Worker->Newest->Newer = Domain;
+	else
+		Worker->Oldest = Domain;
+	Worker->Newest = Domain;
+
+	pthread_mutex_unlock(&Worker->Lock);
+
+	return;
+}
+
+static SchedulerDomain *Pop(SchedulerWorker *Worker, int Newest)
+{
+	SchedulerDomain *Domain;
+
+	pthread_mutex_lock(&Worker->Lock);
+
+	Domain = Newest ? Worker->Newest : Worker->Oldest;
+	if (Domain) {
+
+		if (Domain->Older)
+			Domain->Older->Newer = Domain->Newer;
+		else
+			Worker->Oldest = Domain->Newer;
+		if (Domain->Newer)
+			Domain->Newer->Older = Domain->Older;
+		else
+			Worker->Newest = Domain->Older;
+
+	}
+
+	pthread_mutex_unlock(&Worker->Lock);
+
+	return Domain;
+}
+
+/* Must be called with the scheduler locked. */
+static void MakeRunnable(SMTPScheduler *Scheduler, SchedulerDomain *Domain, SchedulerWorker *Worker)
+{
+	Domain->Queued = 1;
+	Scheduler->Runnable++;
+	Push(Worker, Domain);
+	pthread_cond_signal(&Scheduler->Signal);
+
+	return;
+}
+
+/* Frees the domain once nothing refers to it. Must be called with the scheduler locked. */
+static void Forget(SMTPScheduler *Scheduler, SchedulerDomain *Domain)
+{
+	SchedulerDomain **Link;
+
+	if (Domain->Pending || Domain->Active || Domain->Queued)
+		return;
+
+	for (Link = &Scheduler->Domains[Domain->Hash % SMTP_SCHEDULER_BUCKETS]; *Link; Link = &(*Link)->Next) {
+		if (*Link == Domain) {
+			*Link = Domain->Next;
+			break;
+		}
+	}
+
+	free(Domain);
+
+	return;
+}
+
+static SMTPMail *TakeMail(SMTPScheduler *Scheduler, SchedulerDomain *Domain)
+{
+	SMTPMail *Mail;
+
+	pthread_mutex_lock(&Scheduler->Lock);
+
+	Mail = Domain->First;
+	if (Mail) {
+		Domain->First = Mail->Next;
+		if (!Domain->First)
+			Domain->Last = NULL;
+		Domain->Pending--;
+	}
+
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	return Mail;
+}
+
+/* Sends a single e-mail over the connection, connecting if required. The connection is left ready for the next one. */
+static int Send(SMTPScheduler *Scheduler, SMTPConn *Conn, const char *Domain, SMTPMail *Mail)
+{
+	unsigned int Loop;
+	int Return;
+
+	if (Conn->State == SMTP_DISCONNECTED) {
+
+		Return = SMTPPoolAcquire(Conn, Domain, Scheduler->HeloLine);
+		if (Return != SMTP_ERR_SUCCESS) {
+			for (Loop = 0; Loop < Mail->Count; Loop++)
+				Mail->Results[Loop] = Return;
+			return Return;
+		}
+
+	}
+
+	Return = SMTPAddresses(Conn, Mail->From, Mail->Types, Mail->Addresses, Mail->Count, Mail->Results);
+	if (Return == SMTP_ERR_SUCCESS) {
+		if (Mail->Message)
+			Return = SMTPSendMessage(Conn, Mail->Message);
+		else
+			Return = SMTPData(Conn, Mail->Subject, Mail->Body, Mail->Attachments);
+	}
+
+	if (Conn->State > SMTP_CONNECTED)
+		SMTPReset(Conn);
+
+	return Return;
+}
+
+/* Sends a batch of the domain's e-mails over one connection. */
+static void Deliver(SchedulerWorker *Worker, SchedulerDomain *Domain)
+{
+	SMTPScheduler *Scheduler = Worker->Scheduler;
+	SMTPConn Conn;
+	SMTPMail *Mail;
+	unsigned int Sent;
+	int Return;
+
+	Conn.State = SMTP_DISCONNECTED;
+
+	for (Sent = 0; Sent < SMTP_SCHEDULER_BATCH; Sent++) {
+
+		Mail = TakeMail(Scheduler, Domain);
+		if (!Mail)
+			break;
+
+		Return = Send(Scheduler, &Conn, Domain->Name, Mail);
+
+		pthread_mutex_lock(&Scheduler->Lock);
+		if (Return == SMTP_ERR_SUCCESS)
+			Scheduler->Stats.Delivered++;
+		else
+			Scheduler->Stats.Failed++;
+		pthread_mutex_unlock(&Scheduler->Lock);
+
+		if (Mail->Done)
+			Mail->Done(Mail, Return);
+
+	}
+
+	if (Conn.State != SMTP_DISCONNECTED)
+		SMTPPoolRelease(&Conn, Domain->Name, Scheduler->HeloLine);
+
+	/* Whatever's left goes back onto this worker's queue, where others can steal it. */
+	pthread_mutex_lock(&Scheduler->Lock);
+
+	Domain->Active--;
+	if (Domain->Pending && !Domain->Queued)
+		MakeRunnable(Scheduler, Domain, Worker);
+	else
+		Forget(Scheduler, Domain);
+
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	return;
+}
+
+static void *WorkerThread(void *Data)
+{
+	SchedulerWorker *Worker = Data;
+	SMTPScheduler *Scheduler = Worker->Scheduler;
+	SchedulerDomain *Domain;
+	unsigned int Loop;
+
+	for (;;) {
+
+		/* Our own queue first, then everyone else's. */
+		Domain = Pop(Worker, 1);
+		for (Loop = 1; !Domain && Loop < Scheduler->WorkerCount; Loop++)
+			Domain = Pop(&Scheduler->Workers[(Worker->Index + Loop) % Scheduler->WorkerCount], 0);
+
+		pthread_mutex_lock(&Scheduler->Lock);
+
+		if (!Domain) {
+
+			if (!Scheduler->Runnable) {
+				if (Scheduler->Stopping)
+					break;
+				pthread_cond_wait(&Scheduler->Signal, &Scheduler->Lock);
+			}
+
+			pthread_mutex_unlock(&Scheduler->Lock);
+			continue;
+		}
+
+		if (Loop > 1)
+			Scheduler->Stats.Stolen++;
+
+		Domain->Queued = 0;
+		Scheduler->Runnable--;
+
+		/* Others may have already sent everything. */
+		if (!Domain->Pending) {
+			Forget(Scheduler, Domain);
+			pthread_mutex_unlock(&Scheduler->Lock);
+			continue;
+		}
+
+		/* If there's more waiting, let another worker share the domain. */
+		Domain->Active++;
+		if (Domain->Pending > 1 && Domain->Active < SMTP_SCHEDULER_DOMAIN_LIMIT)
+			MakeRunnable(Scheduler, Domain, Worker);
+
+		pthread_mutex_unlock(&Scheduler->Lock);
+
+		Deliver(Worker, Domain);
+	}
+
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	return NULL;
+}
+
+/* Starts the workers. If Workers is 0, there's one for each processor. */
+int SMTPSchedulerInit(SMTPScheduler *Scheduler, const char *HeloLine, unsigned int Workers)
+{
+	SchedulerWorker *Worker;
+	unsigned int Loop;
+	long Processors;
+
+	if (!Workers) {
+		Processors = sysconf(_SC_NPROCESSORS_ONLN);
+		Workers = Processors > 0 ? Processors : 1;
+	}
+
+	Scheduler->Workers = malloc(Workers * sizeof(SchedulerWorker));
+	if (!Scheduler->Workers)
+		return SMTP_ERR_BUFFER;
+
+	Scheduler->HeloLine = HeloLine;
+	Scheduler->WorkerCount = 0;
+	Scheduler->Runnable = 0;
+	Scheduler->Stopping = 0;
+	memset(Scheduler->Domains, 0, sizeof(Scheduler->Domains));
+	memset(&Scheduler->Stats, 0, sizeof(Scheduler->Stats));
+
+	pthread_mutex_init(&Scheduler->Lock, NULL);
+	pthread_cond_init(&Scheduler->Signal, NULL);
+
+	for (Loop = 0; Loop < Workers; Loop++) {
+		Worker = &Scheduler->Workers[Loop];
+		Worker->Scheduler = Scheduler;
+		Worker->Index = Loop;
+		Worker->Oldest = Worker->Newest = NULL;
+		pthread_mutex_init(&Worker->Lock, NULL);
+	}
+
+	/* The count is only set once they're all ready, as the workers steal from each other. */
+	pthread_mutex_lock(&Scheduler->Lock);
+	Scheduler->WorkerCount = Workers;
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	for (Loop = 0; Loop < Workers; Loop++) {
+		if (pthread_create(&Scheduler->Workers[Loop].Thread, NULL, WorkerThread, &Scheduler->Workers[Loop]) != 0)
+			break;
+	}
+
+	if (Loop < Workers) {
+
+		pthread_mutex_lock(&Scheduler->Lock);
+		Scheduler->Stopping = 1;
+		pthread_cond_broadcast(&Scheduler->Signal);
+		pthread_mutex_unlock(&Scheduler->Lock);
+
+		while (Loop > 0)
+			pthread_join(Scheduler->Workers[--Loop].Thread, NULL);
+
+		for (Loop = 0; Loop < Workers; Loop++)
+			pthread_mutex_destroy(&Scheduler->Workers[Loop].Lock);
+		pthread_mutex_destroy(&Scheduler->Lock);
+		pthread_cond_destroy(&Scheduler->Signal);
+		free(Scheduler->Workers);
+
+		return SMTP_ERR_FAILURE;
+	}
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Queues an e-mail. It'll be sent from one of the workers, which then calls Done. */
+int SMTPSchedulerSubmit(SMTPScheduler *Scheduler, SMTPMail *Mail)
+{
+	SchedulerDomain *Domain;
+	unsigned int Value, Length;
+
+	Value = Hash(Mail->Domain);
+	Mail->Next = NULL;
+
+	pthread_mutex_lock(&Scheduler->Lock);
+
+	if (Scheduler->Stopping) {
+		pthread_mutex_unlock(&Scheduler->Lock);
+		return SMTP_ERR_INVALID_STATE;
+	}
+
+	for (Domain = Scheduler->Domains[Value % SMTP_SCHEDULER_BUCKETS]; Domain; Domain = Domain->Next) {
+		if (strcasecmp(Domain->Name, Mail->Domain) == 0)
+			break;
+	}
+
+	if (!Domain) {
+
+		Length = strlen(Mail->Domain) + 1;
+		Domain = malloc(sizeof(SchedulerDomain) + Length);
+		if (!Domain) {
+			pthread_mutex_unlock(&Scheduler->Lock);
+			return SMTP_ERR_BUFFER;
+		}
+
+		Domain->Name = (char *)(Domain + 1);
+		memcpy(Domain->Name, Mail->Domain, Length);
+		Domain->Hash = Value;
+		Domain->First = Domain->Last = NULL;
+		Domain->Pending = Domain->Active = 0;
+		Domain->Queued = 0;
+
+		Domain->Next = Scheduler->Domains[Value % SMTP_SCHEDULER_BUCKETS];
+		Scheduler->Domains[Value % SMTP_SCHEDULER_BUCKETS] = Domain;
+	}
+
+	if (Domain->Last)
+		Domain->Last->Next = Mail;
+	else
+		Domain->First = Mail;
+	Domain->Last = Mail;
+	Domain->Pending++;
+	Scheduler->Stats.Queued++;
+
+	/* Each domain starts out on the same worker's queue, which keeps its connections together. */
+	if (!Domain->Queued && Domain->Active < SMTP_SCHEDULER_DOMAIN_LIMIT)
+		MakeRunnable(Scheduler, Domain, &Scheduler->Workers[Value % Scheduler->WorkerCount]);
+
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	return SMTP_ERR_SUCCESS;
+}
+
+void SMTPSchedulerGetStats(SMTPScheduler *Scheduler, SMTPSchedulerStats *Result)
+{
+	pthread_mutex_lock(&Scheduler->Lock);
+	*Result = Scheduler->Stats;
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	return;
+}
+
+/* Waits for everything queued to be sent and then stops the workers. */
+void SMTPSchedulerFree(SMTPScheduler *Scheduler)
+{
+	unsigned int Loop;
+
+	pthread_mutex_lock(&Scheduler->Lock);
+	Scheduler->Stopping = 1;
+	pthread_cond_broadcast(&Scheduler->Signal);
+	pthread_mutex_unlock(&Scheduler->Lock);
+
+	for (Loop = 0; Loop < Scheduler->WorkerCount; Loop++)
+		pthread_join(Scheduler->Workers[Loop].Thread, NULL);
+
+	for (Loop = 0; Loop < Scheduler->WorkerCount; Loop++)
+		pthread_mutex_destroy(&Scheduler->Workers[Loop].Lock);
+	pthread_mutex_destroy(&Scheduler->Lock);
+	pthread_cond_destroy(&Scheduler->Signal);
+	free(Scheduler->Workers);
+
+	return;
+}
@@ -0,0 +1,68 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+
+#include "ssmtp.h"
+
+#define SMTP_SCHEDULER_BUCKETS		256
+
+/* The most workers delivering to one domain at once. */
+#ifndef SMTP_SCHEDULER_DOMAIN_LIMIT
+	#define SMTP_SCHEDULER_DOMAIN_LIMIT	2
+#endif
+
+/* How many e-mails a worker sends over one connection before letting go of the domain. */
+#ifndef SMTP_SCHEDULER_BATCH
+	#define SMTP_SCHEDULER_BATCH		16
+#endif
+
+/* A single e-mail. Everything pointed to must last until Done is called. */
+typedef struct SMTPMail {
+	const char *Domain;		/* Where every recipient is. */
+	const char *From;
+	const int *Types;
+	const char **Addresses;
+	unsigned int Count;
+	int *Results;			/* Receives the outcome of each recipient. */
+	const char *Subject;
+	const char *Body;
+	SMTPAttach *Attachments;
+	SMTPMessage *Message;	/* Sent instead of the three above when set. */
+	void (*Done)(struct SMTPMail *Mail, int Result);	/* Called from a worker thread. */
+	void *Data;
+
+	struct SMTPMail *Next;
+} SMTPMail;
+
+typedef struct SMTPSchedulerStats {
+	unsigned long Queued;
+	unsigned long Delivered;
+	unsigned long Failed;
+	unsigned long Stolen;	/* Domains taken from another worker's queue. */
+} SMTPSchedulerStats;
+
+struct SchedulerDomain;
+struct SchedulerWorker;
+
+typedef struct SMTPScheduler {
+	const char *HeloLine;
+
+	unsigned int WorkerCount;
+	struct SchedulerWorker *Workers;
+
+	/* Protects everything below. */
+	pthread_mutex_t Lock;
+	pthread_cond_t Signal;
+	struct SchedulerDomain *Domains[SMTP_SCHEDULER_BUCKETS];
+	unsigned int Runnable;		/* Domains waiting in the workers' queues. */
+	int Stopping;
+	SMTPSchedulerStats Stats;
+} SMTPScheduler;
+
+int SMTPSchedulerInit(SMTPScheduler *Scheduler, const char *HeloLine, unsigned int Workers);
+int SMTPSchedulerSubmit(SMTPScheduler *Scheduler, SMTPMail *Mail);
+void SMTPSchedulerGetStats(SMTPScheduler *Scheduler, SMTPSchedulerStats *Stats);
+void SMTPSchedulerFree(SMTPScheduler *Scheduler);
+
+#endif
@@ -26,27 +26,53 @@
 	#define _WIN32_WINNT	0x0501
 	#include <Ws2tcpip.h>
 	#include <Windns.h>
+#else
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/time.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <arpa/inet.h>
+	#include <netdb.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/uio.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <poll.h>
+	#include <errno.h>
+	#ifdef __linux__
+		#include <linux/errqueue.h>
+	#endif
+
+	#define SOCKET_ERROR	-1
+	#define INVALID_SOCKET	-1
+	#define SD_SEND			SHUT_WR
+	#define closesocket		close
 #endif
 
-#include <string.h>
+/* Writing to a connection the server has closed shouldn't kill the program. */
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL	0
+#endif
 
-/* Enables 64-bit time functions. */
+#include <string.h>
 #ifdef _WIN32
-	#if __MSVCRT_VERSION__ <= 0x0601
-		#undef __MSVCRT_VERSION__
-		#define __MSVCRT_VERSION__	0x0601
-	#endif
+	#define strncasecmp	_strnicmp
+#else
+	#include <strings.h>
 #endif
 
 #include <time.h>
-#include <stdlib.h>	/* For the MIME boundary. */
+#include <stdlib.h>
+#include <limits.h>
 
 /*
 	Using MinGW's snprintf greatly increases the size of the executable so we don't make use of it.
 	They return different return codes though.
 */
+#include <stdio.h>
 #ifdef _WIN32
-	#include <stdio.h>
 	#define __snprintf	_snprintf
 #else
 	#define __snprintf	snprintf
@@ -55,15 +81,41 @@
 #include "ssmtp.h"
 #include "cbuffer.h"
 #include "base64.h"
+#include "body.h"
+#include "qp.h"
+#include "reply.h"
+#include "headers.h"
+#ifndef _WIN32
+	#include "dnscache.h"
+#endif
+
+/* STARTTLS needs OpenSSL, so it's only built in when asked for. Not on Windows. */
+#if defined(SMTP_TLS) && !defined(_WIN32)
+	#define STARTTLS
+	#include "tls.h"
+#endif
 
 static const char EndOfLine[] = "\r\n";
 static const char EndOfData[] = "\r\n.\r\n";
 
-/* Primary used to free the address buffer. */
+/* Primary used to free the message's arena. */
 static int Shutdown(SMTPConn *Conn)
 {
-	if (Conn->AddressBuffer != NULL)
-		free(Conn->AddressBuffer);
+	SMTPArenaFree(&Conn->Arena);
+	Conn->Addresses = Conn->LastAddress = NULL;
+
+	if (Conn->RecvBuffer != NULL) {
+		free(Conn->RecvBuffer);
+		Conn->RecvBuffer = NULL;
+	}
+	Conn->RecvStart = Conn->RecvEnd = Conn->RecvSize = 0;
+
+	#ifdef STARTTLS
+	if (Conn->TLS) {
+		TLSClose(Conn->TLS);
+		Conn->TLS = NULL;
+	}
+	#endif
 
 	closesocket(Conn->Socket);
 	Conn->State = SMTP_DISCONNECTED;
@@ -71,14 +123,48 @@ static int Shutdown(SMTPConn *Conn)
 	return 0;
 }
 
+/* Forgets the current message's addresses and anything else it allocated, ready for the next. */
+static void ResetMessage(SMTPConn *Conn)
+{
+	SMTPArenaReset(&Conn->Arena);
+	Conn->Addresses = Conn->LastAddress = NULL;
+
+	return;
+}
+
+/*
+	Everything's written whole, a command or window of them at a time, and then waited on. Left on, Nagle holds
+	back the end of a write that takes more than one segment until the server's delayed ACK, on every reply.
+*/
+static void DisableNagle(SMTPConn *Conn)
+{
+	int Enable = 1;
+
+	setsockopt(Conn->Socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&Enable, sizeof(Enable));
+
+	return;
+}
+
 static int SendCommand(SMTPConn *Conn, const char *Data, int Size)
 {
 	unsigned int Offset = 0;
 	int Return;
 
+	#ifdef STARTTLS
+	/* Unless the kernel's doing the encryption, everything goes through OpenSSL. */
+	if (Conn->TLS && !TLSOffloaded(Conn->TLS)) {
+		if (TLSSend(Conn->TLS, Data, Size) != 0) {
+			Shutdown(Conn);
+			return -1;
+		}
+		Conn->TotalSent += Size;
+		return 0;
+	}
+	#endif
+
 	while (Offset < Size) {
 
-		Return = send(Conn->Socket, Data + Offset, Size - Offset, 0);
+		Return = send(Conn->Socket, Data + Offset, Size - Offset, MSG_NOSIGNAL);
 		if (Return == SOCKET_ERROR) {
 			Shutdown(Conn);
 			return -1;
@@ -91,523 +177,2306 @@ static int SendCommand(SMTPConn *Conn, const char *Data, int Size)
 	return 0;
 }
 
-static int ReadReply(SMTPConn *Conn, char *Reply, int ReplySize)
+#ifdef _WIN32
+/* Each piece is simply sent in turn. */
+static int SendVector(SMTPConn *Conn, const CVec *Vecs, unsigned int Count)
 {
-	int Return, Done, Loop, Char, LineSize, Multiline;
-	char Buffer[SMTP_BUFFER_SIZE];
+	unsigned int Loop;
 
-	Done = Char = LineSize = Multiline = 0;
+	for (Loop = 0; Loop < Count; Loop++) {
+		if (SendCommand(Conn, Vecs[Loop].Data, Vecs[Loop].Size) != 0)
+			return -1;
+	}
 
-	while (!Done) {
+	return 0;
+}
+#else
+/* MSG_ZEROCOPY needs Linux 4.14 or later. */
+#if SMTP_ZEROCOPY_SIZE > 0 && defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+	#define ZEROCOPY
+#endif
 
-		Return = recv(Conn->Socket, Buffer, sizeof(Buffer), 0);
-		switch (Return) {
-			case 0:
-			case SOCKET_ERROR:
-				goto Err;
-		}
+/* Sends every piece, carrying on from wherever a partial send stopped. */
+static int SendAll(SMTPConn *Conn, struct iovec *IOVecs, unsigned int Count, int Flags)
+{
+	struct msghdr Message;
+	ssize_t Return;
+	#ifdef STARTTLS
+	unsigned int Loop;
 
-		Conn->TotalRecv += Return;
+	if (Conn->TLS && !TLSOffloaded(Conn->TLS)) {
+		for (Loop = 0; Loop < Count; Loop++) {
+			if (SendCommand(Conn, IOVecs[Loop].iov_base, IOVecs[Loop].iov_len) != 0)
+				return -1;
+		}
+		return 0;
+	}
+	#endif
 
-		/* Loop through the bytes recevied. */
-		for (Loop = 0; Loop < Return; Loop++) {
+	memset(&Message, 0, sizeof(Message));
+	Message.msg_iov = IOVecs;
+	Message.msg_iovlen = Count;
 
-			/* Copy what we can into the passed buffer. */
-			if (ReplySize > 1) {
-				*Reply = Buffer[Loop];
-				Reply++;
-				ReplySize--;
-			}
+	while (Message.msg_iovlen > 0) {
 
-			/* Ensure the first three bytes of a line are digits as per the spec. */
-			if (LineSize < 3) {
-				if (Buffer[Loop] < '0' || Buffer[Loop] > '9')
-					goto Err;
-			}
-			/* Check for a hypen as the multi-line indicator. */
-			else if (LineSize == 3) {
-				if (Buffer[Loop] == '-')
-					Multiline = 1;
+		Return = sendmsg(Conn->Socket, &Message, Flags);
+		if (Return == SOCKET_ERROR) {
+			#ifdef ZEROCOPY
+			/* Too much is already waiting on the kernel, so it's copied instead. */
+			if (errno == ENOBUFS && (Flags & MSG_ZEROCOPY)) {
+				Flags &= ~MSG_ZEROCOPY;
+				continue;
 			}
+			#endif
+			Shutdown(Conn);
+			return -1;
+		}
 
-			LineSize++;
-
-			/* Check for the end of line. */
-			if (Buffer[Loop] == EndOfLine[Char]) {
-				Char++;
-				if (Char >= sizeof(EndOfLine) - 1) {
-					/* End of line located. */
-
-					Char = LineSize = 0;
+		#ifdef ZEROCOPY
+		if (Flags & MSG_ZEROCOPY)
+			Conn->ZeroCopySent++;
+		#endif
+		Conn->TotalSent += Return;
 
-					if (!Multiline) {
-						Done = 1;
-						break;
-					}
+		while (Message.msg_iovlen > 0 && (size_t)Return >= Message.msg_iov->iov_len) {
+			Return -= Message.msg_iov->iov_len;
+			Message.msg_iov++;
+			Message.msg_iovlen--;
+		}
 
-					Multiline = 0;
-				}
-			}
-			else
-				Char = 0;
+		if (Message.msg_iovlen > 0) {
+			Message.msg_iov->iov_base = (char *)Message.msg_iov->iov_base + Return;
+			Message.msg_iov->iov_len -= Return;
 		}
 
 	}
 
-	*Reply = '\0';
 	return 0;
-
-	Err:
-	*Reply = '\0';
-	Shutdown(Conn);
-	return -1;
-
 }
 
-/* On most systems, strftime() is easier but the %z specifier isn't standardized and deals with the locale. */
-static int GenerateDate(SMTPConn *Conn, CSendBuffer *CBuffer)
+/*
+	Gathers the pieces into as few sends as possible. Large pieces from outside the send buffer may go out on
+	their own with MSG_ZEROCOPY, as the buffer itself is reused as soon as this returns. Never with TLS, as kTLS
+	doesn't take it.
+*/
+static int SendVector(SMTPConn *Conn, const CVec *Vecs, unsigned int Count)
 {
-	#ifndef _WIN32
-	time_t RawTime;
-	#else
-	__time64_t RawTime;
+	struct iovec IOVecs[CBUFFER_VECS + 1];	/* Room for a BDAT command ahead of a full buffer. */
+	unsigned int Loop, Used;
+	#ifdef ZEROCOPY
+	int Enable;
 	#endif
-	struct tm GMT, Local, *TimeInfo;
-	char Buffer[38];	/* Can store the largest size possible including the NULL byte. Would require a ten digit year! */
-	int Return;
 
-	const char *Days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
-	const char *Months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	Used = 0;
+	for (Loop = 0; Loop < Count; Loop++) {
 
-	RawTime =
-	#ifndef _WIN32
-		time(NULL);
-	#else
-		_time64(NULL);
-	#endif
-	if (RawTime == -1)
-		return 1;
+		#ifdef ZEROCOPY
+		if (!Conn->TLS && Vecs[Loop].Size >= SMTP_ZEROCOPY_SIZE && Vecs[Loop].Size > SMTP_SEND_BUFFER_SIZE) {
 
-	TimeInfo =
-	#ifndef _WIN32
-		gmtime(&RawTime);
-	#else
-		(struct tm *)_gmtime64(&RawTime);
-	#endif
-	GMT = *TimeInfo;
+			Enable = 1;
+			if (setsockopt(Conn->Socket, SOL_SOCKET, SO_ZEROCOPY, &Enable, sizeof(Enable)) == 0) {
 
-	TimeInfo =
-	#ifndef _WIN32
-		localtime(&RawTime);
-	#else
-		(struct tm *)_localtime64(&RawTime);
-	#endif
-	Local = *TimeInfo;
-
-	/* I'm not entirely sure this works correctly for all timezones. */
-	if (Local.tm_isdst > 0) {
-		GMT.tm_hour += 2;
-		if (Local.tm_hour > 12)
-			GMT.tm_hour += 24;
-	} else if (Local.tm_hour >= 12)
-		GMT.tm_hour += 24;
-
-	Return = __snprintf(Buffer, sizeof(Buffer),
-		"%s, %.2d %s %d %.2d:%.2d:%.2d %+03i00",
-		Days[Local.tm_wday], Local.tm_mday, Months[Local.tm_mon], Local.tm_year + 1900,
-		Local.tm_hour, Local.tm_min, Local.tm_sec,
-		GMT.tm_hour - Local.tm_hour);
-	#ifdef _WIN32
-	if (Return <= 0)
-	#else
-	if (Return >= sizeof(Buffer) || Return <= 0)
-	#endif
-		return 1;
+				if (Used > 0 && SendAll(Conn, IOVecs, Used, MSG_NOSIGNAL) != 0)
+					return -1;
+				Used = 0;
 
-	if (CSendStrings(CBuffer, "Date: ", Buffer, EndOfLine, NULL) != 0)
-		return -1;
+				IOVecs[0].iov_base = (void *)Vecs[Loop].Data;
+				IOVecs[0].iov_len = Vecs[Loop].Size;
+				if (SendAll(Conn, IOVecs, 1, MSG_NOSIGNAL | MSG_ZEROCOPY) != 0)
+					return -1;
+				continue;
+			}
+
+		}
+		#endif
+
+		IOVecs[Used].iov_base = (void *)Vecs[Loop].Data;
+		IOVecs[Used].iov_len = Vecs[Loop].Size;
+		Used++;
+	}
+
+	if (Used > 0)
+		return SendAll(Conn, IOVecs, Used, MSG_NOSIGNAL);
 
 	return 0;
 }
+#endif
 
-static int MIMEData(CSendBuffer *CBuffer, const char *Body, SMTPAttach *Attachments)
+/*
+	Waits for the kernel to let go of everything sent with MSG_ZEROCOPY, so the caller is free to change it.
+	Once the server's replied to the data this shouldn't take long.
+*/
+static int WaitZeroCopy(SMTPConn *Conn)
 {
-	char BoundaryString[64] = "Boundary";
+	#ifdef ZEROCOPY
+	char Control[128];
+	struct msghdr Message;
+	struct cmsghdr *Header;
+	struct sock_extended_err *Error;
+	struct pollfd Poll;
 
-	char *Char;
-	unsigned int Var;
+	while (Conn->ZeroCopyDone != Conn->ZeroCopySent) {
 
-	unsigned char DataBuffer[SMTP_BUFFER_SIZE];
-	char Base64Buffer[SMTP_BUFFER_SIZE];
+		memset(&Message, 0, sizeof(Message));
+		Message.msg_control = Control;
+		Message.msg_controllen = sizeof(Control);
 
-	int Return, Done;
-	B64Stream B64S;
-	unsigned int PrintAmount;
+		/* Reading the error queue never blocks, so wait for something to arrive on it. */
+		if (recvmsg(Conn->Socket, &Message, MSG_ERRQUEUE) == SOCKET_ERROR) {
 
-	/* Generate a boundary string and check that it's not in the body. */
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
 
-	srand(time(NULL));
-	Char = &BoundaryString[strlen(BoundaryString)];
+			Poll.fd = Conn->Socket;
+			Poll.events = 0;
+			if (poll(&Poll, 1, SMTP_BLOCKING_TIME) <= 0)
+				return -1;
+			continue;
+		}
 
-	for (;;) {
+		for (Header = CMSG_FIRSTHDR(&Message); Header; Header = CMSG_NXTHDR(&Message, Header)) {
 
-		for (Var = 0; Var < SMTP_BOUNDARY_RAND_LENGTH; Var++)
-			Char[Var] = rand() % 10 + '0';
-		Char[Var] = '\0';
+			if (!(Header->cmsg_level == SOL_IP && Header->cmsg_type == IP_RECVERR) &&
+				!(Header->cmsg_level == SOL_IPV6 && Header->cmsg_type == IPV6_RECVERR))
+				continue;
 
-		if (strstr(Body, BoundaryString) == NULL)
-			break;
+			/* Completions arrive in order, each covering a range of sends. */
+			Error = (struct sock_extended_err *)CMSG_DATA(Header);
+			if (Error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+				Conn->ZeroCopyDone = Error->ee_data + 1;
+
+		}
 
 	}
+	#else
+	(void)Conn;
+	#endif
 
-	/* Headers. */
+	return 0;
+}
 
-	if (CSendStrings(CBuffer,
-		"MIME-Version: 1.0", EndOfLine,
-		"Content-Type: multipart/mixed; boundary=", BoundaryString, EndOfLine,
-		EndOfLine,
-		NULL) != 0)
-		return SMTP_ERR_PROTOCOL;
+/* Makes room for more data, either by moving the unread data to the front or growing the buffer. */
+static int GrowRecvBuffer(SMTPConn *Conn, unsigned int Keep, SMTPReply *Replies, unsigned int Count)
+{
+	char *NewBuffer;
+	unsigned int NewSize;
+
+	if (Keep > 0) {
+		memmove(Conn->RecvBuffer, &Conn->RecvBuffer[Keep], Conn->RecvEnd - Keep);
+		SMTPRebaseReplies(Replies, Count, &Conn->RecvBuffer[Keep], Conn->RecvBuffer);
+		Conn->RecvStart -= Keep;
+		Conn->RecvEnd -= Keep;
+		return 0;
+	}
 
-	/* Start with the body. */
+	NewSize = Conn->RecvSize ? Conn->RecvSize * 2 : SMTP_BUFFER_SIZE;
+	if (NewSize > SMTP_RECV_LIMIT)
+		return -1;
 
-	if (CSendStrings(CBuffer, "--", BoundaryString, EndOfLine,
-		"Content-Type: text/plain", EndOfLine,
-		EndOfLine,
-		Body, EndOfLine,
-		NULL) != 0)
-		return SMTP_ERR_PROTOCOL;
+	NewBuffer = malloc(NewSize);
+	if (!NewBuffer)
+		return -1;
 
-	/* Primary loop for the files. */
+	if (Conn->RecvBuffer) {
+		memcpy(NewBuffer, Conn->RecvBuffer, Conn->RecvEnd);
+		SMTPRebaseReplies(Replies, Count, Conn->RecvBuffer, NewBuffer);
+		free(Conn->RecvBuffer);
+	}
 
-	while (Attachments != NULL) {
+	Conn->RecvBuffer = NewBuffer;
+	Conn->RecvSize = NewSize;
 
-		/* File header. */
-		if (CSendStrings(CBuffer, "--", BoundaryString, EndOfLine,
-			"Content-Type: ", (Attachments->MIMEType ? Attachments->MIMEType : "application/octet-stream"), EndOfLine,
-			"Content-Disposition: attachment",
-			NULL) != 0)
-			return SMTP_ERR_PROTOCOL;
+	return 0;
+}
 
-		if (Attachments->Filename != NULL) {
-			if (CSendStrings(CBuffer, "; filename=", Attachments->Filename,
-			NULL) != 0)
-			return SMTP_ERR_PROTOCOL;
-		}
+/*
+	Waits for several pipelined replies at once. Anything received after them is kept for the next call.
+	The replies point into the connection's buffer and so are only valid until the next read.
+*/
+static int ReadReplies(SMTPConn *Conn, SMTPReply *Replies, unsigned int Count)
+{
+	unsigned int Done, Start;
+	int Return;
 
-		if (CSendStrings(CBuffer,
-			EndOfLine,
-			"Content-Transfer-Encoding: base64",
-			EndOfLine,
-			EndOfLine,
-			NULL) != 0)
-			return SMTP_ERR_PROTOCOL;
+	/* Everything's been read, so start over at the front. */
+	if (Conn->RecvStart >= Conn->RecvEnd)
+		Conn->RecvStart = Conn->RecvEnd = 0;
 
-		InitEncode64(&B64S);
-		Done = Var = 0;
+	Start = Conn->RecvStart;
+	Done = 0;
+	SMTPInitReply(&Replies[0]);
 
-		/* Base64 data. */
-		while (!Done) {
+	for (;;) {
 
-			Return = Attachments->Read(Attachments->ReadData, DataBuffer, sizeof(DataBuffer));
-			switch (Return) {
-				case -1:
-					return SMTP_ERR_DATA;
-				case 0:
-					Done = 1;	/* Do one last run to flush. */
-			}
+		/* Parse what we have. */
+		while (Done < Count) {
 
-			B64S.NextIn = DataBuffer;
-			B64S.AvailIn = Return;
+			Return = SMTPParseReply(&Conn->RecvBuffer[Conn->RecvStart], Conn->RecvEnd - Conn->RecvStart, &Replies[Done]);
+			if (Return == -1)
+				goto Err;
+			else if (Return == 0)
+				break;
 
-			while (B64S.AvailIn > 0 || Done) {
+			Conn->RecvStart += Replies[Done].Size;
+			Done++;
 
-				B64S.NextOut = Base64Buffer;
-				B64S.AvailOut = sizeof(Base64Buffer);
+			if (Done < Count)
+				SMTPInitReply(&Replies[Done]);
+		}
 
-				Encode64(&B64S, Done);
+		if (Done >= Count)
+			return 0;
 
-				/* Limit the line's length. */
-				Return = sizeof(Base64Buffer) - B64S.AvailOut;
-				Char = Base64Buffer;
+		if (Conn->RecvEnd >= Conn->RecvSize) {
+			Return = GrowRecvBuffer(Conn, Start, Replies, Done + 1);
+			if (Return != 0)
+				goto Err;
+			Start = 0;
+		}
 
-				while (Return > 0) {
+		#ifdef STARTTLS
+		if (Conn->TLS)
+			Return = TLSRecv(Conn->TLS, &Conn->RecvBuffer[Conn->RecvEnd], Conn->RecvSize - Conn->RecvEnd);
+		else
+		#endif
+		Return = recv(Conn->Socket, &Conn->RecvBuffer[Conn->RecvEnd], Conn->RecvSize - Conn->RecvEnd, 0);
+		switch (Return) {
+			case 0:
+			case SOCKET_ERROR:
+				goto Err;
+		}
 
-					PrintAmount = SMTP_LINE_LENGTH - Var;
-					if (PrintAmount > Return)
-						PrintAmount = Return;
+		Conn->TotalRecv += Return;
+		Conn->RecvEnd += Return;
+	}
 
-					if (CSend(CBuffer, Char, PrintAmount) != 0) {
-						Attachments->Close(Attachments->ReadData);
-						return SMTP_ERR_PROTOCOL;
-					}
+	Err:
+	Shutdown(Conn);
+	return -1;
+}
 
-					Var += PrintAmount;
-					if (Var >= SMTP_LINE_LENGTH) {
+static int ReadReply(SMTPConn *Conn, SMTPReply *Reply)
+{
+	return ReadReplies(Conn, Reply, 1);
+}
 
-						if (CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0) {
-							Attachments->Close(Attachments->ReadData);
-							return SMTP_ERR_PROTOCOL;
-						}
-						Var = 0;
+/* Writes the Date header from CurrentDate(). Returns 1, leaving the header out, if the time couldn't be had. */
+static int GenerateDate(CSendBuffer *CBuffer)
+{
+	const char *Date;
 
-					}
+	Date = CurrentDate();
+	if (!Date)
+		return 1;
 
-					Return -= PrintAmount;
-					Char += PrintAmount;
+	if (CSendStrings(CBuffer, "Date: ", Date, EndOfLine, NULL) != 0)
+		return -1;
 
-				}
+	return 0;
+}
 
-				if (Done)
-					break;
-			}
+/* Encodes the input straight into the send buffer, flushing it whenever it fills. */
+static int SendBase64(CSendBuffer *CBuffer, B64Stream *Stream, int Finished)
+{
+	int Return;
 
-		}
+	for (;;) {
 
-		if (Var != 0 && CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
-			return SMTP_ERR_PROTOCOL;
+		Stream->NextOut = &CBuffer->Data[CBuffer->Cursor];
+		Stream->AvailOut = CBuffer->Size - CBuffer->Cursor;
 
-		/* Next. */
-		Attachments = Attachments->Next;
-	}
+		Encode64(Stream, Finished);
 
-	/* End. */
-	if (CSendStrings(CBuffer, "--", BoundaryString, "--",
-		NULL) != 0)
-		return SMTP_ERR_PROTOCOL;
+		CBuffer->Cursor = CBuffer->Size - Stream->AvailOut;
+		if (Stream->AvailOut != 0)
+			break;
+
+		Return = CFlush(CBuffer);
+		if (Return != 0)
+			return Return;
+
+	}
 
 	return 0;
 }
 
-int SMTPData(SMTPConn *Conn, const char *Subject, const char *Body, SMTPAttach *Attachments)
+/* Encodes the input straight into the send buffer, flushing it whenever it fills. */
+static int SendQP(CSendBuffer *CBuffer, QPStream *Stream, int Finished)
 {
-	char Buffer[SMTP_BUFFER_SIZE] = "DATA\r\n";
-	CSendBuffer CBuffer;
-	int AddressType, Var;
-	unsigned int Offset;
-
-	if (Conn->State != SMTP_READY)
-		return SMTP_ERR_INVALID_STATE;
+	int Return;
 
-	if (strstr(Body, EndOfData) != NULL)
-		return SMTP_ERR_DATA;
+	for (;;) {
 
-	if (SendCommand(Conn, Buffer, strlen(Buffer)) != 0 ||
-		ReadReply(Conn, Buffer, sizeof(Buffer)) != 0)
-		return SMTP_ERR_PROTOCOL;
+		Stream->NextOut = &CBuffer->Data[CBuffer->Cursor];
+		Stream->AvailOut = CBuffer->Size - CBuffer->Cursor;
 
-	if (atoi(Buffer) != 354)
-		return SMTP_ERR_FAILURE;
+		EncodeQP(Stream, Finished);
 
-	/* Set up the cached buffer. */
-	CInit(&CBuffer, Buffer, sizeof(Buffer), (int (*)(void *, char *, unsigned int))SendCommand, Conn);
+		CBuffer->Cursor = CBuffer->Size - Stream->AvailOut;
+		if (Stream->AvailOut != 0)
+			break;
 
-	/* Ready to send, so generate the headers. */
+		Return = CFlush(CBuffer);
+		if (Return != 0)
+			return Return;
 
-	/* Date. */
-	GenerateDate(Conn, &CBuffer);
+	}
 
-	/* Addresses. */
-	AddressType = -1;
-	Offset = 0;
+	return 0;
+}
 
-	while (Offset < Conn->AddressBufferCursor) {
+/* Used in place of sending when only the size of a message is wanted. Data points to the running total. */
+static int CountVecs(void *Data, const CVec *Vecs, unsigned int Count)
+{
+	unsigned long long *Size = Data;
+	unsigned int Loop;
 
-		if (Conn->AddressBuffer[Offset] != AddressType) {
+	for (Loop = 0; Loop < Count; Loop++)
+		*Size += Vecs[Loop].Size;
 
-			if (AddressType != -1) {
-				if (CSend(&CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
-					return SMTP_ERR_PROTOCOL;
-			}
+	return 0;
+}
 
-			AddressType = Conn->AddressBuffer[Offset];
-			switch (AddressType) {
-				case SMTP_ADDRESS_FROM:
-					Var = CSendStrings(&CBuffer, "From: ", NULL);
-					break;
-				case SMTP_ADDRESS_TO:
-					Var = CSendStrings(&CBuffer, "To: ", NULL);
-					break;
-				case SMTP_ADDRESS_CC:
-					Var = CSendStrings(&CBuffer, "Cc: ", NULL);
-					break;
-				default:
-					return SMTP_ERR_BUFFER;
-			}
+enum TransferEncodings {
+	ENCODING_7BIT,
+	ENCODING_8BIT,
+	ENCODING_QP,
+	ENCODING_BASE64
+};
 
-		}
-		else
-			Var = CSendStrings(&CBuffer, ",", EndOfLine, " ", NULL);
+static const char *EncodingNames[] = { "7bit", "8bit", "quoted-printable", "base64" };
 
-		if (Var != 0)
-			return SMTP_ERR_PROTOCOL;
+/*
+	Picks the smallest encoding that's safe for a part from its scan. Text may have its line endings changed and
+	is never Base64 encoded. EightBit is set when 8BITMIME was asked for, so octets over 127 can be sent as they are.
+*/
+static int ChooseEncoding(const QPScan *Scan, unsigned int Size, int Text, int EightBit)
+{
+	unsigned long long QPSize, B64Size;
 
-		Var = strlen(&Conn->AddressBuffer[Offset + 1]);
-		if (CSend(&CBuffer, &Conn->AddressBuffer[Offset + 1], Var) != 0)
-			return SMTP_ERR_PROTOCOL;
-		Offset += Var + 2;
+	if (!Scan->Controls && Scan->LongestLine <= BODY_LINE_LIMIT && (Text || !Scan->LoneBreaks)) {
+		if (!Scan->HighBytes)
+			return ENCODING_7BIT;
+		if (EightBit)
+			return ENCODING_8BIT;
 	}
 
-	if (CSend(&CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
-		return SMTP_ERR_PROTOCOL;
+	if (Text)
+		return ENCODING_QP;
 
-	/* Subject line if one was provided. */
-	if (Subject) {
-		if (CSendStrings(&CBuffer, "Subject: ", Subject, EndOfLine, NULL) != 0)
+	/* Each escape takes three characters and every line is broken up. */
+	QPSize = Size + 2ULL * Scan->Escapes;
+	QPSize += QPSize / (QP_LINE_LENGTH - 1) * 3;
+	B64Size = (Size + 2ULL) / BASE64_IN_SIZE * BASE64_OUT_SIZE;
+	B64Size += B64Size / SMTP_LINE_LENGTH * 2;
+
+	return QPSize < B64Size ? ENCODING_QP : ENCODING_BASE64;
+}
+
+/* Sends a part held in memory, ending with the line break the boundary after it takes as its own. */
+static int WritePart(CSendBuffer *CBuffer, const unsigned char *Data, unsigned int Size, int Encoding, int Text, int Stuffing)
+{
+	BodyStream Stream;
+	QPStream QPS;
+	B64Stream B64S;
+	unsigned long long Encoded;
+
+	switch (Encoding) {
+
+		case ENCODING_7BIT:
+		case ENCODING_8BIT:
+			InitBody(&Stream, Stuffing);
+			if (SendBody(CBuffer, &Stream, (const char *)Data, Size, 1) != 0 ||
+				CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
+				return SMTP_ERR_PROTOCOL;
+			break;
+
+		case ENCODING_QP:
+			InitEncodeQP(&QPS, Text);
+			QPS.NextIn = (unsigned char *)Data;
+			QPS.AvailIn = Size;
+			if (SendQP(CBuffer, &QPS, 1) != 0)
+				return SMTP_ERR_PROTOCOL;
+			break;
+
+		default:
+			/* When only counting, Base64 needn't be worked through. Every line, the last included, ends with a CRLF. */
+			if (CBuffer->VecCallback == CountVecs) {
+				Encoded = (Size + BASE64_IN_SIZE - 1ULL) / BASE64_IN_SIZE * BASE64_OUT_SIZE;
+				*(unsigned long long *)CBuffer->CallbackData += Encoded + (Encoded + SMTP_LINE_LENGTH - 1) / SMTP_LINE_LENGTH * 2;
+				break;
+			}
+
+			InitEncode64Lines(&B64S, SMTP_LINE_LENGTH);
+			B64S.NextIn = (unsigned char *)Data;
+			B64S.AvailIn = Size;
+			if (SendBase64(CBuffer, &B64S, 1) != 0)
+				return SMTP_ERR_PROTOCOL;
+
+	}
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Either a string or read in pieces, like an attachment. */
+typedef struct MessageBody {
+	const char *Data;
+	int (*Read)(void *, void *, unsigned int);
+	void *ReadData;
+} MessageBody;
+
+/* Sends the body, a piece at a time if it's being read. */
+static int WriteBody(CSendBuffer *CBuffer, const MessageBody *Body, int Stuffing)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	BodyStream Stream;
+	int Return;
+
+	InitBody(&Stream, Stuffing);
+
+	if (!Body->Read)
+		return SendBody(CBuffer, &Stream, Body->Data, strlen(Body->Data), 1) != 0 ? SMTP_ERR_PROTOCOL : SMTP_ERR_SUCCESS;
+
+	/* The buffer's reused for every piece. */
+	Stream.Copy = 1;
+
+	do {
+
+		Return = Body->Read(Body->ReadData, Buffer, sizeof(Buffer));
+		if (Return < 0)
+			return SMTP_ERR_DATA;
+
+		if (SendBody(CBuffer, &Stream, Buffer, Return, Return == 0) != 0)
 			return SMTP_ERR_PROTOCOL;
+
+	} while (Return > 0);
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Labels a text body held in memory, which is taken to be UTF-8 if it isn't ASCII. */
+static int SendTextHeaders(CSendBuffer *CBuffer, const QPScan *Scan, int Encoding)
+{
+	if (CSendStrings(CBuffer,
+		"Content-Type: text/plain", Scan->HighBytes ? "; charset=UTF-8" : "", EndOfLine,
+		"Content-Transfer-Encoding: ", EncodingNames[Encoding], EndOfLine,
+		EndOfLine,
+		NULL) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/*
+	Labels and sends a body being read. It can't be looked over first, so it's taken to be UTF-8. It goes as it is
+	when 8BITMIME was asked for and is quoted-printable encoded otherwise, in case it isn't ASCII.
+*/
+static int WriteReadBody(CSendBuffer *CBuffer, const MessageBody *Body, int Stuffing, int EightBit)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	QPStream QPS;
+	unsigned int Kept;
+	int Return;
+
+	if (CSendStrings(CBuffer,
+		"Content-Type: text/plain; charset=UTF-8", EndOfLine,
+		"Content-Transfer-Encoding: ", EncodingNames[EightBit ? ENCODING_8BIT : ENCODING_QP], EndOfLine,
+		EndOfLine,
+		NULL) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	if (EightBit) {
+		Return = WriteBody(CBuffer, Body, Stuffing);
+		if (Return != SMTP_ERR_SUCCESS)
+			return Return;
+		return CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0 ? SMTP_ERR_PROTOCOL : SMTP_ERR_SUCCESS;
 	}
 
-	if (!Attachments) {
-		/* Main body. */
-		if (CSendStrings(&CBuffer, EndOfLine, Body, NULL) != 0)
+	/* A period starting a line is always encoded, so there's nothing to stuff. */
+	InitEncodeQP(&QPS, 1);
+	Kept = 0;
+
+	do {
+
+		Return = Body->Read(Body->ReadData, &Buffer[Kept], sizeof(Buffer) - Kept);
+		if (Return < 0)
+			return SMTP_ERR_DATA;
+
+		QPS.NextIn = (unsigned char *)Buffer;
+		QPS.AvailIn = Kept + Return;
+		if (SendQP(CBuffer, &QPS, Return == 0) != 0)
 			return SMTP_ERR_PROTOCOL;
+
+		/* A last space, tab or CR is left until what follows it is read. */
+		Kept = QPS.AvailIn;
+		memmove(Buffer, QPS.NextIn, Kept);
+
+	} while (Return > 0);
+
+	return SMTP_ERR_SUCCESS;
+}
+
+static int MIMEData(CSendBuffer *CBuffer, const MessageBody *Body, SMTPAttach *Attachments, int Stuffing, int EightBit)
+{
+	char BoundaryString[64] = "=_";
+	unsigned int Var;
+
+	unsigned char DataBuffer[SMTP_BUFFER_SIZE];
+
+	int Return, Done, Encoding;
+	B64Stream B64S;
+	QPScan Scan;
+
+	/*
+		Generate a boundary string. The body isn't searched, as it may not have been read yet. Instead, "=_" can't
+		appear in anything Base64 or quoted-printable encoded and the rest is long enough that nothing else will
+		have it by chance.
+	*/
+	RandomString(&BoundaryString[2], SMTP_BOUNDARY_RAND_LENGTH);
+	BoundaryString[2 + SMTP_BOUNDARY_RAND_LENGTH] = '\0';
+
+	/* Headers. */
+
+	if (CSendStrings(CBuffer,
+		"MIME-Version: 1.0", EndOfLine,
+		"Content-Type: multipart/mixed; boundary=\"", BoundaryString, "\"", EndOfLine,
+		EndOfLine,
+		NULL) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	/* Start with the body. */
+
+	if (CSendStrings(CBuffer, "--", BoundaryString, EndOfLine, NULL) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	if (Body->Read) {
+		Return = WriteReadBody(CBuffer, Body, Stuffing, EightBit);
+		if (Return != SMTP_ERR_SUCCESS)
+			return Return;
 	}
-	else
-	{
-		Var = MIMEData(&CBuffer, Body, Attachments);
-		if (Var != 0)
-			return Var;
+	else {
+
+		Var = strlen(Body->Data);
+		ScanQP((const unsigned char *)Body->Data, Var, &Scan);
+		Encoding = ChooseEncoding(&Scan, Var, 1, EightBit);
+
+		Return = SendTextHeaders(CBuffer, &Scan, Encoding);
+		if (Return != SMTP_ERR_SUCCESS)
+			return Return;
+
+		Return = WritePart(CBuffer, (const unsigned char *)Body->Data, Var, Encoding, 1, Stuffing);
+		if (Return != SMTP_ERR_SUCCESS)
+			return Return;
+
+	}
+
+	/* Primary loop for the files. */
+
+	while (Attachments != NULL) {
+
+		/* File header. */
+		if (CSendStrings(CBuffer, "--", BoundaryString, EndOfLine,
+			"Content-Type: ", (Attachments->MIMEType ? Attachments->MIMEType : "application/octet-stream"), EndOfLine,
+			"Content-Disposition: attachment",
+			NULL) != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		if (Attachments->Filename != NULL) {
+			if (CSendStrings(CBuffer, "; filename=", Attachments->Filename,
+			NULL) != 0)
+			return SMTP_ERR_PROTOCOL;
+		}
+
+		/* Memory and mapped files are looked over for the smallest encoding. Anything else is Base64. */
+		Encoding = ENCODING_BASE64;
+		if (!Attachments->Read && !Attachments->Encoded) {
+			ScanQP(Attachments->Data, Attachments->Size, &Scan);
+			Encoding = ChooseEncoding(&Scan, Attachments->Size, 0, EightBit);
+		}
+
+		if (CSendStrings(CBuffer,
+			EndOfLine,
+			"Content-Transfer-Encoding: ", EncodingNames[Encoding],
+			EndOfLine,
+			EndOfLine,
+			NULL) != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		InitEncode64Lines(&B64S, SMTP_LINE_LENGTH);
+		Done = 0;
+
+		/* Memory and mapped files are encoded from where they are, all at once. Encoded data is sent as is. */
+		if (!Attachments->Read && Attachments->Encoded) {
+			if (CSendRef(CBuffer, (const char *)Attachments->Data, Attachments->Size) != 0)
+				return SMTP_ERR_PROTOCOL;
+			Done = 1;
+		}
+		else if (!Attachments->Read) {
+			Return = WritePart(CBuffer, Attachments->Data, Attachments->Size, Encoding, 0, Stuffing);
+			if (Return != SMTP_ERR_SUCCESS)
+				return Return;
+			Done = 1;
+		}
+
+		/* Base64 data. */
+		while (!Done) {
+
+			Return = Attachments->Read(Attachments->ReadData, DataBuffer, sizeof(DataBuffer));
+			switch (Return) {
+				case -1:
+					return SMTP_ERR_DATA;
+				case 0:
+					Done = 1;	/* Do one last run to flush. */
+			}
+
+			B64S.NextIn = DataBuffer;
+			B64S.AvailIn = Return;
+
+			if (SendBase64(CBuffer, &B64S, Done) != 0) {
+				Attachments->Close(Attachments->ReadData);
+				return SMTP_ERR_PROTOCOL;
+			}
+
+		}
+
+		/* Next. */
+		Attachments = Attachments->Next;
+	}
+
+	/* End. */
+	if (CSendStrings(CBuffer, "--", BoundaryString, "--", EndOfLine,
+		NULL) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	return 0;
+}
+
+/* The data must last for as long as the attachment is used. */
+void SMTPAttachMemory(SMTPAttach *Attach, char *Filename, char *MIMEType, const void *Data, unsigned int Size)
+{
+	Attach->Filename = Filename;
+	Attach->MIMEType = MIMEType;
+
+	Attach->ReadData = NULL;
+	Attach->Read = NULL;
+	Attach->Close = NULL;
+
+	Attach->Data = Data;
+	Attach->Size = Size;
+	Attach->Mapped = Attach->Encoded = 0;
+
+	Attach->Next = NULL;
+
+	return;
+}
+
+/* Maps the whole file into memory. SMTPAttachFree() unmaps it once it's no longer needed. */
+int SMTPAttachFile(SMTPAttach *Attach, const char *Path, char *Filename, char *MIMEType)
+{
+#ifdef _WIN32
+	HANDLE File, Mapping;
+	LARGE_INTEGER Size;
+	void *View;
+
+	File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File == INVALID_HANDLE_VALUE)
+		return SMTP_ERR_DATA;
+
+	if (!GetFileSizeEx(File, &Size) || Size.QuadPart > UINT_MAX) {
+		CloseHandle(File);
+		return SMTP_ERR_DATA;
+	}
+
+	SMTPAttachMemory(Attach, Filename, MIMEType, NULL, (unsigned int)Size.QuadPart);
+
+	/* Empty files can't be mapped and don't need to be. */
+	if (Size.QuadPart > 0) {
+
+		/* The view keeps the mapping alive on its own. */
+		Mapping = CreateFileMapping(File, NULL, PAGE_READONLY, 0, 0, NULL);
+		View = Mapping ? MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if (Mapping)
+			CloseHandle(Mapping);
+
+		if (!View) {
+			CloseHandle(File);
+			return SMTP_ERR_BUFFER;
+		}
+
+		Attach->Data = View;
+		Attach->Mapped = 1;
+	}
+
+	CloseHandle(File);
+#else
+	struct stat Info;
+	void *View;
+	int File;
+
+	File = open(Path, O_RDONLY);
+	if (File == -1)
+		return SMTP_ERR_DATA;
+
+	if (fstat(File, &Info) != 0 || !S_ISREG(Info.st_mode) || (unsigned long long)Info.st_size > UINT_MAX) {
+		close(File);
+		return SMTP_ERR_DATA;
+	}
+
+	SMTPAttachMemory(Attach, Filename, MIMEType, NULL, (unsigned int)Info.st_size);
+
+	/* Empty files can't be mapped and don't need to be. */
+	if (Info.st_size > 0) {
+
+		View = mmap(NULL, Info.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+		if (View == MAP_FAILED) {
+			close(File);
+			return SMTP_ERR_BUFFER;
+		}
+
+		/* It's read once from start to end, so read ahead and drop pages once passed. */
+		#ifdef MADV_SEQUENTIAL
+		madvise(View, Info.st_size, MADV_SEQUENTIAL);
+		#endif
+
+		Attach->Data = View;
+		Attach->Mapped = 1;
+	}
+
+	close(File);
+#endif
+
+	return SMTP_ERR_SUCCESS;
+}
+
+void SMTPAttachFree(SMTPAttach *Attach)
+{
+	if (Attach->Mapped) {
+		#ifdef _WIN32
+		UnmapViewOfFile(Attach->Data);
+		#else
+		munmap((void *)Attach->Data, Attach->Size);
+		#endif
+		Attach->Mapped = 0;
+	}
+
+	Attach->Data = NULL;
+	Attach->Size = 0;
+
+	return;
+}
+
+/* Locate the e-mail address incase the string passed contains a name as well. */
+static int FindAddress(const char *Address, const char **AddressStart, unsigned int *AddressLength)
+{
+	size_t Length;
+	unsigned int Loop;
+	int InQuotes = 0, ReachedEnd = 0;
+
+	Length = strlen(Address);
+
+	*AddressStart = NULL;
+	*AddressLength = 0;
+
+	for (Loop = 0; Loop < Length; Loop++) {
+
+		if (*AddressStart)
+			(*AddressLength)++;
+
+		if (!(InQuotes & 1)) {
+
+			switch (Address[Loop]) {
+				case '<':
+					if (*AddressStart)
+						return SMTP_ERR_DATA;
+					*AddressStart = &Address[Loop] + 1;
+					break;
+				case '>':
+					if (!*AddressStart)
+						return SMTP_ERR_DATA;
+					Loop = Length;	/* Break out the loop. */
+					(*AddressLength)--;
+					ReachedEnd = 1;
+					break;
+			}
+
+		}
+
+		if (Address[Loop] == '"')
+			InQuotes++;
+	}
+
+	/* If there was no brackets found, we'll use the entire string passed. */
+	if (!*AddressStart) {
+		*AddressStart = Address;
+		*AddressLength = Length;
+	}
+	else if (!ReachedEnd)
+		return SMTP_ERR_DATA;
+
+	if (!memchr(*AddressStart, '@', *AddressLength))
+		return SMTP_ERR_DATA;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Whether there's anything outside of ASCII. */
+static int HasHighBytes(const char *Data, unsigned int Length)
+{
+	unsigned int Loop;
+
+	for (Loop = 0; Loop < Length; Loop++) {
+		if ((unsigned char)Data[Loop] >= 0x80)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+	Writes header text as RFC 2047 encoded words, for when UTF-8 can't be sent as it is. A character is never split
+	between words and each word after the first is folded onto a line of its own.
+*/
+static int SendEncodedWords(CSendBuffer *CBuffer, const char *Text, unsigned int Length)
+{
+	char Encoded[(SMTP_WORD_SIZE + BASE64_IN_SIZE - 1) / BASE64_IN_SIZE * BASE64_OUT_SIZE];
+	B64Stream Stream;
+	unsigned int Size;
+
+	while (Length > 0) {
+
+		Size = Length < SMTP_WORD_SIZE ? Length : SMTP_WORD_SIZE;
+		while (Size < Length && Size > 1 && ((unsigned char)Text[Size] & 0xC0) == 0x80)
+			Size--;
+
+		InitEncode64(&Stream);
+		Stream.NextIn = (unsigned char *)Text;
+		Stream.AvailIn = Size;
+		Stream.NextOut = Encoded;
+		Stream.AvailOut = sizeof(Encoded);
+		Encode64(&Stream, 1);
+
+		if (CSendStrings(CBuffer, "=?UTF-8?B?", NULL) != 0 ||
+			CSend(CBuffer, Encoded, Stream.TotalOut) != 0 ||
+			CSendStrings(CBuffer, "?=", NULL) != 0)
+			return -1;
+
+		Text += Size;
+		Length -= Size;
+
+		if (Length > 0 && CSendStrings(CBuffer, EndOfLine, " ", NULL) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Writes an address for the headers. Without SMTPUTF8, a display name outside of ASCII is encoded. */
+static int SendHeaderAddress(CSendBuffer *CBuffer, const char *Address, unsigned int Length, int UTF8)
+{
+	const char *AddressStart, *Name;
+	unsigned int AddressLength, NameLength;
+
+	if (UTF8 || !HasHighBytes(Address, Length) ||
+		FindAddress(Address, &AddressStart, &AddressLength) != SMTP_ERR_SUCCESS || AddressStart == Address)
+		return CSend(CBuffer, Address, Length);
+
+	/* Everything before the '<', less any spaces and quotes around it. */
+	Name = Address;
+	NameLength = AddressStart - 1 - Address;
+
+	while (NameLength > 0 && *Name == ' ') {
+		Name++;
+		NameLength--;
+	}
+	while (NameLength > 0 && Name[NameLength - 1] == ' ')
+		NameLength--;
+	if (NameLength >= 2 && Name[0] == '"' && Name[NameLength - 1] == '"') {
+		Name++;
+		NameLength -= 2;
+	}
+
+	if (NameLength > 0 && (SendEncodedWords(CBuffer, Name, NameLength) != 0 || CSend(CBuffer, " ", 1) != 0))
+		return -1;
+
+	return CSend(CBuffer, AddressStart - 1, Length - (AddressStart - 1 - Address));
+}
+
+/* Made up of random characters and the sender's domain, as RFC 5322 suggests. */
+static int GenerateMessageID(CSendBuffer *CBuffer, const SMTPStoredAddress *Addresses)
+{
+	char Random[SMTP_MESSAGE_ID_RAND_LENGTH];
+	const char *AddressStart, *Domain;
+	unsigned int AddressLength, DomainLength;
+
+	Domain = "localhost";
+	DomainLength = sizeof("localhost") - 1;
+
+	for (; Addresses != NULL; Addresses = Addresses->Next) {
+
+		if (Addresses->Type != SMTP_ADDRESS_FROM ||
+			FindAddress(Addresses->Address, &AddressStart, &AddressLength) != SMTP_ERR_SUCCESS)
+			continue;
+
+		/* Everything after the last '@'. A domain that isn't ASCII is left out rather than encoded. */
+		for (DomainLength = AddressLength; DomainLength > 0 && AddressStart[DomainLength - 1] != '@'; DomainLength--);
+		if (DomainLength > 0 && DomainLength < AddressLength && !HasHighBytes(&AddressStart[DomainLength], AddressLength - DomainLength)) {
+			Domain = &AddressStart[DomainLength];
+			DomainLength = AddressLength - DomainLength;
+		}
+		else
+			DomainLength = sizeof("localhost") - 1;
+		break;
+	}
+
+	RandomString(Random, sizeof(Random));
+
+	if (CSend(CBuffer, "Message-ID: <", sizeof("Message-ID: <") - 1) != 0 ||
+		CSend(CBuffer, Random, sizeof(Random)) != 0 ||
+		CSend(CBuffer, "@", 1) != 0 ||
+		CSend(CBuffer, Domain, DomainLength) != 0 ||
+		CSendStrings(CBuffer, ">", EndOfLine, NULL) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+	Writes the headers and body, ending with the line break the end of data marker takes as its own. Stuffing is set
+	for DATA. Extensions are those asked for with MAIL FROM; without them, UTF-8 and 8-bit parts are encoded.
+*/
+static int WriteMessage(CSendBuffer *CBuffer, const SMTPStoredAddress *Addresses, const char *Subject, const MessageBody *Body, SMTPAttach *Attachments, int Stuffing, unsigned int Extensions)
+{
+	const SMTPStoredAddress *Stored;
+	int AddressType, Var, Encoding;
+	unsigned int Offset;
+	QPScan Scan;
+
+	/* Date. */
+	GenerateDate(CBuffer);
+
+	/* Addresses. */
+	AddressType = -1;
+
+	for (Stored = Addresses; Stored != NULL; Stored = Stored->Next) {
+
+		if (Stored->Type != AddressType) {
+
+			if (AddressType != -1) {
+				if (CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
+					return SMTP_ERR_PROTOCOL;
+			}
+
+			AddressType = Stored->Type;
+			switch (AddressType) {
+				case SMTP_ADDRESS_FROM:
+					Var = CSendStrings(CBuffer, "From: ", NULL);
+					break;
+				case SMTP_ADDRESS_TO:
+					Var = CSendStrings(CBuffer, "To: ", NULL);
+					break;
+				case SMTP_ADDRESS_CC:
+					Var = CSendStrings(CBuffer, "Cc: ", NULL);
+					break;
+				default:
+					return SMTP_ERR_BUFFER;
+			}
+
+		}
+		else
+			Var = CSendStrings(CBuffer, ",", EndOfLine, " ", NULL);
+
+		if (Var != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		if (SendHeaderAddress(CBuffer, Stored->Address, Stored->Length, Extensions & SMTP_EXT_SMTPUTF8) != 0)
+			return SMTP_ERR_PROTOCOL;
+	}
+
+	if (CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	/* Subject line if one was provided. */
+	if (Subject) {
+		Var = strlen(Subject);
+		if (CSendStrings(CBuffer, "Subject: ", NULL) != 0 ||
+			((Extensions & SMTP_EXT_SMTPUTF8) || !HasHighBytes(Subject, Var) ? CSend(CBuffer, Subject, Var) : SendEncodedWords(CBuffer, Subject, Var)) != 0 ||
+			CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
+			return SMTP_ERR_PROTOCOL;
+	}
+
+	if (GenerateMessageID(CBuffer, Addresses) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	if (Attachments)
+		return MIMEData(CBuffer, Body, Attachments, Stuffing, Extensions & SMTP_EXT_8BITMIME);
+
+	/* A body being read may not be ASCII, so it's labelled just in case. */
+	if (Body->Read) {
+		if (CSendStrings(CBuffer, "MIME-Version: 1.0", EndOfLine, NULL) != 0)
+			return SMTP_ERR_PROTOCOL;
+		return WriteReadBody(CBuffer, Body, Stuffing, Extensions & SMTP_EXT_8BITMIME);
+	}
+
+	/* One held in memory that isn't ASCII is labelled, then encoded unless the server can take it as it is. */
+	Offset = strlen(Body->Data);
+	ScanQP((const unsigned char *)Body->Data, Offset, &Scan);
+
+	if (Scan.HighBytes) {
+		Encoding = ChooseEncoding(&Scan, Offset, 1, Extensions & SMTP_EXT_8BITMIME);
+		if (CSendStrings(CBuffer, "MIME-Version: 1.0", EndOfLine, NULL) != 0)
+			return SMTP_ERR_PROTOCOL;
+		Var = SendTextHeaders(CBuffer, &Scan, Encoding);
+		if (Var != SMTP_ERR_SUCCESS)
+			return Var;
+		return WritePart(CBuffer, (const unsigned char *)Body->Data, Offset, Encoding, 1, Stuffing);
+	}
+
+	/* Main body. */
+	if (CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	Var = WriteBody(CBuffer, Body, Stuffing);
+	if (Var != 0)
+		return Var;
+
+	if (CSend(CBuffer, EndOfLine, sizeof(EndOfLine) - 1) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Sends DATA, unless SMTPAddresses() already has, and waits for the go ahead. */
+static int StartData(SMTPConn *Conn)
+{
+	static const char Command[] = "DATA\r\n";
+	SMTPReply Reply;
+
+	if (Conn->State == SMTP_READY) {
+
+		if (SendCommand(Conn, Command, sizeof(Command) - 1) != 0 ||
+			ReadReply(Conn, &Reply) != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		if (Reply.Code != 354)
+			return SMTP_ERR_FAILURE;
+
+	}
+	Conn->State = SMTP_READY;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Flushes whatever's left of the message, end of data marker included, and waits for it to be accepted. */
+static int FinishData(SMTPConn *Conn, CSendBuffer *CBuffer)
+{
+	SMTPReply Reply;
+
+	if (CFlush(CBuffer) != 0 ||
+		ReadReply(Conn, &Reply) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	/* The server has everything, but the kernel may not have let go of the body yet. */
+	WaitZeroCopy(Conn);
+
+	if (Reply.Code != 250)
+		return SMTP_ERR_FAILURE;
+
+	Conn->Messages++;
+	ResetMessage(Conn);
+	Conn->State = SMTP_CONNECTED;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Each flush of the send buffer goes out as its own BDAT chunk (RFC 3030). */
+typedef struct ChunkSender {
+	SMTPConn *Conn;
+	unsigned int Pending;	/* Chunks sent without their replies read yet. */
+	int Last;				/* The next chunk ends the message. */
+	int Done;				/* It has been sent. */
+	int Failed;				/* The server refused a chunk. */
+} ChunkSender;
+
+/* Reads the reply to every chunk sent so far. Fails once one has been refused, so nothing more is sent. */
+static int ReadChunkReplies(ChunkSender *Sender)
+{
+	SMTPReply Replies[16];
+	unsigned int Batch, Loop;
+
+	while (Sender->Pending > 0) {
+
+		Batch = Sender->Pending < sizeof(Replies) / sizeof(Replies[0]) ? Sender->Pending : sizeof(Replies) / sizeof(Replies[0]);
+		if (ReadReplies(Sender->Conn, Replies, Batch) != 0)
+			return -1;
+		Sender->Pending -= Batch;
+
+		for (Loop = 0; Loop < Batch; Loop++) {
+			if (Replies[Loop].Code != 250)
+				Sender->Failed = 1;
+		}
+
+	}
+
+	return Sender->Failed ? -1 : 0;
+}
+
+static int SendChunk(ChunkSender *Sender, const CVec *Vecs, unsigned int Count)
+{
+	char Command[32];
+	CVec Chunk[CBUFFER_VECS + 1];
+	unsigned int Loop, Size;
+
+	Size = 0;
+	for (Loop = 0; Loop < Count; Loop++) {
+		Chunk[Loop + 1] = Vecs[Loop];
+		Size += Vecs[Loop].Size;
+	}
+
+	/* The command is gathered into the same write as the chunk itself. */
+	Chunk[0].Data = Command;
+	Chunk[0].Size = __snprintf(Command, sizeof(Command), "BDAT %u%s\r\n", Size, Sender->Last ? " LAST" : "");
+
+	if (SendVector(Sender->Conn, Chunk, Count + 1) != 0)
+		return -1;
+	Sender->Pending++;
+	Sender->Done = Sender->Last;
+
+	/* When pipelining, replies are only waited on once a window's worth have built up or the message is done. */
+	if (!(Sender->Conn->Extensions & SMTP_EXT_PIPELINING) || Sender->Pending >= SMTP_PIPELINE_WINDOW || Sender->Done)
+		return ReadChunkReplies(Sender);
+
+	return 0;
+}
+
+/*
+	Sends either a message made by SMTPMessageCreate() or the one described by the rest as BDAT chunks.
+	Nothing is stuffed or scanned for, so large pieces such as the body go out exactly as they are.
+*/
+static int ChunkData(SMTPConn *Conn, const SMTPMessage *Message, const char *Subject, const MessageBody *Body, SMTPAttach *Attachments)
+{
+	char Buffer[SMTP_SEND_BUFFER_SIZE];
+	CSendBuffer CBuffer;
+	ChunkSender Sender;
+	int Return;
+
+	Sender.Conn = Conn;
+	Sender.Pending = 0;
+	Sender.Last = Sender.Done = Sender.Failed = 0;
+
+	CInitVec(&CBuffer, Buffer, sizeof(Buffer), (int (*)(void *, const CVec *, unsigned int))SendChunk, &Sender);
+
+	if (Message)
+		Return = CSendRef(&CBuffer, Message->Data, Message->Size) != 0 ? SMTP_ERR_PROTOCOL : SMTP_ERR_SUCCESS;
+	else {
+		Return = WriteMessage(&CBuffer, Conn->Addresses, Subject, Body, Attachments, 0, Conn->MailExtensions);
+	}
+
+	/* The last chunk may be empty if everything has already been sent. */
+	if (Return == SMTP_ERR_SUCCESS) {
+		Sender.Last = 1;
+		if (CFlush(&CBuffer) != 0 || (!Sender.Done && SendChunk(&Sender, NULL, 0) != 0))
+			Return = SMTP_ERR_PROTOCOL;
+	}
+
+	/* If a read failed, whatever's still waiting is read so the replies stay in step. */
+	if (Sender.Pending > 0 && Conn->State != SMTP_DISCONNECTED)
+		ReadChunkReplies(&Sender);
+
+	if (Conn->State != SMTP_DISCONNECTED)
+		WaitZeroCopy(Conn);
+
+	if (Sender.Failed)
+		Return = SMTP_ERR_FAILURE;
+
+	/* Chunks may have been accepted, leaving the transaction open on the server. Unlike DATA, it can be abandoned with RSET. */
+	if (Return != SMTP_ERR_SUCCESS) {
+		if (Conn->State != SMTP_DISCONNECTED && SMTPReset(Conn) != SMTP_ERR_SUCCESS && Conn->State != SMTP_DISCONNECTED)
+			Shutdown(Conn);
+		return Return;
+	}
+
+	Conn->Messages++;
+	ResetMessage(Conn);
+	Conn->State = SMTP_CONNECTED;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+static int SendData(SMTPConn *Conn, const char *Subject, const MessageBody *Body, SMTPAttach *Attachments)
+{
+	char Buffer[SMTP_SEND_BUFFER_SIZE];
+	CSendBuffer CBuffer;
+	int Return;
+
+	if (Conn->State != SMTP_READY && Conn->State != SMTP_DATA)
+		return SMTP_ERR_INVALID_STATE;
+
+	/* SMTPAddresses() never sends DATA ahead when the server has CHUNKING. */
+	if (Conn->State == SMTP_READY && (Conn->Extensions & SMTP_EXT_CHUNKING))
+		return ChunkData(Conn, NULL, Subject, Body, Attachments);
+
+	Return = StartData(Conn);
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return;
+
+	/* Set up the cached buffer. The body is sent from where it is rather than copied. */
+	CInitVec(&CBuffer, Buffer, sizeof(Buffer), (int (*)(void *, const CVec *, unsigned int))SendVector, Conn);
+
+	/* Ready to send, so generate the headers and body. */
+	Return = WriteMessage(&CBuffer, Conn->Addresses, Subject, Body, Attachments, 1, Conn->MailExtensions);
+	if (Return != SMTP_ERR_SUCCESS) {
+		if (Conn->State != SMTP_DISCONNECTED) {
+			WaitZeroCopy(Conn);
+			/* A read failed part way through. There's no way to end DATA without sending what's been written. */
+			Shutdown(Conn);
+		}
+		return Return;
+	}
+
+	/* End data. The message already ends with the marker's line ending. */
+	if (CSend(&CBuffer, &EndOfData[2], sizeof(EndOfData) - 3) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	return FinishData(Conn, &CBuffer);
+}
+
+int SMTPData(SMTPConn *Conn, const char *Subject, const char *Body, SMTPAttach *Attachments)
+{
+	MessageBody Source;
+
+	Source.Data = Body;
+	Source.Read = NULL;
+	Source.ReadData = NULL;
+
+	return SendData(Conn, Subject, &Source, Attachments);
+}
+
+/*
+	As SMTPData(), but the body is read in pieces as it's sent rather than being held in memory.
+	Read works as it does for attachments.
+*/
+int SMTPDataRead(SMTPConn *Conn, const char *Subject, int (*Read)(void *, void *, unsigned int), void *ReadData, SMTPAttach *Attachments)
+{
+	MessageBody Source;
+
+	Source.Data = NULL;
+	Source.Read = Read;
+	Source.ReadData = ReadData;
+
+	return SendData(Conn, Subject, &Source, Attachments);
+}
+
+/*
+	Sends a message made by SMTPMessageCreate() in place of SMTPData(). Nothing is rendered again, so the same
+	message can go out over any number of connections at once. With BDAT, it's sent without being copied.
+*/
+int SMTPSendMessage(SMTPConn *Conn, const SMTPMessage *Message)
+{
+	char Buffer[SMTP_SEND_BUFFER_SIZE];
+	CSendBuffer CBuffer;
+	BodyStream Stream;
+	int Return;
+
+	if (Conn->State != SMTP_READY && Conn->State != SMTP_DATA)
+		return SMTP_ERR_INVALID_STATE;
+
+	if (Conn->State == SMTP_READY && (Conn->Extensions & SMTP_EXT_CHUNKING))
+		return ChunkData(Conn, Message, NULL, NULL, NULL);
+
+	Return = StartData(Conn);
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return;
+
+	CInitVec(&CBuffer, Buffer, sizeof(Buffer), (int (*)(void *, const CVec *, unsigned int))SendVector, Conn);
+
+	/* Messages are kept unstuffed for BDAT, so DATA stuffs them on the way out. The lines are already fine. */
+	InitBody(&Stream, 1);
+
+	/* The message already ends with the marker's line ending. */
+	if (SendBody(&CBuffer, &Stream, Message->Data, Message->Size, 1) != 0 ||
+		CSend(&CBuffer, &EndOfData[2], sizeof(EndOfData) - 3) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	return FinishData(Conn, &CBuffer);
+}
+
+/*
+	Builds the MAIL or RCPT command for an address. Extensions adds BODY=8BITMIME and SMTPUTF8 to MAIL FROM and a
+	Size other than 0 adds SIZE=.
+*/
+static int AddressCommand(char *Buffer, unsigned int BufferSize, int Type, const char *Address, unsigned int Extensions, unsigned long Size, int *Length)
+{
+	char SizeParam[32];
+
+	const char *AddressStart;
+	unsigned int AddressLength;
+	int Return;
+
+	Return = FindAddress(Address, &AddressStart, &AddressLength);
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return;
+
+	SizeParam[0] = '\0';
+	if (Size)
+		__snprintf(SizeParam, sizeof(SizeParam), " SIZE=%lu", Size);
+
+	if (Type == SMTP_ADDRESS_FROM)
+		Return = __snprintf(Buffer, BufferSize, "MAIL FROM:<%.*s>%s%s%s\r\n", AddressLength, AddressStart,
+			SizeParam,
+			Extensions & SMTP_EXT_8BITMIME ? " BODY=8BITMIME" : "",
+			Extensions & SMTP_EXT_SMTPUTF8 ? " SMTPUTF8" : "");
+	else
+		Return = __snprintf(Buffer, BufferSize, "RCPT TO:<%.*s>\r\n", AddressLength, AddressStart);
+	#ifdef _WIN32
+	if (Return <= 0)
+	#else
+	if (Return >= BufferSize || Return <= 0)
+	#endif
+		return SMTP_ERR_BUFFER;
+
+	*Length = Return;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+int SMTPAddressCommand(char *Buffer, unsigned int BufferSize, int Type, const char *Address, int *Length)
+{
+	return AddressCommand(Buffer, BufferSize, Type, Address, 0, 0, Length);
+}
+
+/*
+	Works out what to ask for with MAIL FROM. 8BITMIME is always asked for when offered, as it costs nothing.
+	SMTPUTF8 is only asked for when an address needs it, as a server further along may not have it.
+*/
+static unsigned int MailExtensions(const SMTPConn *Conn, const char *From, const char **Addresses, unsigned int Count)
+{
+	const char *AddressStart;
+	unsigned int AddressLength, Extensions, Loop;
+
+	Extensions = Conn->Extensions & SMTP_EXT_8BITMIME;
+
+	if (!(Conn->Extensions & SMTP_EXT_SMTPUTF8))
+		return Extensions;
+
+	for (Loop = 0; Loop <= Count; Loop++) {
+		if (FindAddress(Loop < Count ? Addresses[Loop] : From, &AddressStart, &AddressLength) == SMTP_ERR_SUCCESS &&
+			HasHighBytes(AddressStart, AddressLength))
+			return Extensions | SMTP_EXT_SMTPUTF8;
+	}
+
+	return Extensions;
+}
+
+/*
+	The size to pass with MAIL FROM, if the server takes one. Fails without sending anything if it's over the
+	server's limit.
+*/
+static int MailSize(SMTPConn *Conn, unsigned long *Size)
+{
+	*Size = Conn->Extensions & SMTP_EXT_SIZE ? Conn->MessageSize : 0;
+
+	if (*Size && Conn->SizeLimit && *Size > Conn->SizeLimit)
+		return SMTP_ERR_DATA;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* If not a BCC address, add it to the address buffer for the headers. */
+static int StoreAddress(SMTPConn *Conn, int Type, const char *Address)
+{
+	SMTPStoredAddress *Stored;
+	size_t Length;
+
+	if (Type == SMTP_ADDRESS_BCC)
+		return SMTP_ERR_SUCCESS;
+
+	Length = strlen(Address);
+	if (Length > UINT_MAX - sizeof(SMTPStoredAddress) - 1)
+		return SMTP_ERR_DATA;
+
+	/* The text follows the record. */
+	Stored = SMTPArenaAlloc(&Conn->Arena, sizeof(SMTPStoredAddress) + Length + 1);
+	if (!Stored)
+		return SMTP_ERR_BUFFER;
+
+	Stored->Next = NULL;
+	Stored->Type = Type;
+	Stored->Length = Length;
+	Stored->Address = (char *)(Stored + 1);
+	memcpy(Stored + 1, Address, Length + 1);
+
+	if (Conn->LastAddress)
+		Conn->LastAddress->Next = Stored;
+	else
+		Conn->Addresses = Stored;
+	Conn->LastAddress = Stored;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Sends a single address. Extensions are those to ask for if it's the sender. */
+static int SendAddress(SMTPConn *Conn, int Type, const char *Address, unsigned int Extensions)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	SMTPReply Reply;
+	unsigned long Size;
+	int Return, Length;
+
+	if (Conn->State == SMTP_DISCONNECTED || Conn->State == SMTP_DATA ||
+		(Conn->State == SMTP_CONNECTED && Type != SMTP_ADDRESS_FROM) ||
+		(Conn->State >= SMTP_AWAITING_RECIPIENT && Type == SMTP_ADDRESS_FROM))
+		return SMTP_ERR_INVALID_STATE;
+
+	Size = 0;
+	if (Type == SMTP_ADDRESS_FROM) {
+		Return = MailSize(Conn, &Size);
+		if (Return != SMTP_ERR_SUCCESS)
+			return Return;
+	}
+
+	Return = AddressCommand(Buffer, sizeof(Buffer), Type, Address, Extensions, Size, &Length);
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return;
+
+	if (Type == SMTP_ADDRESS_FROM)
+		Conn->MessageSize = 0;
+
+	/* If we're here, we may have a valid e-mail address. */
+
+	if (SendCommand(Conn, Buffer, Length) != 0 ||
+		ReadReply(Conn, &Reply) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	if (Reply.Code != 250 && Reply.Code != 251)
+		return SMTP_ERR_FAILURE;
+
+	if (StoreAddress(Conn, Type, Address) != SMTP_ERR_SUCCESS)
+		return SMTP_ERR_BUFFER;
+
+	if (Type == SMTP_ADDRESS_FROM)
+		Conn->MailExtensions = Extensions;
+
+	if (Conn->State < SMTP_READY)
+		Conn->State++;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Only the sender's address is known when it's sent, so SMTPUTF8 is only asked for if it needs it. */
+int SMTPAddress(SMTPConn *Conn, int Type, const char *Address)
+{
+	return SendAddress(Conn, Type, Address, Type == SMTP_ADDRESS_FROM ? MailExtensions(Conn, Address, NULL, 0) : 0);
+}
+
+/*
+	Sends the sender along with every recipient.
+	If the server supports pipelining, the commands and DATA are all written at once and the replies matched up afterwards.
+	Results receives the outcome of each recipient.
+*/
+int SMTPAddresses(SMTPConn *Conn, const char *From, const int *Types, const char **Addresses, unsigned int Count, int *Results)
+{
+	char Buffer[SMTP_SEND_BUFFER_SIZE];
+	char Command[SMTP_BUFFER_SIZE];
+	CSendBuffer CBuffer;
+	SMTPReply Replies[16];
+	unsigned int Loop, Read, Window, Expected, Batch, Reply, Accepted, Extensions;
+	unsigned long Size;
+	int Return, Length, FromResult;
+
+	if (Conn->State != SMTP_CONNECTED)
+		return SMTP_ERR_INVALID_STATE;
+
+	/* Every address is known up front, so any of them can ask for SMTPUTF8. */
+	Extensions = MailExtensions(Conn, From, Addresses, Count);
+
+	/* Without pipelining, it's no different to calling SMTPAddress() for each. */
+	if (!(Conn->Extensions & SMTP_EXT_PIPELINING)) {
+
+		Return = SendAddress(Conn, SMTP_ADDRESS_FROM, From, Extensions);
+		if (Return != SMTP_ERR_SUCCESS)
+			return Return;
+
+		Accepted = 0;
+		for (Loop = 0; Loop < Count; Loop++) {
+			Results[Loop] = SMTPAddress(Conn, Types[Loop], Addresses[Loop]);
+			if (Results[Loop] == SMTP_ERR_SUCCESS)
+				Accepted++;
+			else if (Results[Loop] == SMTP_ERR_PROTOCOL)
+				return SMTP_ERR_PROTOCOL;
+		}
+
+		return Accepted ? SMTP_ERR_SUCCESS : SMTP_ERR_FAILURE;
+	}
+
+	/*
+		Write the commands out in windows, so neither side blocks writing while the other isn't reading. Each window
+		is only as large as the buffer, so it goes out in a single write.
+	*/
+	CInitVec(&CBuffer, Buffer, sizeof(Buffer), (int (*)(void *, const CVec *, unsigned int))SendVector, Conn);
+
+	Return = MailSize(Conn, &Size);
+	if (Return == SMTP_ERR_SUCCESS)
+		Return = AddressCommand(Command, sizeof(Command), SMTP_ADDRESS_FROM, From, Extensions, Size, &Length);
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return;
+	if (CSend(&CBuffer, Command, Length) != 0)
+		return SMTP_ERR_PROTOCOL;
+	Conn->MailExtensions = Extensions;
+	Conn->MessageSize = 0;
+
+	Expected = 1;
+	FromResult = -1;
+	Accepted = Loop = Read = 0;
+
+	do {
+
+		for (Window = 0; Loop < Count && Window < SMTP_PIPELINE_WINDOW; Loop++) {
+
+			if (Types[Loop] == SMTP_ADDRESS_FROM) {
+				Results[Loop] = SMTP_ERR_INVALID_STATE;
+				continue;
+			}
+
+			Results[Loop] = SMTPAddressCommand(Command, sizeof(Command), Types[Loop], Addresses[Loop], &Length);
+			if (Results[Loop] != SMTP_ERR_SUCCESS)
+				continue;
+
+			/* Left for the next window if it won't fit, along with room for DATA. */
+			if (Window > 0 && CBuffer.Cursor + Length + sizeof("DATA\r\n") - 1 > CBuffer.Size)
+				break;
+
+			if (CSend(&CBuffer, Command, Length) != 0)
+				return SMTP_ERR_PROTOCOL;
+			Window++;
+		}
+		Expected += Window;
+
+		/* DATA goes out with the last of the recipients. Its reply is dealt with below. BDAT doesn't need it. */
+		if (Loop >= Count && !(Conn->Extensions & SMTP_EXT_CHUNKING) && CSendStrings(&CBuffer, "DATA", EndOfLine, NULL) != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		if (CFlush(&CBuffer) != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		/* Now read the replies back in the same order. */
+		while (Expected > 0) {
+
+			Batch = Expected;
+			if (Batch > sizeof(Replies) / sizeof(Replies[0]))
+				Batch = sizeof(Replies) / sizeof(Replies[0]);
+
+			if (ReadReplies(Conn, Replies, Batch) != 0)
+				return SMTP_ERR_PROTOCOL;
+			Expected -= Batch;
+
+			for (Reply = 0; Reply < Batch; Reply++) {
+
+				if (FromResult == -1) {
+					FromResult = Replies[Reply].Code == 250 ? SMTP_ERR_SUCCESS : SMTP_ERR_FAILURE;
+					if (FromResult == SMTP_ERR_SUCCESS && StoreAddress(Conn, SMTP_ADDRESS_FROM, From) != SMTP_ERR_SUCCESS)
+						FromResult = SMTP_ERR_BUFFER;
+					continue;
+				}
+
+				/* Skip over those that were never sent. */
+				while (Results[Read] != SMTP_ERR_SUCCESS)
+					Read++;
+
+				if (Replies[Reply].Code != 250 && Replies[Reply].Code != 251)
+					Results[Read] = SMTP_ERR_FAILURE;
+				else if (FromResult == SMTP_ERR_SUCCESS)
+					Results[Read] = StoreAddress(Conn, Types[Read], Addresses[Read]);
+				else
+					Results[Read] = SMTP_ERR_INVALID_STATE;
+
+				if (Results[Read] == SMTP_ERR_SUCCESS)
+					Accepted++;
+				Read++;
+			}
+
+		}
+
+	} while (Loop < Count);
+
+	/* DATA, unless it was left for BDAT. */
+	if (!(Conn->Extensions & SMTP_EXT_CHUNKING)) {
+
+		if (ReadReply(Conn, Replies) != 0)
+			return SMTP_ERR_PROTOCOL;
+
+		if (Replies[0].Code == 354) {
+
+			/* A server shouldn't accept DATA without any recipients, but end it if it did. */
+			if (FromResult != SMTP_ERR_SUCCESS || !Accepted) {
+				if (SendCommand(Conn, &EndOfData[2], sizeof(EndOfData) - 3) != 0 ||
+					ReadReply(Conn, Replies) != 0)
+					return SMTP_ERR_PROTOCOL;
+			}
+			else {
+				Conn->State = SMTP_DATA;
+				return SMTP_ERR_SUCCESS;
+			}
+
+		}
+
+	}
+
+	if (FromResult != SMTP_ERR_SUCCESS) {
+		ResetMessage(Conn);
+		return FromResult;
+	}
+
+	/* SMTPData() will try DATA again itself. */
+	Conn->State = Accepted ? SMTP_READY : SMTP_AWAITING_RECIPIENT;
+
+	return Accepted ? SMTP_ERR_SUCCESS : SMTP_ERR_FAILURE;
+}
+
+/* Appends to the message being formatted. */
+static int FormatWrite(void *Data, char *Buffer, unsigned int Size)
+{
+	CSendBuffer *Message = Data;
+	char *NewData;
+	unsigned int NewSize;
+
+	if (Message->Cursor + Size > Message->Size) {
+
+		NewSize = Message->Size ? Message->Size : SMTP_BUFFER_SIZE;
+		while (NewSize < Message->Cursor + Size)
+			NewSize *= 2;
+
+		NewData = realloc(Message->Data, NewSize);
+		if (!NewData)
+			return -1;
+		Message->Data = NewData;
+		Message->Size = NewSize;
+
+	}
+
+	memcpy(&Message->Data[Message->Cursor], Buffer, Size);
+	Message->Cursor += Size;
+
+	return 0;
+}
+
+/* Fills in the addresses for the headers without a connection. Only the arena and addresses are used. */
+static int StoreAddresses(SMTPConn *Headers, const char *From, const int *Types, const char **Addresses, unsigned int Count)
+{
+	unsigned int Loop;
+	int Return;
+
+	SMTPArenaInit(&Headers->Arena);
+	Headers->Addresses = Headers->LastAddress = NULL;
+
+	Return = StoreAddress(Headers, SMTP_ADDRESS_FROM, From);
+	for (Loop = 0; Loop < Count && Return == SMTP_ERR_SUCCESS; Loop++)
+		Return = StoreAddress(Headers, Types[Loop], Addresses[Loop]);
+
+	return Return;
+}
+
+/* Periods are only stuffed when the result is sent with DATA as it is. */
+static int FormatMessage(const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments, int Stuffing, char **Message, unsigned int *Length)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	CSendBuffer CBuffer, Output;
+	MessageBody Source;
+	SMTPConn Headers;
+	int Return;
+
+	Source.Data = Body;
+	Source.Read = NULL;
+	Source.ReadData = NULL;
+
+	Return = StoreAddresses(&Headers, From, Types, Addresses, Count);
+
+	Output.Data = NULL;
+	Output.Size = Output.Cursor = 0;
+	CInit(&CBuffer, Buffer, sizeof(Buffer), FormatWrite, &Output);
+
+	/* The server it'll go to isn't known, so nothing is left unencoded for 8BITMIME or SMTPUTF8. */
+	if (Return == SMTP_ERR_SUCCESS)
+		Return = WriteMessage(&CBuffer, Headers.Addresses, Subject, &Source, Attachments, Stuffing, 0);
+
+	if (Return == SMTP_ERR_SUCCESS && CFlush(&CBuffer) != 0)
+		Return = SMTP_ERR_BUFFER;
+
+	SMTPArenaFree(&Headers.Arena);
+
+	if (Return != SMTP_ERR_SUCCESS) {
+		if (Output.Data)
+			free(Output.Data);
+		return Return == SMTP_ERR_PROTOCOL ? SMTP_ERR_BUFFER : Return;
+	}
+
+	*Message = Output.Data;
+	*Length = Output.Cursor;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/*
+	Formats an e-mail into memory, as SMTPData() would send it, without the end of data marker.
+	The headers list every address given. The message is allocated and must be freed by the caller.
+*/
+int SMTPFormat(const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments, char **Message, unsigned int *Length)
+{
+	return FormatMessage(From, Types, Addresses, Count, Subject, Body, Attachments, 1, Message, Length);
+}
+
+/*
+	Works out the exact size of the message SMTPData() would send once SMTPAddresses() has added the same addresses
+	on Conn, for SMTPConn->MessageSize. As RFC 1870 has it, stuffed periods and the end of data marker aren't
+	counted. Conn may be NULL for a message from SMTPFormat(). Attachments with a Read function can't be sized.
+*/
+int SMTPMessageSize(const SMTPConn *Conn, const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments, unsigned long *Size)
+{
+	char Buffer[SMTP_SEND_BUFFER_SIZE];
+	CSendBuffer CBuffer;
+	MessageBody Source;
+	SMTPConn Headers;
+	SMTPAttach *Attach;
+	unsigned long long Total;
+	int Return;
+
+	for (Attach = Attachments; Attach != NULL; Attach = Attach->Next) {
+		if (Attach->Read)
+			return SMTP_ERR_DATA;
+	}
+
+	Source.Data = Body;
+	Source.Read = NULL;
+	Source.ReadData = NULL;
+
+	/* Nothing's copied or encoded that doesn't have to be. Pieces sent from where they are are only added up. */
+	Total = 0;
+	CInitVec(&CBuffer, Buffer, sizeof(Buffer), CountVecs, &Total);
+
+	Return = StoreAddresses(&Headers, From, Types, Addresses, Count);
+	if (Return == SMTP_ERR_SUCCESS)
+		Return = WriteMessage(&CBuffer, Headers.Addresses, Subject, &Source, Attachments, 0,
+			Conn ? MailExtensions(Conn, From, Addresses, Count) : 0);
+	if (Return == SMTP_ERR_SUCCESS && CFlush(&CBuffer) != 0)
+		Return = SMTP_ERR_BUFFER;
+
+	SMTPArenaFree(&Headers.Arena);
+
+	if (Return != SMTP_ERR_SUCCESS)
+		return Return == SMTP_ERR_PROTOCOL ? SMTP_ERR_BUFFER : Return;
+	if (Total > ULONG_MAX)
+		return SMTP_ERR_DATA;
+
+	*Size = (unsigned long)Total;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+static long AddReferences(SMTPMessage *Message, long Amount)
+{
+#ifdef _WIN32
+	return InterlockedExchangeAdd(&Message->References, Amount) + Amount;
+#else
+	return __atomic_add_fetch(&Message->References, Amount, __ATOMIC_ACQ_REL);
+#endif
+}
+
+/*
+	Renders an e-mail once, as SMTPFormat() would, to be sent with SMTPSendMessage() to any envelope.
+	The message starts with a single reference, which is dropped by SMTPMessageRelease().
+*/
+int SMTPMessageCreate(SMTPMessage **Message, const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments)
+{
+	SMTPMessage *Created;
+	int Return;
+
+	Created = malloc(sizeof(SMTPMessage));
+	if (!Created)
+		return SMTP_ERR_BUFFER;
+
+	/* Left unstuffed so BDAT can send it untouched. SMTPSendMessage() stuffs it for DATA. */
+	Return = FormatMessage(From, Types, Addresses, Count, Subject, Body, Attachments, 0, &Created->Data, &Created->Size);
+	if (Return != SMTP_ERR_SUCCESS) {
+		free(Created);
+		return Return;
+	}
+
+	Created->References = 1;
+	*Message = Created;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+/* Adds a reference for another thread or connection to hold. */
+SMTPMessage *SMTPMessageReference(SMTPMessage *Message)
+{
+	AddReferences(Message, 1);
+
+	return Message;
+}
+
+void SMTPMessageRelease(SMTPMessage *Message)
+{
+	if (AddReferences(Message, -1) == 0) {
+		free(Message->Data);
+		free(Message);
+	}
+
+	return;
+}
+
+static void SetHost(SMTPConn *Conn, const char *Host)
+{
+	strncpy(Conn->Host, Host, sizeof(Conn->Host) - 1);
+	Conn->Host[sizeof(Conn->Host) - 1] = '\0';
+
+	return;
+}
+
+/* NOTE: Win32 code. Elsewhere, the addresses are raced against each other below. */
+#ifdef _WIN32
+/* Connects to a single address and exchanges the greetings. */
+static int ConnectAddress(SMTPConn *Conn, const struct sockaddr *Address, int AddressLength, const char *HeloLine)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	SMTPReply Reply;
+	int Return;
+	CONST DWORD TimeoutLength = SMTP_BLOCKING_TIME;
+
+	Conn->Socket = socket(Address->sa_family, SOCK_STREAM, 0);
+	if (Conn->Socket == INVALID_SOCKET)
+		return -1;
+
+	Conn->Extensions = Conn->MailExtensions = 0;
+	Conn->SizeLimit = Conn->MessageSize = 0;
+
+	setsockopt(Conn->Socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&TimeoutLength, sizeof(DWORD));
+
+	if (connect(Conn->Socket, Address, AddressLength) != 0)
+		goto Err;
+	DisableNagle(Conn);
+
+	/* Read the header to ensure that it's working. */
+	if (ReadReply(Conn, &Reply) != 0)
+		return -1;
+	if (Reply.Code != 220)
+		goto Err;
+
+	/* Try EHLO first so we know what the server supports. Older servers only understand HELO. */
+	Return = __snprintf(Buffer, sizeof(Buffer), "EHLO %s\r\n", HeloLine);
+	if (Return <= 0)
+		goto Err;
+	if (SendCommand(Conn, Buffer, Return) != 0 ||
+		ReadReply(Conn, &Reply) != 0)
+		return -1;
+
+	if (Reply.Code == 250)
+		Conn->Extensions = SMTPParseExtensions(&Reply, &Conn->SizeLimit);
+	else {
+
+		Return = __snprintf(Buffer, sizeof(Buffer), "HELO %s\r\n", HeloLine);
+		if (SendCommand(Conn, Buffer, Return) != 0 ||
+			ReadReply(Conn, &Reply) != 0)
+			return -1;
+
+		if (Reply.Code != 250)
+			goto Err;
+	}
+
+	Conn->State = SMTP_CONNECTED;
+
+	return 0;
+
+	Err:
+	Shutdown(Conn);
+	return -1;
+}
+
+static int Connect(SMTPConn *Conn, const char *Server, const char *HeloLine)
+{
+	struct addrinfo Hints, *Results, *Next;
+
+	memset(&Hints, 0, sizeof(Hints));
+	Hints.ai_family = AF_UNSPEC;
+	Hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(Server, SMTP_DEFAULT_PORT, &Hints, &Results) != 0)
+		return -1;
+
+	for (Next = Results; Next != NULL; Next = Next->ai_next) {
+		if (ConnectAddress(Conn, Next->ai_addr, Next->ai_addrlen, HeloLine) == 0)
+			break;
+	}
+
+	freeaddrinfo(Results);
+
+	if (Conn->State == SMTP_DISCONNECTED)
+		return -2;
+
+	SetHost(Conn, Server);
+
+	return 0;
+}
+
+static int CompareMXRecord(const void *First, const void *Second)
+{
+	return (*(DNS_RECORD **)First)->Data.MX.wPreference - (*(DNS_RECORD **)Second)->Data.MX.wPreference;
+}
+
+static int ConnectToMXServer(SMTPConn *Conn, const char *Domain, const char *HeloLine)
+{
+	DNS_RECORD *DNSResults, *DNSNext, **DNSMXSortArrary;
+	HANDLE ProcessHeap;
+	unsigned int Amount, Loop;
+
+	if (DnsQuery_A(Domain, DNS_TYPE_MX, DNS_QUERY_STANDARD, NULL, &DNSResults, NULL) == NOERROR) {
+
+		/* Count the number we have and create an array for them. */
+		Amount = 0;
+		for (DNSNext = DNSResults; DNSNext != NULL; DNSNext = DNSNext->pNext) {
+			if (DNSNext->wType == DNS_TYPE_MX)
+				Amount++;
+		}
+
+		ProcessHeap = GetProcessHeap();
+		if (!ProcessHeap) {
+			DnsRecordListFree(DNSResults, DnsFreeRecordList);
+			return -2;
+		}
+
+		DNSMXSortArrary = HeapAlloc(ProcessHeap, 0, Amount * sizeof(DNS_RECORD*));
+		if (!DNSMXSortArrary) {
+			DnsRecordListFree(DNSResults, DnsFreeRecordList);
+			return -2;
+		}
+
+		Amount = 0;
+		for (DNSNext = DNSResults; DNSNext != NULL; DNSNext = DNSNext->pNext) {
+			if (DNSNext->wType == DNS_TYPE_MX) {
+				DNSMXSortArrary[Amount] = DNSNext;
+				Amount++;
+			}
+		}
+
+		qsort(&DNSMXSortArrary[0], Amount, sizeof(DNS_RECORD*), CompareMXRecord);
+
+		for (Loop = 0; Loop < Amount; Loop++) {
+			if (Connect(Conn, DNSMXSortArrary[Loop]->Data.MX.pNameExchange, HeloLine) == 0)
+				break;
+		}
+
+		HeapFree(ProcessHeap, 0, DNSMXSortArrary);
+
+		DnsRecordListFree(DNSResults, DnsFreeRecordList);
+
+	}
+
+	/* As per a spec, in a last attempt, try to connect to the A record. */
+	if (Conn->State == SMTP_DISCONNECTED) {
+		if (Connect(Conn, Domain, HeloLine) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+#else
+enum AttemptSteps {
+	ATTEMPT_CONNECTING,
+	ATTEMPT_BANNER,
+	ATTEMPT_EHLO,
+	ATTEMPT_HELO,
+	ATTEMPT_DONE
+};
+
+/* A single connection in a race. */
+typedef struct Attempt {
+	SMTPConn Conn;
+	int Step;
+	long long Deadline;
+	SMTPReply Reply;
+} Attempt;
+
+static long long Now(void)
+{
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+
+	return (long long)Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
+}
+
+static int StartAttempt(Attempt *Try, const struct sockaddr_storage *Address)
+{
+	socklen_t Length;
+
+	Length = Address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+	memset(&Try->Conn, 0, sizeof(Try->Conn));
+	Try->Conn.Socket = socket(Address->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (Try->Conn.Socket == INVALID_SOCKET)
+		return -1;
+
+	Try->Conn.State = SMTP_CONNECTED;	/* Only so it's shut down correctly. */
+	Try->Step = ATTEMPT_CONNECTING;
+	Try->Deadline = Now() + SMTP_CONNECT_TIME;
+	SMTPInitReply(&Try->Reply);
+
+	if (connect(Try->Conn.Socket, (const struct sockaddr *)Address, Length) != 0 && errno != EINPROGRESS) {
+		Shutdown(&Try->Conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Moves on to the next step of the greeting once its reply has arrived. */
+static int AttemptReply(Attempt *Try, const char *HeloLine)
+{
+	char Buffer[SMTP_BUFFER_SIZE];
+	int Return;
+
+	switch (Try->Step) {
+
+		case ATTEMPT_BANNER:
+			if (Try->Reply.Code != 220)
+				return -1;
+			Return = __snprintf(Buffer, sizeof(Buffer), "EHLO %s\r\n", HeloLine);
+			break;
+
+		case ATTEMPT_EHLO:
+			if (Try->Reply.Code == 250) {
+				Try->Conn.Extensions = SMTPParseExtensions(&Try->Reply, &Try->Conn.SizeLimit);
+				Try->Step = ATTEMPT_DONE;
+				return 0;
+			}
+			Return = __snprintf(Buffer, sizeof(Buffer), "HELO %s\r\n", HeloLine);
+			break;
+
+		case ATTEMPT_HELO:
+			if (Try->Reply.Code != 250)
+				return -1;
+			Try->Step = ATTEMPT_DONE;
+			return 0;
+
+		default:
+			return -1;
+
 	}
 
-	/* End data. */
-	if (CSendStrings(&CBuffer, EndOfData, NULL) != 0)
-		return SMTP_ERR_PROTOCOL;
+	if (Return >= sizeof(Buffer) || Return <= 0)
+		return -1;
 
-	/* Flush the buffer. */
-	if (CFlush(&CBuffer) != 0 ||
-		ReadReply(Conn, Buffer, sizeof(Buffer)) != 0)
-		return SMTP_ERR_PROTOCOL;
+	/* Nothing else has been written, so a short command always fits. */
+	if (send(Try->Conn.Socket, Buffer, Return, MSG_NOSIGNAL) != Return)
+		return -1;
 
-	if (atoi(Buffer) != 250)
-		return SMTP_ERR_FAILURE;
+	Try->Conn.TotalSent += Return;
+	Try->Step++;
+	Try->Deadline = Now() + SMTP_BLOCKING_TIME;
+	SMTPInitReply(&Try->Reply);
 
-	return SMTP_ERR_SUCCESS;
+	return 0;
 }
 
-int SMTPAddress(SMTPConn *Conn, int Type, const char *Address)
+/* Reads what's arrived for an attempt. Returns -1 if it's failed. */
+static int AttemptRead(Attempt *Try, const char *HeloLine)
 {
-	size_t Length;
-	unsigned int Loop;
+	SMTPConn *Conn = &Try->Conn;
+	int Return;
 
-	int InQuotes = 0, ReachedEnd = 0;
-	const char *AddressStart;
-	unsigned int AddressLength;
+	if (Conn->RecvEnd >= Conn->RecvSize &&
+		GrowRecvBuffer(Conn, Conn->RecvStart, &Try->Reply, 1) != 0)
+		return -1;
 
-	char Buffer[SMTP_BUFFER_SIZE];
-	int Return;
+	Return = recv(Conn->Socket, &Conn->RecvBuffer[Conn->RecvEnd], Conn->RecvSize - Conn->RecvEnd, 0);
+	if (Return == SOCKET_ERROR && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (Return <= 0)
+		return -1;
 
-	unsigned int Size, AllocSize;
-	char *AllocBuffer;
+	Conn->TotalRecv += Return;
+	Conn->RecvEnd += Return;
 
-	if (Conn->State == SMTP_DISCONNECTED ||
-		(Conn->State == SMTP_CONNECTED && Type != SMTP_ADDRESS_FROM) ||
-		(Conn->State >= SMTP_AWAITING_RECIPIENT && Type == SMTP_ADDRESS_FROM))
-		return SMTP_ERR_INVALID_STATE;
+	while (Try->Step != ATTEMPT_DONE) {
 
-	/* Locate the e-mail address incase the string passed contains a name as well. */
-	Length = strlen(Address);
+		Return = SMTPParseReply(&Conn->RecvBuffer[Conn->RecvStart], Conn->RecvEnd - Conn->RecvStart, &Try->Reply);
+		if (Return == -1)
+			return -1;
+		if (Return == 0)
+			break;
 
-	AddressStart = NULL;
-	AddressLength = 0;
+		Conn->RecvStart += Try->Reply.Size;
+		if (AttemptReply(Try, HeloLine) != 0)
+			return -1;
+	}
 
-	for (Loop = 0; Loop < Length; Loop++) {
+	return 0;
+}
 
-		if (AddressStart)
-			AddressLength++;
+/*
+	Races connections to the addresses as per RFC 8305. A new attempt is started every SMTP_CONNECT_DELAY milliseconds,
+	or straight away when one fails, and the first to finish its greeting wins. The rest are dropped.
+*/
+static int Race(SMTPConn *Conn, const struct sockaddr_storage *Addresses, unsigned int Count, const char *HeloLine)
+{
+	Attempt *Attempts;
+	struct pollfd *Polls;
+	unsigned int Started, Active, Loop, Polled, Winner;
+	long long Current, NextStart, Wait;
+	int Error;
+	socklen_t Length;
+	struct timeval TimeoutLength;
+
+	if (!Count)
+		return -1;
 
-		if (!(InQuotes & 1)) {
+	Attempts = malloc(Count * (sizeof(Attempt) + sizeof(struct pollfd)));
+	if (!Attempts)
+		return -1;
+	Polls = (struct pollfd *)&Attempts[Count];
 
-			switch (Address[Loop]) {
-				case '<':
-					if (AddressStart)
-						return SMTP_ERR_DATA;
-					AddressStart = &Address[Loop] + 1;
-					break;
-				case '>':
-					if (!AddressStart)
-						return SMTP_ERR_DATA;
-					Loop = Length;	/* Break out the loop. */
-					AddressLength--;
-					ReachedEnd = 1;
-					break;
+	Started = Active = 0;
+	Winner = Count;
+	NextStart = Now();
+
+	while (Winner == Count) {
+
+		Current = Now();
+
+		/* Start the next attempt if it's time or nothing else is going. */
+		if (Started < Count && (Active == 0 || Current >= NextStart)) {
+			if (StartAttempt(&Attempts[Started], &Addresses[Started]) == 0) {
+				Active++;
+				NextStart = Current + SMTP_CONNECT_DELAY;
 			}
+			else
+				Attempts[Started].Step = ATTEMPT_DONE;
+			Started++;
+			continue;
+		}
+
+		if (!Active)
+			break;
+
+		Polled = 0;
+		Wait = Started < Count ? NextStart - Current : SMTP_CONNECT_TIME + SMTP_BLOCKING_TIME;
+		for (Loop = 0; Loop < Started; Loop++) {
+
+			if (Attempts[Loop].Conn.State == SMTP_DISCONNECTED)
+				continue;
+
+			Polls[Polled].fd = Attempts[Loop].Conn.Socket;
+			Polls[Polled].events = Attempts[Loop].Step == ATTEMPT_CONNECTING ? POLLOUT : POLLIN;
+			Polls[Polled].revents = 0;
+			Polled++;
+
+			if (Attempts[Loop].Deadline - Current < Wait)
+				Wait = Attempts[Loop].Deadline - Current;
+		}
+
+		if (poll(Polls, Polled, Wait > 0 ? Wait : 0) < 0 && errno != EINTR)
+			break;
+
+		Current = Now();
+		Polled = 0;
+		for (Loop = 0; Loop < Started && Winner == Count; Loop++) {
+
+			if (Attempts[Loop].Conn.State == SMTP_DISCONNECTED)
+				continue;
+
+			Error = 0;
+			if (Polls[Polled].revents) {
+
+				if (Attempts[Loop].Step == ATTEMPT_CONNECTING) {
+					Length = sizeof(Error);
+					if (getsockopt(Attempts[Loop].Conn.Socket, SOL_SOCKET, SO_ERROR, &Error, &Length) != 0 || Error != 0)
+						Error = -1;
+					else {
+						Attempts[Loop].Step = ATTEMPT_BANNER;
+						Attempts[Loop].Deadline = Current + SMTP_BLOCKING_TIME;
+					}
+				}
+				else
+					Error = AttemptRead(&Attempts[Loop], HeloLine);
+
+			}
+			else if (Attempts[Loop].Deadline <= Current)
+				Error = -1;
+			Polled++;
+
+			if (Error) {
+				Shutdown(&Attempts[Loop].Conn);
+				Active--;
+				NextStart = Current;	/* Don't wait to start the next. */
+			}
+			else if (Attempts[Loop].Step == ATTEMPT_DONE)
+				Winner = Loop;
 
 		}
 
-		if (Address[Loop] == '"')
-			InQuotes++;
 	}
 
-	/* If there was no brackets found, we'll use the entire string passed. */
-	if (!AddressStart) {
-		AddressStart = Address;
-		AddressLength = Length;
+	for (Loop = 0; Loop < Started; Loop++) {
+		if (Loop != Winner && Attempts[Loop].Conn.State != SMTP_DISCONNECTED)
+			Shutdown(&Attempts[Loop].Conn);
 	}
-	else if (!ReachedEnd)
-		return SMTP_ERR_DATA;
 
-	if (!memchr(AddressStart, '@', AddressLength))
-		return SMTP_ERR_DATA;
+	if (Winner < Count) {
 
-	/* If we're here, we may have a valid e-mail address. */
+		/* Back to blocking with timeouts for everything else. */
+		*Conn = Attempts[Winner].Conn;
+		fcntl(Conn->Socket, F_SETFL, fcntl(Conn->Socket, F_GETFL) & ~O_NONBLOCK);
 
-	if (Type == SMTP_ADDRESS_FROM)
-		Return = __snprintf(Buffer, sizeof(Buffer), "MAIL FROM:<%.*s>\r\n", AddressLength, AddressStart);
-	else
-		Return = __snprintf(Buffer, sizeof(Buffer), "RCPT TO:<%.*s>\r\n", AddressLength, AddressStart);
-	#ifdef _WIN32
-	if (Return <= 0)
-	#else
-	if (Return >= sizeof(Buffer) || Return <= 0)
-	#endif
-		return SMTP_ERR_BUFFER;
+		TimeoutLength.tv_sec = SMTP_BLOCKING_TIME / 1000;
+		TimeoutLength.tv_usec = (SMTP_BLOCKING_TIME % 1000) * 1000;
+		setsockopt(Conn->Socket, SOL_SOCKET, SO_RCVTIMEO, &TimeoutLength, sizeof(TimeoutLength));
+		setsockopt(Conn->Socket, SOL_SOCKET, SO_SNDTIMEO, &TimeoutLength, sizeof(TimeoutLength));
+		DisableNagle(Conn);
 
-	if (SendCommand(Conn, Buffer, Return) != 0 ||
-		ReadReply(Conn, Buffer, sizeof(Buffer)) != 0)
-		return SMTP_ERR_PROTOCOL;
+		Conn->State = SMTP_CONNECTED;
+	}
 
-	Return = atoi(Buffer);
-	if (Return != 250 && Return != 251)
-		return SMTP_ERR_FAILURE;
+	free(Attempts);
 
-	/* If not a BCC address, add it to the address buffer. */
-	if (Type != SMTP_ADDRESS_BCC) {
+	return Winner < Count ? 0 : -1;
+}
 
-		Size = Length + 2;	/* Two extra bytes are added for the end and type bytes. */
-		if (Size + Conn->AddressBufferCursor > Conn->AddressBufferSize) {
+/* Reorders the addresses to alternate between IPv6 and IPv4, keeping their order otherwise. IPv6 goes first. */
+static int Interleave(struct sockaddr_storage *Addresses, unsigned int Count)
+{
+	struct sockaddr_storage *Copy;
+	unsigned int IPv6, IPv4, Loop, Next;
 
-			AllocSize = Size;
-			if (AllocSize < SMTP_BUFFER_SIZE)
-				AllocSize = SMTP_BUFFER_SIZE;
-			Conn->AddressBufferSize += AllocSize;
+	Copy = malloc(Count * sizeof(struct sockaddr_storage));
+	if (!Copy)
+		return -1;
+	memcpy(Copy, Addresses, Count * sizeof(struct sockaddr_storage));
 
-			AllocBuffer = realloc(Conn->AddressBuffer, Conn->AddressBufferSize);
-			if (!AllocBuffer)
-				return SMTP_ERR_BUFFER;
-			Conn->AddressBuffer = AllocBuffer;
+	IPv6 = IPv4 = 0;
+	for (Loop = 0; Loop < Count; Loop++) {
 
-		}
+		/* Find the next of the wanted family, otherwise take whatever's left. */
+		for (; IPv6 < Count && Copy[IPv6].ss_family != AF_INET6; IPv6++);
+		for (; IPv4 < Count && Copy[IPv4].ss_family == AF_INET6; IPv4++);
 
-		Conn->AddressBuffer[Conn->AddressBufferCursor] = Type;
-		memcpy(&Conn->AddressBuffer[Conn->AddressBufferCursor + 1], Address, Length);
-		Conn->AddressBuffer[Conn->AddressBufferCursor + Size - 1] = '\0';
-		Conn->AddressBufferCursor += Size;
+		if ((Loop % 2 == 0 && IPv6 < Count) || IPv4 >= Count)
+			Next = IPv6++;
+		else
+			Next = IPv4++;
+
+		Addresses[Loop] = Copy[Next];
 	}
 
-	if (Conn->State < SMTP_READY)
-		Conn->State++;
+	free(Copy);
 
-	return SMTP_ERR_SUCCESS;
+	return 0;
 }
 
 static int Connect(SMTPConn *Conn, const char *Server, const char *HeloLine)
 {
 	struct addrinfo Hints, *Results, *Next;
-	char Buffer[SMTP_BUFFER_SIZE];
+	struct sockaddr_storage *Addresses;
+	unsigned int Count;
 	int Return;
-	#ifdef _WIN32
-	CONST DWORD TimeoutLength = SMTP_BLOCKING_TIME;
-	#endif
 
 	memset(&Hints, 0, sizeof(Hints));
 	Hints.ai_family = AF_UNSPEC;
@@ -616,135 +2485,157 @@ static int Connect(SMTPConn *Conn, const char *Server, const char *HeloLine)
 	if (getaddrinfo(Server, SMTP_DEFAULT_PORT, &Hints, &Results) != 0)
 		return -1;
 
-	for (Next = Results; Next != NULL; Next = Next->ai_next) {
-
-		Conn->Socket = socket(Next->ai_family, Next->ai_socktype, Next->ai_protocol);
-		if (Conn->Socket == INVALID_SOCKET)
-			continue;
-
-		#ifdef _WIN32
-		setsockopt(Conn->Socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&TimeoutLength, sizeof(DWORD));
-		#endif
-
-		if (connect(Conn->Socket, Next->ai_addr, Next->ai_addrlen) != 0) {
-			closesocket(Conn->Socket);
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
+	Count = 0;
+	for (Next = Results; Next != NULL; Next = Next->ai_next)
+		Count++;
 
-		/* Read the header to ensure that it's working. */
-		if (ReadReply(Conn, Buffer, sizeof(Buffer)) != 0) {
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
-		if (atoi(Buffer) != 220) {
-			closesocket(Conn->Socket);
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
+	Addresses = calloc(Count, sizeof(struct sockaddr_storage));
+	if (!Addresses) {
+		freeaddrinfo(Results);
+		return -1;
+	}
 
-		/* Send our HELO string. */
-		Return = __snprintf(Buffer, sizeof(Buffer), "HELO %s\r\n", HeloLine);
-		#ifdef _WIN32
-		if (Return <= 0)
-		#else
-		if (Return >= sizeof(Buffer) || Return <= 0)
-		#endif
-		{
-			closesocket(Conn->Socket);
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
-		if (SendCommand(Conn, Buffer, Return) != 0) {
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
+	Count = 0;
+	for (Next = Results; Next != NULL; Next = Next->ai_next)
+		memcpy(&Addresses[Count++], Next->ai_addr, Next->ai_addrlen);
 
-		/* Check its reply. */
-		if (ReadReply(Conn, Buffer, sizeof(Buffer)) != 0) {
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
-		if (atoi(Buffer) != 250) {
-			closesocket(Conn->Socket);
-			Conn->Socket = INVALID_SOCKET;
-			continue;
-		}
+	freeaddrinfo(Results);
 
-		break;
-	}
+	Return = Interleave(Addresses, Count);
+	if (Return == 0)
+		Return = Race(Conn, Addresses, Count, HeloLine);
 
-	freeaddrinfo(Results);
+	free(Addresses);
 
-	if (Conn->Socket == INVALID_SOCKET)
+	if (Return != 0)
 		return -2;
 
-	Conn->State = SMTP_CONNECTED;
+	SetHost(Conn, Server);
 
 	return 0;
 }
 
-/* NOTE: Win32 code. Not portable. */
-#ifdef _WIN32
-static int CompareMXRecord(const void *First, const void *Second)
+static void CacheAddress(struct sockaddr_storage *Address, const DNSCacheAddress *Cached)
 {
-	return (*(DNS_RECORD **)First)->Data.MX.wPreference - (*(DNS_RECORD **)Second)->Data.MX.wPreference;
+	struct sockaddr_in *IPv4;
+	struct sockaddr_in6 *IPv6;
+
+	memset(Address, 0, sizeof(*Address));
+
+	if (Cached->Family == AF_INET6) {
+		IPv6 = (struct sockaddr_in6 *)Address;
+		IPv6->sin6_family = AF_INET6;
+		IPv6->sin6_port = htons(atoi(SMTP_DEFAULT_PORT));
+		memcpy(&IPv6->sin6_addr, Cached->Address, sizeof(IPv6->sin6_addr));
+	}
+	else {
+		IPv4 = (struct sockaddr_in *)Address;
+		IPv4->sin_family = AF_INET;
+		IPv4->sin_port = htons(atoi(SMTP_DEFAULT_PORT));
+		memcpy(&IPv4->sin_addr, Cached->Address, sizeof(IPv4->sin_addr));
+	}
+
+	return;
 }
 
-static int ConnectToMXServer(SMTPConn *Conn, const char *Domain, const char *HeloLine)
+/* Works out which of the hosts raced together was connected to from the address it ended up on. */
+static void FindHost(SMTPConn *Conn, const DNSCacheEntry *Entry, unsigned int First, unsigned int Last)
 {
-	DNS_RECORD *DNSResults, *DNSNext, **DNSMXSortArrary;
-	HANDLE ProcessHeap;
-	unsigned int Amount, Loop;
+	struct sockaddr_storage Peer;
+	const DNSCacheAddress *Cached;
+	const void *Address;
+	socklen_t Length;
+	unsigned int Loop, Index;
 
-	if (DnsQuery_A(Domain, DNS_TYPE_MX, DNS_QUERY_STANDARD, NULL, &DNSResults, NULL) == NOERROR) {
+	SetHost(Conn, Entry->Hosts[First].Name);
 
-		/* Count the number we have and create an array for them. */
-		Amount = 0;
-		for (DNSNext = DNSResults; DNSNext != NULL; DNSNext = DNSNext->pNext) {
-			if (DNSNext->wType == DNS_TYPE_MX)
-				Amount++;
-		}
+	Length = sizeof(Peer);
+	if (getpeername(Conn->Socket, (struct sockaddr *)&Peer, &Length) != 0)
+		return;
 
-		ProcessHeap = GetProcessHeap();
-		if (!ProcessHeap) {
-			DnsRecordListFree(DNSResults, DnsFreeRecordList);
-			return -2;
+	if (Peer.ss_family == AF_INET6)
+		Address = &((struct sockaddr_in6 *)&Peer)->sin6_addr;
+	else
+		Address = &((struct sockaddr_in *)&Peer)->sin_addr;
+
+	for (Loop = First; Loop < Last; Loop++) {
+		for (Index = 0; Index < Entry->Hosts[Loop].AddressCount; Index++) {
+			Cached = &Entry->Hosts[Loop].Addresses[Index];
+			if (Cached->Family == Peer.ss_family &&
+				memcmp(Cached->Address, Address, Cached->Family == AF_INET6 ? 16 : 4) == 0) {
+				SetHost(Conn, Entry->Hosts[Loop].Name);
+				return;
+			}
 		}
+	}
 
-		DNSMXSortArrary = HeapAlloc(ProcessHeap, 0, Amount * sizeof(DNS_RECORD*));
-		if (!DNSMXSortArrary) {
-			DnsRecordListFree(DNSResults, DnsFreeRecordList);
-			return -2;
-		}
+	return;
+}
 
-		Amount = 0;
-		for (DNSNext = DNSResults; DNSNext != NULL; DNSNext = DNSNext->pNext) {
-			if (DNSNext->wType == DNS_TYPE_MX) {
-				DNSMXSortArrary[Amount] = DNSNext;
-				Amount++;
-			}
+static int ConnectToMXServer(SMTPConn *Conn, const char *Domain, const char *HeloLine)
+{
+	DNSCacheEntry *Entry;
+	struct sockaddr_storage *Addresses;
+	unsigned char Literal[16];
+	unsigned int First, Last, Loop, Address, Count, Found, Added;
+
+	/* Address literals don't need a lookup at all. */
+	if (inet_pton(AF_INET, Domain, Literal) == 1 || inet_pton(AF_INET6, Domain, Literal) == 1)
+		return Connect(Conn, Domain, HeloLine);
+
+	Found = 0;
+	if (DNSCacheLookup(Domain, &Entry) == 0) {
+
+		if (Entry->NXDomain) {
+			DNSCacheRelease(Entry);
+			return -1;
 		}
 
-		qsort(&DNSMXSortArrary[0], Amount, sizeof(DNS_RECORD*), CompareMXRecord);
+		for (Loop = 0; Loop < Entry->HostCount; Loop++)
+			Found += Entry->Hosts[Loop].AddressCount;
 
-		for (Loop = 0; Loop < Amount; Loop++) {
-			if (Connect(Conn, DNSMXSortArrary[Loop]->Data.MX.pNameExchange, HeloLine) == 0)
-				break;
+		Addresses = malloc((Found ? Found : 1) * sizeof(struct sockaddr_storage));
+		if (!Addresses) {
+			DNSCacheRelease(Entry);
+			return -1;
 		}
 
-		HeapFree(ProcessHeap, 0, DNSMXSortArrary);
+		/*
+			The hosts are in order of preference, followed by the domain itself as per the spec.
+			Those with the same preference are raced together, taking an address from each in turn.
+		*/
+		for (First = 0; First < Entry->HostCount && Conn->State == SMTP_DISCONNECTED; First = Last) {
+
+			for (Last = First + 1; Last < Entry->HostCount && Entry->Hosts[Last].Preference == Entry->Hosts[First].Preference; Last++);
+
+			Count = 0;
+			for (Address = 0, Added = 1; Added; Address++) {
+				Added = 0;
+				for (Loop = First; Loop < Last; Loop++) {
+					if (Address < Entry->Hosts[Loop].AddressCount) {
+						CacheAddress(&Addresses[Count++], &Entry->Hosts[Loop].Addresses[Address]);
+						Added = 1;
+					}
+				}
+			}
 
-		DnsRecordListFree(DNSResults, DnsFreeRecordList);
+			if (Interleave(Addresses, Count) == 0 && Race(Conn, Addresses, Count, HeloLine) == 0)
+				FindHost(Conn, Entry, First, Last);
+		}
 
+		free(Addresses);
+		DNSCacheRelease(Entry);
 	}
 
-	/* As per a spec, in a last attempt, try to connect to the A record. */
-	if (Conn->State == SMTP_DISCONNECTED) {
+	/* Not in the DNS, but may still be known to the system, such as 'localhost'. */
+	if (Conn->State == SMTP_DISCONNECTED && !Found) {
 		if (Connect(Conn, Domain, HeloLine) != 0)
 			return -1;
 	}
 
+	if (Conn->State == SMTP_DISCONNECTED)
+		return -1;
+
 	return 0;
 }
 #endif
@@ -752,17 +2643,23 @@ static int ConnectToMXServer(SMTPConn *Conn, const char *Domain, const char *Hel
 int SMTPDisconnect(SMTPConn *Conn)
 {
 	char Buffer[SMTP_BUFFER_SIZE] = "QUIT\r\n";
+	SMTPReply Reply;
 
 	if (Conn->State == SMTP_DISCONNECTED)
 		return SMTP_ERR_INVALID_STATE;
 
+	if (Conn->State == SMTP_DATA) {
+		Shutdown(Conn);
+		return SMTP_ERR_SUCCESS;
+	}
+
 	if (SendCommand(Conn, Buffer, strlen(Buffer)) != 0)
 		return SMTP_ERR_PROTOCOL;
 
 	shutdown(Conn->Socket, SD_SEND);
 
 	/* As per RFC2821, it's recommended that we read the reply. */
-	if (ReadReply(Conn, Buffer, sizeof(Buffer)) != 0)
+	if (ReadReply(Conn, &Reply) != 0)
 		return SMTP_ERR_PROTOCOL;
 
 	Shutdown(Conn);
@@ -770,38 +2667,138 @@ int SMTPDisconnect(SMTPConn *Conn)
 	return SMTP_ERR_SUCCESS;
 }
 
+/* Drops the connection without a QUIT, such as when the server has already gone. */
+int SMTPAbort(SMTPConn *Conn)
+{
+	if (Conn->State == SMTP_DISCONNECTED)
+		return SMTP_ERR_INVALID_STATE;
+
+	Shutdown(Conn);
+
+	return SMTP_ERR_SUCCESS;
+}
+
 int SMTPReset(SMTPConn *Conn)
 {
 	char Buffer[SMTP_BUFFER_SIZE] = "RSET\r\n";
+	SMTPReply Reply;
 
-	if (Conn->State <= SMTP_CONNECTED)
+	if (Conn->State == SMTP_DISCONNECTED)
 		return SMTP_ERR_INVALID_STATE;
 
+	/* No message has been started, such as straight after one was accepted, so there's nothing to reset. */
+	if (Conn->State == SMTP_CONNECTED)
+		return SMTP_ERR_SUCCESS;
+
+	/* Anything sent now would be taken as part of the message. */
+	if (Conn->State == SMTP_DATA) {
+		Shutdown(Conn);
+		return SMTP_ERR_PROTOCOL;
+	}
+
 	if (SendCommand(Conn, Buffer, strlen(Buffer)) != 0 ||
-		ReadReply(Conn, Buffer, sizeof(Buffer)) != 0)
+		ReadReply(Conn, &Reply) != 0)
 		return SMTP_ERR_PROTOCOL;
 
-	if (atoi(Buffer) != 250)
+	if (Reply.Code != 250)
 		return SMTP_ERR_FAILURE;
 
-	Conn->AddressBufferCursor = 0;
+	ResetMessage(Conn);
 	Conn->State = SMTP_CONNECTED;
 
 	return SMTP_ERR_SUCCESS;
 }
 
+int SMTPNoop(SMTPConn *Conn)
+{
+	char Buffer[SMTP_BUFFER_SIZE] = "NOOP\r\n";
+	SMTPReply Reply;
+
+	if (Conn->State == SMTP_DISCONNECTED || Conn->State == SMTP_DATA)
+		return SMTP_ERR_INVALID_STATE;
+
+	if (SendCommand(Conn, Buffer, strlen(Buffer)) != 0 ||
+		ReadReply(Conn, &Reply) != 0)
+		return SMTP_ERR_PROTOCOL;
+
+	if (Reply.Code != 250)
+		return SMTP_ERR_FAILURE;
+
+	return SMTP_ERR_SUCCESS;
+}
+
+#ifdef STARTTLS
+/*
+	Upgrades the connection as per RFC 3207, then greets the server again as it forgets everything said before.
+	Returns 1 if the server turns it down, in which case the connection carries on in the clear.
+*/
+static int StartTLS(SMTPConn *Conn, const char *HeloLine)
+{
+	char Buffer[SMTP_BUFFER_SIZE] = "STARTTLS\r\n";
+	SMTPReply Reply;
+	TLSConn *TLS;
+	int Return;
+
+	if (SendCommand(Conn, Buffer, strlen(Buffer)) != 0 ||
+		ReadReply(Conn, &Reply) != 0)
+		return -1;
+
+	if (Reply.Code != 220)
+		return 1;
+
+	/* Anything that arrived after the reply was sent in the clear, so may have been injected. */
+	if (Conn->RecvStart < Conn->RecvEnd)
+		goto Err;
+
+	if (TLSStart(Conn->Socket, Conn->Host, &TLS) != 0)
+		goto Err;
+	Conn->TLS = TLS;
+
+	Return = __snprintf(Buffer, sizeof(Buffer), "EHLO %s\r\n", HeloLine);
+	if (Return >= sizeof(Buffer) || Return <= 0)
+		goto Err;
+	if (SendCommand(Conn, Buffer, Return) != 0 ||
+		ReadReply(Conn, &Reply) != 0)
+		return -1;
+
+	if (Reply.Code != 250)
+		goto Err;
+
+	Conn->Extensions = SMTPParseExtensions(&Reply, &Conn->SizeLimit);
+
+	return 0;
+
+	Err:
+	Shutdown(Conn);
+	return -1;
+}
+#endif
+
 int SMTPConnect(SMTPConn *Conn, const char *Domain, const char *HeloLine)
 {
 	if (Conn->State != SMTP_DISCONNECTED)
 		return SMTP_ERR_INVALID_STATE;
 
 	Conn->TotalRecv = Conn->TotalSent = 0;
+	Conn->Messages = 0;
+	Conn->ZeroCopySent = Conn->ZeroCopyDone = 0;
+
+	/* Set before connecting as a failed attempt will free them. */
+	SMTPArenaInit(&Conn->Arena);
+	Conn->Addresses = Conn->LastAddress = NULL;
+	Conn->RecvStart = Conn->RecvEnd = Conn->RecvSize = 0;
+	Conn->RecvBuffer = NULL;
+	Conn->Host[0] = '\0';
+	Conn->TLS = NULL;
 
 	if (ConnectToMXServer(Conn, Domain, HeloLine) != 0)
 		return SMTP_ERR_FAILURE;
 
-	Conn->AddressBufferSize = Conn->AddressBufferCursor = 0;
-	Conn->AddressBuffer = NULL;
+	#ifdef STARTTLS
+	/* Taken up whenever it's offered. */
+	if ((Conn->Extensions & SMTP_EXT_STARTTLS) && StartTLS(Conn, HeloLine) < 0)
+		return SMTP_ERR_FAILURE;
+	#endif
 
 	return SMTP_ERR_SUCCESS;
 }
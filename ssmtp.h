@@ -1,28 +1,108 @@
 #ifndef SMTP_H
 #define SMTP_H
 
-#define SMTP_DEFAULT_PORT	"25"
+#include "arena.h"
+
+#ifndef SMTP_DEFAULT_PORT
+	#define SMTP_DEFAULT_PORT	"25"
+#endif
 #ifndef SMTP_BUFFER_SIZE
 	#define SMTP_BUFFER_SIZE		2048
 #endif
 
+/* Used while sending a message. Attachments are encoded into it and written out each time it fills. */
+#ifndef SMTP_SEND_BUFFER_SIZE
+	#define SMTP_SEND_BUFFER_SIZE	16384
+#endif
+
+/*
+	Parts of a message at least this large, such as the body, are sent with MSG_ZEROCOPY so the kernel reads them
+	in place. Only worth it for sizes well into the hundreds of kilobytes. 0 turns it off. Linux only.
+*/
+#ifndef SMTP_ZEROCOPY_SIZE
+	#define SMTP_ZEROCOPY_SIZE	0
+#endif
+
+/* The most that will be buffered while waiting on replies. */
+#ifndef SMTP_RECV_LIMIT
+	#define SMTP_RECV_LIMIT		(1024 * 1024)
+#endif
+
+/* How many recipients are written before reading their replies when pipelining. */
+#ifndef SMTP_PIPELINE_WINDOW
+	#define SMTP_PIPELINE_WINDOW	100
+#endif
+
 #ifndef SMTP_BLOCKING_TIME
 	#define SMTP_BLOCKING_TIME	15000
 #endif
 
+/* In milliseconds. How long to wait before racing another address and how long each has to connect. Not used on Windows. */
+#ifndef SMTP_CONNECT_DELAY
+	#define SMTP_CONNECT_DELAY	250
+#endif
+#ifndef SMTP_CONNECT_TIME
+	#define SMTP_CONNECT_TIME	SMTP_BLOCKING_TIME
+#endif
+
+/* Enough for any DNS name. */
+#define SMTP_HOST_SIZE		256
+
+/* Random characters ahead of the sender's domain in each Message-ID. */
+#define SMTP_MESSAGE_ID_RAND_LENGTH	24
+
 /* The follow is only used for MIME data. */
-#define SMTP_BOUNDARY_RAND_LENGTH	5
+#define SMTP_BOUNDARY_RAND_LENGTH	24
 #define SMTP_LINE_LENGTH			76
 
+/* Octets of header text per RFC 2047 encoded word, when UTF-8 can't be sent as it is. Keeps each word on a short line. */
+#define SMTP_WORD_SIZE				39
+
+/* An address added to the current message, kept for its headers. BCC addresses aren't kept. */
+typedef struct SMTPStoredAddress {
+	struct SMTPStoredAddress *Next;
+	int Type;
+	unsigned int Length;
+	const char *Address;	/* Terminated as well. */
+} SMTPStoredAddress;
+
 typedef struct SMTPConn {
 	int Socket;
 	unsigned int State;
 
-	unsigned int AddressBufferSize, AddressBufferCursor;
-	char *AddressBuffer;
+	/* Advertised by the server in its EHLO reply. */
+	unsigned int Extensions;
+	unsigned long SizeLimit;
+
+	/* Those of SMTP_EXT_8BITMIME and SMTP_EXT_SMTPUTF8 asked for with the current message's MAIL FROM. */
+	unsigned int MailExtensions;
+
+	/*
+		If set before the sender is added, it's checked against SizeLimit and passed on with MAIL FROM as SIZE=.
+		Cleared once used. SMTPMessageSize() works it out.
+	*/
+	unsigned long MessageSize;
+
+	/* Everything allocated for the current message, such as its addresses. Emptied once it's sent or reset. */
+	SMTPArena Arena;
+	SMTPStoredAddress *Addresses, *LastAddress;
+
+	/* Kept between replies as pipelined replies may arrive together. Grows as required. */
+	unsigned int RecvStart, RecvEnd, RecvSize;
+	char *RecvBuffer;
 
 	unsigned int TotalSent;
 	unsigned int TotalRecv;
+
+	/* Messages accepted since connecting. */
+	unsigned int Messages;
+
+	/* Sends made with MSG_ZEROCOPY and how many of those the kernel has finished with. */
+	unsigned int ZeroCopySent, ZeroCopyDone;
+
+	/* The name of the server connected to. Its TLS session once STARTTLS is done, otherwise NULL. */
+	char Host[SMTP_HOST_SIZE];
+	void *TLS;
 } SMTPConn;
 
 typedef struct SMTPAttach {
@@ -33,20 +113,48 @@ typedef struct SMTPAttach {
 	int (*Read)(void *, void *, unsigned int);
 	void (*Close)(void *);
 
+	/* Used in place of Read when it's NULL. Filled in by SMTPAttachMemory() and SMTPAttachFile(). */
+	const unsigned char *Data;
+	unsigned int Size;
+	int Mapped;
+	int Encoded;	/* Data is already Base64 in lines ending with a CRLF, such as from the attachment cache. */
+
 	struct SMTPAttach *Next;
 } SMTPAttach;
 
+/* An e-mail rendered once by SMTPMessageCreate() to be sent any number of times. Never modified afterwards. */
+typedef struct SMTPMessage {
+	char *Data;		/* Ends with a CRLF. Periods aren't stuffed, as that's only needed for DATA. */
+	unsigned int Size;
+	volatile long References;
+} SMTPMessage;
+
 int SMTPConnect(SMTPConn *Conn, const char *Domain, const char *HeloLine);
 int SMTPAddress(SMTPConn *Conn, int Type, const char *Address);
+int SMTPAddresses(SMTPConn *Conn, const char *From, const int *Types, const char **Addresses, unsigned int Count, int *Results);
 int SMTPData(SMTPConn *Conn, const char *Subject, const char *Body, SMTPAttach *Attachments);
+int SMTPDataRead(SMTPConn *Conn, const char *Subject, int (*Read)(void *, void *, unsigned int), void *ReadData, SMTPAttach *Attachments);
 int SMTPReset(SMTPConn *Conn);
+int SMTPNoop(SMTPConn *Conn);
 int SMTPDisconnect(SMTPConn *Conn);
+int SMTPFormat(const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments, char **Message, unsigned int *Length);
+int SMTPAddressCommand(char *Buffer, unsigned int BufferSize, int Type, const char *Address, int *Length);
+int SMTPMessageSize(const SMTPConn *Conn, const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments, unsigned long *Size);
+int SMTPAbort(SMTPConn *Conn);
+int SMTPMessageCreate(SMTPMessage **Message, const char *From, const int *Types, const char **Addresses, unsigned int Count, const char *Subject, const char *Body, SMTPAttach *Attachments);
+SMTPMessage *SMTPMessageReference(SMTPMessage *Message);
+void SMTPMessageRelease(SMTPMessage *Message);
+int SMTPSendMessage(SMTPConn *Conn, const SMTPMessage *Message);
+void SMTPAttachMemory(SMTPAttach *Attach, char *Filename, char *MIMEType, const void *Data, unsigned int Size);
+int SMTPAttachFile(SMTPAttach *Attach, const char *Path, char *Filename, char *MIMEType);
+void SMTPAttachFree(SMTPAttach *Attach);
 
 enum SMTPStates {
 	SMTP_DISCONNECTED,
 	SMTP_CONNECTED,
 	SMTP_AWAITING_RECIPIENT,
-	SMTP_READY
+	SMTP_READY,
+	SMTP_DATA		/* DATA has already been accepted. Only SMTPData() may follow. */
 };
 
 enum SMTPAddressType {
@@ -56,6 +164,16 @@ enum SMTPAddressType {
 	SMTP_ADDRESS_BCC
 };
 
+enum SMTPExtensions {
+	SMTP_EXT_PIPELINING = 1 << 0,
+	SMTP_EXT_SIZE = 1 << 1,
+	SMTP_EXT_8BITMIME = 1 << 2,
+	SMTP_EXT_SMTPUTF8 = 1 << 3,
+	SMTP_EXT_CHUNKING = 1 << 4,
+	SMTP_EXT_STARTTLS = 1 << 5,
+	SMTP_EXT_ENHANCEDSTATUSCODES = 1 << 6
+};
+
 enum SMTPErrors {
 	SMTP_ERR_INVALID_STATE = -1,
 	SMTP_ERR_SUCCESS,
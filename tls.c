@@ -0,0 +1,386 @@
+/*
+	TLS for STARTTLS, on top of OpenSSL 1.1.1 or later.
+
+	Sessions are kept process-wide by server name, so reconnecting to the same MX resumes rather than doing a full
+	handshake. Once the handshake's done, record encryption is handed to the kernel where possible (kTLS), after
+	which the socket can be written to directly, such as with sendmsg().
+
+	Simple SMTP Mailer.
+	Copyright (C) 2013 Richard Walmsley <richwalm@gmail.com>
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+struct TLSConn {
+	SSL *Handle;
+	int Offloaded;
+	char Host[TLS_HOST_SIZE];	/* What its session is cached under. */
+};
+
+typedef struct CachedSession {
+	char Host[TLS_HOST_SIZE];
+	SSL_SESSION *Session;		/* NULL when the slot is free. */
+	unsigned long long Used;
+} CachedSession;
+
+static SSL_CTX *Context = NULL;
+static pthread_once_t ContextOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CachedSession Cache[TLS_CACHE_SIZE];
+static unsigned long long Clock;
+static TLSStats Stats;
+
+/*
+	OpenSSL writes to the socket itself without MSG_NOSIGNAL, so SIGPIPE is held back around anything that may write.
+	One raised in the meantime is then thrown away, unless it was already pending beforehand.
+*/
+static void HoldSIGPIPE(sigset_t *Old, int *Pending)
+{
+	sigset_t Set;
+
+	sigemptyset(&Set);
+	sigaddset(&Set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &Set, Old);
+
+	sigpending(&Set);
+	*Pending = sigismember(&Set, SIGPIPE);
+
+	return;
+}
+
+static void ReleaseSIGPIPE(const sigset_t *Old, int Pending)
+{
+	sigset_t Set;
+	struct timespec Zero = { 0, 0 };
+
+	if (!Pending) {
+		sigpending(&Set);
+		if (sigismember(&Set, SIGPIPE)) {
+			sigemptyset(&Set);
+			sigaddset(&Set, SIGPIPE);
+			sigtimedwait(&Set, NULL, &Zero);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, Old, NULL);
+
+	return;
+}
+
+/* Expects the lock to be held. */
+static CachedSession *FindSession(const char *Host)
+{
+	unsigned int Loop;
+
+	for (Loop = 0; Loop < TLS_CACHE_SIZE; Loop++) {
+		if (Cache[Loop].Session && strcmp(Cache[Loop].Host, Host) == 0)
+			return &Cache[Loop];
+	}
+
+	return NULL;
+}
+
+/* Called by OpenSSL whenever the server hands out a session. For TLS 1.3 that's on the first read after the handshake. */
+static int NewSession(SSL *Handle, SSL_SESSION *Session)
+{
+	TLSConn *TLS = SSL_get_app_data(Handle);
+	CachedSession *Slot;
+	unsigned int Loop;
+
+	if (!TLS || !SSL_SESSION_is_resumable(Session))
+		return 0;
+
+	pthread_mutex_lock(&Lock);
+
+	Slot = FindSession(TLS->Host);
+	if (!Slot) {
+
+		/* A free slot, otherwise the least recently used. */
+		Slot = &Cache[0];
+		for (Loop = 0; Loop < TLS_CACHE_SIZE; Loop++) {
+			if (!Cache[Loop].Session) {
+				Slot = &Cache[Loop];
+				break;
+			}
+			if (Cache[Loop].Used < Slot->Used)
+				Slot = &Cache[Loop];
+		}
+
+		if (!Slot->Session)
+			Stats.Sessions++;
+		strcpy(Slot->Host, TLS->Host);
+	}
+
+	/* Only the newest is kept. */
+	if (Slot->Session)
+		SSL_SESSION_free(Slot->Session);
+	Slot->Session = Session;
+	Slot->Used = ++Clock;
+
+	pthread_mutex_unlock(&Lock);
+
+	/* The reference is now the cache's. */
+	return 1;
+}
+
+/* Takes a session for the host out of the cache, or a reference to it when it can be used more than once. */
+static SSL_SESSION *TakeSession(const char *Host)
+{
+	CachedSession *Slot;
+	SSL_SESSION *Session = NULL;
+
+	pthread_mutex_lock(&Lock);
+
+	Slot = FindSession(Host);
+	if (Slot) {
+
+		Session = Slot->Session;
+
+		/* TLS 1.3 tickets are single use as per RFC 8446. The new connection is handed fresh ones. */
+		if (SSL_SESSION_get_protocol_version(Session) == TLS1_3_VERSION) {
+			Slot->Session = NULL;
+			Stats.Sessions--;
+		}
+		else {
+			SSL_SESSION_up_ref(Session);
+			Slot->Used = ++Clock;
+		}
+
+	}
+
+	pthread_mutex_unlock(&Lock);
+
+	return Session;
+}
+
+static void CreateContext(void)
+{
+	SSL_CTX *New;
+
+	New = SSL_CTX_new(TLS_client_method());
+	if (!New)
+		return;
+
+	SSL_CTX_set_min_proto_version(New, TLS1_2_VERSION);
+	SSL_CTX_set_mode(New, SSL_MODE_AUTO_RETRY);
+
+	#if TLS_KTLS && defined(SSL_OP_ENABLE_KTLS)
+	SSL_CTX_set_options(New, SSL_OP_ENABLE_KTLS);
+	#endif
+
+	/* Sessions are only kept by the callback, keyed by the server's name rather than its session ID. */
+	SSL_CTX_set_session_cache_mode(New, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(New, NewSession);
+
+	#if TLS_VERIFY
+	if (SSL_CTX_set_default_verify_paths(New) != 1) {
+		SSL_CTX_free(New);
+		return;
+	}
+	SSL_CTX_set_verify(New, SSL_VERIFY_PEER, NULL);
+	#endif
+
+	Context = New;
+
+	return;
+}
+
+static int IsAddress(const char *Host)
+{
+	unsigned char Address[16];
+
+	return inet_pton(AF_INET, Host, Address) == 1 || inet_pton(AF_INET6, Host, Address) == 1;
+}
+
+/* Does the handshake on an already connected socket. Host is the server's name, used for SNI and as the cache key. */
+int TLSStart(int Socket, const char *Host, TLSConn **TLS)
+{
+	TLSConn *New;
+	SSL_SESSION *Session;
+	sigset_t Old;
+	int Pending, Return;
+
+	pthread_once(&ContextOnce, CreateContext);
+	if (!Context)
+		return -1;
+
+	if (strlen(Host) >= TLS_HOST_SIZE)
+		return -1;
+
+	New = malloc(sizeof(TLSConn));
+	if (!New)
+		return -1;
+	strcpy(New->Host, Host);
+	New->Offloaded = 0;
+
+	New->Handle = SSL_new(Context);
+	if (!New->Handle) {
+		free(New);
+		return -1;
+	}
+
+	if (SSL_set_fd(New->Handle, Socket) != 1)
+		goto Err;
+	SSL_set_app_data(New->Handle, New);
+
+	/* Names are only sent when they are names, as per RFC 6066. */
+	if (!IsAddress(Host) && SSL_set_tlsext_host_name(New->Handle, Host) != 1)
+		goto Err;
+
+	#if TLS_VERIFY
+	if (IsAddress(Host))
+		Return = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(New->Handle), Host);
+	else
+		Return = SSL_set1_host(New->Handle, Host);
+	if (Return != 1)
+		goto Err;
+	#endif
+
+	Session = TakeSession(Host);
+	if (Session) {
+		SSL_set_session(New->Handle, Session);
+		SSL_SESSION_free(Session);
+	}
+
+	HoldSIGPIPE(&Old, &Pending);
+	Return = SSL_connect(New->Handle);
+	ReleaseSIGPIPE(&Old, Pending);
+	if (Return != 1)
+		goto Err;
+
+	#if TLS_KTLS && defined(BIO_get_ktls_send)
+	New->Offloaded = BIO_get_ktls_send(SSL_get_wbio(New->Handle)) ? 1 : 0;
+	#endif
+
+	pthread_mutex_lock(&Lock);
+	Stats.Handshakes++;
+	if (SSL_session_reused(New->Handle))
+		Stats.Resumed++;
+	if (New->Offloaded)
+		Stats.Offloaded++;
+	pthread_mutex_unlock(&Lock);
+
+	*TLS = New;
+
+	return 0;
+
+	Err:
+	SSL_free(New->Handle);
+	free(New);
+	return -1;
+}
+
+int TLSSend(TLSConn *TLS, const void *Data, unsigned int Size)
+{
+	size_t Written;
+	sigset_t Old;
+	int Pending, Return;
+
+	HoldSIGPIPE(&Old, &Pending);
+	Return = SSL_write_ex(TLS->Handle, Data, Size, &Written);
+	ReleaseSIGPIPE(&Old, Pending);
+
+	return Return == 1 ? 0 : -1;
+}
+
+/* Returns the amount read, 0 once the server's closed the connection or -1 on an error. */
+int TLSRecv(TLSConn *TLS, void *Buffer, unsigned int Size)
+{
+	size_t Read;
+	sigset_t Old;
+	int Pending, Return;
+
+	/* Reading may write too, such as a reply to a key update. */
+	HoldSIGPIPE(&Old, &Pending);
+	Return = SSL_read_ex(TLS->Handle, Buffer, Size, &Read);
+	ReleaseSIGPIPE(&Old, Pending);
+
+	if (Return == 1)
+		return Read;
+	if (SSL_get_error(TLS->Handle, Return) == SSL_ERROR_ZERO_RETURN)
+		return 0;
+
+	return -1;
+}
+
+/* When set, the kernel encrypts whatever's written to the socket directly. */
+int TLSOffloaded(const TLSConn *TLS)
+{
+	return TLS->Offloaded;
+}
+
+/* Sends our close_notify without waiting for the server's, as the socket's closed straight after. */
+void TLSClose(TLSConn *TLS)
+{
+	sigset_t Old;
+	int Pending;
+
+	HoldSIGPIPE(&Old, &Pending);
+	SSL_shutdown(TLS->Handle);
+	ReleaseSIGPIPE(&Old, Pending);
+
+	SSL_free(TLS->Handle);
+	free(TLS);
+
+	return;
+}
+
+void TLSGetStats(TLSStats *Result)
+{
+	pthread_mutex_lock(&Lock);
+	*Result = Stats;
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
+
+void TLSFlushCache(void)
+{
+	unsigned int Loop;
+
+	pthread_mutex_lock(&Lock);
+
+	for (Loop = 0; Loop < TLS_CACHE_SIZE; Loop++) {
+		if (Cache[Loop].Session) {
+			SSL_SESSION_free(Cache[Loop].Session);
+			Cache[Loop].Session = NULL;
+		}
+	}
+	Stats.Sessions = 0;
+
+	pthread_mutex_unlock(&Lock);
+
+	return;
+}
@@ -0,0 +1,42 @@
+#ifndef TLS_H
+#define TLS_H
+
+/* Enough for any DNS name. */
+#define TLS_HOST_SIZE		256
+
+/* How many servers' sessions are kept for resuming. The least recently used are dropped first. */
+#ifndef TLS_CACHE_SIZE
+	#define TLS_CACHE_SIZE		256
+#endif
+
+/*
+	Once the handshake's done, record encryption is handed to the kernel where it's able to, so the sockets can
+	still be written to directly. Needs OpenSSL 3 built with kTLS and the kernel's tls module. 0 turns it off.
+*/
+#ifndef TLS_KTLS
+	#define TLS_KTLS			1
+#endif
+
+/* Checks the server's certificate against the system's CAs and its name. Most MXs don't have one that passes. */
+#ifndef TLS_VERIFY
+	#define TLS_VERIFY			0
+#endif
+
+typedef struct TLSConn TLSConn;
+
+typedef struct TLSStats {
+	unsigned long Handshakes;
+	unsigned long Resumed;		/* Also counted as handshakes. */
+	unsigned long Offloaded;	/* Handed to the kernel afterwards. */
+	unsigned long Sessions;		/* Currently cached. */
+} TLSStats;
+
+int TLSStart(int Socket, const char *Host, TLSConn **TLS);
+int TLSSend(TLSConn *TLS, const void *Data, unsigned int Size);
+int TLSRecv(TLSConn *TLS, void *Buffer, unsigned int Size);
+int TLSOffloaded(const TLSConn *TLS);
+void TLSClose(TLSConn *TLS);
+void TLSGetStats(TLSStats *Result);
+void TLSFlushCache(void);
+
+#endif